@@ -0,0 +1,193 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * h264.c - decode H.264 rectangles with OpenH264.
+ *
+ * The client keeps one decoder, for the rectangle it last got a picture
+ * for; a rectangle elsewhere, or the server asking for it, starts a new
+ * stream.  If a picture cannot be decoded the decoder is dropped and the
+ * whole screen requested again, which makes the server start over with
+ * an IDR picture.
+ */
+
+#include <rfb/rfbclient.h>
+#include <wels/codec_api.h>
+
+#include "h264.h"
+
+void
+FreeH264(rfbClient* client)
+{
+  ISVCDecoder *decoder = (ISVCDecoder *)client->h264Decoder;
+
+  if (decoder) {
+    (*decoder)->Uninitialize(decoder);
+    WelsDestroyDecoder(decoder);
+    client->h264Decoder = NULL;
+  }
+}
+
+static ISVCDecoder *
+GetDecoder(rfbClient* client)
+{
+  ISVCDecoder *decoder = (ISVCDecoder *)client->h264Decoder;
+  SDecodingParam param;
+
+  if (decoder)
+    return decoder;
+
+  if (WelsCreateDecoder(&decoder) != 0 || !decoder) {
+    rfbClientLog("H.264: could not create a decoder\n");
+    return NULL;
+  }
+  memset(&param, 0, sizeof(param));
+  param.sVideoProperty.eVideoBsType = VIDEO_BITSTREAM_AVC;
+  if ((*decoder)->Initialize(decoder, &param) != 0) {
+    rfbClientLog("H.264: could not initialize the decoder\n");
+    WelsDestroyDecoder(decoder);
+    return NULL;
+  }
+  client->h264Decoder = decoder;
+  return decoder;
+}
+
+static uint8_t
+Clamp(int v)
+{
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Put the decoded picture (BT.601, limited range) into the framebuffer. */
+
+static void
+CopyI420(rfbClient* client, unsigned char **planes, int yStride, int uvStride,
+	 int rx, int ry, int rw, int rh)
+{
+  int bpp = client->format.bitsPerPixel / 8;
+  int x, y;
+
+  for (y = 0; y < rh; y++) {
+    const unsigned char *yRow = planes[0] + y * yStride;
+    const unsigned char *uRow = planes[1] + (y / 2) * uvStride;
+    const unsigned char *vRow = planes[2] + (y / 2) * uvStride;
+    uint8_t *dst = client->frameBuffer + ((ry + y) * client->width + rx) * bpp;
+
+    for (x = 0; x < rw; x++, dst += bpp) {
+      int c = 298 * (yRow[x] - 16);
+      int d = uRow[x / 2] - 128;
+      int e = vRow[x / 2] - 128;
+      uint32_t r = Clamp((c + 409 * e + 128) >> 8);
+      uint32_t g = Clamp((c - 100 * d - 208 * e + 128) >> 8);
+      uint32_t b = Clamp((c + 516 * d + 128) >> 8);
+      uint32_t pix = (r * client->format.redMax + 127) / 255 << client->format.redShift |
+	(g * client->format.greenMax + 127) / 255 << client->format.greenShift |
+	(b * client->format.blueMax + 127) / 255 << client->format.blueShift;
+
+      switch (bpp) {
+      case 1:
+	*dst = (uint8_t)pix;
+	break;
+      case 2:
+	*(uint16_t *)dst = (uint16_t)pix;
+	break;
+      default:
+	*(uint32_t *)dst = pix;
+	break;
+      }
+    }
+  }
+}
+
+rfbBool
+HandleH264(rfbClient* client, int rx, int ry, int rw, int rh)
+{
+  rfbH264Header hdr;
+  ISVCDecoder *decoder;
+  SBufferInfo info;
+  unsigned char *planes[3] = { NULL, NULL, NULL };
+  unsigned char *data;
+  DECODING_STATE state;
+  uint32_t length, flags;
+
+  if (client->frameBuffer == NULL)
+    return FALSE;
+
+  if (rx + rw > client->width || ry + rh > client->height) {
+    rfbClientLog("Rect out of bounds: %dx%d at (%d, %d)\n", rx, ry, rw, rh);
+    return FALSE;
+  }
+
+  if (!ReadFromRFBServer(client, (char *)&hdr, sz_rfbH264Header))
+    return FALSE;
+  length = rfbClientSwap32IfLE(hdr.length);
+  flags = rfbClientSwap32IfLE(hdr.flags);
+
+  /* one stream per rectangle: a new one starts over */
+  if ((flags & (rfbH264ResetContext | rfbH264ResetAllContexts)) ||
+      rx != client->h264X || ry != client->h264Y ||
+      rw != client->h264Width || rh != client->h264Height) {
+    FreeH264(client);
+    client->h264X = rx;
+    client->h264Y = ry;
+    client->h264Width = rw;
+    client->h264Height = rh;
+  }
+
+  /* nothing changed */
+  if (length == 0)
+    return TRUE;
+
+  data = malloc(length);
+  if (data == NULL) {
+    rfbClientLog("Memory allocation error.\n");
+    return FALSE;
+  }
+  if (!ReadFromRFBServer(client, (char *)data, length)) {
+    free(data);
+    return FALSE;
+  }
+
+  decoder = GetDecoder(client);
+  if (!decoder) {
+    free(data);
+    return FALSE;
+  }
+
+  memset(&info, 0, sizeof(info));
+  state = (*decoder)->DecodeFrameNoDelay(decoder, data, (int)length, planes, &info);
+  free(data);
+
+  if (state != dsErrorFree) {
+    rfbClientLog("H.264: could not decode a picture (state 0x%x), asking for a new stream\n", state);
+    FreeH264(client);
+    client->h264Width = client->h264Height = 0;
+    return SendFramebufferUpdateRequest(client, 0, 0, client->width, client->height, FALSE);
+  }
+
+  if (info.iBufferStatus == 1) {
+    if (info.UsrData.sSystemBuffer.iWidth < rw || info.UsrData.sSystemBuffer.iHeight < rh) {
+      rfbClientLog("H.264: picture of %dx%d is smaller than the rectangle\n",
+		   info.UsrData.sSystemBuffer.iWidth, info.UsrData.sSystemBuffer.iHeight);
+      return FALSE;
+    }
+    CopyI420(client, planes, info.UsrData.sSystemBuffer.iStride[0],
+	     info.UsrData.sSystemBuffer.iStride[1], rx, ry, rw, rh);
+  }
+
+  return TRUE;
+}
@@ -63,6 +63,7 @@
 #include "sasl.h"
 #include "minilzo.h"
 #include "tls.h"
+#include "h264.h"
 
 #ifdef _MSC_VER
 #  define snprintf _snprintf /* MSVC went straight to the underscored syntax */
@@ -1296,6 +1297,10 @@ SetFormatAndEncodings(rfbClient* client)
       } else if (strncasecmp(encStr,"zywrle",encStrLen) == 0) {
 	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingZYWRLE);
 	requestQualityLevel = TRUE;
+#endif
+#ifdef LIBVNCSERVER_HAVE_H264
+      } else if (strncasecmp(encStr,"h264",encStrLen) == 0) {
+	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingH264);
 #endif
       } else if ((strncasecmp(encStr,"ultra",encStrLen) == 0) || (strncasecmp(encStr,"ultrazip",encStrLen) == 0)) {
         /* There are 2 encodings used in 'ultra' */
@@ -2132,6 +2137,13 @@ HandleRFBServerMessage(rfbClient* client)
 
 #endif
 
+#ifdef LIBVNCSERVER_HAVE_H264
+      case rfbEncodingH264:
+	if (!HandleH264(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h))
+	  return FALSE;
+	break;
+#endif
+
       default:
 	 {
 	   rfbBool handled = FALSE;
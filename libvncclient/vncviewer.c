@@ -40,6 +40,7 @@
 #include <time.h>
 #include <rfb/rfbclient.h>
 #include "tls.h"
+#include "h264.h"
 
 static void Dummy(rfbClient* client) {
 }
@@ -519,6 +520,10 @@ void rfbClientCleanup(rfbClient* client) {
 #endif
 #endif
 
+#ifdef LIBVNCSERVER_HAVE_H264
+  FreeH264(client);
+#endif
+
   FreeTLS(client);
 
   while (client->clientData) {
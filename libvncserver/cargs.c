@@ -50,6 +50,31 @@ rfbUsage(void)
 #endif
     fprintf(stderr, "-enablehttpproxy       enable http proxy support\n");
     fprintf(stderr, "-progressive height    enable progressive updating for slow links\n");
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    fprintf(stderr, "-epoll                 use epoll instead of select to wait for clients\n");
+#endif
+    fprintf(stderr, "-readylist             only service clients with pending work each round\n");
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    fprintf(stderr, "-workers n             in the background event loop, share n encoder threads\n"
+                    "                       between all clients (-1: one per CPU)\n");
+    fprintf(stderr, "-encoderthreads n      encode the bands of large Tight updates on n\n"
+                    "                       threads at once (-1: one per CPU)\n");
+#endif
+    fprintf(stderr, "-encodecache kbytes    share up to kbytes of encoded rectangles between\n"
+                    "                       clients with the same encoding settings\n");
+    fprintf(stderr, "-scalecache kbytes     keep up to kbytes of scaled screens without clients\n"
+                    "                       for clients which ask for that scale again\n");
+    fprintf(stderr, "-detectdamage          only send the parts of marked areas that really changed\n");
+    fprintf(stderr, "-detectscroll          like -detectdamage, and send scrolled content as CopyRect\n");
+    fprintf(stderr, "-tiledamage            track damage in 64x64 tiles for all clients at once\n");
+    fprintf(stderr, "-classify              send text losslessly and photos/video as JPEG\n");
+    fprintf(stderr, "-refine ms             resend lossy areas losslessly once they did not change\n"
+                    "                       for ms\n");
+    fprintf(stderr, "-video                 detect video areas and send them with the video policy\n");
+    fprintf(stderr, "-videoquality q        send video as JPEG of quality q (0-100) at most\n");
+    fprintf(stderr, "-videofps n            send video areas at most n times a second (0: no limit)\n");
+    fprintf(stderr, "-maxlatency ms         hold back updates and lower quality for clients whose\n"
+                    "                       queued data takes longer to arrive (0: never)\n");
     fprintf(stderr, "-listen ipaddr         listen for connections only on network interface with\n");
     fprintf(stderr, "                       addr ipaddr. '-listen localhost' and hostname work too.\n");
 #ifdef LIBVNCSERVER_IPv6
@@ -181,6 +206,73 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 		return FALSE;
 	    }
             rfbScreen->progressiveSliceHeight = atoi(argv[++i]);
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+        } else if (strcmp(argv[i], "-epoll") == 0) {
+            rfbScreen->useEpoll = TRUE;
+#endif
+        } else if (strcmp(argv[i], "-readylist") == 0) {
+            rfbScreen->useReadyList = TRUE;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+        } else if (strcmp(argv[i], "-workers") == 0) {  /* -workers n */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->workerThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-encoderthreads") == 0) {  /* -encoderthreads n */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->encoderThreads = atoi(argv[++i]);
+#endif
+        } else if (strcmp(argv[i], "-scalecache") == 0) {  /* -scalecache kbytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->scaledScreenCacheSize = atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "-encodecache") == 0) {  /* -encodecache kbytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->encodeCacheSize = atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "-detectdamage") == 0) {
+            rfbScreen->detectDamage = TRUE;
+        } else if (strcmp(argv[i], "-detectscroll") == 0) {
+            rfbScreen->detectDamage = TRUE;
+            rfbScreen->detectScroll = TRUE;
+        } else if (strcmp(argv[i], "-tiledamage") == 0) {
+            rfbScreen->tileDamage = TRUE;
+        } else if (strcmp(argv[i], "-classify") == 0) {
+            rfbScreen->classifyContent = TRUE;
+        } else if (strcmp(argv[i], "-refine") == 0) {  /* -refine ms */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->refineDelay = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-video") == 0) {
+            rfbScreen->detectVideo = TRUE;
+        } else if (strcmp(argv[i], "-videoquality") == 0) {  /* -videoquality q */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->videoPolicy.jpegQuality = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-videofps") == 0) {  /* -videofps n */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->videoPolicy.maxFrameRate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-maxlatency") == 0) {  /* -maxlatency ms */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->maxLatency = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-listen") == 0) {  /* -listen ipaddr */
             if (i + 1 >= *argc) {
 		rfbUsage();
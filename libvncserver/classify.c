@@ -0,0 +1,386 @@
+/*
+ * classify.c - tell what kind of content a rectangle holds.
+ *
+ * When screen->classifyContent is set, the encoders ask rfbClassifyRect()
+ * what a rectangle looks like before choosing how to send it.  A sample of
+ * its pixels gives the number of colors and how many neighbors differ
+ * sharply (text, lines) or only slightly (photos, shading), and the time
+ * between the last few changes of the 64x64 tiles it lies in, noted by
+ * rfbMarkRegionAsModified(), tells animated content from static content.
+ *
+ *   solid   - one color
+ *   text    - few colors, or sharp edges that do not change often
+ *   photo   - many colors with smooth transitions, or changing all the time
+ *   other   - anything else
+ *
+ * When screen->detectVideo is set, the tiles also remember in which of the
+ * last CLASSIFY_WINDOW_SLOTS slots of CLASSIFY_SLOT_TIME ms they changed.
+ * Tiles which changed in most of them, next to another such tile, make up
+ * the video areas rfbClassifierVideoRegion() returns (see video.c).
+ *
+ * The tile map is written by whichever thread marks changes and read by
+ * the encoders, so it is only touched with screen->classifierMutex held.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#ifdef LIBVNCSERVER_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#define CLASSIFY_TILE_SIZE rfbContentTileSize
+/* rows and columns sampled per rectangle */
+#define CLASSIFY_SAMPLE_ROWS 8
+#define CLASSIFY_SAMPLE_COLUMNS 32
+/* more sampled colors than this are not told apart */
+#define CLASSIFY_MAX_COLORS 64
+#define CLASSIFY_TEXT_COLORS 24
+/* sum of the channel differences (scaled to 0..255) of neighbors */
+#define CLASSIFY_SHARP_EDGE 96
+#define CLASSIFY_SMOOTH_EDGE 24
+/* tiles changing at least every this many ms count as animated */
+#define CLASSIFY_VIDEO_INTERVAL 150
+/* ... as long as their last change is not older than this */
+#define CLASSIFY_VIDEO_TIMEOUT 500
+/* video areas changed in more than half the slots of this window */
+#define CLASSIFY_SLOT_TIME 100
+#define CLASSIFY_WINDOW_SLOTS 16
+
+typedef struct {
+    uint32_t lastChange;
+    uint16_t interval;
+    /* bit n set: changed n slots before lastSlot */
+    uint16_t slots;
+    uint32_t lastSlot;
+} rfbContentTile;
+
+struct _rfbContentClassifier {
+    int tilesX, tilesY;
+    rfbContentTile *tiles;
+};
+
+static uint32_t
+nowMs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint32_t)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+/* Call with screen->classifierMutex held */
+static void
+classifierFreeLocked(rfbScreenInfoPtr screen)
+{
+    if (screen->classifier) {
+        free(screen->classifier->tiles);
+        free(screen->classifier);
+        screen->classifier = NULL;
+    }
+}
+
+void
+rfbClassifierFree(rfbScreenInfoPtr screen)
+{
+    LOCK(screen->classifierMutex);
+    classifierFreeLocked(screen);
+    UNLOCK(screen->classifierMutex);
+}
+
+/*
+ * Note that region of the framebuffer changed.  The tile map is made on
+ * the first call, and again after the framebuffer was resized.
+ */
+
+void
+rfbClassifierNoteChange(rfbScreenInfoPtr screen, sraRegionPtr region)
+{
+    rfbContentClassifier *c;
+    int tilesX = (screen->width + CLASSIFY_TILE_SIZE - 1) / CLASSIFY_TILE_SIZE;
+    int tilesY = (screen->height + CLASSIFY_TILE_SIZE - 1) / CLASSIFY_TILE_SIZE;
+    sraRectangleIterator *i;
+    sraRect rect;
+    uint32_t now;
+    int tx, ty;
+
+    LOCK(screen->classifierMutex);
+    c = screen->classifier;
+    if (c && (c->tilesX != tilesX || c->tilesY != tilesY))
+        classifierFreeLocked(screen);
+    if (!screen->classifier) {
+        c = (rfbContentClassifier *)malloc(sizeof(rfbContentClassifier));
+        if (!c) {
+            UNLOCK(screen->classifierMutex);
+            return;
+        }
+        c->tiles = (rfbContentTile *)calloc(tilesX * tilesY, sizeof(rfbContentTile));
+        if (!c->tiles) {
+            free(c);
+            UNLOCK(screen->classifierMutex);
+            return;
+        }
+        c->tilesX = tilesX;
+        c->tilesY = tilesY;
+        screen->classifier = c;
+    }
+
+    now = nowMs();
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect)) {
+        for (ty = rect.y1 / CLASSIFY_TILE_SIZE;
+             ty <= (rect.y2 - 1) / CLASSIFY_TILE_SIZE && ty < tilesY; ty++) {
+            for (tx = rect.x1 / CLASSIFY_TILE_SIZE;
+                 tx <= (rect.x2 - 1) / CLASSIFY_TILE_SIZE && tx < tilesX; tx++) {
+                rfbContentTile *t = &c->tiles[ty * tilesX + tx];
+                uint32_t interval = now - t->lastChange;
+                uint32_t slot = now / CLASSIFY_SLOT_TIME;
+
+                if (slot != t->lastSlot) {
+                    t->slots = slot - t->lastSlot < CLASSIFY_WINDOW_SLOTS
+                        ? t->slots << (slot - t->lastSlot) : 0;
+                    t->lastSlot = slot;
+                }
+                t->slots |= 1;
+
+                /* several marks for one frame are one change */
+                if (interval < 5)
+                    continue;
+                if (interval > 0xFFFF)
+                    interval = 0xFFFF;
+                if (t->lastChange == 0)
+                    t->interval = 0xFFFF;
+                else
+                    t->interval = (uint16_t)((3 * (uint32_t)t->interval + interval) / 4);
+                t->lastChange = now;
+            }
+        }
+    }
+    sraRgnReleaseIterator(i);
+    UNLOCK(screen->classifierMutex);
+}
+
+/* Returns TRUE if most of the rectangle (in screen pixels) keeps changing. */
+
+static rfbBool
+rectAnimated(rfbScreenInfoPtr screen, int x, int y, int w, int h)
+{
+    rfbContentClassifier *c;
+    uint32_t now = nowMs();
+    int tx, ty, n = 0, animated = 0;
+
+    if (w <= 0 || h <= 0)
+        return FALSE;
+    LOCK(screen->classifierMutex);
+    c = screen->classifier;
+    if (!c) {
+        UNLOCK(screen->classifierMutex);
+        return FALSE;
+    }
+    for (ty = y / CLASSIFY_TILE_SIZE;
+         ty <= (y + h - 1) / CLASSIFY_TILE_SIZE && ty < c->tilesY; ty++) {
+        for (tx = x / CLASSIFY_TILE_SIZE;
+             tx <= (x + w - 1) / CLASSIFY_TILE_SIZE && tx < c->tilesX; tx++) {
+            rfbContentTile *t = &c->tiles[ty * c->tilesX + tx];
+
+            n++;
+            if (t->interval < CLASSIFY_VIDEO_INTERVAL &&
+                now - t->lastChange < CLASSIFY_VIDEO_TIMEOUT)
+                animated++;
+        }
+    }
+    UNLOCK(screen->classifierMutex);
+    return n > 0 && 2 * animated > n;
+}
+
+static uint32_t
+getPixel(const char *p, int bytesPerPixel)
+{
+    switch (bytesPerPixel) {
+    case 1:
+        return *(const uint8_t *)p;
+    case 2:
+        return *(const uint16_t *)p;
+    default:
+        return *(const uint32_t *)p;
+    }
+}
+
+/* The sum of the differences of the color channels, each scaled to 0..255. */
+
+static int
+colorDistance(rfbPixelFormat *fmt, uint32_t a, uint32_t b)
+{
+    int ra = (a >> fmt->redShift) & fmt->redMax;
+    int rb = (b >> fmt->redShift) & fmt->redMax;
+    int ga = (a >> fmt->greenShift) & fmt->greenMax;
+    int gb = (b >> fmt->greenShift) & fmt->greenMax;
+    int ba = (a >> fmt->blueShift) & fmt->blueMax;
+    int bb = (b >> fmt->blueShift) & fmt->blueMax;
+
+    if (fmt->redMax == 0 || fmt->greenMax == 0 || fmt->blueMax == 0)
+        return a == b ? 0 : 255;
+    return abs(ra - rb) * 255 / fmt->redMax
+         + abs(ga - gb) * 255 / fmt->greenMax
+         + abs(ba - bb) * 255 / fmt->blueMax;
+}
+
+/*
+ * Classify the rectangle at x,y of cl->scaledScreen, which is where the
+ * encoders take their pixels from.
+ */
+
+rfbContentClass
+rfbClassifyRect(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbScreenInfoPtr scaled = cl->scaledScreen;
+    rfbPixelFormat *fmt = &screen->serverFormat;
+    int bpp = scaled->bitsPerPixel / 8;
+    uint32_t colors[CLASSIFY_MAX_COLORS];
+    int nColors = 0, sharp = 0, smooth = 0;
+    int stepX, stepY, dx, dy, k, d;
+
+    if (w <= 0 || h <= 0)
+        return rfbContentOther;
+
+    stepX = w > CLASSIFY_SAMPLE_COLUMNS ? w / CLASSIFY_SAMPLE_COLUMNS : 1;
+    stepY = h > CLASSIFY_SAMPLE_ROWS ? h / CLASSIFY_SAMPLE_ROWS : 1;
+    for (dy = 0; dy < h; dy += stepY) {
+        const char *row = scaled->frameBuffer
+            + (y + dy) * scaled->paddedWidthInBytes + x * bpp;
+
+        for (dx = 0; dx < w; dx += stepX) {
+            uint32_t pix = getPixel(row + dx * bpp, bpp);
+
+            if (nColors <= CLASSIFY_MAX_COLORS) {
+                for (k = 0; k < nColors && k < CLASSIFY_MAX_COLORS; k++)
+                    if (colors[k] == pix)
+                        break;
+                if (k == nColors) {
+                    if (nColors < CLASSIFY_MAX_COLORS)
+                        colors[nColors] = pix;
+                    nColors++;
+                }
+            }
+            if (dx + 1 < w) {
+                d = colorDistance(fmt, pix, getPixel(row + (dx + 1) * bpp, bpp));
+                if (d >= CLASSIFY_SHARP_EDGE)
+                    sharp++;
+                else if (d > 0 && d <= CLASSIFY_SMOOTH_EDGE)
+                    smooth++;
+            }
+        }
+    }
+
+    if (nColors == 1)
+        return rfbContentSolid;
+    if (nColors <= CLASSIFY_TEXT_COLORS)
+        return rfbContentText;
+
+    /* scaled coordinates back to the ones of the tile map */
+    if (scaled != screen) {
+        int x2 = (x + w) * screen->width / scaled->width;
+        int y2 = (y + h) * screen->height / scaled->height;
+
+        x = x * screen->width / scaled->width;
+        y = y * screen->height / scaled->height;
+        w = x2 - x;
+        h = y2 - y;
+    }
+    if (rectAnimated(screen, x, y, w, h))
+        return rfbContentPhoto;
+
+    if (smooth > 2 * sharp)
+        return rfbContentPhoto;
+    if (sharp > smooth)
+        return rfbContentText;
+    return rfbContentOther;
+}
+
+/* Returns TRUE if tile tx,ty changed in most slots of the window ending now. */
+
+static rfbBool
+tileIsVideo(rfbContentClassifier *c, int tx, int ty, uint32_t slot)
+{
+    rfbContentTile *t;
+    uint32_t age, bits;
+    int n = 0;
+
+    if (tx < 0 || ty < 0 || tx >= c->tilesX || ty >= c->tilesY)
+        return FALSE;
+    t = &c->tiles[ty * c->tilesX + tx];
+    age = slot - t->lastSlot;
+    if (age >= CLASSIFY_WINDOW_SLOTS)
+        return FALSE;
+    bits = (uint32_t)t->slots << age & ((1 << CLASSIFY_WINDOW_SLOTS) - 1);
+    for (; bits; bits &= bits - 1)
+        n++;
+    return 2 * n > CLASSIFY_WINDOW_SLOTS;
+}
+
+/*
+ * Add the video areas of the screen to region: the tiles which changed in
+ * most slots of the last window and have a neighbor which did, too.
+ */
+
+void
+rfbClassifierVideoRegion(rfbScreenInfoPtr screen, sraRegionPtr region)
+{
+    rfbContentClassifier *c;
+    uint32_t slot = nowMs() / CLASSIFY_SLOT_TIME;
+    sraRegionPtr run;
+    int tx, ty, runStart;
+
+    LOCK(screen->classifierMutex);
+    c = screen->classifier;
+    if (!c) {
+        UNLOCK(screen->classifierMutex);
+        return;
+    }
+    for (ty = 0; ty < c->tilesY; ty++) {
+        runStart = -1;
+        for (tx = 0; tx <= c->tilesX; tx++) {
+            rfbBool video = tx < c->tilesX && tileIsVideo(c, tx, ty, slot)
+                && (tileIsVideo(c, tx - 1, ty, slot) || tileIsVideo(c, tx + 1, ty, slot)
+                    || tileIsVideo(c, tx, ty - 1, slot) || tileIsVideo(c, tx, ty + 1, slot));
+
+            if (video && runStart < 0) {
+                runStart = tx;
+            } else if (!video && runStart >= 0) {
+                int x2 = tx * CLASSIFY_TILE_SIZE;
+                int y2 = (ty + 1) * CLASSIFY_TILE_SIZE;
+
+                run = sraRgnCreateRect(runStart * CLASSIFY_TILE_SIZE, ty * CLASSIFY_TILE_SIZE,
+                                       x2 < screen->width ? x2 : screen->width,
+                                       y2 < screen->height ? y2 : screen->height);
+                sraRgnOr(region, run);
+                sraRgnDestroy(run);
+                runStart = -1;
+            }
+        }
+    }
+    UNLOCK(screen->classifierMutex);
+}
@@ -0,0 +1,262 @@
+/*
+ * congestion.c - pace updates and adapt their quality to the client's link.
+ *
+ * Before an update is started we ask the kernel how many bytes it still has
+ * queued for the client, and estimate how fast that queue drains while the
+ * link is busy.  The time it takes to drain is the latency the next update
+ * would add.  While it is over screen->maxLatency (or the round trip time,
+ * if that is longer, since a link needs about a round trip worth of data in
+ * flight to be used fully) no update is started, so the frame rate drops to
+ * what the link carries and nothing ever has to wait inside rfbWriteExact().
+ *
+ * If that keeps happening, the client's JPEG quality is lowered and its
+ * compression level raised, one step at a time, and they are stepped back
+ * to what the client asked for once the queue drains quickly again.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#ifdef LIBVNCSERVER_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef LIBVNCSERVER_HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
+
+/* the link is sampled at most this often, in ms */
+#define CONGESTION_SAMPLE_TIME 10
+/* how many steps quality can be lowered */
+#define CONGESTION_MAX_LEVEL 4
+/* a step back up needs this many ms without congestion */
+#define CONGESTION_RECOVER_TIME 2000
+
+struct _rfbCongestion {
+    struct timeval lastSample;
+    unsigned long lastWritten;
+    int lastQueued;
+    /* bytes per second, 0 until measured */
+    unsigned long bandwidth;
+
+    /* since when updates are held back, tv_sec == 0 if they are not */
+    struct timeval congestedSince;
+    struct timeval lastChange;
+    int level;
+
+    /* what the client asked for */
+    int tightQualityLevel;
+    int turboQualityLevel;
+    int tightCompressLevel;
+    int zlibCompressLevel;
+};
+
+static long
+msSince(struct timeval *now, struct timeval *then)
+{
+    return (now->tv_sec - then->tv_sec) * 1000
+        + (now->tv_usec - then->tv_usec) / 1000;
+}
+
+/* Returns how many bytes the kernel has not sent yet, or -1 if unknown. */
+
+static int
+queuedBytes(rfbClientPtr cl)
+{
+#ifdef SIOCOUTQ
+    int n;
+
+    if (ioctl(cl->sock, SIOCOUTQ, &n) == 0)
+        return n;
+#endif
+    return -1;
+}
+
+/* Returns the kernel's smoothed round trip time in ms, or -1 if unknown. */
+
+static int
+tcpRoundTripTime(rfbClientPtr cl)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(cl->sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+        return info.tcpi_rtt / 1000;
+#endif
+    return -1;
+}
+
+static int
+raiseLevel(int level, int by)
+{
+    return level + by > 9 ? 9 : level + by;
+}
+
+static void
+applyLevel(rfbClientPtr cl, rfbCongestion *c)
+{
+    int level = c->level;
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    cl->zlibCompressLevel = raiseLevel(c->zlibCompressLevel, 2 * level);
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
+    if (c->tightQualityLevel >= 0)
+        cl->tightQualityLevel = rfbMax(c->tightQualityLevel - 2 * level, 0);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    cl->tightCompressLevel = raiseLevel(c->tightCompressLevel, level);
+    if (c->turboQualityLevel >= 0)
+        cl->turboQualityLevel = rfbMax(c->turboQualityLevel - 15 * level, 10);
+#endif
+#endif
+}
+
+/*
+ * Remember the quality settings the client asked for as the ones to go
+ * back to.  Called whenever it sends SetEncodings.
+ */
+
+void
+rfbCongestionReset(rfbClientPtr cl)
+{
+    rfbCongestion *c = cl->congestion;
+
+    if (!c) {
+        c = (rfbCongestion*)calloc(1, sizeof(rfbCongestion));
+        if (!c)
+            return;
+        cl->congestion = c;
+    }
+    c->level = 0;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    c->zlibCompressLevel = cl->zlibCompressLevel;
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
+    c->tightQualityLevel = cl->tightQualityLevel;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    c->tightCompressLevel = cl->tightCompressLevel;
+    c->turboQualityLevel = cl->turboQualityLevel;
+#endif
+#endif
+}
+
+void
+rfbCongestionFree(rfbClientPtr cl)
+{
+    free(cl->congestion);
+    cl->congestion = NULL;
+}
+
+/* Returns how many bytes per second reach the client, or 0 if unknown. */
+
+unsigned long
+rfbClientBandwidth(rfbClientPtr cl)
+{
+    return cl->congestion ? cl->congestion->bandwidth : 0;
+}
+
+/*
+ * Returns TRUE if the client should not get another update yet: it has too
+ * many it did not process (only clients understanding fences can tell), its
+ * output queue did not drain yet, or what is queued for it would take too
+ * long to arrive.
+ */
+
+rfbBool
+rfbClientCongested(rfbClientPtr cl)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbCongestion *c = cl->congestion;
+    int maxFrames = screen->maxFramesInFlight;
+    int queued, rtt, maxDelay;
+    unsigned long written;
+    struct timeval now;
+    long dt;
+    rfbBool congested;
+
+    if (cl->enableFence && maxFrames > 0) {
+        if (maxFrames > RFB_MAX_FRAMES_IN_FLIGHT)
+            maxFrames = RFB_MAX_FRAMES_IN_FLIGHT;
+        if (cl->framesSent - cl->framesAcked >= (uint32_t)maxFrames)
+            return TRUE;
+    }
+
+    if (rfbOutputBacklogged(cl))
+        return TRUE;
+
+    if (screen->maxLatency <= 0 || !c || (queued = queuedBytes(cl)) < 0)
+        return FALSE;
+
+    /* a queue that did not run empty shows how fast the link is */
+    gettimeofday(&now, NULL);
+    dt = msSince(&now, &c->lastSample);
+    if (dt >= CONGESTION_SAMPLE_TIME) {
+        written = cl->bytesWritten;
+        if (c->lastQueued > 0 && queued > 0) {
+            long delivered = (long)(written - c->lastWritten) - (queued - c->lastQueued);
+            if (delivered > 0) {
+                unsigned long rate = (unsigned long)delivered * 1000 / dt;
+                c->bandwidth = c->bandwidth ? (3 * c->bandwidth + rate) / 4 : rate;
+            }
+        }
+        c->lastSample = now;
+        c->lastWritten = written;
+        c->lastQueued = queued;
+    }
+    if (c->bandwidth == 0)
+        return FALSE;
+
+    rtt = tcpRoundTripTime(cl);
+    if (rtt < 0)
+        rtt = cl->roundTripTime;
+    maxDelay = rfbMax(screen->maxLatency, rtt);
+    /* the kernel's queue drains first, then our own */
+    queued += rfbOutputPending(cl);
+    congested = (unsigned long)queued * 1000 / c->bandwidth > (unsigned long)maxDelay;
+
+    if (congested) {
+        if (c->congestedSince.tv_sec == 0)
+            c->congestedSince = now;
+        else if (msSince(&now, &c->congestedSince) > maxDelay
+                 && c->level < CONGESTION_MAX_LEVEL) {
+            c->level++;
+            applyLevel(cl, c);
+            c->congestedSince = c->lastChange = now;
+        }
+    } else {
+        c->congestedSince.tv_sec = 0;
+        if (c->level > 0 && msSince(&now, &c->lastChange) > CONGESTION_RECOVER_TIME
+            && (unsigned long)queued * 1000 / c->bandwidth < (unsigned long)maxDelay / 4) {
+            c->level--;
+            applyLevel(cl, c);
+            c->lastChange = now;
+        }
+    }
+    return congested;
+}
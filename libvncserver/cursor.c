@@ -25,8 +25,7 @@
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
-
-void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2);
+#include "scale.h"
 
 /*
  * Send cursor shape either in X-style format or in client pixel format.
@@ -467,208 +466,345 @@ void rfbMakeRichCursorFromXCursor(rfbScreenInfoPtr rfbScreen,rfbCursorPtr cursor
        else memcpy(cp,back,bpp);
 }
 
-/* functions to draw/hide cursor directly in the frame buffer */
+/*
+ * Clients without cursor shape updates get the cursor drawn into the pixels
+ * they are sent.  It is never drawn into the framebuffer, where every other
+ * client, and the application drawing meanwhile, would find it too: the
+ * pixels under it are copied to an overlay of the client's own, the cursor
+ * is drawn there, and the part of an update under the cursor is encoded
+ * from the overlay.  The overlay passes for the client's scaled screen, so
+ * the encoders need not know about it.
+ */
 
-void rfbHideCursor(rfbClientPtr cl)
-{
-   rfbScreenInfoPtr s=cl->screen;
-   rfbCursorPtr c=s->cursor;
-   int j,x1,x2,y1,y2,bpp=s->serverFormat.bitsPerPixel/8,
-     rowstride=s->paddedWidthInBytes;
-   LOCK(s->cursorMutex);
-   if(!c) {
-     UNLOCK(s->cursorMutex);
-     return;
-   }
-   
-   /* restore what is under the cursor */
-   x1=cl->cursorX-c->xhot;
-   x2=x1+c->width;
-   if(x1<0) x1=0;
-   if(x2>=s->width) x2=s->width-1;
-   x2-=x1; if(x2<=0) {
-     UNLOCK(s->cursorMutex);
-     return;
-   }
-   y1=cl->cursorY-c->yhot;
-   y2=y1+c->height;
-   if(y1<0) y1=0;
-   if(y2>=s->height) y2=s->height-1;
-   y2-=y1; if(y2<=0) {
-     UNLOCK(s->cursorMutex);
-     return;
-   }
+struct _rfbCursorOverlay {
+    /* cl->scaledScreen, but with the pixels under the cursor in buffer */
+    rfbScreenInfo screen;
+    char *buffer;
+    int bufferLen;
+    /* the scaled screen of the client while the overlay stands in for it */
+    rfbScreenInfoPtr scaledScreen;
+    /* the rectangles to encode from it, on the scaled screen */
+    sraRect *rects;
+    int nRects, rectsLen;
+};
 
-   /* get saved data */
-   for(j=0;j<y2;j++)
-     memcpy(s->frameBuffer+(y1+j)*rowstride+x1*bpp,
-	    s->underCursorBuffer+j*x2*bpp,
-	    x2*bpp);
+/* Where the cursor of cl is on the screen.  Call with cursorMutex held. */
 
-   /* Copy to all scaled versions */
-   rfbScaledScreenUpdate(s, x1, y1, x1+x2, y1+y2);
-   
-   UNLOCK(s->cursorMutex);
+static rfbBool
+rfbCursorRect(rfbClientPtr cl, sraRect *rect)
+{
+    rfbScreenInfoPtr s = cl->screen;
+    rfbCursorPtr c = s->cursor;
+
+    if (!c)
+        return FALSE;
+    rect->x1 = cl->cursorX - c->xhot;
+    rect->y1 = cl->cursorY - c->yhot;
+    rect->x2 = rect->x1 + c->width;
+    rect->y2 = rect->y1 + c->height;
+    return sraClipRect2(&rect->x1, &rect->y1, &rect->x2, &rect->y2,
+                        0, 0, s->width, s->height);
 }
 
-void rfbShowCursor(rfbClientPtr cl)
+/* Draw pixel i,j of the cursor over the pixel at dest. */
+
+static void
+rfbDrawCursorPixel(rfbScreenInfoPtr s, rfbCursorPtr c, char *dest, int i, int j)
 {
-   rfbScreenInfoPtr s=cl->screen;
-   rfbCursorPtr c=s->cursor;
-   int i,j,x1,x2,y1,y2,i1,j1,bpp=s->serverFormat.bitsPerPixel/8,
-     rowstride=s->paddedWidthInBytes,
-     bufSize,w;
-   rfbBool wasChanged=FALSE;
-
-   if(!c) return;
-   LOCK(s->cursorMutex);
-
-   bufSize=c->width*c->height*bpp;
-   w=(c->width+7)/8;
-   if(s->underCursorBufferLen<bufSize) {
-      if(s->underCursorBuffer!=NULL)
-	free(s->underCursorBuffer);
-      s->underCursorBuffer=malloc(bufSize);
-      s->underCursorBufferLen=bufSize;
-   }
+   int bpp=s->serverFormat.bitsPerPixel/8;
+   unsigned char *src=c->richSource+j*c->width*bpp+i*bpp;
 
-   /* save what is under the cursor */
-   i1=j1=0; /* offset in cursor */
-   x1=cl->cursorX-c->xhot;
-   x2=x1+c->width;
-   if(x1<0) { i1=-x1; x1=0; }
-   if(x2>=s->width) x2=s->width-1;
-   x2-=x1; if(x2<=0) {
-     UNLOCK(s->cursorMutex);
-     return; /* nothing to do */
-   }
+   if (c->alphaSource) {
+	rfbPixelFormat *f = &s->serverFormat;
+	int amax = 255;	/* alphaSource is always 8bits of info per pixel */
+	unsigned int val, dval, sval;
+	int rdst, gdst, bdst;		/* fb RGB */
+	int asrc, rsrc, gsrc, bsrc;	/* rich source ARGB */
+
+	/*
+	 * the whole cursor is drawn ignoring c->mask[], using the
+	 * extracted alpha value instead.
+	 */
+	asrc = c->alphaSource[j*c->width+i];
+	if (!asrc)
+		return;
+
+	if (bpp == 1) {
+		dval = *((unsigned char*) dest);
+		sval = *((unsigned char*) src);
+	} else if (bpp == 2) {
+		dval = *((unsigned short*) dest);
+		sval = *((unsigned short*) src);
+	} else if (bpp == 3) {
+		unsigned char *dst = (unsigned char *) dest;
+		dval = 0;
+		dval |= ((*(dst+0)) << 0);
+		dval |= ((*(dst+1)) << 8);
+		dval |= ((*(dst+2)) << 16);
+		sval = 0;
+		sval |= ((*(src+0)) << 0);
+		sval |= ((*(src+1)) << 8);
+		sval |= ((*(src+2)) << 16);
+	} else if (bpp == 4) {
+		dval = *((unsigned int*) dest);
+		sval = *((unsigned int*) src);
+	} else {
+		return;
+	}
 
-   y1=cl->cursorY-c->yhot;
-   y2=y1+c->height;
-   if(y1<0) { j1=-y1; y1=0; }
-   if(y2>=s->height) y2=s->height-1;
-   y2-=y1; if(y2<=0) {
-     UNLOCK(s->cursorMutex);
-     return; /* nothing to do */
-   }
+	/* extract dest and src RGB */
+	rdst = (dval >> f->redShift) & f->redMax;	/* fb */
+	gdst = (dval >> f->greenShift) & f->greenMax;
+	bdst = (dval >> f->blueShift) & f->blueMax;
 
-   /* save data */
-   for(j=0;j<y2;j++) {
-     char* dest=s->underCursorBuffer+j*x2*bpp;
-     const char* src=s->frameBuffer+(y1+j)*rowstride+x1*bpp;
-     unsigned int count=x2*bpp;
-     if(wasChanged || memcmp(dest,src,count)) {
-       wasChanged=TRUE;
-       memcpy(dest,src,count);
-     }
+	rsrc = (sval >> f->redShift) & f->redMax;	/* richcursor */
+	gsrc = (sval >> f->greenShift) & f->greenMax;
+	bsrc = (sval >> f->blueShift) & f->blueMax;
+
+	/* blend in fb data. */
+	if (! c->alphaPreMultiplied) {
+		rsrc = (asrc * rsrc)/amax;
+		gsrc = (asrc * gsrc)/amax;
+		bsrc = (asrc * bsrc)/amax;
+	}
+	rdst = rsrc + ((amax - asrc) * rdst)/amax;
+	gdst = gsrc + ((amax - asrc) * gdst)/amax;
+	bdst = bsrc + ((amax - asrc) * bdst)/amax;
+
+	val = 0;
+	val |= (rdst << f->redShift);
+	val |= (gdst << f->greenShift);
+	val |= (bdst << f->blueShift);
+
+	/* insert the cooked pixel */
+	memcpy(dest, &val, bpp);
+   } else if ((c->mask[j*((c->width+7)/8)+i/8]<<(i&7))&0x80) {
+	memcpy(dest, src, bpp);
    }
-   
-   if(!c->richSource)
-     rfbMakeRichCursorFromXCursor(s,c);
-  
-   if (c->alphaSource) {
-	int rmax, rshift;
-	int gmax, gshift;
-	int bmax, bshift;
-	int amax = 255;	/* alphaSource is always 8bits of info per pixel */
-	unsigned int rmask, gmask, bmask;
-
-	rmax   = s->serverFormat.redMax;
-	gmax   = s->serverFormat.greenMax;
-	bmax   = s->serverFormat.blueMax;
-	rshift = s->serverFormat.redShift;
-	gshift = s->serverFormat.greenShift;
-	bshift = s->serverFormat.blueShift;
-
-	rmask = (rmax << rshift);
-	gmask = (gmax << gshift);
-	bmask = (bmax << bshift);
-
-	for(j=0;j<y2;j++) {
-		for(i=0;i<x2;i++) {
-			/*
-			 * we loop over the whole cursor ignoring c->mask[],
-			 * using the extracted alpha value instead.
-			 */
-			char *dest;
-			unsigned char *src, *aptr;
-			unsigned int val, dval, sval;
-			int rdst, gdst, bdst;		/* fb RGB */
-			int asrc, rsrc, gsrc, bsrc;	/* rich source ARGB */
-
-			dest = s->frameBuffer + (j+y1)*rowstride + (i+x1)*bpp;
-			src  = c->richSource  + (j+j1)*c->width*bpp + (i+i1)*bpp;
-			aptr = c->alphaSource + (j+j1)*c->width + (i+i1);
-
-			asrc = *aptr;
-			if (!asrc) {
-				continue;
-			}
+}
 
-			if (bpp == 1) {
-				dval = *((unsigned char*) dest);
-				sval = *((unsigned char*) src);
-			} else if (bpp == 2) {
-				dval = *((unsigned short*) dest);
-				sval = *((unsigned short*) src);
-			} else if (bpp == 3) {
-				unsigned char *dst = (unsigned char *) dest;
-				dval = 0;
-				dval |= ((*(dst+0)) << 0);
-				dval |= ((*(dst+1)) << 8);
-				dval |= ((*(dst+2)) << 16);
-				sval = 0;
-				sval |= ((*(src+0)) << 0);
-				sval |= ((*(src+1)) << 8);
-				sval |= ((*(src+2)) << 16);
-			} else if (bpp == 4) {
-				dval = *((unsigned int*) dest);
-				sval = *((unsigned int*) src);
-			} else {
-				continue;
-			}
+/*
+ * Take the part of updateRegion which the cursor of cl covers out of it.
+ * Returns that part, or NULL if there is none.
+ */
 
-			/* extract dest and src RGB */
-			rdst = (dval & rmask) >> rshift;	/* fb */
-			gdst = (dval & gmask) >> gshift;
-			bdst = (dval & bmask) >> bshift;
+sraRegionPtr
+rfbCursorSplitUpdate(rfbClientPtr cl, sraRegionPtr updateRegion)
+{
+    sraRegionPtr region;
+    sraRect rect;
+    rfbBool visible;
+
+    LOCK(cl->screen->cursorMutex);
+    visible = rfbCursorRect(cl, &rect);
+    UNLOCK(cl->screen->cursorMutex);
+    if (!visible)
+	return NULL;
+
+    region = sraRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y2);
+    sraRgnAnd(region, updateRegion);
+    if (sraRgnEmpty(region)) {
+	sraRgnDestroy(region);
+	return NULL;
+    }
+    sraRgnSubtract(updateRegion, region);
+    return region;
+}
 
-			rsrc = (sval & rmask) >> rshift;	/* richcursor */
-			gsrc = (sval & gmask) >> gshift;
-			bsrc = (sval & bmask) >> bshift;
+/*
+ * Copy what region covers on the scaled screen of cl, which must be up to
+ * date there, and draw the cursor over it.  region is what
+ * rfbCursorSplitUpdate() cut out, or NULL for the cursor as it is now.  The
+ * cursor may have changed since the split: the overlay always covers all of
+ * region, and only what of the cursor falls inside is drawn.  The cursor is
+ * not scaled smoothly, every pixel of the scaled screen takes the one of the
+ * cursor it falls on.  Returns the overlay, which reads like cl->scaledScreen
+ * inside the rectangle x,y,w,h (rounded out to even coordinates, for H.264),
+ * or NULL if none could be made.  The rectangles of region, as scaled now,
+ * are kept for rfbCursorOverlaySend().
+ */
 
-			/* blend in fb data. */
-			if (! c->alphaPreMultiplied) {
-				rsrc = (asrc * rsrc)/amax;
-				gsrc = (asrc * gsrc)/amax;
-				bsrc = (asrc * bsrc)/amax;
-			}
-			rdst = rsrc + ((amax - asrc) * rdst)/amax;
-			gdst = gsrc + ((amax - asrc) * gdst)/amax;
-			bdst = bsrc + ((amax - asrc) * bdst)/amax;
+rfbScreenInfoPtr
+rfbCursorOverlayDraw(rfbClientPtr cl, sraRegionPtr region,
+		     int *px, int *py, int *pw, int *ph)
+{
+    rfbScreenInfoPtr s = cl->screen, scaled = cl->scaledScreen;
+    rfbCursorOverlay *o = cl->cursorOverlay;
+    rfbCursorPtr c;
+    sraRectangleIterator *iter;
+    sraRegionPtr cursorRegion = NULL;
+    sraRect rect, r;
+    rfbBool visible;
+    int bpp = s->serverFormat.bitsPerPixel/8;
+    int x, y, w, h, i, j, ci, cj;
+
+    if (!o) {
+	o = (rfbCursorOverlay *)calloc(1, sizeof(rfbCursorOverlay));
+	if (!o)
+	    return NULL;
+	cl->cursorOverlay = o;
+    }
 
-			val = 0;
-			val |= (rdst << rshift);
-			val |= (gdst << gshift);
-			val |= (bdst << bshift);
+    if (!region) {
+	LOCK(s->cursorMutex);
+	visible = rfbCursorRect(cl, &rect);
+	UNLOCK(s->cursorMutex);
+	if (!visible)
+	    return NULL;
+	region = cursorRegion = sraRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y2);
+    }
 
-			/* insert the cooked pixel into the fb */
-			memcpy(dest, &val, bpp);
-		}
+    /* the rectangles the encoders will be given, and their bounds */
+    rect.x1 = rect.y1 = INT_MAX;
+    rect.x2 = rect.y2 = INT_MIN;
+    o->nRects = 0;
+    iter = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(iter, &r)) {
+	x = r.x1;
+	y = r.y1;
+	w = r.x2 - x;
+	h = r.y2 - y;
+	if (scaled != s)
+	    rfbScaledCorrection(s, scaled, &x, &y, &w, &h, "rfbCursorOverlayDraw");
+	if (o->nRects == o->rectsLen) {
+	    int len = o->rectsLen ? 2 * o->rectsLen : 16;
+	    sraRect *rects = (sraRect *)realloc(o->rects, len * sizeof(sraRect));
+	    if (!rects) {
+		o->nRects = 0;
+		break;
+	    }
+	    o->rects = rects;
+	    o->rectsLen = len;
 	}
-   } else {
-      /* now the cursor has to be drawn */
-      for(j=0;j<y2;j++)
-        for(i=0;i<x2;i++)
-          if((c->mask[(j+j1)*w+(i+i1)/8]<<((i+i1)&7))&0x80)
-   	 memcpy(s->frameBuffer+(j+y1)*rowstride+(i+x1)*bpp,
-   		c->richSource+(j+j1)*c->width*bpp+(i+i1)*bpp,bpp);
-   }
+	o->rects[o->nRects].x1 = x;
+	o->rects[o->nRects].y1 = y;
+	o->rects[o->nRects].x2 = x + w;
+	o->rects[o->nRects].y2 = y + h;
+	o->nRects++;
+	if (x < rect.x1) rect.x1 = x;
+	if (y < rect.y1) rect.y1 = y;
+	if (x + w > rect.x2) rect.x2 = x + w;
+	if (y + h > rect.y2) rect.y2 = y + h;
+    }
+    sraRgnReleaseIterator(iter);
+    if (cursorRegion)
+	sraRgnDestroy(cursorRegion);
+    if (o->nRects == 0)
+	return NULL;
+    /* the screen changed size since the split, this is no update to keep */
+    if (rect.x1 < 0 || rect.y1 < 0 ||
+	rect.x2 > scaled->width || rect.y2 > scaled->height)
+	return NULL;
+    rect.x1 &= ~1;
+    rect.y1 &= ~1;
+    rect.x2 = (rect.x2 + 1) & ~1;
+    rect.y2 = (rect.y2 + 1) & ~1;
+    if (!sraClipRect2(&rect.x1, &rect.y1, &rect.x2, &rect.y2,
+		      0, 0, scaled->width, scaled->height))
+	return NULL;
+    x = rect.x1;
+    y = rect.y1;
+    w = rect.x2 - x;
+    h = rect.y2 - y;
+
+    if (o->bufferLen < w * h * bpp) {
+	char *buffer = (char *)realloc(o->buffer, w * h * bpp);
+	if (!buffer)
+	    return NULL;
+	o->buffer = buffer;
+	o->bufferLen = w * h * bpp;
+    }
+    for (j = 0; j < h; j++)
+	memcpy(o->buffer + j * w * bpp,
+	       scaled->frameBuffer + (y + j) * scaled->paddedWidthInBytes + x * bpp,
+	       w * bpp);
+
+    LOCK(s->cursorMutex);
+    c = s->cursor;
+    if (c && !c->richSource)
+	rfbMakeRichCursorFromXCursor(s,c);
+
+    for (j = 0; c && j < h; j++) {
+	cj = (y + j) * s->height / scaled->height - (cl->cursorY - c->yhot);
+	if (cj < 0 || cj >= c->height)
+	    continue;
+	for (i = 0; i < w; i++) {
+	    ci = (x + i) * s->width / scaled->width - (cl->cursorX - c->xhot);
+	    if (ci >= 0 && ci < c->width)
+		rfbDrawCursorPixel(s, c, o->buffer + (j * w + i) * bpp, ci, cj);
+	}
+    }
+    UNLOCK(s->cursorMutex);
+
+    memcpy(&o->screen, scaled, sizeof(rfbScreenInfo));
+    o->screen.paddedWidthInBytes = w * bpp;
+    /* only ever read inside rect */
+    o->screen.frameBuffer = o->buffer - (y * w + x) * bpp;
+    *px = x;
+    *py = y;
+    *pw = w;
+    *ph = h;
+    return &o->screen;
+}
 
-   /* Copy to all scaled versions */
-   rfbScaledScreenUpdate(s, x1, y1, x1+x2, y1+y2);
+/*
+ * Make the encoders read from the overlay drawn last, through
+ * cl->scaledScreen, until rfbCursorOverlayEnd().
+ */
+
+static void
+rfbCursorOverlayBegin(rfbClientPtr cl)
+{
+    rfbCursorOverlay *o = cl->cursorOverlay;
+
+    LOCK(cl->updateMutex);
+    o->scaledScreen = cl->scaledScreen;
+    cl->scaledScreen = &o->screen;
+    UNLOCK(cl->updateMutex);
+}
+
+static void
+rfbCursorOverlayEnd(rfbClientPtr cl)
+{
+    rfbCursorOverlay *o = cl->cursorOverlay;
+
+    LOCK(cl->updateMutex);
+    cl->scaledScreen = o->scaledScreen;
+    UNLOCK(cl->updateMutex);
+}
 
-   UNLOCK(s->cursorMutex);
+/*
+ * Encode the rectangles kept by the last rfbCursorOverlayDraw() with send,
+ * from the overlay.  They lie inside it whatever happened to the screen
+ * since.
+ */
+
+rfbBool
+rfbCursorOverlaySend(rfbClientPtr cl,
+		     rfbBool (*send)(rfbClientPtr cl, int x, int y, int w, int h))
+{
+    rfbCursorOverlay *o = cl->cursorOverlay;
+    rfbBool result = TRUE;
+    int k;
+
+    rfbCursorOverlayBegin(cl);
+    for (k = 0; result && k < o->nRects; k++)
+	result = send(cl, o->rects[k].x1, o->rects[k].y1,
+		      o->rects[k].x2 - o->rects[k].x1,
+		      o->rects[k].y2 - o->rects[k].y1);
+    rfbCursorOverlayEnd(cl);
+    return result;
+}
+
+void
+rfbCursorOverlayFree(rfbClientPtr cl)
+{
+    if (!cl->cursorOverlay)
+	return;
+    free(cl->cursorOverlay->rects);
+    free(cl->cursorOverlay->buffer);
+    free(cl->cursorOverlay);
+    cl->cursorOverlay = NULL;
 }
 
 /* 
@@ -748,6 +884,7 @@ void rfbSetCursor(rfbScreenInfoPtr rfbScreen,rfbCursorPtr c)
     cl->cursorWasChanged = TRUE;
     if(!cl->enableCursorShapeUpdates)
       rfbRedrawAfterHideCursor(cl,NULL);
+    rfbScheduleClientUpdate(cl);
   }
   rfbReleaseClientIterator(iterator);
 
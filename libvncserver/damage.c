@@ -0,0 +1,395 @@
+/*
+ * damage.c - find out which parts of the framebuffer really changed.
+ *
+ * Screen scrapers and emulators often cannot tell what they drew and just
+ * mark the whole screen as modified.  With screen->detectDamage set,
+ * rfbMarkRegionAsModified() compares the marked area tile by tile with a
+ * shadow copy of what the clients were last told about, and only passes on
+ * the tiles that differ.
+ *
+ * With screen->detectScroll also set, it then looks for content that was
+ * scrolled up/down or left/right within the tiles that differ, by comparing
+ * line hashes of the shadow and the framebuffer, and sends that part as a
+ * CopyRect instead.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <string.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#define DAMAGE_TILE_SIZE 32
+
+/* rectangles smaller than this in the scroll direction are not looked at */
+#define SCROLL_MIN_SIZE 64
+/* nor is damage of fewer pixels than this in total */
+#define SCROLL_MIN_AREA (256 * 256)
+/* at least this many lines must have moved together */
+#define SCROLL_MIN_LINES 16
+
+/*
+ * Compare one tile of the framebuffer with the shadow, and bring the shadow
+ * up to date if they differ and update is set.  memcmp() is vectorised by
+ * any decent libc, so there is nothing to gain from hand written SIMD here.
+ */
+
+static rfbBool
+tileChanged(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2,
+            rfbBool update)
+{
+    int bpp = screen->serverFormat.bitsPerPixel / 8;
+    int rowstride = screen->paddedWidthInBytes;
+    int widthInBytes = (x2 - x1) * bpp;
+    size_t offset = (size_t)y1 * rowstride + x1 * bpp;
+    char *fb = screen->frameBuffer + offset;
+    char *shadow = screen->damageShadow + offset;
+    int y;
+
+    for (y = y1; y < y2; y++, fb += rowstride, shadow += rowstride)
+        if (memcmp(fb, shadow, widthInBytes))
+            break;
+    if (y == y2)
+        return FALSE;
+
+    if (update)
+        for (; y < y2; y++, fb += rowstride, shadow += rowstride)
+            memcpy(shadow, fb, widthInBytes);
+    return TRUE;
+}
+
+static void
+addRect(sraRegionPtr region, int x1, int y1, int x2, int y2)
+{
+    sraRegionPtr rect = sraRgnCreateRect(x1, y1, x2, y2);
+    sraRgnOr(region, rect);
+    sraRgnDestroy(rect);
+}
+
+/*
+ * Returns the part of modRegion whose pixels differ from the shadow, rounded
+ * to tiles (but never beyond modRegion).
+ */
+
+static sraRegionPtr
+changedTiles(rfbScreenInfoPtr screen, sraRegionPtr modRegion, rfbBool update)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+    sraRegionPtr damage;
+    int x, y, y2, runStart;
+
+    damage = sraRgnCreate();
+    i = sraRgnGetIterator(modRegion);
+    while (sraRgnIteratorNext(i, &rect)) {
+        for (y = rect.y1; y < rect.y2; y = y2) {
+            y2 = (y / DAMAGE_TILE_SIZE + 1) * DAMAGE_TILE_SIZE;
+            if (y2 > rect.y2)
+                y2 = rect.y2;
+
+            /* merge neighbouring changed tiles of a row into one rectangle */
+            runStart = -1;
+            for (x = rect.x1; x < rect.x2; ) {
+                int x2 = (x / DAMAGE_TILE_SIZE + 1) * DAMAGE_TILE_SIZE;
+                if (x2 > rect.x2)
+                    x2 = rect.x2;
+                if (tileChanged(screen, x, y, x2, y2, update)) {
+                    if (runStart < 0)
+                        runStart = x;
+                } else if (runStart >= 0) {
+                    addRect(damage, runStart, y, x, y2);
+                    runStart = -1;
+                }
+                x = x2;
+            }
+            if (runStart >= 0)
+                addRect(damage, runStart, y, rect.x2, y2);
+        }
+    }
+    sraRgnReleaseIterator(i);
+
+    return damage;
+}
+
+static void
+updateShadow(rfbScreenInfoPtr screen, sraRegionPtr region)
+{
+    int bpp = screen->serverFormat.bitsPerPixel / 8;
+    int rowstride = screen->paddedWidthInBytes;
+    sraRectangleIterator *i;
+    sraRect rect;
+    size_t offset;
+    int y;
+
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect))
+        for (y = rect.y1; y < rect.y2; y++) {
+            offset = (size_t)y * rowstride + rect.x1 * bpp;
+            memcpy(screen->damageShadow + offset, screen->frameBuffer + offset,
+                   (rect.x2 - rect.x1) * bpp);
+        }
+    sraRgnReleaseIterator(i);
+}
+
+static long
+regionArea(sraRegionPtr region)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+    long area = 0;
+
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect))
+        area += (long)(rect.x2 - rect.x1) * (rect.y2 - rect.y1);
+    sraRgnReleaseIterator(i);
+    return area;
+}
+
+typedef struct {
+    uint32_t hash;
+    int line;
+} rfbLineHash;
+
+static uint32_t
+hashBytes(uint32_t hash, const unsigned char *p, int len)
+{
+    while (len-- > 0)
+        hash = (hash ^ *p++) * 16777619;
+    return hash;
+}
+
+static int
+compareLineHash(const void *a, const void *b)
+{
+    uint32_t h1 = ((const rfbLineHash*)a)->hash, h2 = ((const rfbLineHash*)b)->hash;
+
+    return h1 < h2 ? -1 : h1 > h2;
+}
+
+/* Hash the rows, or the columns, of the w x h pixels at buf. */
+
+static void
+hashLines(rfbLineHash *hashes, const char *buf, int rowstride, int bpp,
+          int w, int h, rfbBool columns)
+{
+    int x, y;
+
+    if (!columns) {
+        for (y = 0; y < h; y++, buf += rowstride) {
+            hashes[y].hash = hashBytes(2166136261U, (const unsigned char*)buf, w * bpp);
+            hashes[y].line = y;
+        }
+        return;
+    }
+
+    for (x = 0; x < w; x++) {
+        hashes[x].hash = 2166136261U;
+        hashes[x].line = x;
+    }
+    for (y = 0; y < h; y++, buf += rowstride)
+        for (x = 0; x < w; x++)
+            hashes[x].hash = hashBytes(hashes[x].hash,
+                                       (const unsigned char*)buf + x * bpp, bpp);
+}
+
+/*
+ * Every line of the new contents whose hash occurs exactly once in the old
+ * contents votes for the distance it moved.  Returns the distance with most
+ * votes, or 0 if there are too few.
+ */
+
+static int
+voteOffset(rfbLineHash *oldHashes, rfbLineHash *newHashes, int n)
+{
+    int *votes = (int*)calloc(2 * n, sizeof(int));
+    int i, lo, hi, mid, best = 0;
+
+    if (!votes)
+        return 0;
+
+    qsort(oldHashes, n, sizeof(rfbLineHash), compareLineHash);
+    for (i = 0; i < n; i++) {
+        uint32_t hash = newHashes[i].hash;
+
+        for (lo = 0, hi = n; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (oldHashes[mid].hash < hash)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == n || oldHashes[lo].hash != hash ||
+            (lo + 1 < n && oldHashes[lo + 1].hash == hash))
+            continue;
+        votes[n + i - oldHashes[lo].line]++;
+    }
+
+    for (i = 1; i < 2 * n; i++)
+        if (i != n && votes[i] > votes[best])
+            best = i;
+    i = votes[best] >= SCROLL_MIN_LINES ? best - n : 0;
+    free(votes);
+    return i;
+}
+
+static rfbBool
+linesEqual(rfbScreenInfoPtr screen, sraRect *rect, int line, int offset,
+           rfbBool columns)
+{
+    int bpp = screen->serverFormat.bitsPerPixel / 8;
+    int rowstride = screen->paddedWidthInBytes;
+    const char *fb, *shadow;
+    int y;
+
+    if (!columns) {
+        fb = screen->frameBuffer + (size_t)line * rowstride + rect->x1 * bpp;
+        shadow = screen->damageShadow + (size_t)(line - offset) * rowstride + rect->x1 * bpp;
+        return !memcmp(fb, shadow, (rect->x2 - rect->x1) * bpp);
+    }
+
+    fb = screen->frameBuffer + (size_t)rect->y1 * rowstride + line * bpp;
+    shadow = screen->damageShadow + (size_t)rect->y1 * rowstride + (line - offset) * bpp;
+    for (y = rect->y1; y < rect->y2; y++, fb += rowstride, shadow += rowstride)
+        if (memcmp(fb, shadow, bpp))
+            return FALSE;
+    return TRUE;
+}
+
+/*
+ * Look for content of rect that moved by a whole number of rows (or
+ * columns) and schedule a copy for it.  Returns TRUE if it found some.
+ */
+
+static rfbBool
+detectScrollInRect(rfbScreenInfoPtr screen, sraRect *rect, rfbBool columns)
+{
+    int bpp = screen->serverFormat.bitsPerPixel / 8;
+    int rowstride = screen->paddedWidthInBytes;
+    int first = columns ? rect->x1 : rect->y1;
+    int n = columns ? rect->x2 - rect->x1 : rect->y2 - rect->y1;
+    size_t offset = (size_t)rect->y1 * rowstride + rect->x1 * bpp;
+    rfbLineHash *oldHashes, *newHashes;
+    sraRegionPtr copyRegion;
+    int d, line, lo, hi, runStart;
+
+    if (n < SCROLL_MIN_SIZE)
+        return FALSE;
+
+    oldHashes = (rfbLineHash*)malloc(2 * n * sizeof(rfbLineHash));
+    if (!oldHashes)
+        return FALSE;
+    newHashes = oldHashes + n;
+    hashLines(oldHashes, screen->damageShadow + offset, rowstride, bpp,
+              rect->x2 - rect->x1, rect->y2 - rect->y1, columns);
+    hashLines(newHashes, screen->frameBuffer + offset, rowstride, bpp,
+              rect->x2 - rect->x1, rect->y2 - rect->y1, columns);
+    d = voteOffset(oldHashes, newHashes, n);
+    free(oldHashes);
+    if (d == 0)
+        return FALSE;
+
+    /* hashes may collide, so only trust lines that really are equal */
+    copyRegion = sraRgnCreate();
+    lo = first + (d > 0 ? d : 0);
+    hi = first + n + (d < 0 ? d : 0);
+    runStart = -1;
+    for (line = lo; line <= hi; line++) {
+        if (line < hi && linesEqual(screen, rect, line, d, columns)) {
+            if (runStart < 0)
+                runStart = line;
+            continue;
+        }
+        if (runStart >= 0 && line - runStart >= SCROLL_MIN_LINES) {
+            if (columns)
+                addRect(copyRegion, runStart, rect->y1, line, rect->y2);
+            else
+                addRect(copyRegion, rect->x1, runStart, rect->x2, line);
+        }
+        runStart = -1;
+    }
+
+    if (sraRgnEmpty(copyRegion)) {
+        sraRgnDestroy(copyRegion);
+        return FALSE;
+    }
+    /* this also moves the pixels in the shadow */
+    if (columns)
+        rfbScheduleCopyRegion(screen, copyRegion, d, 0);
+    else
+        rfbScheduleCopyRegion(screen, copyRegion, 0, d);
+    sraRgnDestroy(copyRegion);
+    return TRUE;
+}
+
+/*
+ * Turn scrolled content inside damage into a CopyRect.  This stops at the
+ * first distance found.  Returns TRUE if it found one.
+ */
+
+static rfbBool
+detectScroll(rfbScreenInfoPtr screen, sraRegionPtr damage)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+    rfbBool found = FALSE;
+
+    i = sraRgnGetIterator(damage);
+    while (!found && sraRgnIteratorNext(i, &rect))
+        found = detectScrollInRect(screen, &rect, FALSE) ||
+                detectScrollInRect(screen, &rect, TRUE);
+    sraRgnReleaseIterator(i);
+    return found;
+}
+
+/*
+ * Returns the part of modRegion whose pixels differ from the shadow, rounded
+ * to tiles (but never beyond modRegion), and brings the shadow up to date.
+ * With screen->detectScroll, scrolled content in there is scheduled as a
+ * copy and left out.  The first call only takes the shadow and returns all
+ * of modRegion.  The caller destroys the result.
+ */
+
+sraRegionPtr
+rfbDetectDamage(rfbScreenInfoPtr screen, sraRegionPtr modRegion)
+{
+    sraRegionPtr damage, rest;
+
+    if (!screen->damageShadow) {
+        size_t size = (size_t)screen->paddedWidthInBytes * screen->height;
+
+        screen->damageShadow = (char*)malloc(size);
+        if (screen->damageShadow)
+            memcpy(screen->damageShadow, screen->frameBuffer, size);
+        return sraRgnCreateRgn(modRegion);
+    }
+
+    if (!screen->detectScroll)
+        return changedTiles(screen, modRegion, TRUE);
+
+    /* the shadow still has the old contents while looking for scrolling */
+    damage = changedTiles(screen, modRegion, FALSE);
+    if (regionArea(damage) >= SCROLL_MIN_AREA && detectScroll(screen, damage)) {
+        /* the copy moved the shadow along, so compare what is left */
+        rest = changedTiles(screen, damage, TRUE);
+        sraRgnDestroy(damage);
+        return rest;
+    }
+    updateShadow(screen, damage);
+    return damage;
+}
@@ -0,0 +1,382 @@
+/*
+ * encodecache.c - share encoded rectangles between clients.
+ *
+ * When many viewers with the same pixel format and encoding settings watch
+ * one screen, they are mostly sent the same rectangles of the same
+ * framebuffer contents.  The first client to encode such a rectangle leaves
+ * the bytes (rectangle headers included) here and the others just copy them
+ * into their update buffers.
+ *
+ * Only encodings whose output does not depend on what was sent to the
+ * client before are shared: Raw, RRE, CoRRE, Hextile and Ultra as they are,
+ * and Tight because every cached Tight rectangle starts by resetting the
+ * client's zlib streams (see rfbTightResetStreams()).  Zlib and ZRLE use a
+ * single stream for the whole connection and are never cached.
+ *
+ * Tight also follows the client's encoding policies (see video.c): only
+ * rectangles entirely outside the client's video areas are shared, and
+ * the JPEG quality of its text policy is part of the key.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#define ENCODE_CACHE_BUCKETS 256
+
+typedef struct _rfbEncodeCacheKey {
+    unsigned long generation;
+    int x, y, w, h;
+    int encoding;
+    int compressLevel;
+    int qualityLevel;
+    int subsampLevel;
+    rfbBool lastRect;
+    int policyQuality;
+    rfbPixelFormat format;
+} rfbEncodeCacheKey;
+
+typedef struct _rfbEncodedRect {
+    struct _rfbEncodedRect *hashNext;
+    /* entries in the order they were added, the oldest is dropped first */
+    struct _rfbEncodedRect *next;
+    rfbEncodeCacheKey key;
+    unsigned int hash;
+    int len;
+    char *data;
+} rfbEncodedRect;
+
+struct _rfbEncodeCache {
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    MUTEX(mutex);
+#endif
+    size_t maxBytes;
+    size_t bytes;
+    rfbEncodedRect *buckets[ENCODE_CACHE_BUCKETS];
+    rfbEncodedRect *oldest, *newest;
+};
+
+rfbEncodeCache*
+rfbEncodeCacheCreate(int maxBytes)
+{
+    rfbEncodeCache *cache = (rfbEncodeCache*)calloc(1, sizeof(rfbEncodeCache));
+
+    if (!cache)
+        return NULL;
+    cache->maxBytes = maxBytes;
+    INIT_MUTEX(cache->mutex);
+    return cache;
+}
+
+static void
+freeOldest(rfbEncodeCache *cache)
+{
+    rfbEncodedRect *e = cache->oldest, **p;
+
+    for (p = &cache->buckets[e->hash % ENCODE_CACHE_BUCKETS]; *p != e;
+         p = &(*p)->hashNext)
+        ;
+    *p = e->hashNext;
+
+    cache->oldest = e->next;
+    if (!cache->oldest)
+        cache->newest = NULL;
+    cache->bytes -= e->len;
+    free(e->data);
+    free(e);
+}
+
+void
+rfbEncodeCacheFree(rfbEncodeCache *cache)
+{
+    if (!cache)
+        return;
+    while (cache->oldest)
+        freeOldest(cache);
+    TINI_MUTEX(cache->mutex);
+    free(cache);
+}
+
+/*
+ * Returns TRUE if what cl is sent can be shared with other clients: its
+ * encoding must be one of the stateless ones, and neither scaling nor a
+ * colour map may make its pixels different from what others get.  A
+ * cursor drawn for the client does not matter: the area under it is cut
+ * out of the update and sent from the client's own overlay.  A
+ * colour-mapped server can change its map without changing the
+ * framebuffer, which the key does not see, so nothing is shared there.
+ */
+
+rfbBool
+rfbEncodeCacheUsable(rfbClientPtr cl)
+{
+    if (!cl->screen->encodeCache ||
+        !cl->format.trueColour || !cl->screen->serverFormat.trueColour ||
+        cl->scaledScreen != cl->screen)
+        return FALSE;
+
+    switch (cl->preferredEncoding) {
+    case -1:
+    case rfbEncodingRaw:
+    case rfbEncodingRRE:
+    case rfbEncodingCoRRE:
+    case rfbEncodingHextile:
+    case rfbEncodingUltra:
+        return TRUE;
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBZ)
+    case rfbEncodingTight:
+        return TRUE;
+#endif
+    }
+    return FALSE;
+}
+
+static unsigned int
+makeKey(rfbClientPtr cl, unsigned long generation, int x, int y, int w, int h,
+        rfbEncodeCacheKey *key)
+{
+    unsigned int hash;
+
+    memset(key, 0, sizeof(*key));
+    key->generation = generation;
+    key->x = x;
+    key->y = y;
+    key->w = w;
+    key->h = h;
+    key->encoding = cl->preferredEncoding;
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBZ)
+    if (key->encoding == rfbEncodingTight) {
+        key->compressLevel = cl->tightCompressLevel;
+        key->qualityLevel = cl->turboQualityLevel;
+        key->subsampLevel = cl->turboSubsampLevel;
+        key->lastRect = cl->enableLastRectEncoding;
+        key->policyQuality = cl->textPolicy.jpegQuality;
+    }
+#endif
+    key->format.bitsPerPixel = cl->format.bitsPerPixel;
+    key->format.depth = cl->format.depth;
+    key->format.bigEndian = cl->format.bigEndian;
+    key->format.trueColour = cl->format.trueColour;
+    key->format.redMax = cl->format.redMax;
+    key->format.greenMax = cl->format.greenMax;
+    key->format.blueMax = cl->format.blueMax;
+    key->format.redShift = cl->format.redShift;
+    key->format.greenShift = cl->format.greenShift;
+    key->format.blueShift = cl->format.blueShift;
+
+    hash = (unsigned int)generation;
+    hash = hash * 31 + x;
+    hash = hash * 31 + y;
+    hash = hash * 31 + w;
+    hash = hash * 31 + h;
+    hash = hash * 31 + key->encoding;
+    return hash;
+}
+
+/*
+ * Returns TRUE if the rectangle is sent with the client's text policy, the
+ * only one in the key.  Its video areas are its own.
+ */
+
+static rfbBool
+policyShared(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    sraRegionPtr rect;
+    rfbBool shared;
+
+    if (cl->preferredEncoding != rfbEncodingTight ||
+        !cl->videoRegion || sraRgnEmpty(cl->videoRegion))
+        return TRUE;
+    rect = sraRgnCreateRect(x, y, x + w, y + h);
+    shared = !sraRgnAnd(rect, cl->videoRegion);
+    sraRgnDestroy(rect);
+    return shared;
+}
+
+static rfbEncodedRect*
+lookup(rfbEncodeCache *cache, rfbEncodeCacheKey *key, unsigned int hash)
+{
+    rfbEncodedRect *e;
+
+    for (e = cache->buckets[hash % ENCODE_CACHE_BUCKETS]; e; e = e->hashNext)
+        if (e->hash == hash && !memcmp(&e->key, key, sizeof(*key)))
+            return e;
+    return NULL;
+}
+
+static rfbBool
+reserveCapture(rfbClientPtr cl, int len)
+{
+    char *buf;
+
+    if (cl->encodeCaptureLen + len <= cl->encodeCaptureSize)
+        return TRUE;
+    buf = (char*)realloc(cl->encodeCaptureBuf, cl->encodeCaptureLen + len);
+    if (!buf)
+        return FALSE;
+    cl->encodeCaptureBuf = buf;
+    cl->encodeCaptureSize = cl->encodeCaptureLen + len;
+    return TRUE;
+}
+
+/*
+ * Send the rectangle from the cache if it is there.  Returns 1 if it was
+ * sent, 0 if it has to be encoded, and -1 if the client is gone.
+ */
+
+int
+rfbEncodeCacheSendRect(rfbClientPtr cl, unsigned long generation,
+                       int x, int y, int w, int h)
+{
+    rfbEncodeCache *cache = cl->screen->encodeCache;
+    rfbEncodeCacheKey key;
+    rfbEncodedRect *e;
+    unsigned int hash = makeKey(cl, generation, x, y, w, h, &key);
+    char *data;
+    int len = 0, n;
+
+    if (!policyShared(cl, x, y, w, h))
+        return 0;
+
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBZ)
+    if (key.encoding == rfbEncodingTight)
+        rfbTightResetStreams(cl);
+#endif
+
+    /* copy the bytes out, so that the cache is not locked while writing */
+    LOCK(cache->mutex);
+    e = lookup(cache, &key, hash);
+    if (e) {
+        cl->encodeCaptureLen = 0;
+        if (!reserveCapture(cl, e->len))
+            e = NULL;
+        else
+            memcpy(cl->encodeCaptureBuf, e->data, len = e->len);
+    }
+    UNLOCK(cache->mutex);
+    if (!e)
+        return 0;
+
+    rfbStatRecordEncodingSent(cl, key.encoding == -1 ? rfbEncodingRaw : key.encoding,
+                              len, w * h * (cl->format.bitsPerPixel / 8));
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBZ)
+    /* the rectangle may hold JPEG */
+    if (key.encoding == rfbEncodingTight && key.qualityLevel != -1)
+        rfbMarkRectLossy(cl, x, y, w, h);
+#endif
+    for (data = cl->encodeCaptureBuf; len > 0; data += n, len -= n) {
+        if (cl->ublen == UPDATE_BUF_SIZE && !rfbSendUpdateBuf(cl))
+            return -1;
+        n = UPDATE_BUF_SIZE - cl->ublen;
+        if (n > len)
+            n = len;
+        memcpy(&cl->updateBuf[cl->ublen], data, n);
+        cl->ublen += n;
+    }
+    return 1;
+}
+
+/* Start collecting what the encoder writes to the update buffer. */
+
+void
+rfbEncodeCacheBeginRect(rfbClientPtr cl)
+{
+    cl->encodeCaptureLen = 0;
+    cl->encodeCaptureFrom = cl->ublen;
+}
+
+/* Called by rfbSendUpdateBuf() before the update buffer is written out. */
+
+void
+rfbEncodeCacheCapture(rfbClientPtr cl)
+{
+    int len = cl->ublen - cl->encodeCaptureFrom;
+
+    if (cl->encodeCaptureLen >= 0) {
+        if (reserveCapture(cl, len)) {
+            memcpy(cl->encodeCaptureBuf + cl->encodeCaptureLen,
+                   cl->updateBuf + cl->encodeCaptureFrom, len);
+            cl->encodeCaptureLen += len;
+        } else
+            cl->encodeCaptureLen = -1;
+    }
+    cl->encodeCaptureFrom = 0;
+}
+
+/* Stop collecting and offer the encoded rectangle to the other clients. */
+
+void
+rfbEncodeCacheEndRect(rfbClientPtr cl, unsigned long generation,
+                      int x, int y, int w, int h)
+{
+    rfbEncodeCache *cache = cl->screen->encodeCache;
+    rfbEncodeCacheKey key;
+    rfbEncodedRect *e;
+    unsigned int hash;
+
+    if (cl->encodeCaptureFrom < 0)
+        return;
+    rfbEncodeCacheCapture(cl);
+    cl->encodeCaptureFrom = -1;
+    if (cl->encodeCaptureLen <= 0 ||
+        (size_t)cl->encodeCaptureLen > cache->maxBytes / 4 ||
+        generation != cl->screen->fbGeneration ||
+        !policyShared(cl, x, y, w, h))
+        return;
+
+    hash = makeKey(cl, generation, x, y, w, h, &key);
+    e = (rfbEncodedRect*)malloc(sizeof(rfbEncodedRect));
+    if (!e)
+        return;
+    e->data = (char*)malloc(cl->encodeCaptureLen);
+    if (!e->data) {
+        free(e);
+        return;
+    }
+    memcpy(e->data, cl->encodeCaptureBuf, cl->encodeCaptureLen);
+    e->len = cl->encodeCaptureLen;
+    e->key = key;
+    e->hash = hash;
+    e->next = NULL;
+
+    LOCK(cache->mutex);
+    if (lookup(cache, &key, hash)) {
+        UNLOCK(cache->mutex);
+        free(e->data);
+        free(e);
+        return;
+    }
+
+    /* entries of older generations are unlikely to be hit again */
+    while (cache->oldest &&
+           (cache->oldest->key.generation != generation ||
+            cache->bytes + e->len > cache->maxBytes))
+        freeOldest(cache);
+
+    e->hashNext = cache->buckets[hash % ENCODE_CACHE_BUCKETS];
+    cache->buckets[hash % ENCODE_CACHE_BUCKETS] = e;
+    if (cache->newest)
+        cache->newest->next = e;
+    else
+        cache->oldest = e;
+    cache->newest = e;
+    cache->bytes += e->len;
+    UNLOCK(cache->mutex);
+}
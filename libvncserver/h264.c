@@ -0,0 +1,436 @@
+/*
+ * h264.c - send the screen as an H.264 stream, using OpenH264.
+ *
+ * A client preferring rfbEncodingH264 gets every update as one rectangle
+ * covering the whole (scaled) screen, which is one picture of a stream
+ * kept per client.  Unchanged macroblocks cost next to nothing in a
+ * P picture, so small updates stay cheap, while video and scrolling
+ * content get the benefit of an inter-frame codec.
+ *
+ * The bitrate follows the bandwidth congestion.c measures for the client.
+ * The first picture of a stream is an IDR picture; later ones are only
+ * sent on demand: when the client asks for a non-incremental update, as
+ * it does when it joins or lost its picture.  If the stream cannot be set
+ * up, the rectangle goes out as Raw.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#ifdef LIBVNCSERVER_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <wels/codec_api.h>
+
+/* bits per second while the client's bandwidth is not known yet, per pixel */
+#define H264_DEFAULT_BITS_PER_PIXEL 2
+#define H264_MIN_BITRATE (256 * 1000)
+#define H264_MAX_BITRATE (40 * 1000 * 1000)
+/* percentage of the measured bandwidth the stream may use */
+#define H264_BANDWIDTH_SHARE 75
+/* the bitrate is only changed if it is off by more than this percentage */
+#define H264_BITRATE_SLACK 20
+#define H264_MAX_FRAME_RATE 60
+
+struct _rfbH264Context {
+    ISVCEncoder *encoder;
+    /* the rectangle the stream is for, and the picture size */
+    int x, y, w, h;
+    int picWidth, picHeight;
+    unsigned char *yuv;
+    int bitrate;
+    struct timeval start;
+    /* the client has to reset its decoder before the next picture */
+    rfbBool reset;
+    /* the next picture has to be an IDR picture */
+    rfbBool keyframe;
+    /* setting up the encoder failed last time, which was logged */
+    rfbBool failed;
+};
+
+static void
+freeEncoder(rfbH264Context *ctx)
+{
+    if (ctx->encoder) {
+        (*ctx->encoder)->Uninitialize(ctx->encoder);
+        WelsDestroySVCEncoder(ctx->encoder);
+        ctx->encoder = NULL;
+    }
+    free(ctx->yuv);
+    ctx->yuv = NULL;
+}
+
+void
+rfbH264Free(rfbClientPtr cl)
+{
+    if (cl->h264Context) {
+        freeEncoder(cl->h264Context);
+        free(cl->h264Context);
+        cl->h264Context = NULL;
+    }
+}
+
+/* Have the next picture sent to cl be an IDR picture. */
+
+void
+rfbH264RequestKeyframe(rfbClientPtr cl)
+{
+    if (cl->h264Context)
+        cl->h264Context->keyframe = TRUE;
+}
+
+/* The bitrate for cl, in bits per second. */
+
+static int
+targetBitrate(rfbClientPtr cl, rfbH264Context *ctx)
+{
+    unsigned long bandwidth = rfbClientBandwidth(cl);
+    double bitrate;
+
+    if (bandwidth > 0)
+        bitrate = (double)bandwidth * 8 * H264_BANDWIDTH_SHARE / 100;
+    else
+        bitrate = (double)ctx->picWidth * ctx->picHeight * H264_DEFAULT_BITS_PER_PIXEL;
+    if (bitrate < H264_MIN_BITRATE)
+        return H264_MIN_BITRATE;
+    if (bitrate > H264_MAX_BITRATE)
+        return H264_MAX_BITRATE;
+    return (int)bitrate;
+}
+
+static float
+frameRate(rfbClientPtr cl)
+{
+    int defer = cl->screen->deferUpdateTime;
+
+    if (defer <= 1000 / H264_MAX_FRAME_RATE)
+        return H264_MAX_FRAME_RATE;
+    return 1000.0f / defer;
+}
+
+/* (Re)start the stream for the rectangle at x,y.  Returns FALSE on error. */
+
+static rfbBool
+initEncoder(rfbClientPtr cl, rfbH264Context *ctx, int x, int y, int w, int h)
+{
+    SEncParamExt param;
+    int format = videoFormatI420;
+
+    freeEncoder(ctx);
+    ctx->x = x;
+    ctx->y = y;
+    ctx->w = w;
+    ctx->h = h;
+    ctx->picWidth = (w + 1) & ~1;
+    ctx->picHeight = (h + 1) & ~1;
+    ctx->yuv = (unsigned char *)malloc(ctx->picWidth * ctx->picHeight * 3 / 2);
+    if (!ctx->yuv)
+        return FALSE;
+    ctx->bitrate = targetBitrate(cl, ctx);
+
+    if (WelsCreateSVCEncoder(&ctx->encoder) != 0 || !ctx->encoder) {
+        ctx->encoder = NULL;
+        return FALSE;
+    }
+    (*ctx->encoder)->GetDefaultParams(ctx->encoder, &param);
+    param.iUsageType = SCREEN_CONTENT_REAL_TIME;
+    param.iPicWidth = ctx->picWidth;
+    param.iPicHeight = ctx->picHeight;
+    param.iTargetBitrate = ctx->bitrate;
+    param.iRCMode = RC_BITRATE_MODE;
+    param.fMaxFrameRate = frameRate(cl);
+    /* a skipped picture would leave the client behind until the next change */
+    param.bEnableFrameSkip = 0;
+    /* IDR pictures only on demand */
+    param.uiIntraPeriod = 0;
+    param.iSpatialLayerNum = 1;
+    param.sSpatialLayers[0].iVideoWidth = ctx->picWidth;
+    param.sSpatialLayers[0].iVideoHeight = ctx->picHeight;
+    param.sSpatialLayers[0].fFrameRate = param.fMaxFrameRate;
+    param.sSpatialLayers[0].iSpatialBitrate = ctx->bitrate;
+    if ((*ctx->encoder)->InitializeExt(ctx->encoder, &param) != 0) {
+        WelsDestroySVCEncoder(ctx->encoder);
+        ctx->encoder = NULL;
+        return FALSE;
+    }
+    (*ctx->encoder)->SetOption(ctx->encoder, ENCODER_OPTION_DATAFORMAT, &format);
+
+    gettimeofday(&ctx->start, NULL);
+    ctx->reset = TRUE;
+    ctx->keyframe = FALSE;
+    return TRUE;
+}
+
+/* Follow the client's bandwidth, but not every small change of it. */
+
+static void
+updateBitrate(rfbClientPtr cl, rfbH264Context *ctx)
+{
+    int bitrate = targetBitrate(cl, ctx);
+    SBitrateInfo info;
+
+    if (abs(bitrate - ctx->bitrate) * 100 <= ctx->bitrate * H264_BITRATE_SLACK)
+        return;
+    info.iLayer = SPATIAL_LAYER_ALL;
+    info.iBitrate = bitrate;
+    if ((*ctx->encoder)->SetOption(ctx->encoder, ENCODER_OPTION_BITRATE, &info) == 0)
+        ctx->bitrate = bitrate;
+}
+
+/* One pixel of fb, in server format, as 8 bit red, green and blue. */
+
+#define GET_RGB(fmt, pix, r, g, b)                                          \
+    do {                                                                    \
+        r = (((pix) >> (fmt)->redShift) & (fmt)->redMax) * 255 / (fmt)->redMax;     \
+        g = (((pix) >> (fmt)->greenShift) & (fmt)->greenMax) * 255 / (fmt)->greenMax; \
+        b = (((pix) >> (fmt)->blueShift) & (fmt)->blueMax) * 255 / (fmt)->blueMax;  \
+    } while (0)
+
+static uint32_t
+getPixel(const unsigned char *p, int bytesPerPixel)
+{
+    switch (bytesPerPixel) {
+    case 1:
+        return *p;
+    case 2:
+        return *(const uint16_t *)p;
+    case 3:
+        return p[0] | p[1] << 8 | p[2] << 16;
+    default:
+        return *(const uint32_t *)p;
+    }
+}
+
+/*
+ * Convert the blocks px1,py1 to px2,py2 (even numbers) of the picture from
+ * the rectangle of screen, the scaled framebuffer or the cursor overlay, to
+ * I420 (BT.601, limited range).  Odd sizes repeat the last column or row.
+ */
+
+static void
+convertToI420(rfbClientPtr cl, rfbH264Context *ctx, rfbScreenInfoPtr screen,
+              int px1, int py1, int px2, int py2)
+{
+    rfbPixelFormat *fmt = &cl->screen->serverFormat;
+    int bpp = screen->bitsPerPixel / 8;
+    int pw = ctx->picWidth, ph = ctx->picHeight;
+    unsigned char *yPlane = ctx->yuv;
+    unsigned char *uPlane = yPlane + pw * ph;
+    unsigned char *vPlane = uPlane + (pw / 2) * (ph / 2);
+    int px, py, i, j;
+
+    for (py = py1; py < py2; py += 2) {
+        for (px = px1; px < px2; px += 2) {
+            int rSum = 0, gSum = 0, bSum = 0;
+
+            for (j = 0; j < 2; j++) {
+                int sy = ctx->y + (py + j < ctx->h ? py + j : ctx->h - 1);
+                const unsigned char *row = (const unsigned char *)screen->frameBuffer
+                    + sy * screen->paddedWidthInBytes;
+
+                for (i = 0; i < 2; i++) {
+                    int sx = ctx->x + (px + i < ctx->w ? px + i : ctx->w - 1);
+                    uint32_t pix = getPixel(row + sx * bpp, bpp);
+                    int r, g, b;
+
+                    GET_RGB(fmt, pix, r, g, b);
+                    yPlane[(py + j) * pw + px + i] =
+                        (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+                    rSum += r;
+                    gSum += g;
+                    bSum += b;
+                }
+            }
+            rSum /= 4;
+            gSum /= 4;
+            bSum /= 4;
+            uPlane[(py / 2) * (pw / 2) + px / 2] =
+                (unsigned char)(((-38 * rSum - 74 * gSum + 112 * bSum + 128) >> 8) + 128);
+            vPlane[(py / 2) * (pw / 2) + px / 2] =
+                (unsigned char)(((112 * rSum - 94 * gSum - 18 * bSum + 128) >> 8) + 128);
+        }
+    }
+}
+
+/*
+ * Clients without cursor shape updates see the cursor in the picture: the
+ * blocks under it are converted again from the overlay of cursor.c, which
+ * covers whole blocks of the picture, as that always starts at 0,0.
+ */
+
+static void
+drawCursor(rfbClientPtr cl, rfbH264Context *ctx)
+{
+    rfbScreenInfoPtr overlay;
+    int x, y, w, h, x2, y2;
+
+    if (cl->enableCursorShapeUpdates)
+        return;
+    overlay = rfbCursorOverlayDraw(cl, NULL, &x, &y, &w, &h);
+    if (!overlay)
+        return;
+    x -= ctx->x;
+    y -= ctx->y;
+    x2 = (x + w < ctx->picWidth ? x + w : ctx->picWidth);
+    y2 = (y + h < ctx->picHeight ? y + h : ctx->picHeight);
+    if (x < 0)
+        x = 0;
+    if (y < 0)
+        y = 0;
+    if (x < x2 && y < y2)
+        convertToI420(cl, ctx, overlay, x, y, x2, y2);
+}
+
+/* Copy len bytes into the update, flushing it when it is full. */
+
+static rfbBool
+sendBytes(rfbClientPtr cl, const unsigned char *data, int len)
+{
+    while (len > 0) {
+        int n = UPDATE_BUF_SIZE - cl->ublen;
+
+        if (n > len)
+            n = len;
+
+        memcpy(cl->updateBuf + cl->ublen, data, n);
+        cl->ublen += n;
+        data += n;
+        len -= n;
+        if (cl->ublen == UPDATE_BUF_SIZE && !rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * rfbSendRectEncodingH264 - send the rectangle at x,y of the scaled screen
+ * as the next picture of the client's H.264 stream.
+ */
+
+rfbBool
+rfbSendRectEncodingH264(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    rfbH264Context *ctx = cl->h264Context;
+    rfbFramebufferUpdateRectHeader rect;
+    rfbH264Header hdr;
+    SSourcePicture pic;
+    SFrameBSInfo info;
+    struct timeval now;
+    int layer, nal, length = 0;
+
+    if (!cl->screen->serverFormat.trueColour)
+        return rfbSendRectEncodingRaw(cl, x, y, w, h);
+
+    if (!ctx) {
+        ctx = (rfbH264Context *)calloc(1, sizeof(rfbH264Context));
+        if (!ctx)
+            return rfbSendRectEncodingRaw(cl, x, y, w, h);
+        cl->h264Context = ctx;
+    }
+    if (!ctx->encoder || ctx->x != x || ctx->y != y || ctx->w != w || ctx->h != h) {
+        if (!initEncoder(cl, ctx, x, y, w, h)) {
+            if (!ctx->failed)
+                rfbLog("H.264: could not set up an encoder for %dx%d, sending Raw\n", w, h);
+            ctx->failed = TRUE;
+            freeEncoder(ctx);
+            return rfbSendRectEncodingRaw(cl, x, y, w, h);
+        }
+        ctx->failed = FALSE;
+    } else {
+        updateBitrate(cl, ctx);
+    }
+
+    if (ctx->keyframe) {
+        (*ctx->encoder)->ForceIntraFrame(ctx->encoder, 1);
+        ctx->keyframe = FALSE;
+    }
+
+    convertToI420(cl, ctx, cl->scaledScreen, 0, 0, ctx->picWidth, ctx->picHeight);
+    drawCursor(cl, ctx);
+    memset(&pic, 0, sizeof(pic));
+    pic.iColorFormat = videoFormatI420;
+    pic.iPicWidth = ctx->picWidth;
+    pic.iPicHeight = ctx->picHeight;
+    pic.iStride[0] = ctx->picWidth;
+    pic.iStride[1] = pic.iStride[2] = ctx->picWidth / 2;
+    pic.pData[0] = ctx->yuv;
+    pic.pData[1] = pic.pData[0] + ctx->picWidth * ctx->picHeight;
+    pic.pData[2] = pic.pData[1] + (ctx->picWidth / 2) * (ctx->picHeight / 2);
+    gettimeofday(&now, NULL);
+    pic.uiTimeStamp = (long long)(now.tv_sec - ctx->start.tv_sec) * 1000
+        + (now.tv_usec - ctx->start.tv_usec) / 1000;
+
+    memset(&info, 0, sizeof(info));
+    if ((*ctx->encoder)->EncodeFrame(ctx->encoder, &pic, &info) != cmResultSuccess) {
+        rfbLog("H.264: encoding failed, sending Raw\n");
+        freeEncoder(ctx);
+        return rfbSendRectEncodingRaw(cl, x, y, w, h);
+    }
+    if (info.eFrameType != videoFrameTypeSkip) {
+        for (layer = 0; layer < info.iLayerNum; layer++)
+            for (nal = 0; nal < info.sLayerInfo[layer].iNalCount; nal++)
+                length += info.sLayerInfo[layer].pNalLengthInByte[nal];
+    }
+
+    rfbStatRecordEncodingSent(cl, rfbEncodingH264,
+                              sz_rfbFramebufferUpdateRectHeader + sz_rfbH264Header + length,
+                              w * (cl->format.bitsPerPixel / 8) * h);
+
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbH264Header
+        > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    rect.r.x = Swap16IfLE(x);
+    rect.r.y = Swap16IfLE(y);
+    rect.r.w = Swap16IfLE(w);
+    rect.r.h = Swap16IfLE(h);
+    rect.encoding = Swap32IfLE(rfbEncodingH264);
+    memcpy(cl->updateBuf + cl->ublen, (char *)&rect,
+           sz_rfbFramebufferUpdateRectHeader);
+    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+    hdr.length = Swap32IfLE(length);
+    hdr.flags = Swap32IfLE(ctx->reset ? rfbH264ResetContext : 0);
+    memcpy(cl->updateBuf + cl->ublen, (char *)&hdr, sz_rfbH264Header);
+    cl->ublen += sz_rfbH264Header;
+    ctx->reset = FALSE;
+
+    if (length == 0)
+        return TRUE;
+
+    /* the NAL units of a layer lie one after the other in its buffer */
+    for (layer = 0; layer < info.iLayerNum; layer++) {
+        SLayerBSInfo *l = &info.sLayerInfo[layer];
+        int size = 0;
+
+        for (nal = 0; nal < l->iNalCount; nal++)
+            size += l->pNalLengthInByte[nal];
+        if (!sendBytes(cl, l->pBsBuf, size))
+            return FALSE;
+    }
+    return TRUE;
+}
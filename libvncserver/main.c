@@ -273,47 +273,232 @@ void rfbLogPerror(const char *str)
 #endif
 }
 
+/* move the pixels of copyRegion in buf, which is laid out like the framebuffer */
+static void rfbCopyPixels(rfbScreenInfoPtr screen,char *buf,sraRegionPtr copyRegion,int dx,int dy)
+{
+   sraRectangleIterator* i;
+   sraRect rect;
+   int j,widthInBytes,bpp=screen->serverFormat.bitsPerPixel/8,
+    rowstride=screen->paddedWidthInBytes;
+   char *in,*out;
+
+   i = sraRgnGetReverseIterator(copyRegion,dx<0,dy<0);
+   while(sraRgnIteratorNext(i,&rect)) {
+     widthInBytes = (rect.x2-rect.x1)*bpp;
+     out = buf+rect.x1*bpp+rect.y1*rowstride;
+     in = buf+(rect.x1-dx)*bpp+(rect.y1-dy)*rowstride;
+     if(dy<0)
+       for(j=rect.y1;j<rect.y2;j++,out+=rowstride,in+=rowstride)
+	 memmove(out,in,widthInBytes);
+     else {
+       out += rowstride*(rect.y2-rect.y1-1);
+       in += rowstride*(rect.y2-rect.y1-1);
+       for(j=rect.y2-1;j>=rect.y1;j--,out-=rowstride,in-=rowstride)
+	 memmove(out,in,widthInBytes);
+     }
+   }
+   sraRgnReleaseIterator(i);
+}
+
+/*
+ * The copies pending for a client are kept in the order they were scheduled,
+ * since a copy may read what an earlier one wrote.  copyRegion is the union
+ * of their destinations.  All of these need the client's updateMutex.
+ */
+
+static void rfbUpdateCopyRegion(rfbClientPtr cl)
+{
+   int i,j;
+
+   sraRgnMakeEmpty(cl->copyRegion);
+   for(i=j=0;i<cl->nCopyMoves;i++) {
+     if(sraRgnEmpty(cl->copyMoves[i].region)) {
+       sraRgnDestroy(cl->copyMoves[i].region);
+       continue;
+     }
+     sraRgnOr(cl->copyRegion,cl->copyMoves[i].region);
+     cl->copyMoves[j++]=cl->copyMoves[i];
+   }
+   cl->nCopyMoves=j;
+}
+
+/* send the oldest copy as pixels, and whatever later copies take from it */
+static void rfbDropOldestCopy(rfbClientPtr cl)
+{
+   sraRegionPtr stale=sraRgnCreateRgn(cl->copyMoves[0].region),tmp;
+   int i;
+
+   sraRgnOr(cl->modifiedRegion,stale);
+   for(i=1;i<cl->nCopyMoves;i++) {
+     tmp=sraRgnCreateRgn(stale);
+     sraRgnOffset(tmp,cl->copyMoves[i].dx,cl->copyMoves[i].dy);
+     sraRgnAnd(tmp,cl->copyMoves[i].region);
+     sraRgnOr(cl->modifiedRegion,tmp);
+     sraRgnOr(stale,tmp);
+     sraRgnDestroy(tmp);
+   }
+   sraRgnDestroy(stale);
+
+   sraRgnMakeEmpty(cl->copyMoves[0].region);
+   rfbUpdateCopyRegion(cl);
+}
+
+static void rfbAddCopy(rfbClientPtr cl,sraRegionPtr copyRegion,int dx,int dy)
+{
+   rfbCopyMove *last=cl->nCopyMoves>0 ? &cl->copyMoves[cl->nCopyMoves-1] : NULL;
+
+   cl->copyDX = dx;
+   cl->copyDY = dy;
+   sraRgnOr(cl->copyRegion,copyRegion);
+
+   /* one pass can do both if the new one does not read what the last wrote */
+   if(last && last->dx==dx && last->dy==dy) {
+     sraRegionPtr source=sraRgnCreateRgn(copyRegion);
+     rfbBool independent;
+
+     sraRgnOffset(source,-dx,-dy);
+     independent=!sraRgnAnd(source,last->region);
+     sraRgnDestroy(source);
+     if(independent) {
+       sraRgnOr(last->region,copyRegion);
+       return;
+     }
+   }
+
+   if(cl->nCopyMoves==RFB_MAX_COPY_MOVES) {
+     sraRegionPtr stale;
+
+     rfbDropOldestCopy(cl);
+     /* the new copy may read from what is now sent as pixels, too */
+     stale=sraRgnCreateRgn(cl->modifiedRegion);
+     sraRgnOffset(stale,dx,dy);
+     sraRgnAnd(stale,copyRegion);
+     sraRgnOr(cl->modifiedRegion,stale);
+     sraRgnDestroy(stale);
+   }
+   cl->copyMoves[cl->nCopyMoves].region=sraRgnCreateRgn(copyRegion);
+   cl->copyMoves[cl->nCopyMoves].dx=dx;
+   cl->copyMoves[cl->nCopyMoves].dy=dy;
+   cl->nCopyMoves++;
+}
+
+/*
+ * Take region, which is going to be sent as pixels anyway, out of the
+ * pending copies, except where a later copy still reads from it.
+ */
+
+void rfbPruneCopies(rfbClientPtr cl,sraRegionPtr region)
+{
+   sraRegionPtr read=sraRgnCreate(),tmp;
+   int i;
+
+   for(i=cl->nCopyMoves-1;i>=0;i--) {
+     rfbCopyMove *m=&cl->copyMoves[i];
+
+     tmp=sraRgnCreateRgn(region);
+     sraRgnSubtract(tmp,read);
+     sraRgnSubtract(m->region,tmp);
+     sraRgnDestroy(tmp);
+
+     tmp=sraRgnCreateRgn(m->region);
+     sraRgnOffset(tmp,-m->dx,-m->dy);
+     sraRgnOr(read,tmp);
+     sraRgnDestroy(tmp);
+   }
+   sraRgnDestroy(read);
+   rfbUpdateCopyRegion(cl);
+}
+
+/*
+ * Hand the pending copies over for sending, cut down to what can be sent:
+ * the client has no pixels outside requestedRegion, so both ends of a copy
+ * must lie inside it, and a copy must not read from where an earlier one
+ * could not be sent.  Returns the number of copies moved to moves (some may
+ * be empty) and sets done to the area they leave right.  copyRegion is left
+ * alone.
+ */
+
+int rfbTakeCopies(rfbClientPtr cl,rfbCopyMove *moves,sraRegionPtr done)
+{
+   sraRegionPtr stale=sraRgnCreate(),ok,tmp;
+   int i,n=cl->nCopyMoves;
+
+   sraRgnMakeEmpty(done);
+   for(i=0;i<n;i++) {
+     rfbCopyMove *m=&cl->copyMoves[i];
+
+     ok=sraRgnCreateRgn(m->region);
+     sraRgnAnd(ok,cl->requestedRegion);
+     tmp=sraRgnCreateRgn(cl->requestedRegion);
+     sraRgnOffset(tmp,m->dx,m->dy);
+     sraRgnAnd(ok,tmp);
+     sraRgnDestroy(tmp);
+     tmp=sraRgnCreateRgn(stale);
+     sraRgnOffset(tmp,m->dx,m->dy);
+     sraRgnSubtract(ok,tmp);
+     sraRgnDestroy(tmp);
+
+     /* what is copied is right now, what is not still shows the old pixels */
+     sraRgnSubtract(stale,ok);
+     sraRgnSubtract(m->region,ok);
+     sraRgnOr(stale,m->region);
+     sraRgnOr(done,ok);
+
+     sraRgnDestroy(m->region);
+     moves[i].region=ok;
+     moves[i].dx=m->dx;
+     moves[i].dy=m->dy;
+   }
+   sraRgnSubtract(done,stale);
+   sraRgnDestroy(stale);
+   cl->nCopyMoves=0;
+   return n;
+}
+
+/* forget all pending copies, e.g. because everything is resent */
+void rfbClearCopies(rfbClientPtr cl)
+{
+   int i;
+
+   for(i=0;i<cl->nCopyMoves;i++)
+     sraRgnDestroy(cl->copyMoves[i].region);
+   cl->nCopyMoves=0;
+   sraRgnMakeEmpty(cl->copyRegion);
+   cl->copyDX = 0;
+   cl->copyDY = 0;
+}
+
 void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,int dx,int dy)
 {  
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
 
+   rfbScreen->fbGeneration++;
+
+   /* the clients will do the same copy on their side */
+   if(rfbScreen->damageShadow)
+     rfbCopyPixels(rfbScreen,rfbScreen->damageShadow,copyRegion,dx,dy);
+
    iterator=rfbGetClientIterator(rfbScreen);
    while((cl=rfbClientIteratorNext(iterator))) {
      LOCK(cl->updateMutex);
+     /* damage from before the copy moves along with it */
+     rfbCollectTileDamage(cl);
      if(cl->useCopyRect) {
        sraRegionPtr modifiedRegionBackup;
-       if(!sraRgnEmpty(cl->copyRegion)) {
-	  if(cl->copyDX!=dx || cl->copyDY!=dy) {
-	     /* if a copyRegion was not yet executed, treat it as a
-	      * modifiedRegion. The idea: in this case it could be
-	      * source of the new copyRect or modified anyway. */
-	     sraRgnOr(cl->modifiedRegion,cl->copyRegion);
-	     sraRgnMakeEmpty(cl->copyRegion);
-	  } else {
-	     /* we have to set the intersection of the source of the copy
-	      * and the old copy to modified. */
-	     modifiedRegionBackup=sraRgnCreateRgn(copyRegion);
-	     sraRgnOffset(modifiedRegionBackup,-dx,-dy);
-	     sraRgnAnd(modifiedRegionBackup,cl->copyRegion);
-	     sraRgnOr(cl->modifiedRegion,modifiedRegionBackup);
-	     sraRgnDestroy(modifiedRegionBackup);
-	  }
-       }
-	  
-       sraRgnOr(cl->copyRegion,copyRegion);
-       cl->copyDX = dx;
-       cl->copyDY = dy;
 
        /* if there were modified regions, which are now copied,
 	* mark them as modified, because the source of these can be overlapped
 	* either by new modified or now copied regions. */
        modifiedRegionBackup=sraRgnCreateRgn(cl->modifiedRegion);
        sraRgnOffset(modifiedRegionBackup,dx,dy);
-       sraRgnAnd(modifiedRegionBackup,cl->copyRegion);
+       sraRgnAnd(modifiedRegionBackup,copyRegion);
        sraRgnOr(cl->modifiedRegion,modifiedRegionBackup);
        sraRgnDestroy(modifiedRegionBackup);
 
+       /* earlier copies stay as they are, they are sent first */
+       rfbAddCopy(cl,copyRegion,dx,dy);
+
        if(!cl->enableCursorShapeUpdates) {
           /*
            * n.b. (dx, dy) is the vector pointing in the direction the
@@ -327,7 +512,7 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
           int h = cl->screen->cursor->height;
 
           cursorRegion = sraRgnCreateRect(x, y, x + w, y + h);
-          sraRgnAnd(cursorRegion, cl->copyRegion);
+          sraRgnAnd(cursorRegion, copyRegion);
           if(!sraRgnEmpty(cursorRegion)) {
              /*
               * current cursor rect overlaps with the copy region *dest*,
@@ -340,7 +525,7 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
           cursorRegion = sraRgnCreateRect(x, y, x + w, y + h);
           /* displace it to check for overlap with copy region source: */
           sraRgnOffset(cursorRegion, dx, dy);
-          sraRgnAnd(cursorRegion, cl->copyRegion);
+          sraRgnAnd(cursorRegion, copyRegion);
           if(!sraRgnEmpty(cursorRegion)) {
              /*
               * current cursor rect overlaps with the copy region *source*,
@@ -355,8 +540,9 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
      } else {
        sraRgnOr(cl->modifiedRegion,copyRegion);
      }
-     TSIGNAL(cl->updateCond);
+     rfbSignalClientUpdate(cl);
      UNLOCK(cl->updateMutex);
+     rfbScheduleClientUpdate(cl);
    }
 
    rfbReleaseClientIterator(iterator);
@@ -364,29 +550,8 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
 
 void rfbDoCopyRegion(rfbScreenInfoPtr screen,sraRegionPtr copyRegion,int dx,int dy)
 {
-   sraRectangleIterator* i;
-   sraRect rect;
-   int j,widthInBytes,bpp=screen->serverFormat.bitsPerPixel/8,
-    rowstride=screen->paddedWidthInBytes;
-   char *in,*out;
-
    /* copy it, really */
-   i = sraRgnGetReverseIterator(copyRegion,dx<0,dy<0);
-   while(sraRgnIteratorNext(i,&rect)) {
-     widthInBytes = (rect.x2-rect.x1)*bpp;
-     out = screen->frameBuffer+rect.x1*bpp+rect.y1*rowstride;
-     in = screen->frameBuffer+(rect.x1-dx)*bpp+(rect.y1-dy)*rowstride;
-     if(dy<0)
-       for(j=rect.y1;j<rect.y2;j++,out+=rowstride,in+=rowstride)
-	 memmove(out,in,widthInBytes);
-     else {
-       out += rowstride*(rect.y2-rect.y1-1);
-       in += rowstride*(rect.y2-rect.y1-1);
-       for(j=rect.y2-1;j>=rect.y1;j--,out-=rowstride,in-=rowstride)
-	 memmove(out,in,widthInBytes);
-     }
-   }
-   sraRgnReleaseIterator(i);
+   rfbCopyPixels(screen,screen->frameBuffer,copyRegion,dx,dy);
   
    rfbScheduleCopyRegion(screen,copyRegion,dx,dy);
 }
@@ -409,16 +574,124 @@ void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
 {
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
+   sraRegionPtr damage=NULL;
+
+   if(screen->detectDamage) {
+     damage=rfbDetectDamage(screen,modRegion);
+     if(sraRgnEmpty(damage)) {
+       sraRgnDestroy(damage);
+       return;
+     }
+     modRegion=damage;
+   }
+
+   /* before touching the clients, see rfbSendFramebufferUpdate() */
+   screen->fbGeneration++;
+
+   if(screen->classifyContent || screen->detectVideo)
+     rfbClassifierNoteChange(screen,modRegion);
+
+   /* the clients take it from the tiles at their own pace, see
+      rfbCollectTileDamage(); none of them is touched here */
+   if(screen->tileDamageMap) {
+     rfbTileDamageMark(screen,modRegion);
+     if(damage)
+       sraRgnDestroy(damage);
+     return;
+   }
 
    iterator=rfbGetClientIterator(screen);
    while((cl=rfbClientIteratorNext(iterator))) {
      LOCK(cl->updateMutex);
      sraRgnOr(cl->modifiedRegion,modRegion);
-     TSIGNAL(cl->updateCond);
+     rfbSignalClientUpdate(cl);
      UNLOCK(cl->updateMutex);
+     rfbScheduleClientUpdate(cl);
    }
 
    rfbReleaseClientIterator(iterator);
+   if(damage)
+     sraRgnDestroy(damage);
+}
+
+/*
+ * Wake up the output thread of cl: it waits on updateCond, or for tile
+ * damage on the screen's damageCond (see clientOutput()).  Call with
+ * updateMutex held.
+ */
+
+void rfbSignalClientUpdate(rfbClientPtr cl)
+{
+   TSIGNAL(cl->updateCond);
+   if(cl->screen->tileDamage) {
+     LOCK(cl->screen->damageMutex);
+     if(cl->waitingForDamage) {
+       cl->damageWakeUp=TRUE;
+       TBROADCAST(cl->screen->damageCond);
+     }
+     UNLOCK(cl->screen->damageMutex);
+   }
+}
+
+/*
+ * Marking tile damage does not put the clients on the ready list; the I/O
+ * side does it here instead, once for any number of marks.
+ */
+
+static void rfbScheduleTileDamage(rfbScreenInfoPtr screen)
+{
+   rfbClientIteratorPtr iterator;
+   rfbClientPtr cl;
+   unsigned long marks=screen->tileDamageMarks;
+
+   if(!screen->tileDamageMap || marks==screen->tileDamageScheduled)
+     return;
+   screen->tileDamageScheduled=marks;
+
+   iterator=rfbGetClientIterator(screen);
+   while((cl=rfbClientIteratorNext(iterator)))
+     if(cl->tileDamageMarks!=marks)
+       rfbScheduleClientUpdate(cl);
+   rfbReleaseClientIterator(iterator);
+}
+
+/*
+ * Put a client on its screen's ready list, so that rfbProcessEvents() looks
+ * at it even when useReadyList is set.  Cheap and idempotent; call it
+ * whenever something changed that the client might need to be sent.
+ */
+
+void rfbScheduleClientUpdate(rfbClientPtr cl)
+{
+   rfbScreenInfoPtr screen=cl->screen;
+
+   if(!screen->useReadyList)
+     return;
+
+   LOCK(screen->readyListMutex);
+   if(!cl->onReadyList) {
+     cl->onReadyList=TRUE;
+     cl->readyNext=screen->readyClientHead;
+     screen->readyClientHead=cl;
+   }
+   UNLOCK(screen->readyListMutex);
+}
+
+void rfbUnscheduleClientUpdate(rfbClientPtr cl)
+{
+   rfbScreenInfoPtr screen=cl->screen;
+   rfbClientPtr* p;
+
+   LOCK(screen->readyListMutex);
+   if(cl->onReadyList) {
+     for(p=&screen->readyClientHead;*p;p=&(*p)->readyNext)
+       if(*p==cl) {
+	 *p=cl->readyNext;
+	 break;
+       }
+     cl->onReadyList=FALSE;
+   }
+   UNLOCK(screen->readyListMutex);
 }
 
 void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2);
@@ -470,9 +743,18 @@ clientOutput(void *data)
 
 		LOCK(cl->updateMutex);
 
+		/* again under the lock, or the signal from rfbCloseClient()
+		   can come before the wait below */
+		if (cl->sock == -1) {
+			UNLOCK(cl->updateMutex);
+			return NULL;
+		}
+
 		if (sraRgnEmpty(cl->requestedRegion)) {
 			; /* always require a FB Update Request (otherwise can crash.) */
 		} else {
+			rfbCollectTileDamage(cl);
+			rfbScheduleRefinement(cl);
 			haveUpdate = FB_UPDATE_PENDING(cl);
 			if(!haveUpdate) {
 				updateRegion = sraRgnCreateRgn(cl->modifiedRegion);
@@ -480,6 +762,39 @@ clientOutput(void *data)
 				sraRgnDestroy(updateRegion);
 			}
 		}
+		/* the client or its link is still busy with what it got; the
+		   fence answer signals, but a draining queue does not */
+		if (haveUpdate && rfbClientCongested(cl)) {
+			UNLOCK(cl->updateMutex);
+			usleep(rfbMax(cl->screen->deferUpdateTime, 1) * 1000);
+			haveUpdate = FALSE;
+			continue;
+		}
+
+		/* nobody signals when lossy areas come to rest */
+		if (!haveUpdate && rfbRefinePending(cl)) {
+			UNLOCK(cl->updateMutex);
+			usleep(rfbMax(cl->screen->deferUpdateTime, 1) * 1000);
+			continue;
+		}
+
+		/* all clients waiting for tile damage are woken at once by
+		   rfbTileDamageMark(), anything else wakes only this one */
+		if (!haveUpdate && cl->screen->tileDamageMap) {
+			unsigned long marks = cl->tileDamageMarks;
+
+			LOCK(cl->screen->damageMutex);
+			cl->waitingForDamage = TRUE;
+			UNLOCK(cl->screen->damageMutex);
+			UNLOCK(cl->updateMutex);
+
+			LOCK(cl->screen->damageMutex);
+			while (cl->screen->tileDamageMarks == marks && !cl->damageWakeUp)
+				WAIT(cl->screen->damageCond, cl->screen->damageMutex);
+			cl->waitingForDamage = cl->damageWakeUp = FALSE;
+			UNLOCK(cl->screen->damageMutex);
+			continue;
+		}
 
 		if (!haveUpdate) {
 			WAIT(cl->updateCond, cl->updateMutex);
@@ -497,6 +812,7 @@ clientOutput(void *data)
            That way, if anything that overlaps the region we're sending
            is updated, we'll be sure to do another update later. */
         LOCK(cl->updateMutex);
+	rfbCollectTileDamage(cl);
 	updateRegion = sraRgnCreateRgn(cl->modifiedRegion);
         UNLOCK(cl->updateMutex);
 
@@ -572,7 +888,7 @@ clientInput(void *data)
 
     /* Get rid of the output thread. */
     LOCK(cl->updateMutex);
-    TSIGNAL(cl->updateCond);
+    rfbSignalClientUpdate(cl);
     UNLOCK(cl->updateMutex);
     IF_PTHREADS(pthread_join(output_thread, NULL));
 
@@ -628,9 +944,10 @@ rfbStartOnHoldClient(rfbClientPtr cl)
 {
     cl->onHold = FALSE;
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
-    if(cl->screen->backgroundLoop)
+    if(cl->screen->backgroundLoop && !cl->screen->workerPool)
 	pthread_create(&cl->client_thread, NULL, clientInput, (void *)cl);
 #endif
+    rfbScheduleClientUpdate(cl);
 }
 
 
@@ -666,8 +983,10 @@ rfbDefaultPtrAddEvent(int buttonMask, int x, int y, rfbClientPtr cl)
     /* But inform all remaining clients about this cursor movement. */
     iterator = rfbGetClientIterator(s);
     while ((other_client = rfbClientIteratorNext(iterator)) != NULL) {
-      if (other_client != cl && other_client->enableCursorPosUpdates) {
-	other_client->cursorWasMoved = TRUE;
+      if (other_client != cl) {
+	if (other_client->enableCursorPosUpdates)
+	  other_client->cursorWasMoved = TRUE;
+	rfbScheduleClientUpdate(other_client);
       }
     }
     rfbReleaseClientIterator(iterator);
@@ -888,6 +1207,47 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
 
    screen->handleEventsEagerly = FALSE;
 
+   screen->useEpoll = FALSE;
+   screen->epollFd = -1;
+   screen->useReadyList = FALSE;
+   screen->readyClientHead = NULL;
+
+   screen->workerThreads = 0;
+   screen->workerPool = NULL;
+   screen->encoderThreads = 0;
+   screen->encoderPool = NULL;
+
+   screen->encodeCacheSize = 0;
+   screen->encodeCache = NULL;
+   screen->fbGeneration = 0;
+
+   screen->detectDamage = FALSE;
+   screen->detectScroll = FALSE;
+   screen->damageShadow = NULL;
+   screen->tileDamage = FALSE;
+   screen->tileDamageMap = NULL;
+   screen->tileDamageMarks = 0;
+   screen->tileDamageScheduled = 0;
+
+   screen->maxFramesInFlight = 4;
+   screen->maxLatency = 100;
+
+   screen->classifyContent = FALSE;
+   screen->classifier = NULL;
+   screen->refineDelay = 0;
+
+   screen->detectVideo = FALSE;
+   screen->textPolicy.jpegQuality = -1;
+   screen->textPolicy.maxFrameRate = 0;
+   screen->textPolicy.refine = TRUE;
+   screen->videoPolicy.jpegQuality = 50;
+   screen->videoPolicy.maxFrameRate = 25;
+   screen->videoPolicy.refine = FALSE;
+
+   screen->scaledScreenDirty = NULL;
+   screen->scaledScreenCacheSize = 8*1024*1024;
+   screen->scaledScreenLastUsed = 0;
+
    screen->protocolMajorVersion = rfbProtocolMajorVersion;
    screen->protocolMinorVersion = rfbProtocolMinorVersion;
 
@@ -920,6 +1280,11 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    screen->dontConvertRichCursorToXCursor = FALSE;
    screen->cursor = &myCursor;
    INIT_MUTEX(screen->cursorMutex);
+   INIT_MUTEX(screen->readyListMutex);
+   INIT_MUTEX(screen->damageMutex);
+   INIT_COND(screen->damageCond);
+   INIT_MUTEX(screen->scaledScreenMutex);
+   INIT_MUTEX(screen->classifierMutex);
 
    IF_PTHREADS(screen->backgroundLoop = FALSE);
 
@@ -960,6 +1325,7 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
   rfbBool format_changed = FALSE;
   rfbClientIteratorPtr iterator;
   rfbClientPtr cl;
+  rfbTileDamage *oldTileDamage = NULL;
 
   /* Update information in the screenInfo structure */
 
@@ -989,6 +1355,17 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
   if (screen->cursorY >= height)
     screen->cursorY = height - 1;
 
+  screen->fbGeneration++;
+
+  /* the shadow is taken again on the next rfbMarkRegionAsModified() */
+  free(screen->damageShadow);
+  screen->damageShadow = NULL;
+
+  /* the clients take over the new tile map below; after that, none of
+     them uses the old one any more */
+  if (screen->tileDamageMap)
+    oldTileDamage = rfbTileDamageCreate(screen);
+
   /* For each client: */
   iterator = rfbGetClientIterator(screen);
   while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
@@ -1004,17 +1381,18 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
     LOCK(cl->updateMutex);
     sraRgnDestroy(cl->modifiedRegion);
     cl->modifiedRegion = sraRgnCreateRect(0, 0, width, height);
-    sraRgnMakeEmpty(cl->copyRegion);
-    cl->copyDX = 0;
-    cl->copyDY = 0;
+    rfbTileDamageInit(cl);
+    rfbClearCopies(cl);
 
     if (cl->useNewFBSize)
       cl->newFBSizePending = TRUE;
 
-    TSIGNAL(cl->updateCond);
+    rfbSignalClientUpdate(cl);
     UNLOCK(cl->updateMutex);
+    rfbScheduleClientUpdate(cl);
   }
   rfbReleaseClientIterator(iterator);
+  rfbTileDamageFree(oldTileDamage);
 }
 
 /* hang up on all clients and free all reserved memory */
@@ -1029,11 +1407,27 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
     cl1=cl;
   }
   rfbReleaseClientIterator(i);
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  if(screen->workerPool)
+    rfbWorkerPoolDestroy(screen->workerPool);
+  if(screen->encoderPool)
+    rfbWorkerPoolDestroy(screen->encoderPool);
+#endif
+  rfbEncodeCacheFree(screen->encodeCache);
+  free(screen->damageShadow);
+  rfbTileDamageFree(screen->tileDamageMap);
+  rfbClassifierFree(screen);
     
 #define FREE_IF(x) if(screen->x) free(screen->x)
   FREE_IF(colourMap.data.bytes);
   FREE_IF(underCursorBuffer);
   TINI_MUTEX(screen->cursorMutex);
+  TINI_MUTEX(screen->readyListMutex);
+  TINI_MUTEX(screen->damageMutex);
+  TINI_COND(screen->damageCond);
+  TINI_MUTEX(screen->scaledScreenMutex);
+  TINI_MUTEX(screen->classifierMutex);
   if(screen->cursor && screen->cursor->cleanup)
     rfbFreeCursor(screen->cursor);
 
@@ -1049,6 +1443,9 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
       rfbScreenInfoPtr ptr;
       ptr = screen->scaledScreenNext;
       screen->scaledScreenNext = ptr->scaledScreenNext;
+      sraRgnDestroy(ptr->scaledScreenDirty);
+      TINI_MUTEX(ptr->scaledScreenMutex);
+      TINI_MUTEX(ptr->scaledScreenRefreshMutex);
       free(ptr->frameBuffer);
       free(ptr);
   }
@@ -1073,6 +1470,15 @@ void rfbInitServer(rfbScreenInfoPtr screen)
 #endif
   rfbInitSockets(screen);
   rfbHttpInitSockets(screen);
+  if(screen->encodeCacheSize>0 && !screen->encodeCache)
+    screen->encodeCache=rfbEncodeCacheCreate(screen->encodeCacheSize);
+  if(screen->tileDamage && !screen->tileDamageMap)
+    rfbTileDamageCreate(screen);
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  if(screen->encoderThreads!=0 && !screen->encoderPool)
+    screen->encoderPool=rfbWorkerPoolCreate(screen->encoderThreads<0 ?
+        rfbWorkerPoolDefaultSize() : screen->encoderThreads);
+#endif
 #ifndef WIN32
   if(screen->ignoreSIGPIPE)
     signal(SIGPIPE,SIG_IGN);
@@ -1082,19 +1488,63 @@ void rfbInitServer(rfbScreenInfoPtr screen)
 void rfbShutdownServer(rfbScreenInfoPtr screen,rfbBool disconnectClients) {
   if(disconnectClients) {
     rfbClientPtr cl;
-    rfbClientIteratorPtr iter = rfbGetClientIterator(screen);
-    while( (cl = rfbClientIteratorNext(iter)) ) {
-      if (cl->sock > -1) {
-       /* we don't care about maxfd here, because the server goes away */
-       rfbCloseClient(cl);
-       rfbClientConnectionGone(cl);
+    rfbClientIteratorPtr iter;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    extern rfbClientIteratorPtr
+      rfbGetClientIteratorWithClosed(rfbScreenInfoPtr rfbScreen);
+
+    /*
+     * With a thread per client, the input thread reaps its client once
+     * nobody holds it any more, so the iterator has to step on before
+     * the thread can be waited for.
+     */
+    if(screen->backgroundLoop && !screen->workerPool) {
+      rfbClientPtr clNext;
+      pthread_t thread;
+      rfbBool onHold;
+
+      iter = rfbGetClientIteratorWithClosed(screen);
+      cl = rfbClientIteratorNext(iter);
+      while(cl) {
+        thread = cl->client_thread;
+        onHold = cl->onHold;
+        if (cl->sock > -1)
+          rfbCloseClient(cl);
+        clNext = rfbClientIteratorNext(iter);
+        /* clients on hold have no thread yet; the others may be gone now */
+        if(onHold)
+          rfbClientConnectionGone(cl);
+        else if(!pthread_equal(pthread_self(), thread))
+          pthread_join(thread, NULL);
+        cl = clNext;
       }
+      rfbReleaseClientIterator(iter);
+    } else
+#endif
+    {
+      iter = rfbGetClientIterator(screen);
+      while( (cl = rfbClientIteratorNext(iter)) ) {
+        if (cl->sock > -1) {
+         /* we don't care about maxfd here, because the server goes away */
+         rfbCloseClient(cl);
+         /* in worker pool mode, the I/O thread reaps closed clients */
+         if(!screen->workerPool)
+           rfbClientConnectionGone(cl);
+        }
+      }
+      rfbReleaseClientIterator(iter);
     }
-    rfbReleaseClientIterator(iter);
   }
 
   rfbShutdownSockets(screen);
   rfbHttpShutdownSockets(screen);
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  /* without clients and sockets the I/O thread runs out of work */
+  if(screen->workerPool && disconnectClients
+     && !pthread_equal(pthread_self(), screen->workerIoThread))
+    pthread_join(screen->workerIoThread, NULL);
+#endif
 }
 
 #ifndef LIBVNCSERVER_HAVE_GETTIMEOFDAY
@@ -1111,6 +1561,53 @@ void gettimeofday(struct timeval* tv,char* dummy)
 }
 #endif
 
+/*
+ * Walk the ready list instead of all clients.  The list is detached first;
+ * clients that still have work pending afterwards (a deferred update or
+ * pointer event, a running file transfer) are put back for the next round.
+ */
+
+static rfbBool
+rfbProcessReadyClients(rfbScreenInfoPtr screen)
+{
+  rfbClientPtr cl,clNext;
+  rfbBool result=FALSE;
+
+  rfbScheduleTileDamage(screen);
+
+  LOCK(screen->readyListMutex);
+  cl=screen->readyClientHead;
+  screen->readyClientHead=NULL;
+  UNLOCK(screen->readyListMutex);
+
+  while(cl) {
+    /* cl stays marked until it was looked at, so that rescheduling it
+       meanwhile does not clobber readyNext */
+    LOCK(screen->readyListMutex);
+    clNext=cl->readyNext;
+    cl->onReadyList=FALSE;
+    UNLOCK(screen->readyListMutex);
+
+    if(rfbUpdateClient(cl))
+      result=TRUE;
+    if(cl->sock>=0 && cl->fileTransfer.fd!=-1 && cl->fileTransfer.sending)
+      rfbSendFileTransferChunk(cl);
+
+    if(cl->sock==-1) {
+      rfbClientConnectionGone(cl);
+      result=TRUE;
+    } else if((FB_UPDATE_PENDING(cl) && !sraRgnEmpty(cl->requestedRegion))
+	      || rfbRefinePending(cl)
+	      || cl->lastPtrX>=0
+	      || (cl->fileTransfer.fd!=-1 && cl->fileTransfer.sending))
+      rfbScheduleClientUpdate(cl);
+
+    cl=clNext;
+  }
+
+  return result;
+}
+
 rfbBool
 rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
 {
@@ -1126,6 +1623,9 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
   rfbCheckFds(screen,usec);
   rfbHttpCheckFds(screen);
 
+  if(screen->useReadyList)
+    return rfbProcessReadyClients(screen);
+
   i = rfbGetClientIteratorWithClosed(screen);
   cl=rfbClientIteratorHead(i);
   while(cl) {
@@ -1142,34 +1642,46 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
   return result;
 }
 
-rfbBool
-rfbUpdateClient(rfbClientPtr cl)
+/*
+ * Returns TRUE once a pending update of cl has been deferred for
+ * deferUpdateTime ms, so that it should be sent now.
+ */
+
+static rfbBool
+rfbClientUpdateDue(rfbClientPtr cl)
 {
   struct timeval tv;
-  rfbBool result=FALSE;
   rfbScreenInfoPtr screen = cl->screen;
 
-  if (cl->sock >= 0 && !cl->onHold && FB_UPDATE_PENDING(cl) &&
-        !sraRgnEmpty(cl->requestedRegion)) {
-      result=TRUE;
-      if(screen->deferUpdateTime == 0) {
-          rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
-      } else if(cl->startDeferring.tv_usec == 0) {
-        gettimeofday(&cl->startDeferring,NULL);
-        if(cl->startDeferring.tv_usec == 0)
-          cl->startDeferring.tv_usec++;
-      } else {
-        gettimeofday(&tv,NULL);
-        if(tv.tv_sec < cl->startDeferring.tv_sec /* at midnight */
-           || ((tv.tv_sec-cl->startDeferring.tv_sec)*1000
-               +(tv.tv_usec-cl->startDeferring.tv_usec)/1000)
-             > screen->deferUpdateTime) {
-          cl->startDeferring.tv_usec = 0;
-          rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
-        }
-      }
-    }
+  if(rfbClientCongested(cl))
+    return FALSE;
 
+  if(screen->deferUpdateTime == 0)
+    return TRUE;
+
+  if(cl->startDeferring.tv_usec == 0) {
+    gettimeofday(&cl->startDeferring,NULL);
+    if(cl->startDeferring.tv_usec == 0)
+      cl->startDeferring.tv_usec++;
+    return FALSE;
+  }
+
+  gettimeofday(&tv,NULL);
+  if(tv.tv_sec < cl->startDeferring.tv_sec /* at midnight */
+     || ((tv.tv_sec-cl->startDeferring.tv_sec)*1000
+         +(tv.tv_usec-cl->startDeferring.tv_usec)/1000)
+       > screen->deferUpdateTime) {
+    cl->startDeferring.tv_usec = 0;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+/* hand a deferred pointer event to ptrAddEvent once deferPtrUpdateTime passed */
+
+static void
+rfbClientFlushDeferredPointer(rfbClientPtr cl)
+{
     if (!cl->viewOnly && cl->lastPtrX >= 0) {
       if(cl->startPtrDeferring.tv_usec == 0) {
         gettimeofday(&cl->startPtrDeferring,NULL);
@@ -1190,6 +1702,33 @@ rfbUpdateClient(rfbClientPtr cl)
         }
       }
     }
+}
+
+rfbBool
+rfbUpdateClient(rfbClientPtr cl)
+{
+  rfbBool result=FALSE;
+
+  if (cl->screen->tileDamageMap) {
+      LOCK(cl->updateMutex);
+      rfbCollectTileDamage(cl);
+      UNLOCK(cl->updateMutex);
+  }
+
+  if (cl->sock >= 0 && !cl->onHold && rfbRefinePending(cl)) {
+      LOCK(cl->updateMutex);
+      rfbScheduleRefinement(cl);
+      UNLOCK(cl->updateMutex);
+  }
+
+  if (cl->sock >= 0 && !cl->onHold && FB_UPDATE_PENDING(cl) &&
+        !sraRgnEmpty(cl->requestedRegion)) {
+      result=TRUE;
+      if(rfbClientUpdateDue(cl))
+          rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
+    }
+
+    rfbClientFlushDeferredPointer(cl);
 
     return result;
 }
@@ -1198,6 +1737,115 @@ rfbBool rfbIsActive(rfbScreenInfoPtr screenInfo) {
   return screenInfo->socketState!=RFB_SOCKET_SHUTDOWN || screenInfo->clientHead!=NULL;
 }
 
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+/*
+ * Worker pool mode: one I/O thread reads all client sockets and walks the
+ * ready list; whenever a client has damage, an outstanding update request
+ * and its defer time has passed, a job encoding and sending the update is
+ * queued on the screen's worker pool.  sendMutex and updateMutex protect
+ * the client exactly like in the thread-per-client mode.
+ */
+
+static void
+rfbClientUpdateJob(void *data)
+{
+    rfbClientPtr cl = (rfbClientPtr)data;
+    sraRegion* updateRegion;
+
+    LOCK(cl->updateMutex);
+    rfbCollectTileDamage(cl);
+    updateRegion = sraRgnCreateRgn(cl->modifiedRegion);
+    UNLOCK(cl->updateMutex);
+
+    LOCK(cl->sendMutex);
+    if (cl->sock != -1)
+        rfbSendFramebufferUpdate(cl, updateRegion);
+    UNLOCK(cl->sendMutex);
+
+    sraRgnDestroy(updateRegion);
+
+    LOCK(cl->screen->readyListMutex);
+    cl->updateJobQueued = FALSE;
+    UNLOCK(cl->screen->readyListMutex);
+
+    /* more damage may have come in while we were encoding */
+    rfbScheduleClientUpdate(cl);
+    rfbDecrClientRef(cl);
+}
+
+static void
+rfbDispatchReadyClients(rfbScreenInfoPtr screen)
+{
+    rfbClientPtr cl, clNext;
+    rfbBool pending, queued, refine;
+
+    rfbScheduleTileDamage(screen);
+
+    LOCK(screen->readyListMutex);
+    cl = screen->readyClientHead;
+    screen->readyClientHead = NULL;
+    UNLOCK(screen->readyListMutex);
+
+    while (cl) {
+        LOCK(screen->readyListMutex);
+        clNext = cl->readyNext;
+        cl->onReadyList = FALSE;
+        queued = cl->updateJobQueued;
+        UNLOCK(screen->readyListMutex);
+
+        if (cl->sock == -1) {
+            /* waits for a queued update job to drop its reference */
+            rfbClientConnectionGone(cl);
+            cl = clNext;
+            continue;
+        }
+
+        LOCK(cl->updateMutex);
+        rfbCollectTileDamage(cl);
+        if (!cl->onHold && !queued)
+            rfbScheduleRefinement(cl);
+        pending = !cl->onHold && FB_UPDATE_PENDING(cl)
+            && !sraRgnEmpty(cl->requestedRegion);
+        refine = rfbRefinePending(cl);
+        UNLOCK(cl->updateMutex);
+
+        /* a queued job reschedules the client when it is done */
+        if (pending && !queued && rfbClientUpdateDue(cl)) {
+            LOCK(screen->readyListMutex);
+            cl->updateJobQueued = queued = TRUE;
+            UNLOCK(screen->readyListMutex);
+            rfbIncrClientRef(cl);
+            rfbWorkerPoolSubmit(screen->workerPool, rfbClientUpdateJob, cl);
+        }
+
+        rfbClientFlushDeferredPointer(cl);
+        if (cl->fileTransfer.fd != -1 && cl->fileTransfer.sending)
+            rfbSendFileTransferChunk(cl);
+
+        if ((pending && !queued) || refine || cl->lastPtrX >= 0
+            || (cl->fileTransfer.fd != -1 && cl->fileTransfer.sending))
+            rfbScheduleClientUpdate(cl);
+
+        cl = clNext;
+    }
+}
+
+static void*
+workerIoRun(void *data)
+{
+    rfbScreenInfoPtr screen = (rfbScreenInfoPtr)data;
+
+    while (rfbIsActive(screen)) {
+        /* updates scheduled by other threads are picked up after at most
+           deferUpdateTime, which is as long as they would be deferred */
+        rfbCheckFds(screen, rfbMax(screen->deferUpdateTime, 1) * 1000);
+        rfbHttpCheckFds(screen);
+        rfbDispatchReadyClients(screen);
+    }
+    return NULL;
+}
+#endif
+
 void rfbRunEventLoop(rfbScreenInfoPtr screen, long usec, rfbBool runInBackground)
 {
   if(runInBackground) {
@@ -1206,6 +1854,17 @@ void rfbRunEventLoop(rfbScreenInfoPtr screen, long usec, rfbBool runInBackground
 
        screen->backgroundLoop = TRUE;
 
+       if(screen->workerThreads != 0) {
+	 screen->workerPool = rfbWorkerPoolCreate(screen->workerThreads < 0 ?
+	     rfbWorkerPoolDefaultSize() : screen->workerThreads);
+	 if(screen->workerPool) {
+	   screen->useReadyList = TRUE;
+	   pthread_create(&screen->workerIoThread, NULL, workerIoRun, screen);
+	   return;
+	 }
+	 rfbErr("Could not start worker pool, using one thread per client\n");
+       }
+
        pthread_create(&listener_thread, NULL, listenerRun, screen);
     return;
 #else
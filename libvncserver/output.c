@@ -0,0 +1,552 @@
+/*
+ * output.c - gather a framebuffer update and write it with few system calls.
+ *
+ * While rfbSendFramebufferUpdate() runs, a full cl->updateBuf is not written
+ * out but copied to a buffer from a small per-client pool, which goes on
+ * the client's output chain.  Encoders can also add
+ * pieces of memory that stay valid until the update is done, like rows of
+ * the framebuffer, without copying them into the update buffer first.  The
+ * chain is written with writev() when it is full and when the update ends,
+ * so a large update goes out in a handful of system calls.
+ *
+ * Clients served by the event loop (rfbProcessEvents() or the worker pool's
+ * I/O thread) are also never waited for.  What the socket does not take
+ * right away is copied to a queue, which rfbCheckFds() drains once the
+ * socket is writable again.  While the queue is longer than
+ * OUTPUT_HIGH_WATER no new update is started for the client, so changes
+ * pile up in its modifiedRegion and are sent as one frame when it caught
+ * up.  Only if the queue would grow beyond OUTPUT_MAX_QUEUED do writes
+ * wait, like they always did.
+ *
+ * The copies of a client that encode parts of an update in parallel (see
+ * parallel.c) capture their output in a chain that is never written; it
+ * is moved to the real client's chain with rfbOutputAppend().
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#include <errno.h>
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef LIBVNCSERVER_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* at most this many pieces are written with one call */
+#define OUTPUT_MAX_SEGMENTS 64
+/* at most this many update buffers are held before they are written */
+#define OUTPUT_MAX_BUFFERS 16
+/* smaller pieces are cheaper to copy than to write separately */
+#define OUTPUT_MIN_REFERENCE 512
+/* no update is started while more than this is queued */
+#define OUTPUT_HIGH_WATER (256 * 1024)
+/* writes wait rather than queue more than this */
+#define OUTPUT_MAX_QUEUED (32 * 1024 * 1024)
+
+typedef struct {
+    const char *data;
+    int len;
+    /* the update buffer this is, to go back to the pool once written */
+    char *buffer;
+} rfbOutputSegment;
+
+struct _rfbOutput {
+    rfbBool batching;
+    /* only collect, never write */
+    rfbBool capture;
+    rfbOutputSegment *segments;
+    int nSegments, maxSegments;
+    int nBuffers;
+    char *pool[OUTPUT_MAX_BUFFERS];
+    int nPool;
+
+    /* what the socket did not take yet, protected by outputMutex */
+    char *pending;
+    size_t pendingStart, pendingLen, pendingSize;
+};
+
+static char *
+newBuffer(rfbOutput *out)
+{
+    if (out->nPool > 0)
+        return out->pool[--out->nPool];
+    return (char *)malloc(UPDATE_BUF_SIZE);
+}
+
+static void
+releaseSegments(rfbOutput *out)
+{
+    int i;
+
+    for (i = 0; i < out->nSegments; i++) {
+        char *buffer = out->segments[i].buffer;
+        if (!buffer)
+            continue;
+        if (out->nPool < OUTPUT_MAX_BUFFERS)
+            out->pool[out->nPool++] = buffer;
+        else
+            free(buffer);
+    }
+    out->nSegments = 0;
+    out->nBuffers = 0;
+}
+
+rfbBool
+rfbOutputInit(rfbClientPtr cl)
+{
+    rfbOutput *out = (rfbOutput *)calloc(1, sizeof(rfbOutput));
+
+    if (!out)
+        return FALSE;
+    out->maxSegments = OUTPUT_MAX_SEGMENTS;
+    out->segments = (rfbOutputSegment *)malloc(out->maxSegments * sizeof(rfbOutputSegment));
+    if (!out->segments) {
+        free(out);
+        return FALSE;
+    }
+    cl->output = out;
+    return TRUE;
+}
+
+void
+rfbOutputFree(rfbClientPtr cl)
+{
+    rfbOutput *out = cl->output;
+
+    if (!out)
+        return;
+    releaseSegments(out);
+    while (out->nPool > 0)
+        free(out->pool[--out->nPool]);
+    free(out->pending);
+    free(out->segments);
+    free(out);
+    cl->output = NULL;
+}
+
+/* From now on, rfbSendUpdateBuf() only queues the update buffer. */
+
+void
+rfbOutputBegin(rfbClientPtr cl)
+{
+    if (cl->output)
+        cl->output->batching = TRUE;
+}
+
+/* Collect everything sent to cl until rfbOutputAppend() takes it. */
+
+void
+rfbOutputCapture(rfbClientPtr cl)
+{
+    cl->output->batching = TRUE;
+    cl->output->capture = TRUE;
+}
+
+rfbBool
+rfbOutputBatching(rfbClientPtr cl)
+{
+    return cl->output && cl->output->batching;
+}
+
+/*
+ * Returns TRUE if len bytes are worth adding by reference with
+ * rfbOutputQueueReference() instead of being copied to the update buffer.
+ * Not while the encode cache collects what is sent, since it only looks
+ * at the update buffer.
+ */
+
+rfbBool
+rfbOutputCanReference(rfbClientPtr cl, int len)
+{
+    return rfbOutputBatching(cl) && !cl->output->capture
+        && cl->encodeCaptureFrom < 0 && len >= OUTPUT_MIN_REFERENCE;
+}
+
+/*
+ * Write everything that is queued.  Returns FALSE, after closing the
+ * client, if that failed.
+ */
+
+rfbBool
+rfbOutputWrite(rfbClientPtr cl)
+{
+    rfbOutput *out = cl->output;
+    int i, result = 1;
+
+    if (!out || out->nSegments == 0 || out->capture)
+        return TRUE;
+
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+    {
+        struct iovec iov[OUTPUT_MAX_SEGMENTS];
+
+        for (i = 0; i < out->nSegments; i++) {
+            iov[i].iov_base = (void *)out->segments[i].data;
+            iov[i].iov_len = out->segments[i].len;
+        }
+        result = rfbWriteExactV(cl, iov, out->nSegments);
+    }
+#else
+    for (i = 0; i < out->nSegments && result > 0; i++)
+        result = rfbWriteExact(cl, out->segments[i].data, out->segments[i].len);
+#endif
+    releaseSegments(out);
+
+    if (result < 0) {
+        rfbLogPerror("rfbOutputWrite: write");
+        rfbCloseClient(cl);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static rfbBool
+queueSegment(rfbClientPtr cl, const char *data, int len, char *buffer)
+{
+    rfbOutput *out = cl->output;
+    rfbOutputSegment *s;
+
+    if (out->capture && out->nSegments == out->maxSegments) {
+        s = (rfbOutputSegment *)realloc(out->segments,
+                                        2 * out->maxSegments * sizeof(rfbOutputSegment));
+        if (!s) {
+            free(buffer);
+            return FALSE;
+        }
+        out->segments = s;
+        out->maxSegments *= 2;
+    }
+    if (out->nSegments == out->maxSegments && !rfbOutputWrite(cl)) {
+        free(buffer);
+        return FALSE;
+    }
+    s = &out->segments[out->nSegments++];
+    s->data = data;
+    s->len = len;
+    s->buffer = buffer;
+    if (buffer && ++out->nBuffers >= OUTPUT_MAX_BUFFERS && !out->capture)
+        return rfbOutputWrite(cl);
+    return TRUE;
+}
+
+/*
+ * Copy the contents of cl->updateBuf to the chain and empty it.
+ */
+
+rfbBool
+rfbOutputQueueUpdateBuf(rfbClientPtr cl)
+{
+    char *buffer;
+    int len = cl->ublen;
+
+    if (len == 0)
+        return TRUE;
+    buffer = newBuffer(cl->output);
+    if (!buffer) {
+        rfbErr("rfbOutputQueueUpdateBuf: out of memory\n");
+        if (!cl->output->capture)
+            rfbCloseClient(cl);
+        return FALSE;
+    }
+    memcpy(buffer, cl->updateBuf, len);
+    cl->ublen = 0;
+    return queueSegment(cl, buffer, len, buffer);
+}
+
+/*
+ * Send len bytes at data after what is in cl->updateBuf.  They are not
+ * copied, so they must stay unchanged until the next rfbOutputWrite() or
+ * rfbOutputFlush().
+ */
+
+rfbBool
+rfbOutputQueueReference(rfbClientPtr cl, const char *data, int len)
+{
+    if (!rfbOutputBatching(cl)) {
+        if (cl->ublen > 0 && !rfbSendUpdateBuf(cl))
+            return FALSE;
+        if (rfbWriteExact(cl, data, len) < 0) {
+            rfbLogPerror("rfbOutputQueueReference: write");
+            rfbCloseClient(cl);
+            return FALSE;
+        }
+        return TRUE;
+    }
+    return rfbOutputQueueUpdateBuf(cl) && queueSegment(cl, data, len, NULL);
+}
+
+/*
+ * Send what was captured for from after what was sent to cl so far.  The
+ * buffers change hands, nothing is copied.
+ */
+
+rfbBool
+rfbOutputAppend(rfbClientPtr cl, rfbClientPtr from)
+{
+    rfbOutput *out = from->output;
+    int i;
+
+    if (!rfbOutputQueueUpdateBuf(from) || !rfbOutputQueueUpdateBuf(cl))
+        return FALSE;
+    for (i = 0; i < out->nSegments; i++) {
+        char *buffer = out->segments[i].buffer;
+
+        /* queueSegment() owns it now, even if it fails */
+        out->segments[i].buffer = NULL;
+        if (!queueSegment(cl, out->segments[i].data, out->segments[i].len, buffer)) {
+            releaseSegments(out);
+            return FALSE;
+        }
+    }
+    out->nSegments = 0;
+    out->nBuffers = 0;
+    return TRUE;
+}
+
+/* Write out the whole update and stop batching. */
+
+rfbBool
+rfbOutputFlush(rfbClientPtr cl)
+{
+    rfbBool result;
+
+    if (!rfbOutputBatching(cl))
+        return TRUE;
+    result = rfbOutputQueueUpdateBuf(cl) && rfbOutputWrite(cl);
+    cl->output->batching = FALSE;
+    return result;
+}
+
+/* Drop what is queued, after the update failed. */
+
+void
+rfbOutputDiscard(rfbClientPtr cl)
+{
+    if (!cl->output)
+        return;
+    releaseSegments(cl->output);
+    cl->output->batching = FALSE;
+}
+
+/*
+ * Returns TRUE if writes to cl may be queued instead of waited for: if the
+ * event loop watches its socket.  With a thread per client, waiting in
+ * rfbWriteExact() stalls no one else.  TLS needs the same buffer passed
+ * again after a short write, so it always waits.
+ */
+
+rfbBool
+rfbOutputQueueing(rfbClientPtr cl)
+{
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+    return cl->output && cl->screen
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+        && !cl->sslctx
+#endif
+        && (!cl->screen->backgroundLoop || cl->screen->workerPool);
+#else
+    return FALSE;
+#endif
+}
+
+/* Returns how many bytes wait in the queue. */
+
+unsigned long
+rfbOutputPending(rfbClientPtr cl)
+{
+    return cl->output ? cl->output->pendingLen : 0;
+}
+
+/* Returns TRUE if no new update should be started for cl yet. */
+
+rfbBool
+rfbOutputBacklogged(rfbClientPtr cl)
+{
+    return rfbOutputPending(cl) > OUTPUT_HIGH_WATER;
+}
+
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+
+static rfbBool
+appendPending(rfbClientPtr cl, struct iovec *iov, int iovcnt, size_t len)
+{
+    rfbOutput *out = cl->output;
+    int i;
+
+    if (out->pendingStart > 0) {
+        memmove(out->pending, out->pending + out->pendingStart, out->pendingLen);
+        out->pendingStart = 0;
+    }
+    if (out->pendingLen + len > out->pendingSize) {
+        size_t size = rfbMax(out->pendingLen + len, 2 * out->pendingSize);
+        char *pending = (char *)realloc(out->pending, size);
+        if (!pending)
+            return FALSE;
+        out->pending = pending;
+        out->pendingSize = size;
+    }
+    if (out->pendingLen == 0)
+        rfbWatchSocketWritable(cl, TRUE);
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(out->pending + out->pendingLen, iov[i].iov_base, iov[i].iov_len);
+        out->pendingLen += iov[i].iov_len;
+    }
+    return TRUE;
+}
+
+/*
+ * Write what the socket takes of the queue.  Returns -1 on errors, else 0.
+ * Called with outputMutex held.
+ */
+
+static int
+drainPending(rfbClientPtr cl)
+{
+    rfbOutput *out = cl->output;
+    ssize_t n;
+
+    while (out->pendingLen > 0) {
+        n = write(cl->sock, out->pending + out->pendingStart, out->pendingLen);
+        if (n > 0) {
+            out->pendingStart += n;
+            out->pendingLen -= n;
+            cl->bytesWritten += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+    out->pendingStart = 0;
+    rfbWatchSocketWritable(cl, FALSE);
+    return 0;
+}
+
+/*
+ * The rfbWriteExactV() of queueing clients: writes what the socket takes
+ * and queues the rest.  Returns 1 on success, -1 on errors.
+ */
+
+int
+rfbOutputSendV(rfbClientPtr cl, struct iovec *iov, int iovcnt)
+{
+    rfbOutput *out = cl->output;
+    int totalTimeWaited = 0;
+    const int timeout = cl->screen->maxClientWait ? cl->screen->maxClientWait : rfbMaxClientWait;
+    size_t left;
+    ssize_t n;
+    int i;
+
+    LOCK(cl->outputMutex);
+    while (TRUE) {
+        if (drainPending(cl) < 0)
+            goto failed;
+
+        /* nothing may overtake what is queued */
+        while (out->pendingLen == 0 && iovcnt > 0) {
+            n = writev(cl->sock, iov, iovcnt);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EWOULDBLOCK || errno == EAGAIN)
+                    break;
+                goto failed;
+            }
+            cl->bytesWritten += n;
+            while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+                n -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if (n > 0) {
+                iov->iov_base = (char *)iov->iov_base + n;
+                iov->iov_len -= n;
+            }
+        }
+
+        for (left = 0, i = 0; i < iovcnt; i++)
+            left += iov[i].iov_len;
+        if (left == 0)
+            break;
+        if (out->pendingLen + left <= OUTPUT_MAX_QUEUED) {
+            if (!appendPending(cl, iov, iovcnt, left)) {
+                errno = ENOMEM;
+                goto failed;
+            }
+            break;
+        }
+
+        /* too much is queued already, wait until some of it went out */
+        n = rfbWaitForSocket(cl->sock, TRUE, 5000);
+        if (n < 0 && errno != EINTR)
+            goto failed;
+        if (n == 0) {
+            totalTimeWaited += 5000;
+            if (totalTimeWaited >= timeout) {
+                errno = ETIMEDOUT;
+                goto failed;
+            }
+        } else {
+            totalTimeWaited = 0;
+        }
+    }
+    UNLOCK(cl->outputMutex);
+    return 1;
+
+failed:
+    UNLOCK(cl->outputMutex);
+    return -1;
+}
+
+#endif
+
+/*
+ * Write as much of the queue as the socket takes now.  rfbCheckFds() calls
+ * this when the socket of a client with queued output is writable.
+ */
+
+void
+rfbOutputDrain(rfbClientPtr cl)
+{
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+    rfbOutput *out = cl->output;
+    rfbBool backlogged;
+    int result;
+
+    if (!out || cl->sock < 0)
+        return;
+    LOCK(cl->outputMutex);
+    backlogged = out->pendingLen > OUTPUT_HIGH_WATER;
+    result = drainPending(cl);
+    UNLOCK(cl->outputMutex);
+
+    if (result < 0) {
+        rfbLogPerror("rfbOutputDrain: write");
+        rfbCloseClient(cl);
+    } else if (backlogged && !rfbOutputBacklogged(cl)) {
+        /* let it have the changes it missed */
+        rfbScheduleClientUpdate(cl);
+    }
+#endif
+}
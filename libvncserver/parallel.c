@@ -0,0 +1,328 @@
+/*
+ * parallel.c - encode the rectangles of one update on several threads.
+ *
+ * A large Tight update is cut into bands of BAND_HEIGHT rows, and the bands
+ * are shared out, in order, between up to four copies of the client.  Each
+ * copy encodes its share on a thread of the screen's encoderPool (the first
+ * one on the calling thread) into an output chain of its own (see
+ * output.c), using a zlib stream and an encoder context of its own:
+ * Tight has four streams, which is why there are no more copies.
+ * Afterwards the chains are appended to the client's in the order of the
+ * bands, so the client sees the same stream of rectangles as if they had
+ * been encoded one after the other.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+#include "scale.h"
+
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && defined(LIBVNCSERVER_HAVE_LIBZ) \
+    && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+#define PARALLEL_TIGHT
+#endif
+
+#ifdef PARALLEL_TIGHT
+
+/* the number of zlib streams of Tight */
+#define MAX_SLOTS 4
+/* rows per band */
+#define BAND_HEIGHT 64
+/* smaller updates are not worth the threads */
+#define MIN_PARALLEL_AREA (256 * 256)
+
+typedef struct {
+    int x, y, w, h;
+} rfbBand;
+
+typedef struct _rfbParallelJob rfbParallelJob;
+
+typedef struct {
+    rfbParallelJob *job;
+    rfbClientRec copy;
+    int first, last;
+    rfbBool result;
+} rfbParallelSlot;
+
+struct _rfbParallelJob {
+    rfbBand *bands;
+    rfbParallelSlot slots[MAX_SLOTS];
+    MUTEX(mutex);
+    COND(done);
+    int running;
+};
+
+/*
+ * Returns TRUE if the update region may be sent with rfbSendRegionParallel().
+ * A pending stream reset is signalled in the next control byte, which only
+ * works if rectangles go out in the order they were encoded in.
+ */
+
+rfbBool
+rfbParallelEncodeUsable(rfbClientPtr cl, sraRegionPtr region)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+    long area = 0;
+
+    if (!cl->screen->encoderPool
+        || cl->preferredEncoding != rfbEncodingTight
+        || !cl->enableLastRectEncoding || cl->zsResetPending)
+        return FALSE;
+
+    i = sraRgnGetIterator(region);
+    while (area < MIN_PARALLEL_AREA && sraRgnIteratorNext(i, &rect))
+        area += (long)(rect.x2 - rect.x1) * (rect.y2 - rect.y1);
+    sraRgnReleaseIterator(i);
+    return area >= MIN_PARALLEL_AREA;
+}
+
+/* Cut the scaled rectangles of region into bands.  Returns how many. */
+
+static int
+cutBands(rfbClientPtr cl, sraRegionPtr region, rfbBand **bands)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+    int n = 0, size = 16;
+
+    *bands = (rfbBand *)malloc(size * sizeof(rfbBand));
+    if (!*bands)
+        return 0;
+    for (i = sraRgnGetIterator(region); sraRgnIteratorNext(i, &rect);) {
+        int x = rect.x1;
+        int y = rect.y1;
+        int w = rect.x2 - x;
+        int h = rect.y2 - y;
+        int y1;
+
+        if (cl->screen != cl->scaledScreen)
+            rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "cutBands");
+        for (y1 = y; y1 < y + h; y1 += BAND_HEIGHT) {
+            if (n == size) {
+                rfbBand *b = (rfbBand *)realloc(*bands, 2 * size * sizeof(rfbBand));
+                if (!b) {
+                    sraRgnReleaseIterator(i);
+                    free(*bands);
+                    *bands = NULL;
+                    return 0;
+                }
+                *bands = b;
+                size *= 2;
+            }
+            (*bands)[n].x = x;
+            (*bands)[n].y = y1;
+            (*bands)[n].w = w;
+            (*bands)[n].h = (y + h - y1 < BAND_HEIGHT ? y + h - y1 : BAND_HEIGHT);
+            n++;
+        }
+    }
+    sraRgnReleaseIterator(i);
+    return n;
+}
+
+static void
+encodeSlot(rfbParallelSlot *slot)
+{
+    rfbBand *b;
+    int n;
+
+    slot->result = TRUE;
+    for (n = slot->first; n < slot->last && slot->result; n++) {
+        b = &slot->job->bands[n];
+        slot->result = rfbSendRectEncodingTight(&slot->copy, b->x, b->y, b->w, b->h);
+    }
+}
+
+static void
+encodeSlotJob(void *data)
+{
+    rfbParallelSlot *slot = (rfbParallelSlot *)data;
+    rfbParallelJob *job = slot->job;
+
+    encodeSlot(slot);
+    LOCK(job->mutex);
+    if (--job->running == 0)
+        TSIGNAL(job->done);
+    UNLOCK(job->mutex);
+}
+
+/*
+ * Make copy encode for cl on Tight stream k.  It only gets what the
+ * encoders read: the screens, the pixel format, the Tight settings and the
+ * policies, and a region of its own for each one they use.  Everything
+ * else stays zero, so the copy has no mutexes, statistics, regions or
+ * encoder state of cl to touch.  The Tight context and the zlib stream
+ * are reached through encodeParent, and the socket is only looked at:
+ * what the copy sends is captured.
+ */
+
+static void
+initCopy(rfbClientPtr copy, rfbClientPtr cl, int k)
+{
+    memset(copy, 0, sizeof(rfbClientRec));
+    copy->screen = cl->screen;
+    copy->scaledScreen = cl->scaledScreen;
+    copy->sock = cl->sock;
+    copy->format = cl->format;
+    copy->translateFn = cl->translateFn;
+    copy->translateLookupTable = cl->translateLookupTable;
+    copy->preferredEncoding = cl->preferredEncoding;
+    copy->enableLastRectEncoding = cl->enableLastRectEncoding;
+    copy->tightCompressLevel = cl->tightCompressLevel;
+    copy->turboQualityLevel = cl->turboQualityLevel;
+    copy->turboSubsampLevel = cl->turboSubsampLevel;
+    copy->losslessUpdate = cl->losslessUpdate;
+    copy->textPolicy = cl->textPolicy;
+    copy->videoPolicy = cl->videoPolicy;
+    if (cl->videoRegion)
+        copy->videoRegion = sraRgnCreateRgn(cl->videoRegion);
+    copy->lossyNewRegion = sraRgnCreate();
+    copy->encodeParent = cl;
+    copy->encodeStream = k;
+    copy->encodeCaptureFrom = -1;
+}
+
+static void
+freeCopy(rfbClientPtr copy)
+{
+    if (copy->videoRegion)
+        sraRgnDestroy(copy->videoRegion);
+    sraRgnDestroy(copy->lossyNewRegion);
+}
+
+/* Add what a copy of cl counted to the statistics of cl. */
+
+static void
+mergeStats(rfbClientPtr cl, rfbClientPtr copy)
+{
+    rfbStatList *from, *to;
+    int c;
+
+    for (from = copy->statEncList; from; from = from->Next) {
+        to = rfbStatLookupEncoding(cl, from->type);
+        if (!to)
+            continue;
+        to->sentCount += from->sentCount;
+        to->bytesSent += from->bytesSent;
+        to->bytesSentIfRaw += from->bytesSentIfRaw;
+    }
+    for (c = 0; c < rfbContentClasses; c++) {
+        cl->contentClassRects[c] += copy->contentClassRects[c];
+        cl->contentClassPixels[c] += copy->contentClassPixels[c];
+    }
+    cl->videoPixels += copy->videoPixels;
+    rfbResetStats(copy);
+}
+
+/*
+ * Send the pixels of region, like the loop in rfbSendFramebufferUpdate()
+ * does, but with the work shared between threads.  The update must end
+ * with a LastRect marker.
+ */
+
+rfbBool
+rfbSendRegionParallel(rfbClientPtr cl, sraRegionPtr region)
+{
+    rfbParallelJob *job;
+    rfbBool result = TRUE;
+    long total = 0, done = 0;
+    int nBands, nSlots, k, n;
+
+    job = (rfbParallelJob *)calloc(1, sizeof(rfbParallelJob));
+    if (!job)
+        return FALSE;
+    nBands = cutBands(cl, region, &job->bands);
+    if (nBands == 0) {
+        free(job);
+        return FALSE;
+    }
+    for (n = 0; n < nBands; n++)
+        total += (long)job->bands[n].w * job->bands[n].h;
+
+    /* give every copy about the same number of pixels */
+    nSlots = nBands < MAX_SLOTS ? nBands : MAX_SLOTS;
+    for (k = n = 0; k < nSlots; k++) {
+        rfbParallelSlot *slot = &job->slots[k];
+        rfbClientPtr copy = &slot->copy;
+
+        slot->job = job;
+        slot->first = n;
+        while (n < nBands && (k == nSlots - 1 || done * nSlots < total * (k + 1))) {
+            done += (long)job->bands[n].w * job->bands[n].h;
+            n++;
+        }
+        slot->last = n;
+
+        initCopy(copy, cl, k);
+        if (!rfbOutputInit(copy)) {
+            freeCopy(copy);
+            nSlots = k;
+            result = FALSE;
+            break;
+        }
+        rfbOutputCapture(copy);
+    }
+
+    if (result) {
+        INIT_MUTEX(job->mutex);
+        INIT_COND(job->done);
+        job->running = nSlots - 1;
+        for (k = 1; k < nSlots; k++)
+            rfbWorkerPoolSubmit(cl->screen->encoderPool, encodeSlotJob, &job->slots[k]);
+        encodeSlot(&job->slots[0]);
+        LOCK(job->mutex);
+        while (job->running > 0)
+            WAIT(job->done, job->mutex);
+        UNLOCK(job->mutex);
+        TINI_COND(job->done);
+        TINI_MUTEX(job->mutex);
+    }
+
+    for (k = 0; k < nSlots; k++) {
+        rfbClientPtr copy = &job->slots[k].copy;
+
+        if (result && !(job->slots[k].result && rfbOutputAppend(cl, copy)))
+            result = FALSE;
+        mergeStats(cl, copy);
+        sraRgnOr(cl->lossyNewRegion, copy->lossyNewRegion);
+        rfbOutputFree(copy);
+        freeCopy(copy);
+    }
+    free(job->bands);
+    free(job);
+    return result;
+}
+
+#else
+
+rfbBool
+rfbParallelEncodeUsable(rfbClientPtr cl, sraRegionPtr region)
+{
+    return FALSE;
+}
+
+rfbBool
+rfbSendRegionParallel(rfbClientPtr cl, sraRegionPtr region)
+{
+    return FALSE;
+}
+
+#endif
@@ -3,19 +3,170 @@
 
 /* from cursor.c */
 
-void rfbShowCursor(rfbClientPtr cl);
-void rfbHideCursor(rfbClientPtr cl);
+typedef struct _rfbCursorOverlay rfbCursorOverlay;
+
 void rfbRedrawAfterHideCursor(rfbClientPtr cl,sraRegionPtr updateRegion);
+sraRegionPtr rfbCursorSplitUpdate(rfbClientPtr cl, sraRegionPtr updateRegion);
+rfbScreenInfoPtr rfbCursorOverlayDraw(rfbClientPtr cl, sraRegionPtr region, int *x, int *y, int *w, int *h);
+rfbBool rfbCursorOverlaySend(rfbClientPtr cl, rfbBool (*send)(rfbClientPtr cl, int x, int y, int w, int h));
+void rfbCursorOverlayFree(rfbClientPtr cl);
 
 /* from main.c */
 
 rfbClientPtr rfbClientIteratorHead(rfbClientIteratorPtr i);
+void rfbUnscheduleClientUpdate(rfbClientPtr cl);
+void rfbPruneCopies(rfbClientPtr cl, sraRegionPtr region);
+int rfbTakeCopies(rfbClientPtr cl, rfbCopyMove *moves, sraRegionPtr done);
+void rfbClearCopies(rfbClientPtr cl);
+void rfbSignalClientUpdate(rfbClientPtr cl);
+
+/* from congestion.c */
+
+typedef struct _rfbCongestion rfbCongestion;
+
+void rfbCongestionReset(rfbClientPtr cl);
+void rfbCongestionFree(rfbClientPtr cl);
+rfbBool rfbClientCongested(rfbClientPtr cl);
+unsigned long rfbClientBandwidth(rfbClientPtr cl);
+
+/* from classify.c */
+
+typedef struct _rfbContentClassifier rfbContentClassifier;
+
+/* change rates are kept for tiles of this size */
+#define rfbContentTileSize 64
+
+void rfbClassifierNoteChange(rfbScreenInfoPtr screen, sraRegionPtr region);
+void rfbClassifierFree(rfbScreenInfoPtr screen);
+rfbContentClass rfbClassifyRect(rfbClientPtr cl, int x, int y, int w, int h);
+void rfbClassifierVideoRegion(rfbScreenInfoPtr screen, sraRegionPtr region);
+
+/* from video.c */
+
+void rfbVideoInit(rfbClientPtr cl);
+void rfbVideoFree(rfbClientPtr cl);
+void rfbVideoSplitUpdate(rfbClientPtr cl, sraRegionPtr updateRegion);
+rfbEncodingPolicy *rfbPolicyForRect(rfbClientPtr cl, int x, int y, int w, int h);
+void rfbApplyRefinePolicy(rfbClientPtr cl, sraRegionPtr region);
+
+/* from h264.c */
+
+#ifdef LIBVNCSERVER_HAVE_H264
+typedef struct _rfbH264Context rfbH264Context;
+
+void rfbH264Free(rfbClientPtr cl);
+void rfbH264RequestKeyframe(rfbClientPtr cl);
+#endif
+
+/* from refine.c */
+
+void rfbLossyInit(rfbClientPtr cl);
+void rfbLossyFree(rfbClientPtr cl);
+void rfbMarkRectLossy(rfbClientPtr cl, int x, int y, int w, int h);
+void rfbLossyUpdateDone(rfbClientPtr cl, sraRegionPtr updateRegion,
+                        rfbCopyMove *moves, int nMoves);
+rfbBool rfbRefinePending(rfbClientPtr cl);
+rfbBool rfbScheduleRefinement(rfbClientPtr cl);
+
+/* from sockets.c */
+
+rfbBool rfbWatchSocket(rfbScreenInfoPtr rfbScreen, int sock, void *owner);
+void rfbUnwatchSocket(rfbScreenInfoPtr rfbScreen, int sock);
+int rfbWaitForSocket(int sock, rfbBool forWrite, int timeout);
+void rfbWatchSocketWritable(rfbClientPtr cl, rfbBool writable);
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+struct iovec;
+int rfbWriteExactV(rfbClientPtr cl, struct iovec *iov, int iovcnt);
+#endif
+
+/* from output.c */
+
+typedef struct _rfbOutput rfbOutput;
+
+rfbBool rfbOutputInit(rfbClientPtr cl);
+void rfbOutputFree(rfbClientPtr cl);
+void rfbOutputBegin(rfbClientPtr cl);
+void rfbOutputCapture(rfbClientPtr cl);
+rfbBool rfbOutputBatching(rfbClientPtr cl);
+rfbBool rfbOutputCanReference(rfbClientPtr cl, int len);
+rfbBool rfbOutputQueueUpdateBuf(rfbClientPtr cl);
+rfbBool rfbOutputQueueReference(rfbClientPtr cl, const char *data, int len);
+rfbBool rfbOutputWrite(rfbClientPtr cl);
+rfbBool rfbOutputAppend(rfbClientPtr cl, rfbClientPtr from);
+rfbBool rfbOutputFlush(rfbClientPtr cl);
+void rfbOutputDiscard(rfbClientPtr cl);
+rfbBool rfbOutputQueueing(rfbClientPtr cl);
+unsigned long rfbOutputPending(rfbClientPtr cl);
+rfbBool rfbOutputBacklogged(rfbClientPtr cl);
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+int rfbOutputSendV(rfbClientPtr cl, struct iovec *iov, int iovcnt);
+#endif
+void rfbOutputDrain(rfbClientPtr cl);
+
+/* from parallel.c */
+
+rfbBool rfbParallelEncodeUsable(rfbClientPtr cl, sraRegionPtr region);
+rfbBool rfbSendRegionParallel(rfbClientPtr cl, sraRegionPtr region);
+
+/* from workerpool.c */
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+typedef void (*rfbWorkerJobProc)(void *data);
+typedef struct _rfbWorkerPool rfbWorkerPool;
+
+int rfbWorkerPoolDefaultSize(void);
+rfbWorkerPool* rfbWorkerPoolCreate(int nThreads);
+void rfbWorkerPoolSubmit(rfbWorkerPool *pool, rfbWorkerJobProc proc, void *data);
+void rfbWorkerPoolDestroy(rfbWorkerPool *pool);
+#endif
+
+/* from damage.c */
+
+sraRegionPtr rfbDetectDamage(rfbScreenInfoPtr screen, sraRegionPtr modRegion);
+
+/* from translate.c */
+
+void rfbReleaseTranslateTable(char *table);
+
+/* from translatesimd.c */
+
+rfbTranslateFnType rfbSimdTranslateFunction(rfbPixelFormat *in, rfbPixelFormat *out);
+
+/* from tiledamage.c */
+
+typedef struct _rfbTileDamage rfbTileDamage;
+
+/* damage is tracked in tiles of this size with screen->tileDamage */
+#define rfbDamageTileSize 64
+
+rfbTileDamage *rfbTileDamageCreate(rfbScreenInfoPtr screen);
+void rfbTileDamageFree(rfbTileDamage *map);
+void rfbTileDamageInit(rfbClientPtr cl);
+void rfbTileDamageFreeClient(rfbClientPtr cl);
+void rfbTileDamageMark(rfbScreenInfoPtr screen, sraRegionPtr region);
+void rfbCollectTileDamage(rfbClientPtr cl);
+
+/* from encodecache.c */
+
+typedef struct _rfbEncodeCache rfbEncodeCache;
+
+rfbEncodeCache* rfbEncodeCacheCreate(int maxBytes);
+void rfbEncodeCacheFree(rfbEncodeCache *cache);
+rfbBool rfbEncodeCacheUsable(rfbClientPtr cl);
+int rfbEncodeCacheSendRect(rfbClientPtr cl, unsigned long generation,
+                           int x, int y, int w, int h);
+void rfbEncodeCacheBeginRect(rfbClientPtr cl);
+void rfbEncodeCacheCapture(rfbClientPtr cl);
+void rfbEncodeCacheEndRect(rfbClientPtr cl, unsigned long generation,
+                           int x, int y, int w, int h);
 
 /* from tight.c */
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 extern void rfbTightCleanup(rfbScreenInfoPtr screen);
+extern void rfbTightResetStreams(rfbClientPtr cl);
+extern void rfbFreeTightData(rfbClientPtr cl);
 #endif
 
 /* from zlib.c */
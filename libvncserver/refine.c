@@ -0,0 +1,221 @@
+/*
+ * refine.c - send lossy areas again losslessly once they stopped changing.
+ *
+ * Everything sent as JPEG (Tight) or wavelet-reduced (ZYWRLE) is noted in
+ * the client's lossyRegion.  Every screen->refineDelay ms, the lossy areas
+ * which were not sent again during the last period are moved to
+ * lossyIdleRegion.  When the client has nothing else to update, asked for
+ * an update and its link is idle, a slice of lossyIdleRegion is queued as
+ * an update of its own which is encoded losslessly, so moving content
+ * stays cheap while content at rest ends up exact.
+ *
+ * The regions are protected by updateMutex.  The sender collects what it
+ * encodes lossily in lossyNewRegion, which only it touches, and hands it
+ * over in rfbLossyUpdateDone().
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#ifdef LIBVNCSERVER_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+/* pixels refined per update */
+#define REFINE_MAX_AREA (256 * 512)
+
+void
+rfbLossyInit(rfbClientPtr cl)
+{
+    cl->lossyRegion = sraRgnCreate();
+    cl->lossyRecentRegion = sraRgnCreate();
+    cl->lossyIdleRegion = sraRgnCreate();
+    cl->lossyNewRegion = sraRgnCreate();
+    gettimeofday(&cl->lossyTick, NULL);
+    cl->refinePending = FALSE;
+    cl->losslessUpdate = FALSE;
+}
+
+void
+rfbLossyFree(rfbClientPtr cl)
+{
+    sraRgnDestroy(cl->lossyRegion);
+    sraRgnDestroy(cl->lossyRecentRegion);
+    sraRgnDestroy(cl->lossyIdleRegion);
+    sraRgnDestroy(cl->lossyNewRegion);
+    cl->lossyRegion = cl->lossyRecentRegion = NULL;
+    cl->lossyIdleRegion = cl->lossyNewRegion = NULL;
+}
+
+/*
+ * Note that the rectangle at x,y of cl->scaledScreen, where the encoders
+ * work, was sent lossily.  Called by the sender only.
+ */
+
+void
+rfbMarkRectLossy(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbScreenInfoPtr scaled = cl->scaledScreen;
+    sraRegionPtr rect;
+    int x2 = x + w, y2 = y + h;
+
+    if (screen->refineDelay <= 0 || !cl->lossyNewRegion || w <= 0 || h <= 0)
+        return;
+
+    /* back to framebuffer coordinates, rounding outwards */
+    if (scaled != screen) {
+        x = x * screen->width / scaled->width;
+        y = y * screen->height / scaled->height;
+        x2 = (x2 * screen->width + scaled->width - 1) / scaled->width;
+        y2 = (y2 * screen->height + scaled->height - 1) / scaled->height;
+    }
+    rect = sraRgnCreateRect(x, y, x2, y2);
+    sraRgnOr(cl->lossyNewRegion, rect);
+    sraRgnDestroy(rect);
+}
+
+/* Apply a copy of region, moved by dx,dy, to the lossy region reg. */
+
+static void
+moveLossy(sraRegionPtr reg, sraRegionPtr region, int dx, int dy)
+{
+    sraRegionPtr moved = sraRgnCreateRgn(region);
+
+    sraRgnOffset(moved, -dx, -dy);
+    sraRgnAnd(moved, reg);
+    sraRgnOffset(moved, dx, dy);
+    sraRgnSubtract(reg, region);
+    sraRgnOr(reg, moved);
+    sraRgnDestroy(moved);
+}
+
+/*
+ * Bring the lossy regions up to date after an update: the copies in moves
+ * took lossy pixels along, everything in updateRegion was sent again, and
+ * lossyNewRegion is what of that went out lossily.  Call with updateMutex
+ * held.
+ */
+
+void
+rfbLossyUpdateDone(rfbClientPtr cl, sraRegionPtr updateRegion,
+                   rfbCopyMove *moves, int nMoves)
+{
+    int m;
+
+    if (cl->screen->refineDelay <= 0 || !cl->lossyRegion)
+        return;
+
+    for (m = 0; m < nMoves; m++) {
+        moveLossy(cl->lossyRegion, moves[m].region, moves[m].dx, moves[m].dy);
+        /* moved content is not known to be at rest */
+        sraRgnOr(cl->lossyRecentRegion, moves[m].region);
+        sraRgnAnd(cl->lossyRecentRegion, cl->lossyRegion);
+        sraRgnSubtract(cl->lossyIdleRegion, moves[m].region);
+    }
+
+    sraRgnSubtract(cl->lossyRegion, updateRegion);
+    sraRgnSubtract(cl->lossyRecentRegion, updateRegion);
+    sraRgnSubtract(cl->lossyIdleRegion, updateRegion);
+
+    sraRgnOr(cl->lossyRegion, cl->lossyNewRegion);
+    sraRgnOr(cl->lossyRecentRegion, cl->lossyNewRegion);
+    sraRgnMakeEmpty(cl->lossyNewRegion);
+}
+
+/* Returns TRUE if cl has lossy areas left to refine some time. */
+
+rfbBool
+rfbRefinePending(rfbClientPtr cl)
+{
+    return cl->screen->refineDelay > 0 && cl->lossyRegion
+        && !sraRgnEmpty(cl->lossyRegion);
+}
+
+/*
+ * If cl has nothing else to do and idle lossy areas, add a slice of them to
+ * its modifiedRegion and have the next update sent losslessly.  Returns TRUE
+ * if it did.  Call with updateMutex held.
+ */
+
+rfbBool
+rfbScheduleRefinement(rfbClientPtr cl)
+{
+    struct timeval now;
+    sraRectangleIterator *i;
+    sraRegionPtr slice, piece;
+    sraRect rect;
+    long area = 0, elapsed;
+
+    if (!rfbRefinePending(cl) || cl->refinePending)
+        return FALSE;
+
+    gettimeofday(&now, NULL);
+    elapsed = (now.tv_sec - cl->lossyTick.tv_sec) * 1000
+        + (now.tv_usec - cl->lossyTick.tv_usec) / 1000;
+    if (elapsed >= cl->screen->refineDelay || elapsed < 0) {
+        /* what was not sent again during a whole period is at rest */
+        sraRgnOr(cl->lossyIdleRegion, cl->lossyRegion);
+        sraRgnSubtract(cl->lossyIdleRegion, cl->lossyRecentRegion);
+        rfbApplyRefinePolicy(cl, cl->lossyIdleRegion);
+        sraRgnMakeEmpty(cl->lossyRecentRegion);
+        cl->lossyTick = now;
+    }
+
+    /* refinement comes last: after real changes, and on an idle link */
+    if (sraRgnEmpty(cl->lossyIdleRegion) || sraRgnEmpty(cl->requestedRegion)
+        || !sraRgnEmpty(cl->modifiedRegion) || !sraRgnEmpty(cl->copyRegion)
+        || rfbOutputPending(cl) > 0 || rfbClientCongested(cl))
+        return FALSE;
+
+    slice = sraRgnCreate();
+    i = sraRgnGetIterator(cl->lossyIdleRegion);
+    while (area < REFINE_MAX_AREA && sraRgnIteratorNext(i, &rect)) {
+        int w = rect.x2 - rect.x1;
+        int h = rect.y2 - rect.y1;
+
+        if (area + (long)w * h > REFINE_MAX_AREA) {
+            h = (REFINE_MAX_AREA - area) / w;
+            if (h < 1)
+                h = 1;
+        }
+        piece = sraRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y1 + h);
+        sraRgnOr(slice, piece);
+        sraRgnDestroy(piece);
+        area += (long)w * h;
+    }
+    sraRgnReleaseIterator(i);
+
+    sraRgnSubtract(cl->lossyIdleRegion, slice);
+    sraRgnAnd(slice, cl->requestedRegion);
+    if (sraRgnEmpty(slice)) {
+        sraRgnDestroy(slice);
+        return FALSE;
+    }
+    sraRgnOr(cl->modifiedRegion, slice);
+    sraRgnDestroy(slice);
+    cl->refinePending = TRUE;
+    return TRUE;
+}
@@ -3,786 +3,776 @@
  *
  * A general purpose region clipping library
  * Only deals with rectangular regions, though.
+ *
+ * A region is an array of rectangles in y-x banded order: the rectangles
+ * of a band have the same y1 and y2 and are sorted by x, bands are sorted
+ * by y and do not overlap, and two touching bands with the same x spans
+ * are one band.  This is the form the span lists this used to be built of
+ * had, so the same rectangles come out.
+ *
+ * The array is reference counted: sraRgnCreateRgn() and sraRgnOr() into
+ * an empty region share it, and a region only copies it when it changes
+ * while shared.  The boolean operations build their result in a new array
+ * which replaces the old one.  Arrays and regions given up are kept for
+ * reuse, per thread.
  */
 
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 
-/* -=- Internal Span structure */
-
-struct sraRegion;
-
-typedef struct sraSpan {
-  struct sraSpan *_next;
-  struct sraSpan *_prev;
-  int start;
-  int end;
-  struct sraRegion *subspan;
-} sraSpan;
+/* -=- Internal data structures */
+
+typedef struct sraRegionData {
+  int refs;			/* regions and iterators using it */
+  int size;			/* room for this many rectangles */
+  int n;			/* rectangles used, never 0 */
+  sraRect extents;		/* a box around all, exact for one rectangle */
+  struct sraRegionData *nextFree;
+  sraRect rects[1];
+} sraRegionData;
+
+struct sraRegion {
+  sraRegionData *data;		/* NULL if the region is empty */
+  struct sraRegion *nextFree;
+};
+
+/* -=- Reference counts */
+
+#if defined(LIBVNCSERVER_HAVE_SYNC_BUILTINS)
+#define REF_ADD(d, n) __sync_add_and_fetch(&(d)->refs, (n))
+#elif defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+static pthread_mutex_t refsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+sraRefAdd(sraRegionData *d, int n) {
+  int refs;
+  pthread_mutex_lock(&refsMutex);
+  refs = d->refs += n;
+  pthread_mutex_unlock(&refsMutex);
+  return refs;
+}
+#define REF_ADD(d, n) sraRefAdd((d), (n))
+#else
+#define REF_ADD(d, n) ((d)->refs += (n))
+#endif
 
-typedef struct sraRegion {
-  sraSpan front;
-  sraSpan back;
-} sraSpanList;
+/* -=- Pool of free arrays and regions */
 
-/* -=- Span routines */
+#define POOL_MAX 16		/* entries of each kind kept */
+#define POOL_MAX_RECTS 1024	/* larger arrays are freed */
+#define MIN_RECTS 8
 
-sraSpanList *sraSpanListDup(const sraSpanList *src);
-void sraSpanListDestroy(sraSpanList *list);
+typedef struct sraPool {
+  sraRegionData *data;
+  int nData;
+  sraRegion *regions;
+  int nRegions;
+} sraPool;
 
-static sraSpan *
-sraSpanCreate(int start, int end, const sraSpanList *subspan) {
-  sraSpan *item = (sraSpan*)malloc(sizeof(sraSpan));
-  item->_next = item->_prev = NULL;
-  item->start = start;
-  item->end = end;
-  item->subspan = sraSpanListDup(subspan);
-  return item;
-}
-
-static sraSpan *
-sraSpanDup(const sraSpan *src) {
-  sraSpan *span;
-  if (!src) return NULL;
-  span = sraSpanCreate(src->start, src->end, src->subspan);
-  return span;
-}
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+static pthread_key_t poolKey;
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
 
 static void
-sraSpanInsertAfter(sraSpan *newspan, sraSpan *after) {
-  newspan->_next = after->_next;
-  newspan->_prev = after;
-  after->_next->_prev = newspan;
-  after->_next = newspan;
+sraPoolFree(void *p) {
+  sraPool *pool = (sraPool*)p;
+  while (pool->data) {
+    sraRegionData *d = pool->data;
+    pool->data = d->nextFree;
+    free(d);
+  }
+  while (pool->regions) {
+    sraRegion *r = pool->regions;
+    pool->regions = r->nextFree;
+    free(r);
+  }
+  free(pool);
 }
 
 static void
-sraSpanInsertBefore(sraSpan *newspan, sraSpan *before) {
-  newspan->_next = before;
-  newspan->_prev = before->_prev;
-  before->_prev->_next = newspan;
-  before->_prev = newspan;
+sraPoolKeyCreate(void) {
+  pthread_key_create(&poolKey, sraPoolFree);
+}
+
+static sraPool *
+sraGetPool(void) {
+  sraPool *pool;
+  pthread_once(&poolOnce, sraPoolKeyCreate);
+  pool = (sraPool*)pthread_getspecific(poolKey);
+  if (!pool) {
+    pool = (sraPool*)calloc(1, sizeof(sraPool));
+    if (pool && pthread_setspecific(poolKey, pool) != 0) {
+      free(pool);
+      pool = NULL;
+    }
+  }
+  return pool;
 }
+#else
+static sraPool thePool;
+#define sraGetPool() (&thePool)
+#endif
 
-static void
-sraSpanRemove(sraSpan *span) {
-  span->_prev->_next = span->_next;
-  span->_next->_prev = span->_prev;
+static sraRegionData *
+sraDataAlloc(int size) {
+  sraPool *pool = sraGetPool();
+  sraRegionData *d = NULL;
+
+  if (size < MIN_RECTS)
+    size = MIN_RECTS;
+  if (pool && pool->data) {
+    d = pool->data;
+    pool->data = d->nextFree;
+    pool->nData--;
+    if (d->size < size) {
+      sraRegionData *bigger = (sraRegionData*)realloc(d, sizeof(sraRegionData) + (size - 1) * sizeof(sraRect));
+      if (!bigger)
+        free(d);
+      else
+        bigger->size = size;
+      d = bigger;
+    }
+  } else {
+    d = (sraRegionData*)malloc(sizeof(sraRegionData) + (size - 1) * sizeof(sraRect));
+    if (d)
+      d->size = size;
+  }
+  if (!d) {
+    rfbErr("sraRegion: out of memory\n");
+    abort();
+  }
+  d->refs = 1;
+  d->n = 0;
+  return d;
 }
 
 static void
-sraSpanDestroy(sraSpan *span) {
-  if (span->subspan) sraSpanListDestroy(span->subspan);
-  free(span);
+sraDataRelease(sraRegionData *d) {
+  sraPool *pool;
+
+  if (!d || REF_ADD(d, -1) > 0)
+    return;
+  pool = sraGetPool();
+  if (pool && pool->nData < POOL_MAX && d->size <= POOL_MAX_RECTS) {
+    d->nextFree = pool->data;
+    pool->data = d;
+    pool->nData++;
+  } else
+    free(d);
+}
+
+/* Make room for extra more rectangles in d, which must not be shared. */
+
+static sraRegionData *
+sraDataReserve(sraRegionData *d, int extra) {
+  if (d->n + extra > d->size) {
+    int size = d->size * 2;
+    if (size < d->n + extra)
+      size = d->n + extra;
+    d = (sraRegionData*)realloc(d, sizeof(sraRegionData) + (size - 1) * sizeof(sraRect));
+    if (!d) {
+      rfbErr("sraRegion: out of memory\n");
+      abort();
+    }
+    d->size = size;
+  }
+  return d;
 }
 
-#ifdef DEBUG
 static void
-sraSpanCheck(const sraSpan *span, const char *text) {
-  /* Check the span is valid! */
-  if (span->start == span->end) {
-    printf(text); 
-    printf(":%d-%d\n", span->start, span->end);
+sraDataExtents(sraRegionData *d, sraRect *extents) {
+  int k;
+  extents->y1 = d->rects[0].y1;
+  extents->y2 = d->rects[d->n - 1].y2;
+  extents->x1 = d->rects[0].x1;
+  extents->x2 = d->rects[0].x2;
+  for (k = 1; k < d->n; k++) {
+    if (d->rects[k].x1 < extents->x1)
+      extents->x1 = d->rects[k].x1;
+    if (d->rects[k].x2 > extents->x2)
+      extents->x2 = d->rects[k].x2;
   }
 }
-#endif
-
-/* -=- SpanList routines */
 
-static void sraSpanPrint(const sraSpan *s);
+/* Replace the data of rgn, which is given up. */
 
 static void
-sraSpanListPrint(const sraSpanList *l) {
-  sraSpan *curr;
-  if (!l) {
-	  printf("NULL");
-	  return;
+sraSetData(sraRegion *rgn, sraRegionData *d) {
+  sraRegionData *old = rgn->data;
+  if (d && d->n == 0) {
+    sraDataRelease(d);
+    d = NULL;
   }
-  curr = l->front._next;
-  printf("[");
-  while (curr != &(l->back)) {
-    sraSpanPrint(curr);
-    curr = curr->_next;
-  }
-  printf("]");
+  rgn->data = d;
+  sraDataRelease(old);
 }
 
-void
-sraSpanPrint(const sraSpan *s) {
-  printf("(%d-%d)", (s->start), (s->end));
-  if (s->subspan)
-    sraSpanListPrint(s->subspan);
-}
-
-static sraSpanList *
-sraSpanListCreate(void) {
-  sraSpanList *item = (sraSpanList*)malloc(sizeof(sraSpanList));
-  item->front._next = &(item->back);
-  item->front._prev = NULL;
-  item->back._prev = &(item->front);
-  item->back._next = NULL;
-  return item;
-}
-
-sraSpanList *
-sraSpanListDup(const sraSpanList *src) {
-  sraSpanList *newlist;
-  sraSpan *newspan, *curr;
-
-  if (!src) return NULL;
-  newlist = sraSpanListCreate();
-  curr = src->front._next;
-  while (curr != &(src->back)) {
-    newspan = sraSpanDup(curr);
-    sraSpanInsertBefore(newspan, &(newlist->back));
-    curr = curr->_next;
-  }
-
-  return newlist;
+static void
+sraShareData(sraRegion *rgn, sraRegionData *d) {
+  if (d)
+    REF_ADD(d, 1);
+  sraSetData(rgn, d);
 }
 
-void
-sraSpanListDestroy(sraSpanList *list) {
-  sraSpan *curr, *next;
-  while (list->front._next != &(list->back)) {
-    curr = list->front._next;
-    next = curr->_next;
-    sraSpanRemove(curr);
-    sraSpanDestroy(curr);
-    curr = next;
-  }
-  free(list);
-}
+/* Give rgn a copy of its data of its own before it is changed. */
 
 static void
-sraSpanListMakeEmpty(sraSpanList *list) {
-  sraSpan *curr, *next;
-  while (list->front._next != &(list->back)) {
-    curr = list->front._next;
-    next = curr->_next;
-    sraSpanRemove(curr);
-    sraSpanDestroy(curr);
-    curr = next;
-  }
-  list->front._next = &(list->back);
-  list->front._prev = NULL;
-  list->back._prev = &(list->front);
-  list->back._next = NULL;
-}
+sraMakeWritable(sraRegion *rgn) {
+  sraRegionData *d = rgn->data, *copy;
 
-static rfbBool
-sraSpanListEqual(const sraSpanList *s1, const sraSpanList *s2) {
-  sraSpan *sp1, *sp2;
+  if (!d || REF_ADD(d, 0) == 1)
+    return;
+  copy = sraDataAlloc(d->n);
+  memcpy(copy->rects, d->rects, d->n * sizeof(sraRect));
+  copy->n = d->n;
+  copy->extents = d->extents;
+  sraSetData(rgn, copy);
+}
 
-  if (!s1) {
-    if (!s2) {
-      return 1;
-    } else {
-      rfbErr("sraSpanListEqual:incompatible spans (only one NULL!)\n");
-      return FALSE;
-    }
-  }
+/* -=- Band routines */
 
-  sp1 = s1->front._next;
-  sp2 = s2->front._next;
-  while ((sp1 != &(s1->back)) &&
-	 (sp2 != &(s2->back))) {
-    if ((sp1->start != sp2->start) ||
-	(sp1->end != sp2->end) ||
-	(!sraSpanListEqual(sp1->subspan, sp2->subspan))) {
-      return 0;
-    }
-    sp1 = sp1->_next;
-    sp2 = sp2->_next;
-  }
+static int
+sraBandEnd(const sraRegionData *d, int start) {
+  int end = start + 1;
+  while (end < d->n && d->rects[end].y1 == d->rects[start].y1)
+    end++;
+  return end;
+}
 
-  if ((sp1 == &(s1->back)) && (sp2 == &(s2->back))) {
-    return 1;
-  } else {
-    return 0;
-  }    
+static int
+sraBandStart(const sraRegionData *d, int last) {
+  int start = last;
+  while (start > 0 && d->rects[start - 1].y1 == d->rects[last].y1)
+    start--;
+  return start;
 }
 
-static rfbBool
-sraSpanListEmpty(const sraSpanList *list) {
-  return (list->front._next == &(list->back));
+static void
+sraAddSpan(sraRegionData *d, int x1, int y1, int x2, int y2) {
+  sraRect *r = &d->rects[d->n++];
+  r->x1 = x1;
+  r->y1 = y1;
+  r->x2 = x2;
+  r->y2 = y2;
 }
 
-static unsigned long
-sraSpanListCount(const sraSpanList *list) {
-  sraSpan *curr = list->front._next;
-  unsigned long count = 0;
-  while (curr != &(list->back)) {
-    if (curr->subspan) {
-      count += sraSpanListCount(curr->subspan);
-    } else {
-      count += 1;
+/*
+ * The band just added from start on goes into the one before it if that
+ * touches it and has the same spans.
+ */
+
+static void
+sraCoalesce(sraRegionData *d, int *prevBand, int start) {
+  int n = d->n - start, k;
+
+  if (n == 0)
+    return;
+  if (*prevBand >= 0 && start - *prevBand == n
+      && d->rects[*prevBand].y2 == d->rects[start].y1) {
+    for (k = 0; k < n; k++)
+      if (d->rects[*prevBand + k].x1 != d->rects[start + k].x1
+          || d->rects[*prevBand + k].x2 != d->rects[start + k].x2)
+        break;
+    if (k == n) {
+      for (k = 0; k < n; k++)
+        d->rects[*prevBand + k].y2 = d->rects[start].y2;
+      d->n = start;
+      return;
     }
-    curr = curr->_next;
   }
-  return count;
+  *prevBand = start;
 }
 
 static void
-sraSpanMergePrevious(sraSpan *dest) {
-  sraSpan *prev = dest->_prev;
- 
-  while ((prev->_prev) &&
-	 (prev->end == dest->start) &&
-	 (sraSpanListEqual(prev->subspan, dest->subspan))) {
-    /*
-    printf("merge_prev:");
-    sraSpanPrint(prev);
-    printf(" & ");
-    sraSpanPrint(dest);
-    printf("\n");
-    */
-    dest->start = prev->start;
-    sraSpanRemove(prev);
-    sraSpanDestroy(prev);
-    prev = dest->_prev;
+sraUnionSpans(sraRegionData *d, int y1, int y2,
+              const sraRect *a, int na, const sraRect *b, int nb) {
+  int i = 0, j = 0, start = d->n;
+
+  while (i < na || j < nb) {
+    const sraRect *r;
+    if (j >= nb || (i < na && a[i].x1 <= b[j].x1))
+      r = &a[i++];
+    else
+      r = &b[j++];
+    if (d->n > start && d->rects[d->n - 1].x2 >= r->x1) {
+      if (r->x2 > d->rects[d->n - 1].x2)
+        d->rects[d->n - 1].x2 = r->x2;
+    } else
+      sraAddSpan(d, r->x1, y1, r->x2, y2);
   }
-}    
+}
 
 static void
-sraSpanMergeNext(sraSpan *dest) {
-  sraSpan *next = dest->_next;
-  while ((next->_next) &&
-	 (next->start == dest->end) &&
-	 (sraSpanListEqual(next->subspan, dest->subspan))) {
-/*
-	  printf("merge_next:");
-    sraSpanPrint(dest);
-    printf(" & ");
-    sraSpanPrint(next);
-    printf("\n");
-	*/
-    dest->end = next->end;
-    sraSpanRemove(next);
-    sraSpanDestroy(next);
-    next = dest->_next;
+sraIntersectSpans(sraRegionData *d, int y1, int y2,
+                  const sraRect *a, int na, const sraRect *b, int nb) {
+  int i = 0, j = 0;
+
+  while (i < na && j < nb) {
+    int x1 = a[i].x1 > b[j].x1 ? a[i].x1 : b[j].x1;
+    int x2 = a[i].x2 < b[j].x2 ? a[i].x2 : b[j].x2;
+    if (x1 < x2)
+      sraAddSpan(d, x1, y1, x2, y2);
+    if (a[i].x2 < b[j].x2)
+      i++;
+    else
+      j++;
   }
 }
 
 static void
-sraSpanListOr(sraSpanList *dest, const sraSpanList *src) {
-  sraSpan *d_curr, *s_curr;
-  int s_start, s_end;
-
-  if (!dest) {
-    if (!src) {
-      return;
-    } else {
-      rfbErr("sraSpanListOr:incompatible spans (only one NULL!)\n");
-      return;
+sraSubtractSpans(sraRegionData *d, int y1, int y2,
+                 const sraRect *a, int na, const sraRect *b, int nb) {
+  int i, j = 0, k, x;
+
+  for (i = 0; i < na; i++) {
+    x = a[i].x1;
+    while (j < nb && b[j].x2 <= x)
+      j++;
+    for (k = j; k < nb && b[k].x1 < a[i].x2 && x < a[i].x2; k++) {
+      if (b[k].x1 > x)
+        sraAddSpan(d, x, y1, b[k].x1, y2);
+      if (b[k].x2 > x)
+        x = b[k].x2;
     }
+    if (x < a[i].x2)
+      sraAddSpan(d, x, y1, a[i].x2, y2);
   }
+}
 
-  d_curr = dest->front._next;
-  s_curr = src->front._next;
-  s_start = s_curr->start;
-  s_end = s_curr->end;
-  while (s_curr != &(src->back)) {
-
-    /* - If we are at end of destination list OR
-       If the new span comes before the next destination one */
-    if ((d_curr == &(dest->back)) ||
-		(d_curr->start >= s_end)) {
-      /* - Add the span */
-      sraSpanInsertBefore(sraSpanCreate(s_start, s_end,
-					s_curr->subspan),
-			  d_curr);
-      if (d_curr != &(dest->back))
-	sraSpanMergePrevious(d_curr);
-      s_curr = s_curr->_next;
-      s_start = s_curr->start;
-      s_end = s_curr->end;
-    } else {
+/* -=- The boolean operations, on regions that are not empty */
 
-      /* - If the new span overlaps the existing one */
-      if ((s_start < d_curr->end) &&
-	  (s_end > d_curr->start)) {
-
-	/* - Insert new span before the existing destination one? */
-	if (s_start < d_curr->start) {
-	  sraSpanInsertBefore(sraSpanCreate(s_start,
-					    d_curr->start,
-					    s_curr->subspan),
-			      d_curr);
-	  sraSpanMergePrevious(d_curr);
-	}
-
-	/* Split the existing span if necessary */
-	if (s_end < d_curr->end) {
-	  sraSpanInsertAfter(sraSpanCreate(s_end,
-					   d_curr->end,
-					   d_curr->subspan),
-			     d_curr);
-	  d_curr->end = s_end;
-	}
-	if (s_start > d_curr->start) {
-	  sraSpanInsertBefore(sraSpanCreate(d_curr->start,
-					    s_start,
-					    d_curr->subspan),
-			      d_curr);
-	  d_curr->start = s_start;
-	}
-
-	/* Recursively OR subspans */
-	sraSpanListOr(d_curr->subspan, s_curr->subspan);
-
-	/* Merge this span with previous or next? */
-	if (d_curr->_prev != &(dest->front))
-	  sraSpanMergePrevious(d_curr);
-	if (d_curr->_next != &(dest->back))
-	  sraSpanMergeNext(d_curr);
-
-	/* Move onto the next pair to compare */
-	if (s_end > d_curr->end) {
-	  s_start = d_curr->end;
-	  d_curr = d_curr->_next;
-	} else {
-	  s_curr = s_curr->_next;
-	  s_start = s_curr->start;
-	  s_end = s_curr->end;
-	}
-      } else {
-	/* - No overlap.  Move to the next destination span */
-	d_curr = d_curr->_next;
-      }
-    }
-  }
-}
+enum { SRA_AND, SRA_OR, SRA_SUBTRACT };
 
-static rfbBool
-sraSpanListAnd(sraSpanList *dest, const sraSpanList *src) {
-  sraSpan *d_curr, *s_curr, *d_next;
+/* The index of the first band of d from start on which goes below y. */
 
-  if (!dest) {
-    if (!src) {
-      return 1;
-    } else {
-      rfbErr("sraSpanListAnd:incompatible spans (only one NULL!)\n");
-      return FALSE;
-    }
+static int
+sraBandsAbove(const sraRegionData *d, int start, int y) {
+  int end = d->n;
+  while (start < end) {
+    int mid = (start + end) / 2;
+    if (d->rects[mid].y2 <= y)
+      start = mid + 1;
+    else
+      end = mid;
   }
+  return start;
+}
 
-  d_curr = dest->front._next;
-  s_curr = src->front._next;
-  while ((s_curr != &(src->back)) && (d_curr != &(dest->back))) {
+/*
+ * Append the bands of src from start to end, which the other region has
+ * nothing next to, as they are.
+ */
 
-    /* - If we haven't reached a destination span yet then move on */
-    if (d_curr->start >= s_curr->end) {
-      s_curr = s_curr->_next;
-      continue;
+static sraRegionData *
+sraCopyBands(sraRegionData *d, int *prevBand, const sraRegionData *src,
+             int start, int end) {
+  int first = sraBandEnd(src, start), at = d->n;
+
+  d = sraDataReserve(d, end - start);
+  memcpy(&d->rects[d->n], &src->rects[start], (first - start) * sizeof(sraRect));
+  d->n += first - start;
+  sraCoalesce(d, prevBand, at);
+  if (first < end) {
+    memcpy(&d->rects[d->n], &src->rects[first], (end - first) * sizeof(sraRect));
+    d->n += end - first;
+    *prevBand = sraBandStart(d, d->n - 1);
+  }
+  return d;
+}
+
+static sraRegionData *
+sraRegionOp(const sraRegionData *a, const sraRegionData *b, int op) {
+  sraRegionData *d = sraDataAlloc(a->n + b->n);
+  int ia = 0, ea = sraBandEnd(a, 0);
+  int ib = 0, eb = sraBandEnd(b, 0);
+  int y, yNext, prevBand = -1;
+
+  y = a->rects[0].y1 < b->rects[0].y1 ? a->rects[0].y1 : b->rects[0].y1;
+  while (ia < a->n || ib < b->n) {
+    const sraRect *ra = ia < a->n ? &a->rects[ia] : NULL;
+    const sraRect *rb = ib < b->n ? &b->rects[ib] : NULL;
+    rfbBool inA, inB;
+    int start = d->n;
+
+    if (op == SRA_AND && (!ra || !rb))
+      break;
+    if (op == SRA_SUBTRACT && !ra)
+      break;
+
+    /* skip the rows neither has anything in */
+    if ((!ra || ra->y1 > y) && (!rb || rb->y1 > y))
+      y = !rb || (ra && ra->y1 < rb->y1) ? ra->y1 : rb->y1;
+    inA = ra && ra->y1 <= y;
+    inB = rb && rb->y1 <= y;
+
+    /* whole bands only one of them has are copied */
+    if (op != SRA_AND && inA != inB
+        && (inA ? ra->y1 == y : op == SRA_OR && rb->y1 == y)) {
+      if (inA) {
+        int end = rb ? sraBandsAbove(a, ia, rb->y1) : a->n;
+        if (end > ia) {
+          d = sraCopyBands(d, &prevBand, a, ia, end);
+          y = a->rects[end - 1].y2;
+          ia = end;
+          if (ia < a->n)
+            ea = sraBandEnd(a, ia);
+          continue;
+        }
+      } else {
+        int end = ra ? sraBandsAbove(b, ib, ra->y1) : b->n;
+        if (end > ib) {
+          d = sraCopyBands(d, &prevBand, b, ib, end);
+          y = b->rects[end - 1].y2;
+          ib = end;
+          if (ib < b->n)
+            eb = sraBandEnd(b, ib);
+          continue;
+        }
+      }
     }
 
-    /* - If we are beyond the current destination span then remove it */
-    if (d_curr->end <= s_curr->start) {
-      sraSpan *next = d_curr->_next;
-      sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
-      d_curr = next;
-      continue;
+    /* the rows until the next band starts or ends */
+    yNext = inA ? ra->y2 : ra ? ra->y1 : rb->y2;
+    if (rb) {
+      int yb = inB ? rb->y2 : rb->y1;
+      if (yb < yNext)
+        yNext = yb;
     }
 
-    /* - If we partially overlap a span then split it up or remove bits */
-    if (s_curr->start > d_curr->start) {
-      /* - The top bit of the span does not match */
-      d_curr->start = s_curr->start;
-    }
-    if (s_curr->end < d_curr->end) {
-      /* - The end of the span does not match */
-      sraSpanInsertAfter(sraSpanCreate(s_curr->end,
-				       d_curr->end,
-				       d_curr->subspan),
-			 d_curr);
-      d_curr->end = s_curr->end;
+    d = sraDataReserve(d, (inA ? ea - ia : 0) + (inB ? eb - ib : 0));
+    switch (op) {
+    case SRA_AND:
+      if (inA && inB)
+        sraIntersectSpans(d, y, yNext, ra, ea - ia, rb, eb - ib);
+      break;
+    case SRA_OR:
+      sraUnionSpans(d, y, yNext, ra, inA ? ea - ia : 0, rb, inB ? eb - ib : 0);
+      break;
+    case SRA_SUBTRACT:
+      if (inA)
+        sraSubtractSpans(d, y, yNext, ra, ea - ia, rb, inB ? eb - ib : 0);
+      break;
     }
+    sraCoalesce(d, &prevBand, start);
 
-    /* - Now recursively process the affected span */
-    if (!sraSpanListAnd(d_curr->subspan, s_curr->subspan)) {
-      /* - The destination subspan is now empty, so we should remove it */
-		sraSpan *next = d_curr->_next;
-      sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
-      d_curr = next;
-    } else {
-      /* Merge this span with previous or next? */
-      if (d_curr->_prev != &(dest->front))
-	sraSpanMergePrevious(d_curr);
-
-      /* - Move on to the next span */
-      d_next = d_curr;
-      if (s_curr->end >= d_curr->end) {
-	d_next = d_curr->_next;
-      }
-      if (s_curr->end <= d_curr->end) {
-	s_curr = s_curr->_next;
-      }
-      d_curr = d_next;
+    y = yNext;
+    if (inA && ra->y2 == y) {
+      ia = ea;
+      if (ia < a->n)
+        ea = sraBandEnd(a, ia);
+    }
+    if (inB && rb->y2 == y) {
+      ib = eb;
+      if (ib < b->n)
+        eb = sraBandEnd(b, ib);
     }
   }
 
-  while (d_curr != &(dest->back)) {
-    sraSpan *next = d_curr->_next;
-    sraSpanRemove(d_curr);
-    sraSpanDestroy(d_curr);
-    d_curr=next;
+  /* a box around the result, without going through it */
+  if (d->n == 1)
+    d->extents = d->rects[0];
+  else if (d->n > 1) {
+    d->extents = a->extents;
+    if (op == SRA_OR) {
+      if (b->extents.x1 < d->extents.x1)
+        d->extents.x1 = b->extents.x1;
+      if (b->extents.x2 > d->extents.x2)
+        d->extents.x2 = b->extents.x2;
+    } else if (op == SRA_AND) {
+      if (b->extents.x1 > d->extents.x1)
+        d->extents.x1 = b->extents.x1;
+      if (b->extents.x2 < d->extents.x2)
+        d->extents.x2 = b->extents.x2;
+    }
+    d->extents.y1 = d->rects[0].y1;
+    d->extents.y2 = d->rects[d->n - 1].y2;
   }
-
-  return !sraSpanListEmpty(dest);
+  return d;
 }
 
 static rfbBool
-sraSpanListSubtract(sraSpanList *dest, const sraSpanList *src) {
-  sraSpan *d_curr, *s_curr;
-
-  if (!dest) {
-    if (!src) {
-      return 1;
-    } else {
-      rfbErr("sraSpanListSubtract:incompatible spans (only one NULL!)\n");
-      return FALSE;
-    }
-  }
-
-  d_curr = dest->front._next;
-  s_curr = src->front._next;
-  while ((s_curr != &(src->back)) && (d_curr != &(dest->back))) {
-
-    /* - If we haven't reached a destination span yet then move on */
-    if (d_curr->start >= s_curr->end) {
-      s_curr = s_curr->_next;
-      continue;
-    }
+sraExtentsOverlap(const sraRegionData *a, const sraRegionData *b) {
+  return a->extents.x1 < b->extents.x2 && b->extents.x1 < a->extents.x2
+    && a->extents.y1 < b->extents.y2 && b->extents.y1 < a->extents.y2;
+}
 
-    /* - If we are beyond the current destination span then skip it */
-    if (d_curr->end <= s_curr->start) {
-      d_curr = d_curr->_next;
-      continue;
-    }
+/* TRUE if a is one rectangle covering all of b */
 
-    /* - If we partially overlap the current span then split it up */
-    if (s_curr->start > d_curr->start) {
-      sraSpanInsertBefore(sraSpanCreate(d_curr->start,
-					s_curr->start,
-					d_curr->subspan),
-			  d_curr);
-      d_curr->start = s_curr->start;
-    }
-    if (s_curr->end < d_curr->end) {
-      sraSpanInsertAfter(sraSpanCreate(s_curr->end,
-				       d_curr->end,
-				       d_curr->subspan),
-			 d_curr);
-      d_curr->end = s_curr->end;
-    }
-
-    /* - Now recursively process the affected span */
-    if ((!d_curr->subspan) || !sraSpanListSubtract(d_curr->subspan, s_curr->subspan)) {
-      /* - The destination subspan is now empty, so we should remove it */
-      sraSpan *next = d_curr->_next;
-      sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
-      d_curr = next;
-    } else {
-      /* Merge this span with previous or next? */
-      if (d_curr->_prev != &(dest->front))
-	sraSpanMergePrevious(d_curr);
-      if (d_curr->_next != &(dest->back))
-	sraSpanMergeNext(d_curr);
-
-      /* - Move on to the next span */
-      if (s_curr->end > d_curr->end) {
-	d_curr = d_curr->_next;
-      } else {
-	s_curr = s_curr->_next;
-      }
-    }
-  }
-
-  return !sraSpanListEmpty(dest);
+static rfbBool
+sraCovers(const sraRegionData *a, const sraRegionData *b) {
+  return a->n == 1
+    && a->extents.x1 <= b->extents.x1 && a->extents.x2 >= b->extents.x2
+    && a->extents.y1 <= b->extents.y1 && a->extents.y2 >= b->extents.y2;
 }
 
 /* -=- Region routines */
 
 sraRegion *
 sraRgnCreate(void) {
-  return (sraRegion*)sraSpanListCreate();
+  sraPool *pool = sraGetPool();
+  sraRegion *rgn;
+
+  if (pool && pool->regions) {
+    rgn = pool->regions;
+    pool->regions = rgn->nextFree;
+    pool->nRegions--;
+  } else {
+    rgn = (sraRegion*)malloc(sizeof(sraRegion));
+    if (!rgn) {
+      rfbErr("sraRegion: out of memory\n");
+      abort();
+    }
+  }
+  rgn->data = NULL;
+  rgn->nextFree = NULL;
+  return rgn;
 }
 
 sraRegion *
 sraRgnCreateRect(int x1, int y1, int x2, int y2) {
-  sraSpanList *vlist, *hlist;
-  sraSpan *vspan, *hspan;
-
-  /* - Build the horizontal portion of the span */
-  hlist = sraSpanListCreate();
-  hspan = sraSpanCreate(x1, x2, NULL);
-  sraSpanInsertAfter(hspan, &(hlist->front));
-
-  /* - Build the vertical portion of the span */
-  vlist = sraSpanListCreate();
-  vspan = sraSpanCreate(y1, y2, hlist);
-  sraSpanInsertAfter(vspan, &(vlist->front));
+  sraRegion *rgn = sraRgnCreate();
 
-  sraSpanListDestroy(hlist);
-
-  return (sraRegion*)vlist;
+  if (x1 < x2 && y1 < y2) {
+    rgn->data = sraDataAlloc(1);
+    sraAddSpan(rgn->data, x1, y1, x2, y2);
+    rgn->data->extents = rgn->data->rects[0];
+  }
+  return rgn;
 }
 
 sraRegion *
 sraRgnCreateRgn(const sraRegion *src) {
-  return (sraRegion*)sraSpanListDup((sraSpanList*)src);
+  sraRegion *rgn = sraRgnCreate();
+
+  if (src)
+    sraShareData(rgn, src->data);
+  return rgn;
 }
 
 void
 sraRgnDestroy(sraRegion *rgn) {
-  sraSpanListDestroy((sraSpanList*)rgn);
+  sraPool *pool;
+
+  if (!rgn)
+    return;
+  sraDataRelease(rgn->data);
+  pool = sraGetPool();
+  if (pool && pool->nRegions < POOL_MAX) {
+    rgn->nextFree = pool->regions;
+    pool->regions = rgn;
+    pool->nRegions++;
+  } else
+    free(rgn);
 }
 
 void
 sraRgnMakeEmpty(sraRegion *rgn) {
-  sraSpanListMakeEmpty((sraSpanList*)rgn);
+  sraSetData(rgn, NULL);
 }
 
 /* -=- Boolean Region ops */
 
 rfbBool
 sraRgnAnd(sraRegion *dst, const sraRegion *src) {
-  return sraSpanListAnd((sraSpanList*)dst, (sraSpanList*)src);
+  if (!dst->data)
+    return FALSE;
+  if (!src->data || !sraExtentsOverlap(dst->data, src->data)) {
+    sraSetData(dst, NULL);
+    return FALSE;
+  }
+  if (sraCovers(src->data, dst->data))
+    return TRUE;
+  if (sraCovers(dst->data, src->data)) {
+    sraShareData(dst, src->data);
+    return TRUE;
+  }
+  sraSetData(dst, sraRegionOp(dst->data, src->data, SRA_AND));
+  return dst->data != NULL;
 }
 
 void
 sraRgnOr(sraRegion *dst, const sraRegion *src) {
-  sraSpanListOr((sraSpanList*)dst, (sraSpanList*)src);
+  if (!src->data || dst->data == src->data)
+    return;
+  if (!dst->data || sraCovers(src->data, dst->data)) {
+    sraShareData(dst, src->data);
+    return;
+  }
+  if (sraCovers(dst->data, src->data))
+    return;
+  sraSetData(dst, sraRegionOp(dst->data, src->data, SRA_OR));
 }
 
 rfbBool
 sraRgnSubtract(sraRegion *dst, const sraRegion *src) {
-  return sraSpanListSubtract((sraSpanList*)dst, (sraSpanList*)src);
+  if (!dst->data)
+    return FALSE;
+  if (!src->data || !sraExtentsOverlap(dst->data, src->data))
+    return TRUE;
+  if (sraCovers(src->data, dst->data)) {
+    sraSetData(dst, NULL);
+    return FALSE;
+  }
+  sraSetData(dst, sraRegionOp(dst->data, src->data, SRA_SUBTRACT));
+  return dst->data != NULL;
 }
 
 void
 sraRgnOffset(sraRegion *dst, int dx, int dy) {
-  sraSpan *vcurr, *hcurr;
-
-  vcurr = ((sraSpanList*)dst)->front._next;
-  while (vcurr != &(((sraSpanList*)dst)->back)) {
-    vcurr->start += dy;
-    vcurr->end += dy;
-    
-    hcurr = vcurr->subspan->front._next;
-    while (hcurr != &(vcurr->subspan->back)) {
-      hcurr->start += dx;
-      hcurr->end += dx;
-      hcurr = hcurr->_next;
-    }
-
-    vcurr = vcurr->_next;
+  sraRegionData *d;
+  int k;
+
+  if (!dst->data)
+    return;
+  sraMakeWritable(dst);
+  d = dst->data;
+  for (k = 0; k < d->n; k++) {
+    d->rects[k].x1 += dx;
+    d->rects[k].x2 += dx;
+    d->rects[k].y1 += dy;
+    d->rects[k].y2 += dy;
   }
+  d->extents.x1 += dx;
+  d->extents.x2 += dx;
+  d->extents.y1 += dy;
+  d->extents.y2 += dy;
 }
 
 sraRegion *sraRgnBBox(const sraRegion *src) {
-  int xmin=((unsigned int)(int)-1)>>1,ymin=xmin,xmax=1-xmin,ymax=xmax;
-  sraSpan *vcurr, *hcurr;
-
-  if(!src)
-    return sraRgnCreate();
+  sraRect bbox;
 
-  vcurr = ((sraSpanList*)src)->front._next;
-  while (vcurr != &(((sraSpanList*)src)->back)) {
-    if(vcurr->start<ymin)
-      ymin=vcurr->start;
-    if(vcurr->end>ymax)
-      ymax=vcurr->end;
-    
-    hcurr = vcurr->subspan->front._next;
-    while (hcurr != &(vcurr->subspan->back)) {
-      if(hcurr->start<xmin)
-	xmin=hcurr->start;
-      if(hcurr->end>xmax)
-	xmax=hcurr->end;
-      hcurr = hcurr->_next;
-    }
-
-    vcurr = vcurr->_next;
-  }
-
-  if(xmax<xmin || ymax<ymin)
+  if(!src || !src->data)
     return sraRgnCreate();
 
-  return sraRgnCreateRect(xmin,ymin,xmax,ymax);
+  sraDataExtents(src->data, &bbox);
+  return sraRgnCreateRect(bbox.x1, bbox.y1, bbox.x2, bbox.y2);
 }
 
 rfbBool
 sraRgnPopRect(sraRegion *rgn, sraRect *rect, unsigned long flags) {
-  sraSpan *vcurr, *hcurr;
-  sraSpan *vend, *hend;
+  sraRegionData *d;
   rfbBool right2left = (flags & 2) == 2;
   rfbBool bottom2top = (flags & 1) == 1;
+  int start, end, k;
+
+  if (!rgn->data)
+    return 0;
+  sraMakeWritable(rgn);
+  d = rgn->data;
 
   /* - Pick correct order */
   if (bottom2top) {
-    vcurr = ((sraSpanList*)rgn)->back._prev;
-    vend = &(((sraSpanList*)rgn)->front);
+    end = d->n;
+    start = sraBandStart(d, end - 1);
   } else {
-    vcurr = ((sraSpanList*)rgn)->front._next;
-    vend = &(((sraSpanList*)rgn)->back);
+    start = 0;
+    end = sraBandEnd(d, 0);
   }
+  k = right2left ? end - 1 : start;
 
-  if (vcurr != vend) {
-    rect->y1 = vcurr->start;
-    rect->y2 = vcurr->end;
-
-    /* - Pick correct order */
-    if (right2left) {
-      hcurr = vcurr->subspan->back._prev;
-      hend = &(vcurr->subspan->front);
-    } else {
-      hcurr = vcurr->subspan->front._next;
-      hend = &(vcurr->subspan->back);
-    }
-
-    if (hcurr != hend) {
-      rect->x1 = hcurr->start;
-      rect->x2 = hcurr->end;
-
-      sraSpanRemove(hcurr);
-      sraSpanDestroy(hcurr);
-      
-      if (sraSpanListEmpty(vcurr->subspan)) {
-	sraSpanRemove(vcurr);
-	sraSpanDestroy(vcurr);
-      }
+  *rect = d->rects[k];
+  memmove(&d->rects[k], &d->rects[k + 1], (d->n - k - 1) * sizeof(sraRect));
+  d->n--;
+  if (d->n == 0)
+    sraSetData(rgn, NULL);
+  else if (d->n == 1)
+    d->extents = d->rects[0];
 
 #if 0
-      printf("poprect:(%dx%d)-(%dx%d)\n",
-	     rect->x1, rect->y1, rect->x2, rect->y2);
+  printf("poprect:(%dx%d)-(%dx%d)\n",
+	 rect->x1, rect->y1, rect->x2, rect->y2);
 #endif
-      return 1;
-    }
-  }
-
-  return 0;
+  return 1;
 }
 
 unsigned long
 sraRgnCountRects(const sraRegion *rgn) {
-  unsigned long count = sraSpanListCount((sraSpanList*)rgn);
-  return count;
+  return rgn->data ? rgn->data->n : 0;
 }
 
 rfbBool
 sraRgnEmpty(const sraRegion *rgn) {
-  return sraSpanListEmpty((sraSpanList*)rgn);
+  return rgn->data == NULL;
 }
 
 /* iterator stuff */
 sraRectangleIterator *sraRgnGetIterator(sraRegion *s)
 {
-  /* these values have to be multiples of 4 */
-#define DEFSIZE 4
-#define DEFSTEP 8
+  return sraRgnGetReverseIterator(s, FALSE, FALSE);
+}
+
+/*
+ * The iterator holds on to the rectangles, so it goes on with the ones the
+ * region had when it was created even if the region changes.
+ */
+
+sraRectangleIterator *sraRgnGetReverseIterator(sraRegion *s,rfbBool reverseX,rfbBool reverseY)
+{
   sraRectangleIterator *i =
     (sraRectangleIterator*)malloc(sizeof(sraRectangleIterator));
   if(!i)
     return NULL;
 
-  /* we have to recurse eventually. So, the first sPtr is the pointer to
-     the sraSpan in the first level. the second sPtr is the pointer to
-     the sraRegion.back. The third and fourth sPtr are for the second
-     recursion level and so on. */
-  i->sPtrs = (sraSpan**)malloc(sizeof(sraSpan*)*DEFSIZE);
-  if(!i->sPtrs) {
-    free(i);
-    return NULL;
-  }
-  i->ptrSize = DEFSIZE;
-  i->sPtrs[0] = &(s->front);
-  i->sPtrs[1] = &(s->back);
-  i->ptrPos = 0;
-  i->reverseX = 0;
-  i->reverseY = 0;
-  return i;
-}
-
-sraRectangleIterator *sraRgnGetReverseIterator(sraRegion *s,rfbBool reverseX,rfbBool reverseY)
-{
-  sraRectangleIterator *i = sraRgnGetIterator(s);
-  if(reverseY) {
-    i->sPtrs[1] = &(s->front);
-    i->sPtrs[0] = &(s->back);
-  }
+  i->data = s->data;
+  if (i->data)
+    REF_ADD(i->data, 1);
   i->reverseX = reverseX;
   i->reverseY = reverseY;
-  return(i);
-}
-
-static rfbBool sraReverse(sraRectangleIterator *i)
-{
-  return( ((i->ptrPos&2) && i->reverseX) ||
-     (!(i->ptrPos&2) && i->reverseY));
-}
-
-static sraSpan* sraNextSpan(sraRectangleIterator *i)
-{
-  if(sraReverse(i))
-    return(i->sPtrs[i->ptrPos]->_prev);
-  else
-    return(i->sPtrs[i->ptrPos]->_next);
+  /* an empty band before the first one to go through */
+  i->bandStart = i->bandEnd = (reverseY && i->data) ? i->data->n : 0;
+  i->pos = reverseX ? i->bandStart - 1 : i->bandEnd;
+  return i;
 }
 
 rfbBool sraRgnIteratorNext(sraRectangleIterator* i,sraRect* r)
 {
-  /* is the subspan finished? */
-  while(sraNextSpan(i) == i->sPtrs[i->ptrPos+1]) {
-    i->ptrPos -= 2;
-    if(i->ptrPos < 0) /* the end */
-      return(0);
-  }
+  const sraRegionData *d = i->data;
 
-  i->sPtrs[i->ptrPos] = sraNextSpan(i);
+  if (!d)
+    return FALSE;
 
-  /* is this a new subspan? */
-  while(i->sPtrs[i->ptrPos]->subspan) {
-    if(i->ptrPos+2 > i->ptrSize) { /* array is too small */
-      i->ptrSize += DEFSTEP;
-      i->sPtrs = (sraSpan**)realloc(i->sPtrs, sizeof(sraSpan*)*i->ptrSize);
-    }
-    i->ptrPos += 2;
-    if(sraReverse(i)) {
-      i->sPtrs[i->ptrPos]   =   i->sPtrs[i->ptrPos-2]->subspan->back._prev;
-      i->sPtrs[i->ptrPos+1] = &(i->sPtrs[i->ptrPos-2]->subspan->front);
+  /* is the band finished? */
+  if (i->reverseX ? i->pos < i->bandStart : i->pos >= i->bandEnd) {
+    if (i->reverseY) {
+      if (i->bandStart == 0)
+	return FALSE;
+      i->bandEnd = i->bandStart;
+      i->bandStart = sraBandStart(d, i->bandEnd - 1);
     } else {
-      i->sPtrs[i->ptrPos]   =   i->sPtrs[i->ptrPos-2]->subspan->front._next;
-      i->sPtrs[i->ptrPos+1] = &(i->sPtrs[i->ptrPos-2]->subspan->back);
+      if (i->bandEnd >= d->n)
+	return FALSE;
+      i->bandStart = i->bandEnd;
+      i->bandEnd = sraBandEnd(d, i->bandStart);
     }
+    i->pos = i->reverseX ? i->bandEnd - 1 : i->bandStart;
   }
 
-  if((i->ptrPos%4)!=2) {
-    rfbErr("sraRgnIteratorNext: offset is wrong (%d%%4!=2)\n",i->ptrPos);
-    return FALSE;
-  }
-
-  r->y1 = i->sPtrs[i->ptrPos-2]->start;
-  r->y2 = i->sPtrs[i->ptrPos-2]->end;
-  r->x1 = i->sPtrs[i->ptrPos]->start;
-  r->x2 = i->sPtrs[i->ptrPos]->end;
+  *r = d->rects[i->pos];
+  i->pos += i->reverseX ? -1 : 1;
 
-  return(-1);
+  return TRUE;
 }
 
 void sraRgnReleaseIterator(sraRectangleIterator* i)
 {
-  free(i->sPtrs);
+  sraDataRelease(i->data);
   free(i);
 }
 
 void
 sraRgnPrint(const sraRegion *rgn) {
-	sraSpanListPrint((sraSpanList*)rgn);
+  const sraRegionData *d = rgn->data;
+  int start, end, k;
+
+  printf("[");
+  for (start = 0; d && start < d->n; start = end) {
+    end = sraBandEnd(d, start);
+    printf("(%d-%d)[", d->rects[start].y1, d->rects[start].y2);
+    for (k = start; k < end; k++)
+      printf("(%d-%d)", d->rects[k].x1, d->rects[k].x2);
+    printf("]");
+  }
+  printf("]");
 }
 
 rfbBool
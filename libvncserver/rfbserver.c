@@ -319,6 +319,12 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
     rfbProtocolExtension* extension;
 
     cl = (rfbClientPtr)calloc(sizeof(rfbClientRec),1);
+    if (!cl || !rfbOutputInit(cl)) {
+      rfbErr("rfbNewClient: out of memory\n");
+      free(cl);
+      close(sock);
+      return NULL;
+    }
 
     cl->screen = rfbScreen;
     cl->sock = sock;
@@ -369,8 +375,10 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 	rfbLogPerror("setsockopt failed: can't set TCP_NODELAY flag, non TCP socket?");
       }
 
-      FD_SET(sock,&(rfbScreen->allFds));
-		rfbScreen->maxFd = rfbMax(sock,rfbScreen->maxFd);
+      if(!rfbWatchSocket(rfbScreen,sock,cl)) {
+	close(sock);
+	return NULL;
+      }
 
       INIT_MUTEX(cl->outputMutex);
       INIT_MUTEX(cl->refCountMutex);
@@ -400,6 +408,11 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       INIT_COND(cl->updateCond);
 
       cl->requestedRegion = sraRgnCreate();
+      cl->continuousRegion = sraRgnCreate();
+      rfbLossyInit(cl);
+      rfbVideoInit(cl);
+      cl->tileDamageSeen = NULL;
+      rfbTileDamageInit(cl);
 
       cl->format = cl->screen->serverFormat;
       cl->translateFn = rfbTranslateNone;
@@ -425,11 +438,13 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 	int i;
 	for (i = 0; i < 4; i++)
           cl->zsActive[i] = FALSE;
+	cl->zsResetPending = 0;
       }
 #endif
 #endif
 
       cl->fileTransfer.fd = -1;
+      cl->encodeCaptureFrom = -1;
 
       cl->enableCursorShapeUpdates = FALSE;
       cl->enableCursorPosUpdates = FALSE;
@@ -461,6 +476,8 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 
       cl->lastPtrX = -1;
 
+      rfbCongestionReset(cl);
+
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
       /*
        * Wait a few ms for the client to send one of:
@@ -562,24 +579,31 @@ rfbClientConnectionGone(rfbClientPtr cl)
     }
 #endif
 
-    if(cl->sock>=0)
+    rfbUnscheduleClientUpdate(cl);
+
+    if(cl->sock>=0) {
+	rfbUnwatchSocket(cl->screen,cl->sock);
 	close(cl->sock);
+    }
 
     if (cl->scaledScreen!=NULL)
-        cl->scaledScreen->scaledScreenRefCount--;
+        rfbScalingRelease(cl, cl->scaledScreen);
+    if (cl->scaledScreenPending!=NULL)
+        rfbScalingRelease(cl, cl->scaledScreenPending);
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     rfbFreeZrleData(cl);
 #endif
+#ifdef LIBVNCSERVER_HAVE_H264
+    rfbH264Free(cl);
+#endif
 
     rfbFreeUltraData(cl);
 
     /* free buffers holding pixel data before and after encoding */
     free(cl->beforeEncBuf);
     free(cl->afterEncBuf);
-
-    if(cl->sock>=0)
-       FD_CLR(cl->sock,&(cl->screen->allFds));
+    free(cl->encodeCaptureBuf);
 
     cl->clientGoneHook(cl);
 
@@ -597,6 +621,7 @@ rfbClientConnectionGone(rfbClientPtr cl)
 	if (cl->zsActive[i])
 	    deflateEnd(&cl->zsStruct[i]);
     }
+    rfbFreeTightData(cl);
 #endif
 #endif
 
@@ -605,9 +630,17 @@ rfbClientConnectionGone(rfbClientPtr cl)
 
     sraRgnDestroy(cl->modifiedRegion);
     sraRgnDestroy(cl->requestedRegion);
+    sraRgnDestroy(cl->continuousRegion);
+    rfbLossyFree(cl);
+    rfbVideoFree(cl);
+    rfbCursorOverlayFree(cl);
+    rfbTileDamageFreeClient(cl);
+    rfbCongestionFree(cl);
+    rfbOutputFree(cl);
+    rfbClearCopies(cl);
     sraRgnDestroy(cl->copyRegion);
 
-    if (cl->translateLookupTable) free(cl->translateLookupTable);
+    rfbReleaseTranslateTable(cl->translateLookupTable);
 
     TINI_COND(cl->updateCond);
     TINI_MUTEX(cl->updateMutex);
@@ -651,6 +684,9 @@ rfbProcessClientMessage(rfbClientPtr cl)
         return;
     default:
         rfbProcessClientNormalMessage(cl);
+        /* requests, encodings and pointer events all affect what the next
+           rfbUpdateClient() has to do */
+        rfbScheduleClientUpdate(cl);
         return;
     }
 }
@@ -968,6 +1004,10 @@ rfbSendSupportedMessages(rfbClientPtr cl)
         rfbSetBit(msgs.client2server, rfbXvp);
         rfbSetBit(msgs.server2client, rfbXvp);
     }
+    rfbSetBit(msgs.client2server, rfbFence);
+    rfbSetBit(msgs.server2client, rfbFence);
+    rfbSetBit(msgs.client2server, rfbEnableContinuousUpdates);
+    rfbSetBit(msgs.server2client, rfbEndOfContinuousUpdates);
 
     memcpy(&cl->updateBuf[cl->ublen], (char *)&msgs, sz_rfbSupportedMessages);
     cl->ublen += sz_rfbSupportedMessages;
@@ -1007,6 +1047,9 @@ rfbSendSupportedEncodings(rfbClientPtr cl)
 #endif
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
 	rfbEncodingTightPng,
+#endif
+#ifdef LIBVNCSERVER_HAVE_H264
+	rfbEncodingH264,
 #endif
 	rfbEncodingUltra,
 	rfbEncodingUltraZip,
@@ -1019,6 +1062,8 @@ rfbSendSupportedEncodings(rfbClientPtr cl)
 	rfbEncodingSupportedMessages,
 	rfbEncodingSupportedEncodings,
 	rfbEncodingServerIdentity,
+	rfbEncodingFence,
+	rfbEncodingContinuousUpdates,
     };
     uint32_t nEncodings = sizeof(supported) / sizeof(supported[0]), i;
 
@@ -1143,6 +1188,138 @@ rfbSendXvp(rfbClientPtr cl, uint8_t version, uint8_t code)
 }
 
 
+/*
+ * Send a Fence message, used to answer the client's fence requests.
+ */
+
+static rfbBool
+rfbSendFence(rfbClientPtr cl, uint32_t flags, uint8_t length, const char *data)
+{
+    char buf[sz_rfbFenceMsg + rfbFenceMaxLength];
+    rfbFenceMsg f;
+
+    f.type = rfbFence;
+    f.pad[0] = f.pad[1] = f.pad[2] = 0;
+    f.flags = Swap32IfLE(flags);
+    f.length = length;
+    memcpy(buf, (char *)&f, sz_rfbFenceMsg);
+    memcpy(buf + sz_rfbFenceMsg, data, length);
+
+    LOCK(cl->sendMutex);
+    if (rfbWriteExact(cl, buf, sz_rfbFenceMsg + length) < 0) {
+      rfbLogPerror("rfbSendFence: write");
+      rfbCloseClient(cl);
+      UNLOCK(cl->sendMutex);
+      return FALSE;
+    }
+    UNLOCK(cl->sendMutex);
+
+    rfbStatRecordMessageSent(cl, rfbFence, sz_rfbFenceMsg + length, sz_rfbFenceMsg + length);
+
+    return TRUE;
+}
+
+/*
+ * Send EndOfContinuousUpdates, to say we support them or that they are off.
+ */
+
+static rfbBool
+rfbSendEndOfContinuousUpdates(rfbClientPtr cl)
+{
+    rfbEndOfContinuousUpdatesMsg eocu;
+
+    eocu.type = rfbEndOfContinuousUpdates;
+
+    LOCK(cl->sendMutex);
+    if (rfbWriteExact(cl, (char *)&eocu, sz_rfbEndOfContinuousUpdatesMsg) < 0) {
+      rfbLogPerror("rfbSendEndOfContinuousUpdates: write");
+      rfbCloseClient(cl);
+      UNLOCK(cl->sendMutex);
+      return FALSE;
+    }
+    UNLOCK(cl->sendMutex);
+
+    rfbStatRecordMessageSent(cl, rfbEndOfContinuousUpdates,
+        sz_rfbEndOfContinuousUpdatesMsg, sz_rfbEndOfContinuousUpdatesMsg);
+
+    return TRUE;
+}
+
+/*
+ * Put a fence request behind the update in updateBuf; its answer tells when
+ * the client has processed the update.
+ */
+
+static rfbBool
+rfbSendUpdateFence(rfbClientPtr cl)
+{
+    rfbFenceMsg f;
+    uint32_t frame = cl->framesSent + 1;
+
+    if (cl->ublen + sz_rfbFenceMsg + sizeof(frame) > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    f.type = rfbFence;
+    f.pad[0] = f.pad[1] = f.pad[2] = 0;
+    f.flags = Swap32IfLE(rfbFenceFlagRequest | rfbFenceFlagBlockBefore);
+    f.length = sizeof(frame);
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&f, sz_rfbFenceMsg);
+    cl->ublen += sz_rfbFenceMsg;
+    /* only we read this back, so the byte order does not matter */
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&frame, sizeof(frame));
+    cl->ublen += sizeof(frame);
+
+    rfbStatRecordMessageSent(cl, rfbFence, sz_rfbFenceMsg + sizeof(frame),
+        sz_rfbFenceMsg + sizeof(frame));
+
+    LOCK(cl->updateMutex);
+    gettimeofday(&cl->fenceSentTime[frame % RFB_MAX_FRAMES_IN_FLIGHT], NULL);
+    cl->framesSent = frame;
+    UNLOCK(cl->updateMutex);
+
+    return TRUE;
+}
+
+/*
+ * Handle a Fence message from the client: answer its requests, and take
+ * the answers to ours as the acknowledgement of an update.
+ */
+
+static void
+rfbHandleFence(rfbClientPtr cl, uint32_t flags, uint8_t length, const char *data)
+{
+    uint32_t frame;
+    struct timeval now, *sent;
+
+    if (flags & rfbFenceFlagRequest) {
+        /* everything before was handled and the answer goes out before
+           anything after is, so both blocking flags come for free */
+        flags &= rfbFenceFlagBlockBefore | rfbFenceFlagBlockAfter;
+        rfbSendFence(cl, flags, length, data);
+        return;
+    }
+
+    if (length != sizeof(frame))
+        return;
+    memcpy((char *)&frame, data, sizeof(frame));
+
+    LOCK(cl->updateMutex);
+    /* ignore answers out of order or to fences we did not send */
+    if (frame - cl->framesAcked - 1 < cl->framesSent - cl->framesAcked) {
+        gettimeofday(&now, NULL);
+        sent = &cl->fenceSentTime[frame % RFB_MAX_FRAMES_IN_FLIGHT];
+        cl->roundTripTime = (now.tv_sec - sent->tv_sec) * 1000
+            + (now.tv_usec - sent->tv_usec) / 1000;
+        cl->framesAcked = frame;
+    }
+    rfbSignalClientUpdate(cl);
+    UNLOCK(cl->updateMutex);
+
+    rfbScheduleClientUpdate(cl);
+}
+
 rfbBool rfbSendTextChatMessage(rfbClientPtr cl, uint32_t length, char *buffer)
 {
     rfbTextChatMsg tc;
@@ -1491,8 +1668,6 @@ rfbBool rfbSendFileTransferChunk(rfbClientPtr cl)
     unsigned char readBuf[sz_rfbBlockSize];
     int bytesRead=0;
     int retval=0;
-    fd_set wfds;
-    struct timeval tv;
     int n;
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     unsigned char compBuf[sz_rfbBlockSize + 1024];
@@ -1514,13 +1689,12 @@ rfbBool rfbSendFileTransferChunk(rfbClientPtr cl)
     /* If not sending, or no file open...   Return as if we sent something! */
     if ((cl->fileTransfer.fd!=-1) && (cl->fileTransfer.sending==1))
     {
-	FD_ZERO(&wfds);
-        FD_SET(cl->sock, &wfds);
+        /* wait until what is queued for the client went out */
+        if (rfbOutputPending(cl) > 0)
+            return TRUE;
 
         /* return immediately */
-	tv.tv_sec = 0; 
-	tv.tv_usec = 0;
-	n = select(cl->sock + 1, NULL, &wfds, NULL, &tv);
+	n = rfbWaitForSocket(cl->sock, TRUE, 0);
 
 	if (n<0) {
 #ifdef WIN32
@@ -2135,6 +2309,9 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 #endif
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
 	    case rfbEncodingTightPng:
+#endif
+#ifdef LIBVNCSERVER_HAVE_H264
+	    case rfbEncodingH264:
 #endif
             /* The first supported encoding is the 'preferred' encoding */
                 if (cl->preferredEncoding == -1)
@@ -2215,6 +2392,23 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
                   cl->enableServerIdentity = TRUE;
                 }
                 break;
+            case rfbEncodingFence:
+                if (!cl->enableFence) {
+                  rfbLog("Enabling Fence protocol extension for client "
+                          "%s\n", cl->host);
+                  cl->enableFence = TRUE;
+                }
+                break;
+            case rfbEncodingContinuousUpdates:
+                if (!cl->enableContinuousUpdates) {
+                  rfbLog("Enabling ContinuousUpdates protocol extension for client "
+                          "%s\n", cl->host);
+                  cl->enableContinuousUpdates = TRUE;
+                  /* tells the client we can do it */
+                  if (!rfbSendEndOfContinuousUpdates(cl))
+                    return;
+                }
+                break;
             case rfbEncodingXvp:
                 if (cl->screen->xvpHook) {
                   rfbLog("Enabling Xvp protocol extension for client "
@@ -2336,6 +2530,9 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 	  cl->enableCursorPosUpdates = FALSE;
 	}
 
+        /* congestion control goes back to what was asked for from here */
+        rfbCongestionReset(cl);
+
         return;
     }
 
@@ -2379,7 +2576,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 	    if (!cl->format.trueColour) {
 		if (!rfbSetClientColourMap(cl, 0, 0)) {
 		    sraRgnDestroy(tmpRegion);
-		    TSIGNAL(cl->updateCond);
+		    rfbSignalClientUpdate(cl);
 		    UNLOCK(cl->updateMutex);
 		    return;
 		}
@@ -2388,9 +2585,13 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
        if (!msg.fur.incremental) {
 	    sraRgnOr(cl->modifiedRegion,tmpRegion);
-	    sraRgnSubtract(cl->copyRegion,tmpRegion);
+	    rfbPruneCopies(cl,tmpRegion);
+#ifdef LIBVNCSERVER_HAVE_H264
+	    /* the client lost its picture, or never had one */
+	    rfbH264RequestKeyframe(cl);
+#endif
        }
-       TSIGNAL(cl->updateCond);
+       rfbSignalClientUpdate(cl);
        UNLOCK(cl->updateMutex);
 
        sraRgnDestroy(tmpRegion);
@@ -2643,6 +2844,86 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
       rfbSendNewScaleSize(cl);
       return;
 
+    case rfbFence:
+    {
+        char data[rfbFenceMaxLength];
+
+        if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
+                              sz_rfbFenceMsg - 1)) <= 0) {
+            if (n != 0)
+                rfbLogPerror("rfbProcessClientNormalMessage: read");
+            rfbCloseClient(cl);
+            return;
+        }
+        msg.f.flags = Swap32IfLE(msg.f.flags);
+        if (msg.f.length > rfbFenceMaxLength) {
+            rfbErr("rfbProcessClientNormalMessage: fence of %d bytes\n",
+                   msg.f.length);
+            rfbCloseClient(cl);
+            return;
+        }
+        if (msg.f.length > 0 &&
+            (n = rfbReadExact(cl, data, msg.f.length)) <= 0) {
+            if (n != 0)
+                rfbLogPerror("rfbProcessClientNormalMessage: read");
+            rfbCloseClient(cl);
+            return;
+        }
+        rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbFenceMsg + msg.f.length,
+                                 sz_rfbFenceMsg + msg.f.length);
+
+        if (!cl->enableFence) {
+            rfbErr("rfbProcessClientNormalMessage: fence without the Fence encoding\n");
+            rfbCloseClient(cl);
+            return;
+        }
+        rfbHandleFence(cl, msg.f.flags, msg.f.length, data);
+        return;
+    }
+
+    case rfbEnableContinuousUpdates:
+
+        if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
+                              sz_rfbEnableContinuousUpdatesMsg - 1)) <= 0) {
+            if (n != 0)
+                rfbLogPerror("rfbProcessClientNormalMessage: read");
+            rfbCloseClient(cl);
+            return;
+        }
+        rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbEnableContinuousUpdatesMsg,
+                                 sz_rfbEnableContinuousUpdatesMsg);
+
+        if (!cl->enableContinuousUpdates) {
+            rfbErr("rfbProcessClientNormalMessage: continuous updates were not negotiated\n");
+            rfbCloseClient(cl);
+            return;
+        }
+
+        LOCK(cl->updateMutex);
+        /* the old area was only asked for by being continuous; once they
+           are off, the client asks again after EndOfContinuousUpdates */
+        if (cl->continuousUpdates)
+            sraRgnSubtract(cl->requestedRegion, cl->continuousRegion);
+        sraRgnDestroy(cl->continuousRegion);
+        if (msg.ecu.enable) {
+            int x = Swap16IfLE(msg.ecu.x), y = Swap16IfLE(msg.ecu.y);
+            cl->continuousRegion = sraRgnCreateRect(x, y,
+                x + Swap16IfLE(msg.ecu.w), y + Swap16IfLE(msg.ecu.h));
+            sraRgnOr(cl->requestedRegion, cl->continuousRegion);
+            cl->continuousUpdates = TRUE;
+            rfbSignalClientUpdate(cl);
+        } else {
+            cl->continuousRegion = sraRgnCreate();
+            cl->continuousUpdates = FALSE;
+        }
+        UNLOCK(cl->updateMutex);
+
+        if (msg.ecu.enable)
+            rfbScheduleClientUpdate(cl);
+        else if (!rfbSendEndOfContinuousUpdates(cl))
+            return;
+        return;
+
     case rfbXvp:
 
       if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
@@ -2691,6 +2972,190 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
 
 
+/*
+ * Count the rectangles the preferred encoding of cl sends region in, or
+ * return 0xFFFF if it cannot tell beforehand.
+ */
+
+static int
+rfbCountUpdateRects(rfbClientPtr cl, sraRegionPtr region)
+{
+    sraRectangleIterator* i;
+    sraRect rect;
+    int n;
+
+    if (cl->preferredEncoding == rfbEncodingCoRRE) {
+        n = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+	    int rectsPerRow, rows;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+	    rectsPerRow = (w-1)/cl->correMaxWidth+1;
+	    rows = (h-1)/cl->correMaxHeight+1;
+	    n += rectsPerRow*rows;
+        }
+	sraRgnReleaseIterator(i);
+    } else if (cl->preferredEncoding == rfbEncodingUltra) {
+        n = 0;
+        
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+            n += (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
+          }
+        sraRgnReleaseIterator(i);
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    } else if (cl->preferredEncoding == rfbEncodingZlib) {
+	n = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+	    n += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
+	}
+	sraRgnReleaseIterator(i);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    } else if (cl->preferredEncoding == rfbEncodingTight) {
+	n = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            int k;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+	    k = rfbNumCodedRectsTight(cl, x, y, w, h);
+	    if (k == 0) {
+		n = 0xFFFF;
+		break;
+	    }
+	    n += k;
+	}
+	sraRgnReleaseIterator(i);
+#endif
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBPNG)
+    } else if (cl->preferredEncoding == rfbEncodingTightPng) {
+	n = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            int k;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+	    k = rfbNumCodedRectsTight(cl, x, y, w, h);
+	    if (k == 0) {
+		n = 0xFFFF;
+		break;
+	    }
+	    n += k;
+	}
+	sraRgnReleaseIterator(i);
+#endif
+    } else {
+        n = sraRgnCountRects(region);
+    }
+    return n;
+}
+
+/* Send the rectangle x,y,w,h of the scaled screen in the preferred encoding. */
+
+static rfbBool
+rfbSendRectEncoded(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    switch (cl->preferredEncoding) {
+    case -1:
+    case rfbEncodingRaw:
+        return rfbSendRectEncodingRaw(cl, x, y, w, h);
+    case rfbEncodingRRE:
+        return rfbSendRectEncodingRRE(cl, x, y, w, h);
+    case rfbEncodingCoRRE:
+        return rfbSendRectEncodingCoRRE(cl, x, y, w, h);
+    case rfbEncodingHextile:
+        return rfbSendRectEncodingHextile(cl, x, y, w, h);
+    case rfbEncodingUltra:
+        return rfbSendRectEncodingUltra(cl, x, y, w, h);
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    case rfbEncodingZlib:
+        return rfbSendRectEncodingZlib(cl, x, y, w, h);
+    case rfbEncodingZYWRLE:
+        /* only Raw is both lossless and sure not to upset the client's
+           idea of the ZYWRLE level */
+        if (cl->losslessUpdate)
+            return rfbSendRectEncodingRaw(cl, x, y, w, h);
+        /* fall through */
+    case rfbEncodingZRLE:
+        return rfbSendRectEncodingZRLE(cl, x, y, w, h);
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    case rfbEncodingTight:
+        return rfbSendRectEncodingTight(cl, x, y, w, h);
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+    case rfbEncodingTightPng:
+        return rfbSendRectEncodingTightPng(cl, x, y, w, h);
+#endif
+#endif
+#ifdef LIBVNCSERVER_HAVE_H264
+    case rfbEncodingH264:
+        return rfbSendRectEncodingH264(cl, x, y, w, h);
+#endif
+    }
+    return TRUE;
+}
+
+/*
+ * Send the part of an update under the cursor of cl, with the cursor drawn
+ * in, from the overlay of cursor.c.
+ */
+
+static rfbBool
+rfbSendCursorRegion(rfbClientPtr cl, sraRegionPtr region)
+{
+    sraRectangleIterator* i;
+    sraRect rect;
+    rfbBool result = TRUE;
+    int x, y, w, h;
+
+    if (rfbCursorOverlayDraw(cl, region, &x, &y, &w, &h))
+        return rfbCursorOverlaySend(cl, rfbSendRectEncoded);
+
+    /* without an overlay, this is sent like the rest */
+    for(i = sraRgnGetIterator(region); result && sraRgnIteratorNext(i,&rect);){
+        x = rect.x1;
+        y = rect.y1;
+        w = rect.x2 - x;
+        h = rect.y2 - y;
+        if (cl->screen!=cl->scaledScreen)
+            rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendCursorRegion");
+        result = rfbSendRectEncoded(cl, x, y, w, h);
+    }
+    sraRgnReleaseIterator(i);
+    return result;
+}
+
 /*
  * rfbSendFramebufferUpdate - send the currently pending framebuffer update to
  * the RFB client.
@@ -2703,10 +3168,14 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 {
     sraRectangleIterator* i=NULL;
     sraRect rect;
-    int nUpdateRegionRects;
+    int nUpdateRegionRects, nCursorRects = 0;
     rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
-    sraRegionPtr updateRegion,updateCopyRegion,tmpRegion;
-    int dx, dy;
+    sraRegionPtr updateRegion,updateCopyRegion,cursorRegion = NULL;
+    rfbCopyMove moves[RFB_MAX_COPY_MOVES];
+    int nMoves, nCopyRects, m;
+    unsigned long generation;
+    rfbBool useEncodeCache;
+    rfbBool parallel;
     rfbBool sendCursorShape = FALSE;
     rfbBool sendCursorPos = FALSE;
     rfbBool sendKeyboardLedState = FALSE;
@@ -2716,6 +3185,11 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     rfbBool result = TRUE;
     
 
+    /* a new scale takes effect between updates; other clients are told
+       of it with a message of its own, see rfbSendNewScaleSize() */
+    if (cl->useNewFBSize)
+        rfbScalingSwitch(cl);
+
     if(cl->screen->displayHook)
       cl->screen->displayHook(cl);
 
@@ -2813,10 +3287,10 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     /*
      * The modifiedRegion may overlap the destination copyRegion.  We remove
      * any overlapping bits from the copyRegion (since they'd only be
-     * overwritten anyway).
+     * overwritten anyway), unless a later copy reads from them.
      */
     
-    sraRgnSubtract(cl->copyRegion,cl->modifiedRegion);
+    rfbPruneCopies(cl,cl->modifiedRegion);
 
     /*
      * The client is interested in the region requestedRegion.  The region
@@ -2847,8 +3321,9 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     }
 
     sraRgnOr(updateRegion,cl->copyRegion);
-    if(!sraRgnAnd(updateRegion,cl->requestedRegion) &&
-       sraRgnEmpty(updateRegion) &&
+    sraRgnAnd(updateRegion,cl->requestedRegion);
+    rfbVideoSplitUpdate(cl,updateRegion);
+    if(sraRgnEmpty(updateRegion) &&
        (cl->enableCursorShapeUpdates ||
 	(cl->cursorX == cl->screen->cursorX && cl->cursorY == cl->screen->cursorY)) &&
        !sendCursorShape && !sendCursorPos && !sendKeyboardLedState &&
@@ -2863,20 +3338,17 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     /*
      * We assume that the client doesn't have any pixel data outside the
      * requestedRegion.  In other words, both the source and destination of a
-     * copy must lie within requestedRegion.  So the region we can send as a
-     * copy is the intersection of the copyRegion with both the requestedRegion
-     * and the requestedRegion translated by the amount of the copy.  We set
-     * updateCopyRegion to this.
+     * copy must lie within requestedRegion.  rfbTakeCopies() cuts each
+     * pending copy down accordingly, and sets updateCopyRegion to the area
+     * which is right once the copies are done.  Where that area was modified
+     * after a copy was scheduled, it still has to be sent as pixels.
      */
 
-    updateCopyRegion = sraRgnCreateRgn(cl->copyRegion);
-    sraRgnAnd(updateCopyRegion,cl->requestedRegion);
-    tmpRegion = sraRgnCreateRgn(cl->requestedRegion);
-    sraRgnOffset(tmpRegion,cl->copyDX,cl->copyDY);
-    sraRgnAnd(updateCopyRegion,tmpRegion);
-    sraRgnDestroy(tmpRegion);
-    dx = cl->copyDX;
-    dy = cl->copyDY;
+    updateCopyRegion = sraRgnCreate();
+    nMoves = rfbTakeCopies(cl,moves,updateCopyRegion);
+    sraRgnSubtract(updateCopyRegion,cl->modifiedRegion);
+    for(m = nCopyRects = 0; m < nMoves; m++)
+	nCopyRects += sraRgnCountRects(moves[m].region);
 
     /*
      * Next we remove updateCopyRegion from updateRegion so that updateRegion
@@ -2897,13 +3369,20 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      sraRgnSubtract(cl->modifiedRegion,updateRegion);
      sraRgnSubtract(cl->modifiedRegion,updateCopyRegion);
 
+     /* a refinement scheduled by rfbScheduleRefinement() is sent now */
+     cl->losslessUpdate = cl->refinePending;
+     cl->refinePending = FALSE;
+
+     /* in continuous mode the next update is as good as requested */
      sraRgnMakeEmpty(cl->requestedRegion);
+     if (cl->continuousUpdates)
+	 sraRgnOr(cl->requestedRegion,cl->continuousRegion);
      sraRgnMakeEmpty(cl->copyRegion);
      cl->copyDX = 0;
      cl->copyDY = 0;
    
      UNLOCK(cl->updateMutex);
-   
+
     if (!cl->enableCursorShapeUpdates) {
       if(cl->cursorX != cl->screen->cursorX || cl->cursorY != cl->screen->cursorY) {
 	rfbRedrawAfterHideCursor(cl,updateRegion);
@@ -2913,112 +3392,60 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	UNLOCK(cl->screen->cursorMutex);
 	rfbRedrawAfterHideCursor(cl,updateRegion);
       }
-      rfbShowCursor(cl);
+      /* what is under the cursor is sent on its own, with the cursor drawn in */
+      cursorRegion = rfbCursorSplitUpdate(cl,updateRegion);
     }
 
+    /*
+     * Read the generation only now: damage that came in before the subtraction
+     * above has bumped it already, so no cached rectangle older than that
+     * damage can be picked up.
+     */
+
+    generation = cl->screen->fbGeneration;
+    useEncodeCache = !cl->losslessUpdate && rfbEncodeCacheUsable(cl);
+    parallel = !useEncodeCache && rfbParallelEncodeUsable(cl, updateRegion);
+
     /*
      * Now send the update.
      */
     
     rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, 0, 0);
-    if (cl->preferredEncoding == rfbEncodingCoRRE) {
-        nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-	    int rectsPerRow, rows;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    rectsPerRow = (w-1)/cl->correMaxWidth+1;
-	    rows = (h-1)/cl->correMaxHeight+1;
-	    nUpdateRegionRects += rectsPerRow*rows;
-        }
-	sraRgnReleaseIterator(i); i=NULL;
-    } else if (cl->preferredEncoding == rfbEncodingUltra) {
-        nUpdateRegionRects = 0;
-        
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-            nUpdateRegionRects += (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
-          }
-        sraRgnReleaseIterator(i); i=NULL;
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-    } else if (cl->preferredEncoding == rfbEncodingZlib) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    nUpdateRegionRects += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
-	}
-	sraRgnReleaseIterator(i); i=NULL;
-#ifdef LIBVNCSERVER_HAVE_LIBJPEG
-    } else if (cl->preferredEncoding == rfbEncodingTight) {
+    if (parallel) {
+        /* the bands are cut differently, let LastRect end the update */
+        nUpdateRegionRects = 0xFFFF;
+#ifdef LIBVNCSERVER_HAVE_H264
+    } else if (cl->preferredEncoding == rfbEncodingH264) {
+	/* every update is one picture of the whole screen, see h264.c */
 	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            int n;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
-	    if (n == 0) {
-		nUpdateRegionRects = 0xFFFF;
-		break;
-	    }
-	    nUpdateRegionRects += n;
+	if (!sraRgnEmpty(updateRegion) || cursorRegion) {
+	    sraRgnDestroy(updateRegion);
+	    updateRegion = sraRgnCreateRect(0, 0, cl->screen->width, cl->screen->height);
+	    nUpdateRegionRects = 1;
 	}
-	sraRgnReleaseIterator(i); i=NULL;
-#endif
-#endif
-#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBPNG)
-    } else if (cl->preferredEncoding == rfbEncodingTightPng) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            int n;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
-	    if (n == 0) {
-		nUpdateRegionRects = 0xFFFF;
-		break;
-	    }
-	    nUpdateRegionRects += n;
+	/* h264.c draws the cursor into the picture itself */
+	if (cursorRegion) {
+	    sraRgnDestroy(cursorRegion);
+	    cursorRegion = NULL;
 	}
-	sraRgnReleaseIterator(i); i=NULL;
 #endif
     } else {
-        nUpdateRegionRects = sraRgnCountRects(updateRegion);
+        nUpdateRegionRects = rfbCountUpdateRects(cl, updateRegion);
+    }
+    if (cursorRegion && nUpdateRegionRects != 0xFFFF) {
+        nCursorRects = rfbCountUpdateRects(cl, cursorRegion);
+        if (nCursorRects == 0xFFFF)
+            nUpdateRegionRects = 0xFFFF;
     }
 
+    /* from here on the update is gathered and written in one go */
+    rfbOutputBegin(cl);
+
     fu->type = rfbFramebufferUpdate;
     if (nUpdateRegionRects != 0xFFFF) {
 	if(cl->screen->maxRectsPerUpdate>0
+	   /* runs of whole tiles are few and worth sending as they are */
+	   && !cl->screen->tileDamageMap
 	   /* CoRRE splits the screen into smaller squares */
 	   && cl->preferredEncoding != rfbEncodingCoRRE
 	   /* Ultra encoding splits rectangles up into smaller chunks */
@@ -3041,8 +3468,8 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	    updateRegion = newUpdateRegion;
 	    nUpdateRegionRects = sraRgnCountRects(updateRegion);
 	}
-	fu->nRects = Swap16IfLE((uint16_t)(sraRgnCountRects(updateCopyRegion) +
-					   nUpdateRegionRects +
+	fu->nRects = Swap16IfLE((uint16_t)(nCopyRects +
+					   nUpdateRegionRects + nCursorRects +
 					   !!sendCursorShape + !!sendCursorPos + !!sendKeyboardLedState +
 					   !!sendSupportedMessages + !!sendSupportedEncodings + !!sendServerIdentity));
     } else {
@@ -3080,12 +3507,22 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
            goto updateFailed;
    }
 
-    if (!sraRgnEmpty(updateCopyRegion)) {
-	if (!rfbSendCopyRegion(cl,updateCopyRegion,dx,dy))
+    /* a scaled framebuffer is only rescaled where it is about to be sent */
+    rfbScaledScreenRefresh(cl, updateRegion);
+    if (cursorRegion)
+        rfbScaledScreenRefresh(cl, cursorRegion);
+
+    /* in the order they were scheduled, a copy may read what one before wrote */
+    for (m = 0; m < nMoves; m++) {
+	if (!sraRgnEmpty(moves[m].region) &&
+	    !rfbSendCopyRegion(cl,moves[m].region,moves[m].dx,moves[m].dy))
 	        goto updateFailed;
     }
 
-    for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
+    if (parallel && !rfbSendRegionParallel(cl, updateRegion))
+        goto updateFailed;
+
+    for(i = sraRgnGetIterator(updateRegion); !parallel && sraRgnIteratorNext(i,&rect);){
         int x = rect.x1;
         int y = rect.y1;
         int w = rect.x2 - x;
@@ -3095,75 +3532,59 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
         if (cl->screen!=cl->scaledScreen)
             rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
 
-        switch (cl->preferredEncoding) {
-	case -1:
-        case rfbEncodingRaw:
-            if (!rfbSendRectEncodingRaw(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingRRE:
-            if (!rfbSendRectEncodingRRE(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingCoRRE:
-            if (!rfbSendRectEncodingCoRRE(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-        case rfbEncodingHextile:
-            if (!rfbSendRectEncodingHextile(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingUltra:
-            if (!rfbSendRectEncodingUltra(cl, x, y, w, h))
+        if (useEncodeCache) {
+            int sent = rfbEncodeCacheSendRect(cl, generation, x, y, w, h);
+            if (sent < 0)
                 goto updateFailed;
-            break;
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-	case rfbEncodingZlib:
-	    if (!rfbSendRectEncodingZlib(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-       case rfbEncodingZRLE:
-       case rfbEncodingZYWRLE:
-           if (!rfbSendRectEncodingZRLE(cl, x, y, w, h))
-	       goto updateFailed;
-           break;
-#endif
-#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
-	case rfbEncodingTight:
-	    if (!rfbSendRectEncodingTight(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-#ifdef LIBVNCSERVER_HAVE_LIBPNG
-	case rfbEncodingTightPng:
-	    if (!rfbSendRectEncodingTightPng(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-#endif
-#endif
+            if (sent)
+                continue;
+            rfbEncodeCacheBeginRect(cl);
         }
+
+        if (!rfbSendRectEncoded(cl, x, y, w, h))
+            goto updateFailed;
+
+        if (useEncodeCache)
+            rfbEncodeCacheEndRect(cl, generation, x, y, w, h);
     }
     if (i) {
         sraRgnReleaseIterator(i);
         i = NULL;
     }
 
+    if (cursorRegion && !rfbSendCursorRegion(cl, cursorRegion))
+        goto updateFailed;
+
     if ( nUpdateRegionRects == 0xFFFF &&
 	 !rfbSendLastRectMarker(cl) )
 	    goto updateFailed;
 
-    if (!rfbSendUpdateBuf(cl)) {
+    if (cl->enableFence && !rfbSendUpdateFence(cl))
+	goto updateFailed;
+
+    if (!rfbSendUpdateBuf(cl) || !rfbOutputFlush(cl)) {
 updateFailed:
+	rfbOutputDiscard(cl);
 	result = FALSE;
     }
+    cl->encodeCaptureFrom = -1;
 
-    if (!cl->enableCursorShapeUpdates) {
-      rfbHideCursor(cl);
+    if (cursorRegion) {
+        sraRgnOr(updateRegion, cursorRegion);
+        sraRgnDestroy(cursorRegion);
     }
 
+    LOCK(cl->updateMutex);
+    rfbLossyUpdateDone(cl, updateRegion, moves, nMoves);
+    cl->losslessUpdate = FALSE;
+    UNLOCK(cl->updateMutex);
+
     if(i)
         sraRgnReleaseIterator(i);
     sraRgnDestroy(updateRegion);
     sraRgnDestroy(updateCopyRegion);
+    for (m = 0; m < nMoves; m++)
+	sraRgnDestroy(moves[m].region);
 
     if(cl->screen->displayFinishedHook)
       cl->screen->displayFinishedHook(cl, result);
@@ -3203,6 +3624,14 @@ rfbSendCopyRegion(rfbClientPtr cl,
       w = rect1.x2 - x;
       h = rect1.y2 - y;
 
+      /* several copies may not fit into one buffer any more */
+      if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbCopyRect > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl)) {
+          sraRgnReleaseIterator(i);
+          return FALSE;
+        }
+      }
+
       /* correct for scaling (if necessary) */
       rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "copyrect");
 
@@ -3266,6 +3695,21 @@ rfbSendRectEncodingRaw(rfbClientPtr cl,
     rfbStatRecordEncodingSent(cl, rfbEncodingRaw, sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h,
         sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h);
 
+    /* Pixels the client takes as they are can be sent from the framebuffer. */
+    if (cl->translateFn == rfbTranslateNone
+        && cl->scaledScreen->bitsPerPixel == cl->format.bitsPerPixel) {
+        int stride = cl->scaledScreen->paddedWidthInBytes;
+
+        if (bytesPerLine == stride && rfbOutputCanReference(cl, bytesPerLine * h))
+            return rfbOutputQueueReference(cl, fbptr, bytesPerLine * h);
+        if (rfbOutputCanReference(cl, bytesPerLine)) {
+            for (; h > 0; h--, fbptr += stride)
+                if (!rfbOutputQueueReference(cl, fbptr, bytesPerLine))
+                    return FALSE;
+            return TRUE;
+        }
+    }
+
     nlines = (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine;
 
     while (TRUE) {
@@ -3374,8 +3818,9 @@ rfbSendNewFBSize(rfbClientPtr cl,
 
 
 /*
- * Send the contents of cl->updateBuf.  Returns 1 if successful, -1 if
- * not (errno should be set).
+ * Send the contents of cl->updateBuf, or while a framebuffer update is
+ * gathered, queue them to go out with the rest of it.  Returns 1 if
+ * successful, -1 if not (errno should be set).
  */
 
 rfbBool
@@ -3384,6 +3829,12 @@ rfbSendUpdateBuf(rfbClientPtr cl)
     if(cl->sock<0)
       return FALSE;
 
+    if (cl->encodeCaptureFrom >= 0)
+        rfbEncodeCacheCapture(cl);
+
+    if (rfbOutputBatching(cl))
+        return rfbOutputQueueUpdateBuf(cl);
+
     if (rfbWriteExact(cl, cl->updateBuf, cl->ublen) < 0) {
         rfbLogPerror("rfbSendUpdateBuf: write");
         rfbCloseClient(cl);
@@ -37,6 +37,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef WIN32
 #define write(sock,buf,len) send(sock,buf,len,0)
 #else
@@ -148,151 +152,536 @@ void rfbScaledCorrection(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int *x, int
     if (*y+*h > to->height) *h=to->height - *y;
 }
 
+/*
+ * The scalers.  Integer ratios are box filtered, every other ratio is
+ * scaled bilinearly with 7 bit weights.  Rows of pixels are unpacked into
+ * one value per channel first, so that only the unpacking and packing look
+ * at the pixel size.  32 bit pixels with 8 bit channels, by far the most
+ * common kind, are worked on a byte at a time with SSE2 where there is.
+ */
+
+/* with add set, the channels are added to what is in rgb already */
+
+static void
+rfbScaleUnpackRow(rfbPixelFormat *f, int bytesPerPixel, unsigned char *src,
+                  int n, uint32_t *rgb, rfbBool add)
+{
+    uint32_t p, keep = add ? ~0 : 0;
+    uint32_t redMax = f->redMax, greenMax = f->greenMax, blueMax = f->blueMax;
+    int redShift = f->redShift, greenShift = f->greenShift, blueShift = f->blueShift;
+    int x;
+
+#define UNPACK(fetch)                                                   \
+    for (x = 0; x < n; x++, rgb += 3) {                                 \
+        p = (fetch);                                                    \
+        rgb[0] = (rgb[0] & keep) + ((p >> redShift) & redMax);          \
+        rgb[1] = (rgb[1] & keep) + ((p >> greenShift) & greenMax);      \
+        rgb[2] = (rgb[2] & keep) + ((p >> blueShift) & blueMax);        \
+    }
+
+    switch (bytesPerPixel) {
+    case 4: UNPACK(((uint32_t *)src)[x]); break;
+    case 2: UNPACK(((uint16_t *)src)[x]); break;
+    case 1: UNPACK(src[x]); break;
+    default:
+        /* fixme: endianness problem? */
+        UNPACK(src[3*x] | (src[3*x+1] << 8) | ((uint32_t)src[3*x+2] << 16));
+        break;
+    }
+#undef UNPACK
+}
+
+static void
+rfbScalePackRow(rfbPixelFormat *f, int bytesPerPixel, uint32_t *rgb,
+                int n, unsigned char *dst)
+{
+    uint32_t p;
+    int redShift = f->redShift, greenShift = f->greenShift, blueShift = f->blueShift;
+    int x;
+
+#define PACK(store)                                     \
+    for (x = 0; x < n; x++, rgb += 3) {                 \
+        p = (rgb[0] << redShift) |                      \
+            (rgb[1] << greenShift) |                    \
+            (rgb[2] << blueShift);                      \
+        store;                                          \
+    }
+
+    switch (bytesPerPixel) {
+    case 4: PACK(((uint32_t *)dst)[x] = p); break;
+    case 2: PACK(((uint16_t *)dst)[x] = (uint16_t)p); break;
+    case 1: PACK(dst[x] = (unsigned char)p); break;
+    default:
+        /* fixme: endianness problem? */
+        PACK((dst[3*x] = p & 0xff, dst[3*x+1] = (p >> 8) & 0xff,
+              dst[3*x+2] = (p >> 16) & 0xff));
+        break;
+    }
+#undef PACK
+}
+
+/* can the pixels be scaled as 4 independent bytes? */
+static rfbBool
+rfbScaleBytewise(rfbScreenInfoPtr screen)
+{
+    rfbPixelFormat *f = &screen->serverFormat;
+
+    return screen->bitsPerPixel == 32 &&
+        f->redMax == 255 && f->greenMax == 255 && f->blueMax == 255 &&
+        f->redShift % 8 == 0 && f->greenShift % 8 == 0 && f->blueShift % 8 == 0;
+}
+
+/*
+ * Where destination pixel d samples the source: pixel *s0 and the one
+ * after it, weighted by *frac / 128.  The pixel centres are lined up.
+ */
+
+static void
+rfbScaleCoord(int d, int srcSize, int dstSize, int *s0, int *frac)
+{
+    int64_t s = ((int64_t)(2 * d + 1) * srcSize - dstSize) * 65536 / (2 * dstSize);
+
+    if (s < 0)
+        s = 0;
+    if (s > (int64_t)(srcSize - 1) << 16)
+        s = (int64_t)(srcSize - 1) << 16;
+    *s0 = (int)(s >> 16);
+    *frac = (int)(s & 0xffff) >> 9;
+    /* the last pixel is sampled as the second one of a pair */
+    if (*s0 == srcSize - 1 && srcSize > 1) {
+        (*s0)--;
+        *frac = 128;
+    }
+}
+
+static void
+rfbScaleBox(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr,
+            int x1, int y1, int w1, int h1)
+{
+    rfbPixelFormat *f = &screen->serverFormat;
+    int bytesPerPixel = screen->bitsPerPixel / 8;
+    int areaX = screen->width / ptr->width;
+    int areaY = screen->height / ptr->height;
+    uint32_t area = areaX * areaY;
+    int n = w1 * areaX;
+    uint32_t *sum, *out, *col, r, g, b;
+    unsigned char *srcptr, *dstptr;
+    int x, y, v, w;
+
+    sum = (uint32_t *)malloc((n + w1) * 3 * sizeof(uint32_t));
+    if (!sum)
+        return;
+    out = sum + n * 3;
+
+    for (y = 0; y < h1; y++) {
+        /* add up the source rows of this destination row... */
+        for (v = 0; v < areaY; v++) {
+            srcptr = (unsigned char *)screen->frameBuffer +
+                ((y1 + y) * areaY + v) * screen->paddedWidthInBytes +
+                x1 * areaX * bytesPerPixel;
+            rfbScaleUnpackRow(f, bytesPerPixel, srcptr, n, sum, v > 0);
+        }
+        /* ...then the columns of each destination pixel */
+        for (x = 0, col = sum; x < w1; x++) {
+            r = g = b = area / 2;
+            for (w = 0; w < areaX; w++, col += 3) {
+                r += col[0];
+                g += col[1];
+                b += col[2];
+            }
+            out[x * 3] = r / area;
+            out[x * 3 + 1] = g / area;
+            out[x * 3 + 2] = b / area;
+        }
+        dstptr = (unsigned char *)ptr->frameBuffer +
+            (y1 + y) * ptr->paddedWidthInBytes + x1 * bytesPerPixel;
+        rfbScalePackRow(f, bytesPerPixel, out, w1, dstptr);
+    }
+
+    free(sum);
+}
+
+static void
+rfbScaleBilinear(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr,
+                 int x1, int y1, int w1, int h1)
+{
+    rfbPixelFormat *f = &screen->serverFormat;
+    int bytesPerPixel = screen->bitsPerPixel / 8;
+    int *xs, *fx, first, n, sy, fy, x, y, i;
+    uint32_t *row0, *row1, *out, a, b;
+    unsigned char *dstptr;
+
+    xs = (int *)malloc(w1 * 2 * sizeof(int));
+    fx = xs + w1;
+    if (!xs)
+        return;
+    for (x = 0; x < w1; x++)
+        rfbScaleCoord(x1 + x, screen->width, ptr->width, &xs[x], &fx[x]);
+    first = xs[0];
+    n = xs[w1 - 1] + 2 > screen->width ? screen->width - first : xs[w1 - 1] + 2 - first;
+
+    row0 = (uint32_t *)malloc((2 * n + w1) * 3 * sizeof(uint32_t));
+    if (!row0) {
+        free(xs);
+        return;
+    }
+    row1 = row0 + n * 3;
+    out = row1 + n * 3;
+
+    for (y = 0; y < h1; y++) {
+        rfbScaleCoord(y1 + y, screen->height, ptr->height, &sy, &fy);
+        rfbScaleUnpackRow(f, bytesPerPixel, (unsigned char *)screen->frameBuffer +
+                          sy * screen->paddedWidthInBytes + first * bytesPerPixel,
+                          n, row0, FALSE);
+        if (sy + 1 < screen->height)
+            rfbScaleUnpackRow(f, bytesPerPixel, (unsigned char *)screen->frameBuffer +
+                              (sy + 1) * screen->paddedWidthInBytes + first * bytesPerPixel,
+                              n, row1, FALSE);
+        else
+            memcpy(row1, row0, n * 3 * sizeof(uint32_t));
+
+        for (x = 0; x < w1; x++) {
+            int s0 = (xs[x] - first) * 3;
+            int s1 = xs[x] + 1 < screen->width ? s0 + 3 : s0;
+
+            for (i = 0; i < 3; i++) {
+                a = (row0[s0 + i] * (128 - fx[x]) + row0[s1 + i] * fx[x] + 64) >> 7;
+                b = (row1[s0 + i] * (128 - fx[x]) + row1[s1 + i] * fx[x] + 64) >> 7;
+                out[x * 3 + i] = (a * (128 - fy) + b * fy + 64) >> 7;
+            }
+        }
+        dstptr = (unsigned char *)ptr->frameBuffer +
+            (y1 + y) * ptr->paddedWidthInBytes + x1 * bytesPerPixel;
+        rfbScalePackRow(f, bytesPerPixel, out, w1, dstptr);
+    }
+
+    free(row0);
+    free(xs);
+}
+
+#ifdef __SSE2__
+
+/* the column sums are 16 bit, so areaY must be at most 257 */
+
+static void
+rfbScaleBoxSse2(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr,
+                int x1, int y1, int w1, int h1)
+{
+    int areaX = screen->width / ptr->width;
+    int areaY = screen->height / ptr->height;
+    int n = w1 * areaX * 4;
+    __m128i zero = _mm_setzero_si128(), b, acc;
+    __m128 inv = _mm_set1_ps(1.0f / (areaX * areaY));
+    uint16_t *sum;
+    unsigned char *srcptr, *dstptr;
+    int x, y, v, w, i;
+
+    sum = (uint16_t *)malloc(n * sizeof(uint16_t));
+    if (!sum)
+        return;
+
+    for (y = 0; y < h1; y++) {
+        memset(sum, 0, n * sizeof(uint16_t));
+        for (v = 0; v < areaY; v++) {
+            srcptr = (unsigned char *)screen->frameBuffer +
+                ((y1 + y) * areaY + v) * screen->paddedWidthInBytes +
+                x1 * areaX * 4;
+            for (i = 0; i + 16 <= n; i += 16) {
+                b = _mm_loadu_si128((const __m128i *)(srcptr + i));
+                _mm_storeu_si128((__m128i *)(sum + i),
+                    _mm_add_epi16(_mm_loadu_si128((const __m128i *)(sum + i)),
+                                  _mm_unpacklo_epi8(b, zero)));
+                _mm_storeu_si128((__m128i *)(sum + i + 8),
+                    _mm_add_epi16(_mm_loadu_si128((const __m128i *)(sum + i + 8)),
+                                  _mm_unpackhi_epi8(b, zero)));
+            }
+            for (; i < n; i++)
+                sum[i] += srcptr[i];
+        }
+
+        dstptr = (unsigned char *)ptr->frameBuffer +
+            (y1 + y) * ptr->paddedWidthInBytes + x1 * 4;
+        for (x = 0; x < w1; x++) {
+            acc = zero;
+            for (w = 0; w < areaX; w++)
+                acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(
+                    _mm_loadl_epi64((const __m128i *)(sum + (x * areaX + w) * 4)), zero));
+            acc = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(acc), inv));
+            acc = _mm_packs_epi32(acc, acc);
+            *(uint32_t *)(dstptr + x * 4) = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+        }
+    }
+
+    free(sum);
+}
+
+/* both rows are interpolated at once; needs a screen at least 2 wide */
+
+static void
+rfbScaleBilinearSse2(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr,
+                     int x1, int y1, int w1, int h1)
+{
+    __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi16(64);
+    __m128i a, b, left, right, h, vfy;
+    unsigned char *row0, *row1, *dstptr;
+    int sx, fx, sy, fy, x, y;
+
+    for (y = 0; y < h1; y++) {
+        rfbScaleCoord(y1 + y, screen->height, ptr->height, &sy, &fy);
+        row0 = (unsigned char *)screen->frameBuffer + sy * screen->paddedWidthInBytes;
+        row1 = sy + 1 < screen->height ? row0 + screen->paddedWidthInBytes : row0;
+        vfy = _mm_set1_epi16(fy);
+        dstptr = (unsigned char *)ptr->frameBuffer +
+            (y1 + y) * ptr->paddedWidthInBytes + x1 * 4;
+
+        for (x = 0; x < w1; x++) {
+            rfbScaleCoord(x1 + x, screen->width, ptr->width, &sx, &fx);
+            /* a pixel and the one right of it, from both rows */
+            a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row0 + sx * 4)), zero);
+            b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row1 + sx * 4)), zero);
+            left = _mm_unpacklo_epi64(a, b);
+            right = _mm_unpackhi_epi64(a, b);
+            h = _mm_add_epi16(left, _mm_srai_epi16(_mm_add_epi16(
+                    _mm_mullo_epi16(_mm_sub_epi16(right, left), _mm_set1_epi16(fx)), half), 7));
+            /* and the two rows */
+            a = _mm_srli_si128(h, 8);
+            h = _mm_add_epi16(h, _mm_srai_epi16(_mm_add_epi16(
+                    _mm_mullo_epi16(_mm_sub_epi16(a, h), vfy), half), 7));
+            *(uint32_t *)(dstptr + x * 4) = _mm_cvtsi128_si32(_mm_packus_epi16(h, h));
+        }
+    }
+}
+
+#endif
+
+/* not truecolour, so we can't blend: use the top-left pixel instead */
+
+static void
+rfbScaleNearest(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr,
+                int x1, int y1, int w1, int h1)
+{
+    int bytesPerPixel = screen->bitsPerPixel / 8;
+    int x, y, sx, sy;
+
+    for (y = y1; y < y1 + h1; y++) {
+        sy = (int)((int64_t)y * screen->height / ptr->height);
+        for (x = x1; x < x1 + w1; x++) {
+            sx = (int)((int64_t)x * screen->width / ptr->width);
+            memcpy(&ptr->frameBuffer[y * ptr->paddedWidthInBytes + x * bytesPerPixel],
+                   &screen->frameBuffer[sy * screen->paddedWidthInBytes + sx * bytesPerPixel],
+                   bytesPerPixel);
+        }
+    }
+}
+
 void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, int x0, int y0, int w0, int h0)
 {
-    int x,y,w,v,z;
     int x1, y1, w1, h1;
-    int bitsPerPixel, bytesPerPixel, bytesPerLine, areaX, areaY, area2;
-    unsigned char *srcptr, *dstptr;
 
     /* Nothing to do!!! */
     if (screen==ptr) return;
 
+    /* scaling up blends the pixels next to the rectangle into it */
+    if (ptr->width > screen->width || ptr->height > screen->height) {
+        x0--; y0--; w0 += 2; h0 += 2;
+        if (x0 < 0) { w0 += x0; x0 = 0; }
+        if (y0 < 0) { h0 += y0; y0 = 0; }
+        if (x0 + w0 > screen->width) w0 = screen->width - x0;
+        if (y0 + h0 > screen->height) h0 = screen->height - y0;
+    }
+
     x1 = x0;
     y1 = y0;
     w1 = w0;
     h1 = h0;
-
     rfbScaledCorrection(screen, ptr, &x1, &y1, &w1, &h1, "rfbScaledScreenUpdateRect");
-    x0 = ScaleX(ptr, screen, x1);
-    y0 = ScaleY(ptr, screen, y1);
-    w0 = ScaleX(ptr, screen, w1);
-    h0 = ScaleY(ptr, screen, h1);
-
-    bitsPerPixel = screen->bitsPerPixel;
-    bytesPerPixel = bitsPerPixel / 8;
-    bytesPerLine = w1 * bytesPerPixel;
-    srcptr = (unsigned char *)(screen->frameBuffer +
-     (y0 * screen->paddedWidthInBytes + x0 * bytesPerPixel));
-    dstptr = (unsigned char *)(ptr->frameBuffer +
-     ( y1 * ptr->paddedWidthInBytes + x1 * bytesPerPixel));
-    /* The area of the source framebuffer for each destination pixel */
-    areaX = ScaleX(ptr,screen,1);
-    areaY = ScaleY(ptr,screen,1);
-    area2 = areaX*areaY;
-
 
     /* Ensure that we do not go out of bounds */
-    if ((x1+w1) > (ptr->width))
-    {
-      if (x1==0) w1=ptr->width; else x1 = ptr->width - w1;
-    }
-    if ((y1+h1) > (ptr->height))
-    {
-      if (y1==0) h1=ptr->height; else y1 = ptr->height - h1;
+    if (x1 < 0 || y1 < 0 || x1 >= ptr->width || y1 >= ptr->height)
+        return;
+    if (x1 + w1 > ptr->width) w1 = ptr->width - x1;
+    if (y1 + h1 > ptr->height) h1 = ptr->height - y1;
+    if (w1 <= 0 || h1 <= 0)
+        return;
+
+    if (!screen->serverFormat.trueColour) {
+        rfbScaleNearest(screen, ptr, x1, y1, w1, h1);
+    } else if (screen->width % ptr->width == 0 && screen->height % ptr->height == 0) {
+#ifdef __SSE2__
+        if (rfbScaleBytewise(screen) && screen->height / ptr->height <= 257) {
+            rfbScaleBoxSse2(screen, ptr, x1, y1, w1, h1);
+            return;
+        }
+#endif
+        rfbScaleBox(screen, ptr, x1, y1, w1, h1);
+    } else {
+#ifdef __SSE2__
+        if (rfbScaleBytewise(screen) && screen->width >= 2) {
+            rfbScaleBilinearSse2(screen, ptr, x1, y1, w1, h1);
+            return;
+        }
+#endif
+        rfbScaleBilinear(screen, ptr, x1, y1, w1, h1);
     }
-    /*
-     * rfbLog("rfbScaledScreenUpdateRect(%dXx%dY-%dWx%dH  ->  %dXx%dY-%dWx%dH <%dx%d>) {%dWx%dH -> %dWx%dH} 0x%p\n",
-     *    x0, y0, w0, h0, x1, y1, w1, h1, areaX, areaY,
-     *    screen->width, screen->height, ptr->width, ptr->height, ptr->frameBuffer);
-     */
-
-    if (screen->serverFormat.trueColour) { /* Blend neighbouring pixels together */
-      unsigned char *srcptr2;
-      unsigned long pixel_value, red, green, blue;
-      unsigned int redShift = screen->serverFormat.redShift;
-      unsigned int greenShift = screen->serverFormat.greenShift;
-      unsigned int blueShift = screen->serverFormat.blueShift;
-      unsigned long redMax = screen->serverFormat.redMax;
-      unsigned long greenMax = screen->serverFormat.greenMax;
-      unsigned long blueMax = screen->serverFormat.blueMax;
-
-     /* for each *destination* pixel... */
-     for (y = 0; y < h1; y++) {
-       for (x = 0; x < w1; x++) {
-         red = green = blue = 0;
-         /* Get the totals for rgb from the source grid... */
-         for (w = 0; w < areaX; w++) {
-           for (v = 0; v < areaY; v++) {
-             srcptr2 = &srcptr[(((x * areaX) + w) * bytesPerPixel) +
-                               (v * screen->paddedWidthInBytes)];
-             pixel_value = 0;
-
-
-             switch (bytesPerPixel) {
-             case 4: pixel_value = *((unsigned int *)srcptr2);   break;
-             case 2: pixel_value = *((unsigned short *)srcptr2); break;
-             case 1: pixel_value = *((unsigned char *)srcptr2);  break;
-             default:
-               /* fixme: endianness problem? */
-               for (z = 0; z < bytesPerPixel; z++)
-                 pixel_value += (srcptr2[z] << (8 * z));
-                break;
-              }
-              /*
-              srcptr2 += bytesPerPixel;
-              */
-
-            red += ((pixel_value >> redShift) & redMax);
-            green += ((pixel_value >> greenShift) & greenMax);
-            blue += ((pixel_value >> blueShift) & blueMax);
-
-           }
-         }
-         /* We now have a total for all of the colors, find the average! */
-         red /= area2;
-         green /= area2;
-         blue /= area2;
-          /* Stuff the new value back into memory */
-         pixel_value = ((red & redMax) << redShift) | ((green & greenMax) << greenShift) | ((blue & blueMax) << blueShift);
-
-         switch (bytesPerPixel) {
-         case 4: *((unsigned int *)dstptr)   = (unsigned int)   pixel_value; break;
-         case 2: *((unsigned short *)dstptr) = (unsigned short) pixel_value; break;
-         case 1: *((unsigned char *)dstptr)  = (unsigned char)  pixel_value; break;
-         default:
-           /* fixme: endianness problem? */
-           for (z = 0; z < bytesPerPixel; z++)
-             dstptr[z]=(pixel_value >> (8 * z)) & 0xff;
-            break;
-          }
-          dstptr += bytesPerPixel;
-       }
-       srcptr += (screen->paddedWidthInBytes * areaY);
-       dstptr += (ptr->paddedWidthInBytes - bytesPerLine);
-     }
-   } else
-   { /* Not truecolour, so we can't blend. Just use the top-left pixel instead */
-     for (y = y1; y < (y1+h1); y++) {
-       for (x = x1; x < (x1+w1); x++)
-         memcpy (&ptr->frameBuffer[(y *ptr->paddedWidthInBytes) + (x * bytesPerPixel)],
-                 &screen->frameBuffer[(y * areaY * screen->paddedWidthInBytes) + (x *areaX * bytesPerPixel)], bytesPerPixel);
-     }
-  }
 }
 
+/*
+ * The scaled versions of the framebuffer are not updated here, only told
+ * what changed: rfbScaledScreenRefresh() scales it when a client using
+ * them is sent it, so marking costs the same with or without them.
+ */
+
 void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2)
 {
-    /* ok, now the task is to update each and every scaled version of the framebuffer
-     * and we only have to do this for this specific changed rectangle!
-     */
     rfbScreenInfoPtr ptr;
-    int count=0;
+    sraRegionPtr region = NULL;
+
+    if (screen->scaledScreenNext==NULL)
+        return;
 
     /* We don't point to cl->screen as it is the original */
+    LOCK(screen->scaledScreenMutex);
     for (ptr=screen->scaledScreenNext;ptr!=NULL;ptr=ptr->scaledScreenNext)
     {
-        /* Only update if it has active clients... */
+        /* Only if it has active clients, the others are rescaled when taken */
         if (ptr->scaledScreenRefCount>0)
         {
-          rfbScaledScreenUpdateRect(screen, ptr, x1, y1, x2-x1, y2-y1);
-          count++;
+          if (!region)
+              region = sraRgnCreateRect(x1, y1, x2, y2);
+          LOCK(ptr->scaledScreenMutex);
+          sraRgnOr(ptr->scaledScreenDirty, region);
+          UNLOCK(ptr->scaledScreenMutex);
         }
     }
+    UNLOCK(screen->scaledScreenMutex);
+    if (region)
+        sraRgnDestroy(region);
 }
 
-/* Create a new scaled version of the framebuffer */
-rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
+/*
+ * Bring the client's scaled framebuffer up to date where it is about to be
+ * sent (region is in the coordinates of cl->screen).  A second client of
+ * the same scale waits until the first has finished, so that it does not
+ * send what is still being scaled.
+ */
+
+void rfbScaledScreenRefresh(rfbClientPtr cl, sraRegionPtr region)
+{
+    rfbScreenInfoPtr ptr = cl->scaledScreen;
+    sraRegionPtr todo;
+    sraRectangleIterator *i;
+    sraRect rect;
+
+    if (ptr == cl->screen)
+        return;
+
+    LOCK(ptr->scaledScreenRefreshMutex);
+    LOCK(ptr->scaledScreenMutex);
+    todo = sraRgnCreateRgn(ptr->scaledScreenDirty);
+    sraRgnAnd(todo, region);
+    sraRgnSubtract(ptr->scaledScreenDirty, todo);
+    UNLOCK(ptr->scaledScreenMutex);
+
+    i = sraRgnGetIterator(todo);
+    while (sraRgnIteratorNext(i, &rect))
+        rfbScaledScreenUpdateRect(cl->screen, ptr, rect.x1, rect.y1,
+                                  rect.x2 - rect.x1, rect.y2 - rect.y1);
+    sraRgnReleaseIterator(i);
+    UNLOCK(ptr->scaledScreenRefreshMutex);
+    sraRgnDestroy(todo);
+}
+
+/* Everything is rescaled before it is next sent */
+static void rfbScaledScreenInvalidate(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr)
+{
+    LOCK(ptr->scaledScreenMutex);
+    sraRgnDestroy(ptr->scaledScreenDirty);
+    ptr->scaledScreenDirty = sraRgnCreateRect(0, 0, screen->width, screen->height);
+    UNLOCK(ptr->scaledScreenMutex);
+}
+
+/*
+ * Scaled screens no client uses any more are kept, as clients often go
+ * back to a size they had before, but only up to scaledScreenCacheSize
+ * bytes of them: the one left the longest ago is freed first.  The list
+ * of scaled screens and their reference counts are guarded by the
+ * original screen's scaledScreenMutex.
+ */
+
+static unsigned long rfbScaledScreenSize(rfbScreenInfoPtr ptr)
+{
+    return sizeof(rfbScreenInfo) + ptr->sizeInBytes;
+}
+
+static void rfbScaledScreenFree(rfbScreenInfoPtr ptr)
+{
+    sraRgnDestroy(ptr->scaledScreenDirty);
+    TINI_MUTEX(ptr->scaledScreenMutex);
+    TINI_MUTEX(ptr->scaledScreenRefreshMutex);
+    free(ptr->frameBuffer);
+    free(ptr);
+}
+
+/* Call with screen->scaledScreenMutex held */
+static void rfbScaledScreenEvict(rfbScreenInfoPtr screen)
+{
+    rfbScreenInfoPtr ptr, *p, *oldest;
+    unsigned long unused;
+
+    for (;;) {
+        rfbScaledScreenMemory(screen, &unused);
+        if (unused <= (unsigned long)screen->scaledScreenCacheSize)
+            return;
+
+        oldest = NULL;
+        for (p = &screen->scaledScreenNext; (ptr = *p) != NULL; p = &ptr->scaledScreenNext)
+            if (ptr->scaledScreenRefCount < 1 &&
+                (!oldest || ptr->scaledScreenLastUsed < (*oldest)->scaledScreenLastUsed))
+                oldest = p;
+        if (!oldest)
+            return;
+
+        ptr = *oldest;
+        *oldest = ptr->scaledScreenNext;
+        rfbLog("Freeing the unused %dx%d scaled screen\n", ptr->width, ptr->height);
+        rfbScaledScreenFree(ptr);
+    }
+}
+
+/*
+ * A client lets go of a scaled screen.  Call with screen->scaledScreenMutex
+ * held.
+ */
+static void rfbScaledScreenRelease(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr)
+{
+    ptr->scaledScreenRefCount--;
+    if (ptr == screen || ptr->scaledScreenRefCount > 0)
+        return;
+    ptr->scaledScreenLastUsed = ++screen->scaledScreenLastUsed;
+    rfbScaledScreenEvict(screen);
+}
+
+unsigned long rfbScaledScreenMemory(rfbScreenInfoPtr screen, unsigned long *unused)
+{
+    rfbScreenInfoPtr ptr;
+    unsigned long total = 0;
+
+    if (unused)
+        *unused = 0;
+    for (ptr = screen->scaledScreenNext; ptr != NULL; ptr = ptr->scaledScreenNext) {
+        total += rfbScaledScreenSize(ptr);
+        if (unused && ptr->scaledScreenRefCount < 1)
+            *unused += rfbScaledScreenSize(ptr);
+    }
+    return total;
+}
+
+/*
+ * Create a new scaled version of the framebuffer.  Call with
+ * cl->screen->scaledScreenMutex held: until the caller counts its use, the
+ * new screen is the first one rfbScaledScreenEvict() would free.
+ */
+static rfbScreenInfoPtr rfbScaledScreenAllocateLocked(rfbClientPtr cl, int width, int height)
 {
     rfbScreenInfoPtr ptr;
     ptr = malloc(sizeof(rfbScreenInfo));
@@ -324,6 +713,7 @@ rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
 
         /* Reset the reference count to 0! */
         ptr->scaledScreenRefCount = 0;
+        ptr->scaledScreenLastUsed = 0;
 
         ptr->sizeInBytes = ptr->paddedWidthInBytes * ptr->height;
         ptr->serverFormat = cl->screen->serverFormat;
@@ -332,12 +722,13 @@ rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
         if (ptr->frameBuffer!=NULL)
         {
             /* Reset to a known condition: scale the entire framebuffer */
-            rfbScaledScreenUpdateRect(cl->screen, ptr, 0, 0, cl->screen->width, cl->screen->height);
+            INIT_MUTEX(ptr->scaledScreenMutex);
+            INIT_MUTEX(ptr->scaledScreenRefreshMutex);
+            ptr->scaledScreenDirty = NULL;
+            rfbScaledScreenInvalidate(cl->screen, ptr);
             /* Now, insert into the chain */
-            LOCK(cl->updateMutex);
             ptr->scaledScreenNext = cl->screen->scaledScreenNext;
             cl->screen->scaledScreenNext = ptr;
-            UNLOCK(cl->updateMutex);
         }
         else
         {
@@ -349,62 +740,128 @@ rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
     return ptr;
 }
 
-/* Find an active scaled version of the framebuffer
- * TODO: implement a refcount per scaled screen to prevent
- * unreferenced scaled screens from hanging around
+rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
+{
+    rfbScreenInfoPtr ptr;
+
+    LOCK(cl->screen->scaledScreenMutex);
+    ptr = rfbScaledScreenAllocateLocked(cl, width, height);
+    UNLOCK(cl->screen->scaledScreenMutex);
+    return ptr;
+}
+
+/*
+ * Find a scaled version of the framebuffer, in use or kept for reuse.  Call
+ * with cl->screen->scaledScreenMutex held.
  */
-rfbScreenInfoPtr rfbScalingFind(rfbClientPtr cl, int width, int height)
+static rfbScreenInfoPtr rfbScalingFindLocked(rfbClientPtr cl, int width, int height)
 {
     rfbScreenInfoPtr ptr;
     /* include the original in the search (ie: fine 1:1 scaled version of the frameBuffer) */
     for (ptr=cl->screen; ptr!=NULL; ptr=ptr->scaledScreenNext)
     {
         if ((ptr->width==width) && (ptr->height==height))
-            return ptr;
+            break;
     }
-    return NULL;
+    return ptr;
 }
 
-/* Future needs "scale to 320x240, as that's the client's screen size */
-void rfbScalingSetup(rfbClientPtr cl, int width, int height)
+rfbScreenInfoPtr rfbScalingFind(rfbClientPtr cl, int width, int height)
 {
     rfbScreenInfoPtr ptr;
 
-    ptr = rfbScalingFind(cl,width,height);
+    LOCK(cl->screen->scaledScreenMutex);
+    ptr = rfbScalingFindLocked(cl, width, height);
+    UNLOCK(cl->screen->scaledScreenMutex);
+    return ptr;
+}
+
+/*
+ * Future needs "scale to 320x240, as that's the client's screen size.
+ * An update being sent reads cl->scaledScreen all along, so the new one
+ * only takes its place with rfbScalingSwitch().
+ */
+void rfbScalingSetup(rfbClientPtr cl, int width, int height)
+{
+    rfbScreenInfoPtr ptr, old;
+    unsigned long total, unused;
+
+    /* counted before the lock is let go, or another client may evict it */
+    LOCK(cl->screen->scaledScreenMutex);
+    ptr = rfbScalingFindLocked(cl,width,height);
     if (ptr==NULL)
-        ptr = rfbScaledScreenAllocate(cl,width,height);
+        ptr = rfbScaledScreenAllocateLocked(cl,width,height);
     /* Now, there is a new screen available (if ptr is not NULL) */
     if (ptr!=NULL)
     {
         /* Update it! */
-        if (ptr->scaledScreenRefCount<1)
-            rfbScaledScreenUpdateRect(cl->screen, ptr, 0, 0, cl->screen->width, cl->screen->height);
-        /*
-         * rfbLog("Taking one from %dx%d-%d and adding it to %dx%d-%d\n",
-         *    cl->scaledScreen->width, cl->scaledScreen->height,
-         *    cl->scaledScreen->scaledScreenRefCount,
-         *    ptr->width, ptr->height, ptr->scaledScreenRefCount);
-         */
+        if (ptr->scaledScreenRefCount<1 && ptr!=cl->screen)
+            rfbScaledScreenInvalidate(cl->screen, ptr);
+        ptr->scaledScreenRefCount++;
 
         LOCK(cl->updateMutex);
-        cl->scaledScreen->scaledScreenRefCount--;
-        ptr->scaledScreenRefCount++;
-        cl->scaledScreen=ptr;
-        cl->newFBSizePending = TRUE;
+        old=cl->scaledScreenPending;
+        cl->scaledScreenPending=ptr;
+        rfbSignalClientUpdate(cl);
         UNLOCK(cl->updateMutex);
 
-        rfbLog("Scaling to %dx%d (refcount=%d)\n",width,height,ptr->scaledScreenRefCount);
+        /* asked for, but never used */
+        if (old)
+            rfbScaledScreenRelease(cl->screen, old);
+        total = rfbScaledScreenMemory(cl->screen, &unused);
+        UNLOCK(cl->screen->scaledScreenMutex);
+        rfbScheduleClientUpdate(cl);
+
+        rfbLog("Scaling to %dx%d (refcount=%d, scaled screens take %lu KB, %lu KB of it unused)\n",
+               width,height,ptr->scaledScreenRefCount,total/1024,unused/1024);
     }
     else
+    {
+        UNLOCK(cl->screen->scaledScreenMutex);
         rfbLog("Scaling to %dx%d failed, leaving things alone\n",width,height);
+    }
+}
+
+/* The client is gone, or done with a scaled screen */
+void rfbScalingRelease(rfbClientPtr cl, rfbScreenInfoPtr ptr)
+{
+    LOCK(cl->screen->scaledScreenMutex);
+    rfbScaledScreenRelease(cl->screen, ptr);
+    UNLOCK(cl->screen->scaledScreenMutex);
+}
+
+/*
+ * Take the scaled screen rfbScalingSetup() was last asked for, and let go
+ * of the old one.  Call with sendMutex held, so that no update reads it,
+ * and tell the client the new size before sending it anything else.
+ */
+void rfbScalingSwitch(rfbClientPtr cl)
+{
+    rfbScreenInfoPtr old = NULL;
+
+    LOCK(cl->updateMutex);
+    if (cl->scaledScreenPending) {
+        old = cl->scaledScreen;
+        cl->scaledScreen = cl->scaledScreenPending;
+        cl->scaledScreenPending = NULL;
+        cl->newFBSizePending = TRUE;
+    }
+    UNLOCK(cl->updateMutex);
+    /* even if it is the same one, it was counted once more for this */
+    if (old)
+        rfbScalingRelease(cl, old);
 }
 
 int rfbSendNewScaleSize(rfbClientPtr cl)
 {
+    rfbBool result = TRUE;
+
     /* if the client supports newFBsize Encoding, use it */
-    if (cl->useNewFBSize && cl->newFBSizePending)
+    if (cl->useNewFBSize)
 	return FALSE;
 
+    LOCK(cl->sendMutex);
+    rfbScalingSwitch(cl);
     LOCK(cl->updateMutex);
     cl->newFBSizePending = FALSE;
     UNLOCK(cl->updateMutex);
@@ -424,7 +881,7 @@ int rfbSendNewScaleSize(rfbClientPtr cl)
         if (rfbWriteExact(cl, (char *)&pmsg, sz_rfbPalmVNCReSizeFrameBufferMsg) < 0) {
             rfbLogPerror("rfbNewClient: write");
             rfbCloseClient(cl);
-            return FALSE;
+            result = FALSE;
         }
     }
     else
@@ -438,9 +895,10 @@ int rfbSendNewScaleSize(rfbClientPtr cl)
         if (rfbWriteExact(cl, (char *)&rmsg, sz_rfbResizeFrameBufferMsg) < 0) {
             rfbLogPerror("rfbNewClient: write");
             rfbCloseClient(cl);
-            return FALSE;
+            result = FALSE;
         }
     }
-    return TRUE;
+    UNLOCK(cl->sendMutex);
+    return result;
 }
 /****************************/
@@ -52,6 +52,7 @@
 #endif
 
 #include <rfb/rfb.h>
+#include "private.h"
 
 #ifdef LIBVNCSERVER_HAVE_SYS_TYPES_H
 #include <sys/types.h>
@@ -63,6 +64,9 @@
 #ifdef LIBVNCSERVER_HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #ifdef LIBVNCSERVER_HAVE_NETINET_IN_H
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -72,6 +76,10 @@
 #ifdef LIBVNCSERVER_HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <poll.h>
+#endif
 
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
 #include "rfbssl.h"
@@ -126,6 +134,118 @@ int deny_severity=LOG_WARNING;
 int rfbMaxClientWait = 20000;   /* time (ms) after which we decide client has
                                    gone away - needed to stop us hanging */
 
+/* how many ready descriptors one epoll_wait() call reports at most */
+#define RFB_EPOLL_MAX_EVENTS 64
+
+/*
+ * rfbWatchSocket adds a socket to the set rfbCheckFds waits on.  owner is
+ * what the epoll backend reports back when the socket becomes readable:
+ * the client record for client sockets, or the address of the screen's
+ * socket member for listening sockets.  Sockets without an owner yet (see
+ * rfbConnect) are only put into allFds; the client record registers them
+ * with epoll once it is created.
+ */
+
+rfbBool
+rfbWatchSocket(rfbScreenInfoPtr rfbScreen, int sock, void *owner)
+{
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    if (rfbScreen->epollFd != -1 && owner) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = owner;
+	if (epoll_ctl(rfbScreen->epollFd, EPOLL_CTL_ADD, sock, &ev) < 0
+	    && (errno != EEXIST
+		|| epoll_ctl(rfbScreen->epollFd, EPOLL_CTL_MOD, sock, &ev) < 0)) {
+	    rfbLogPerror("rfbWatchSocket: epoll_ctl");
+	    return FALSE;
+	}
+    }
+    /* allFds is still used by the select() based helpers, but epoll has no
+       FD_SETSIZE limit, so only track the descriptors that fit */
+    if (rfbScreen->epollFd != -1 && sock >= FD_SETSIZE)
+	return TRUE;
+#endif
+    if (sock >= FD_SETSIZE) {
+	rfbErr("rfbWatchSocket: socket %d exceeds FD_SETSIZE\n", sock);
+	return FALSE;
+    }
+    FD_SET(sock, &(rfbScreen->allFds));
+    rfbScreen->maxFd = rfbMax(sock, rfbScreen->maxFd);
+    return TRUE;
+}
+
+/*
+ * While output for cl waits in its queue, have the epoll backend also
+ * report its socket as writable.  The select() backend asks the queue
+ * itself.
+ */
+
+void
+rfbWatchSocketWritable(rfbClientPtr cl, rfbBool writable)
+{
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+
+    if (cl->screen->epollFd == -1 || cl->sock < 0)
+	return;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = writable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = cl;
+    /* the socket may just have been unwatched by rfbCloseClient */
+    if (epoll_ctl(cl->screen->epollFd, EPOLL_CTL_MOD, cl->sock, &ev) < 0
+	&& errno != ENOENT && errno != EBADF)
+	rfbLogPerror("rfbWatchSocketWritable: epoll_ctl");
+#endif
+}
+
+void
+rfbUnwatchSocket(rfbScreenInfoPtr rfbScreen, int sock)
+{
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+
+    /* ev is ignored, but kernels before 2.6.9 reject a NULL pointer */
+    if (rfbScreen->epollFd != -1)
+	epoll_ctl(rfbScreen->epollFd, EPOLL_CTL_DEL, sock, &ev);
+#endif
+    if (sock >= 0 && sock < FD_SETSIZE)
+	FD_CLR(sock, &(rfbScreen->allFds));
+}
+
+/*
+ * rfbWaitForSocket waits up to timeout ms for sock to become readable (or
+ * writable).  Returns like select(): >0 if ready, 0 on timeout, <0 on error.
+ * Where available poll() is used since descriptors handed out under the
+ * epoll backend may exceed FD_SETSIZE.
+ */
+
+int
+rfbWaitForSocket(int sock, rfbBool forWrite, int timeout)
+{
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    struct pollfd pfd;
+
+    pfd.fd = sock;
+    pfd.events = forWrite ? POLLOUT : POLLIN | POLLPRI;
+    pfd.revents = 0;
+    return poll(&pfd, 1, timeout);
+#else
+    fd_set fds;
+    struct timeval tv;
+
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    if (forWrite)
+	return select(sock+1, NULL, &fds, NULL, &tv);
+    return select(sock+1, &fds, NULL, &fds, &tv);
+#endif
+}
+
 static rfbBool
 rfbNewConnectionFromSock(rfbScreenInfoPtr rfbScreen, int sock)
 {
@@ -190,6 +310,13 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 
     rfbScreen->socketState = RFB_SOCKET_READY;
 
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    if (rfbScreen->useEpoll && rfbScreen->epollFd == -1) {
+	if ((rfbScreen->epollFd = epoll_create(RFB_EPOLL_MAX_EVENTS)) < 0)
+	    rfbLogPerror("rfbInitSockets: epoll_create, falling back to select");
+    }
+#endif
+
 #ifdef LIBVNCSERVER_WITH_SYSTEMD
     if (sd_listen_fds(0) == 1)
     {
@@ -216,8 +343,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 	}
 
     	FD_ZERO(&(rfbScreen->allFds));
-    	FD_SET(rfbScreen->inetdSock, &(rfbScreen->allFds));
-    	rfbScreen->maxFd = rfbScreen->inetdSock;
+    	rfbWatchSocket(rfbScreen, rfbScreen->inetdSock, &rfbScreen->inetdSock);
 	return;
     }
 
@@ -239,8 +365,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
         }
 
         rfbLog("Autoprobing selected TCP port %d\n", rfbScreen->port);
-        FD_SET(rfbScreen->listenSock, &(rfbScreen->allFds));
-        rfbScreen->maxFd = rfbScreen->listenSock;
+        rfbWatchSocket(rfbScreen, rfbScreen->listenSock, &rfbScreen->listenSock);
     }
 
 #ifdef LIBVNCSERVER_IPv6
@@ -260,8 +385,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
         }
 
         rfbLog("Autoprobing selected TCP6 port %d\n", rfbScreen->ipv6port);
-	FD_SET(rfbScreen->listen6Sock, &(rfbScreen->allFds));
-	rfbScreen->maxFd = rfbMax((int)rfbScreen->listen6Sock,rfbScreen->maxFd);
+	rfbWatchSocket(rfbScreen, rfbScreen->listen6Sock, &rfbScreen->listen6Sock);
     }
 #endif
 
@@ -274,8 +398,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
       }
       rfbLog("Listening for VNC connections on TCP port %d\n", rfbScreen->port);  
   
-      FD_SET(rfbScreen->listenSock, &(rfbScreen->allFds));
-      rfbScreen->maxFd = rfbScreen->listenSock;
+      rfbWatchSocket(rfbScreen, rfbScreen->listenSock, &rfbScreen->listenSock);
 	    }
 
 #ifdef LIBVNCSERVER_IPv6
@@ -286,8 +409,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
       }
       rfbLog("Listening for VNC connections on TCP6 port %d\n", rfbScreen->ipv6port);  
 	
-      FD_SET(rfbScreen->listen6Sock, &(rfbScreen->allFds));
-      rfbScreen->maxFd = rfbMax((int)rfbScreen->listen6Sock,rfbScreen->maxFd);
+      rfbWatchSocket(rfbScreen, rfbScreen->listen6Sock, &rfbScreen->listen6Sock);
 	    }
 #endif
 
@@ -302,8 +424,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 	}
 	rfbLog("Listening for VNC connections on TCP port %d\n", rfbScreen->port);  
 
-	FD_SET(rfbScreen->udpSock, &(rfbScreen->allFds));
-	rfbScreen->maxFd = rfbMax((int)rfbScreen->udpSock,rfbScreen->maxFd);
+	rfbWatchSocket(rfbScreen, rfbScreen->udpSock, &rfbScreen->udpSock);
     }
 }
 
@@ -315,30 +436,176 @@ void rfbShutdownSockets(rfbScreenInfoPtr rfbScreen)
     rfbScreen->socketState = RFB_SOCKET_SHUTDOWN;
 
     if(rfbScreen->inetdSock>-1) {
+	rfbUnwatchSocket(rfbScreen,rfbScreen->inetdSock);
 	closesocket(rfbScreen->inetdSock);
-	FD_CLR(rfbScreen->inetdSock,&rfbScreen->allFds);
 	rfbScreen->inetdSock=-1;
     }
 
     if(rfbScreen->listenSock>-1) {
+	rfbUnwatchSocket(rfbScreen,rfbScreen->listenSock);
 	closesocket(rfbScreen->listenSock);
-	FD_CLR(rfbScreen->listenSock,&rfbScreen->allFds);
 	rfbScreen->listenSock=-1;
     }
 
     if(rfbScreen->listen6Sock>-1) {
+	rfbUnwatchSocket(rfbScreen,rfbScreen->listen6Sock);
 	closesocket(rfbScreen->listen6Sock);
-	FD_CLR(rfbScreen->listen6Sock,&rfbScreen->allFds);
 	rfbScreen->listen6Sock=-1;
     }
 
     if(rfbScreen->udpSock>-1) {
+	rfbUnwatchSocket(rfbScreen,rfbScreen->udpSock);
 	closesocket(rfbScreen->udpSock);
-	FD_CLR(rfbScreen->udpSock,&rfbScreen->allFds);
 	rfbScreen->udpSock=-1;
     }
+
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    if(rfbScreen->epollFd>-1) {
+	close(rfbScreen->epollFd);
+	rfbScreen->epollFd=-1;
+    }
+#endif
 }
 
+/*
+ * rfbCheckUDPSock handles a datagram pending on the UDP socket.  Returns
+ * FALSE if the socket could not be connected to the new remote end.
+ */
+
+static rfbBool
+rfbCheckUDPSock(rfbScreenInfoPtr rfbScreen)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    char buf[6];
+
+    if(!rfbScreen->udpClient)
+	rfbNewUDPClient(rfbScreen);
+    if (recvfrom(rfbScreen->udpSock, buf, 1, MSG_PEEK,
+		(struct sockaddr *)&addr, &addrlen) < 0) {
+	rfbLogPerror("rfbCheckFds: UDP: recvfrom");
+	rfbDisconnectUDPSock(rfbScreen);
+	rfbScreen->udpSockConnected = FALSE;
+    } else {
+	if (!rfbScreen->udpSockConnected ||
+		(memcmp(&addr, &rfbScreen->udpRemoteAddr, addrlen) != 0))
+	{
+	    /* new remote end */
+	    rfbLog("rfbCheckFds: UDP: got connection\n");
+
+	    memcpy(&rfbScreen->udpRemoteAddr, &addr, addrlen);
+	    rfbScreen->udpSockConnected = TRUE;
+
+	    if (connect(rfbScreen->udpSock,
+			(struct sockaddr *)&addr, addrlen) < 0) {
+		rfbLogPerror("rfbCheckFds: UDP: connect");
+		rfbDisconnectUDPSock(rfbScreen);
+		return FALSE;
+	    }
+
+	    rfbNewUDPConnection(rfbScreen,rfbScreen->udpSock);
+	}
+
+	rfbProcessUDPInput(rfbScreen);
+    }
+    return TRUE;
+}
+
+static rfbBool
+rfbAcceptConnection(rfbScreenInfoPtr rfbScreen, int listenSock)
+{
+    int sock;
+
+    if ((sock = accept(listenSock, NULL, NULL)) < 0) {
+      rfbLogPerror("rfbCheckFds: accept");
+      return FALSE;
+    }
+
+    return rfbNewConnectionFromSock(rfbScreen, sock);
+}
+
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+static void
+rfbSendFileTransferChunks(rfbScreenInfoPtr rfbScreen)
+{
+    rfbClientIteratorPtr i;
+    rfbClientPtr cl;
+
+    i = rfbGetClientIterator(rfbScreen);
+    while((cl = rfbClientIteratorNext(i))) {
+	if (cl->onHold)
+	    continue;
+	if (cl->sock >= 0)
+	    rfbSendFileTransferChunk(cl);
+    }
+    rfbReleaseClientIterator(i);
+}
+
+/*
+ * The epoll flavour of rfbCheckFds.  Only the sockets that are actually
+ * readable are looked at, so the cost per call does not grow with the number
+ * of connected clients.  Pending file transfers are pumped from the ready
+ * list walk in rfbProcessEvents if useReadyList is set, otherwise all clients
+ * are swept as with select().
+ */
+
+static int
+rfbCheckFdsEpoll(rfbScreenInfoPtr rfbScreen,long usec)
+{
+    struct epoll_event events[RFB_EPOLL_MAX_EVENTS];
+    rfbClientPtr cl;
+    void *owner;
+    int nfds, n;
+    int result = 0;
+
+    do {
+	nfds = epoll_wait(rfbScreen->epollFd, events, RFB_EPOLL_MAX_EVENTS,
+			  (usec + 999) / 1000);
+	if (nfds < 0) {
+	    if (errno != EINTR)
+		rfbLogPerror("rfbCheckFds: epoll_wait");
+	    return -1;
+	}
+
+	if (!rfbScreen->useReadyList)
+	    rfbSendFileTransferChunks(rfbScreen);
+
+	if (nfds == 0)
+	    return result;
+
+	result += nfds;
+
+	for (n = 0; n < nfds; n++) {
+	    owner = events[n].data.ptr;
+
+	    if (owner == &rfbScreen->listenSock || owner == &rfbScreen->listen6Sock) {
+		if (!rfbAcceptConnection(rfbScreen, *(int *)owner))
+		    return -1;
+	    } else if (owner == &rfbScreen->udpSock) {
+		if (!rfbCheckUDPSock(rfbScreen))
+		    return -1;
+	    } else if (owner != &rfbScreen->inetdSock) {
+		cl = (rfbClientPtr)owner;
+		if (cl->onHold || cl->sock < 0)
+		    continue;
+		if (events[n].events & EPOLLOUT)
+		    rfbOutputDrain(cl);
+		if (!(events[n].events & ~EPOLLOUT) || cl->sock < 0)
+		    continue;
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+		do {
+		    rfbProcessClientMessage(cl);
+		} while (cl->sock > 0 && webSocketsHasDataInBuffer(cl));
+#else
+		rfbProcessClientMessage(cl);
+#endif
+	    }
+	}
+    } while(rfbScreen->handleEventsEagerly);
+    return result;
+}
+#endif
+
 /*
  * rfbCheckFds is called from ProcessInputEvents to check for input on the RFB
  * socket(s).  If there is input to process, the appropriate function in the
@@ -350,11 +617,8 @@ int
 rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 {
     int nfds;
-    fd_set fds;
+    fd_set fds, wfds;
     struct timeval tv;
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
-    char buf[6];
     rfbClientIteratorPtr i;
     rfbClientPtr cl;
     int result = 0;
@@ -364,11 +628,23 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 	rfbScreen->inetdInitDone = TRUE;
     }
 
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    if (rfbScreen->epollFd != -1)
+	return rfbCheckFdsEpoll(rfbScreen, usec);
+#endif
+
     do {
 	memcpy((char *)&fds, (char *)&(rfbScreen->allFds), sizeof(fd_set));
+	/* clients with queued output want to know when they can write */
+	FD_ZERO(&wfds);
+	i = rfbGetClientIterator(rfbScreen);
+	while((cl = rfbClientIteratorNext(i)))
+	    if (cl->sock >= 0 && rfbOutputPending(cl) > 0)
+		FD_SET(cl->sock, &wfds);
+	rfbReleaseClientIterator(i);
 	tv.tv_sec = 0;
 	tv.tv_usec = usec;
-	nfds = select(rfbScreen->maxFd + 1, &fds, NULL, NULL /* &fds */, &tv);
+	nfds = select(rfbScreen->maxFd + 1, &fds, &wfds, NULL /* &fds */, &tv);
 	if (nfds == 0) {
 	    /* timed out, check for async events */
             i = rfbGetClientIterator(rfbScreen);
@@ -414,35 +690,8 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 	}
 
 	if ((rfbScreen->udpSock != -1) && FD_ISSET(rfbScreen->udpSock, &fds)) {
-	    if(!rfbScreen->udpClient)
-		rfbNewUDPClient(rfbScreen);
-	    if (recvfrom(rfbScreen->udpSock, buf, 1, MSG_PEEK,
-			(struct sockaddr *)&addr, &addrlen) < 0) {
-		rfbLogPerror("rfbCheckFds: UDP: recvfrom");
-		rfbDisconnectUDPSock(rfbScreen);
-		rfbScreen->udpSockConnected = FALSE;
-	    } else {
-		if (!rfbScreen->udpSockConnected ||
-			(memcmp(&addr, &rfbScreen->udpRemoteAddr, addrlen) != 0))
-		{
-		    /* new remote end */
-		    rfbLog("rfbCheckFds: UDP: got connection\n");
-
-		    memcpy(&rfbScreen->udpRemoteAddr, &addr, addrlen);
-		    rfbScreen->udpSockConnected = TRUE;
-
-		    if (connect(rfbScreen->udpSock,
-				(struct sockaddr *)&addr, addrlen) < 0) {
-			rfbLogPerror("rfbCheckFds: UDP: connect");
-			rfbDisconnectUDPSock(rfbScreen);
-			return -1;
-		    }
-
-		    rfbNewUDPConnection(rfbScreen,rfbScreen->udpSock);
-		}
-
-		rfbProcessUDPInput(rfbScreen);
-	    }
+	    if (!rfbCheckUDPSock(rfbScreen))
+		return -1;
 
 	    FD_CLR(rfbScreen->udpSock, &fds);
 	    if (--nfds == 0)
@@ -455,6 +704,9 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 	    if (cl->onHold)
 		continue;
 
+            if (cl->sock >= 0 && FD_ISSET(cl->sock, &wfds))
+                rfbOutputDrain(cl);
+
             if (FD_ISSET(cl->sock, &(rfbScreen->allFds)))
             {
                 if (FD_ISSET(cl->sock, &fds))
@@ -479,7 +731,6 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 rfbBool
 rfbProcessNewConnection(rfbScreenInfoPtr rfbScreen)
 {
-    int sock = -1;
     fd_set listen_fds; 
     int chosen_listen_sock = -1;
 
@@ -500,12 +751,7 @@ rfbProcessNewConnection(rfbScreenInfoPtr rfbScreen)
     if (rfbScreen->listen6Sock >= 0 && FD_ISSET(rfbScreen->listen6Sock, &listen_fds))
       chosen_listen_sock = rfbScreen->listen6Sock;
 
-    if ((sock = accept(chosen_listen_sock, NULL, NULL)) < 0) {
-      rfbLogPerror("rfbCheckFds: accept");
-      return FALSE;
-    }
-
-    return rfbNewConnectionFromSock(rfbScreen, sock);
+    return rfbAcceptConnection(rfbScreen, chosen_listen_sock);
 }
 
 
@@ -531,7 +777,7 @@ rfbCloseClient(rfbClientPtr cl)
     if (cl->sock != -1)
 #endif
       {
-	FD_CLR(cl->sock,&(cl->screen->allFds));
+	rfbUnwatchSocket(cl->screen,cl->sock);
 	if(cl->sock==cl->screen->maxFd)
 	  while(cl->screen->maxFd>0
 		&& !FD_ISSET(cl->screen->maxFd,&(cl->screen->allFds)))
@@ -547,8 +793,11 @@ rfbCloseClient(rfbClientPtr cl)
 	closesocket(cl->sock);
 	cl->sock = -1;
       }
-    TSIGNAL(cl->updateCond);
+    rfbSignalClientUpdate(cl);
     UNLOCK(cl->updateMutex);
+
+    /* let rfbProcessEvents reap it */
+    rfbScheduleClientUpdate(cl);
 }
 
 
@@ -583,8 +832,10 @@ rfbConnect(rfbScreenInfoPtr rfbScreen,
     }
 
     /* AddEnabledDevice(sock); */
-    FD_SET(sock, &rfbScreen->allFds);
-    rfbScreen->maxFd = rfbMax(sock,rfbScreen->maxFd);
+    if(!rfbWatchSocket(rfbScreen, sock, NULL)) {
+        closesocket(sock);
+	return -1;
+    }
 
     return sock;
 }
@@ -600,8 +851,6 @@ rfbReadExactTimeout(rfbClientPtr cl, char* buf, int len, int timeout)
 {
     int sock = cl->sock;
     int n;
-    fd_set fds;
-    struct timeval tv;
 
     while (len > 0) {
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
@@ -645,11 +894,7 @@ rfbReadExactTimeout(rfbClientPtr cl, char* buf, int len, int timeout)
 		    continue;
 	    }
 #endif
-            FD_ZERO(&fds);
-            FD_SET(sock, &fds);
-            tv.tv_sec = timeout / 1000;
-            tv.tv_usec = (timeout % 1000) * 1000;
-            n = select(sock+1, &fds, NULL, &fds, &tv);
+            n = rfbWaitForSocket(sock, FALSE, timeout);
             if (n < 0) {
                 rfbLogPerror("ReadExact: select");
                 return n;
@@ -692,8 +937,6 @@ rfbPeekExactTimeout(rfbClientPtr cl, char* buf, int len, int timeout)
 {
     int sock = cl->sock;
     int n;
-    fd_set fds;
-    struct timeval tv;
 
     while (len > 0) {
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
@@ -731,11 +974,7 @@ rfbPeekExactTimeout(rfbClientPtr cl, char* buf, int len, int timeout)
 		    continue;
 	    }
 #endif
-            FD_ZERO(&fds);
-            FD_SET(sock, &fds);
-            tv.tv_sec = timeout / 1000;
-            tv.tv_usec = (timeout % 1000) * 1000;
-            n = select(sock+1, &fds, NULL, &fds, &tv);
+            n = rfbWaitForSocket(sock, FALSE, timeout);
             if (n < 0) {
                 rfbLogPerror("PeekExact: select");
                 return n;
@@ -770,8 +1009,6 @@ rfbWriteExact(rfbClientPtr cl,
 {
     int sock = cl->sock;
     int n;
-    fd_set fds;
-    struct timeval tv;
     int totalTimeWaited = 0;
     const int timeout = (cl->screen && cl->screen->maxClientWait) ? cl->screen->maxClientWait : rfbMaxClientWait;
 
@@ -794,6 +1031,16 @@ rfbWriteExact(rfbClientPtr cl,
     }
 #endif
 
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+    if (rfbOutputQueueing(cl)) {
+        struct iovec iov;
+
+        iov.iov_base = (void *)buf;
+        iov.iov_len = len;
+        return rfbOutputSendV(cl, &iov, 1);
+    }
+#endif
+
     LOCK(cl->outputMutex);
     while (len > 0) {
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
@@ -807,6 +1054,7 @@ rfbWriteExact(rfbClientPtr cl,
 
             buf += n;
             len -= n;
+            cl->bytesWritten += n;
 
         } else if (n == 0) {
 
@@ -829,11 +1077,7 @@ rfbWriteExact(rfbClientPtr cl,
                need to do this because select doesn't necessarily return
                immediately when the other end has gone away */
 
-            FD_ZERO(&fds);
-            FD_SET(sock, &fds);
-            tv.tv_sec = 5;
-            tv.tv_usec = 0;
-            n = select(sock+1, NULL, &fds, NULL /* &fds */, &tv);
+            n = rfbWaitForSocket(sock, TRUE, 5000);
 	    if (n < 0) {
 #ifdef WIN32
                 errno=WSAGetLastError();
@@ -860,6 +1104,100 @@ rfbWriteExact(rfbClientPtr cl,
     return 1;
 }
 
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+/*
+ * Like rfbWriteExact(), but gathers the data from iovcnt buffers, so that
+ * they can go out with a single system call.  The iovec array is changed.
+ */
+
+int
+rfbWriteExactV(rfbClientPtr cl,
+               struct iovec *iov,
+               int iovcnt)
+{
+    int sock = cl->sock;
+    ssize_t n;
+    int totalTimeWaited = 0;
+    const int timeout = (cl->screen && cl->screen->maxClientWait) ? cl->screen->maxClientWait : rfbMaxClientWait;
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    if (cl->wsctx || cl->sslctx) {
+        /* every piece is framed on its own */
+        for (; iovcnt > 0; iov++, iovcnt--) {
+            if ((n = rfbWriteExact(cl, iov->iov_base, iov->iov_len)) <= 0)
+                return n;
+        }
+        return 1;
+    }
+#endif
+
+    if (rfbOutputQueueing(cl))
+        return rfbOutputSendV(cl, iov, iovcnt);
+
+    LOCK(cl->outputMutex);
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+
+        n = writev(sock, iov, iovcnt);
+
+        if (n > 0) {
+
+            cl->bytesWritten += n;
+            while (n > 0) {
+                if ((size_t)n < iov->iov_len) {
+                    iov->iov_base = (char *)iov->iov_base + n;
+                    iov->iov_len -= n;
+                    break;
+                }
+                n -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+
+        } else if (n == 0) {
+
+            rfbErr("WriteExactV: writev returned 0?\n");
+            UNLOCK(cl->outputMutex);
+            return 0;
+
+        } else {
+	    if (errno == EINTR)
+		continue;
+
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+	        UNLOCK(cl->outputMutex);
+                return n;
+            }
+
+            n = rfbWaitForSocket(sock, TRUE, 5000);
+	    if (n < 0) {
+       	        if(errno==EINTR)
+		    continue;
+                rfbLogPerror("WriteExactV: select");
+                UNLOCK(cl->outputMutex);
+                return n;
+            }
+            if (n == 0) {
+                totalTimeWaited += 5000;
+                if (totalTimeWaited >= timeout) {
+                    errno = ETIMEDOUT;
+                    UNLOCK(cl->outputMutex);
+                    return -1;
+                }
+            } else {
+                totalTimeWaited = 0;
+            }
+        }
+    }
+    UNLOCK(cl->outputMutex);
+    return 1;
+}
+#endif
+
 /* currently private, called by rfbProcessArguments() */
 int
 rfbStringToAddr(char *str, in_addr_t *addr)  {
@@ -42,6 +42,7 @@ void  rfbStatRecordEncodingRcvd(rfbClientPtr cl, uint32_t type, int byteCount, i
 void  rfbStatRecordMessageSent(rfbClientPtr cl, uint32_t type, int byteCount, int byteIfRaw);
 void  rfbStatRecordMessageRcvd(rfbClientPtr cl, uint32_t type, int byteCount, int byteIfRaw);
 void rfbResetStats(rfbClientPtr cl);
+void rfbStatRecordContentClass(rfbClientPtr cl, rfbContentClass contentClass, int w, int h);
 void rfbPrintStats(rfbClientPtr cl);
 
 
@@ -59,6 +60,8 @@ char *messageNameServer2Client(uint32_t type, char *buf, int len) {
     case rfbTextChat:                 snprintf(buf, len, "TextChat"); break;
     case rfbPalmVNCReSizeFrameBuffer: snprintf(buf, len, "PalmVNCReSize"); break;
     case rfbXvp:                      snprintf(buf, len, "XvpServerMessage"); break;
+    case rfbFence:                    snprintf(buf, len, "Fence"); break;
+    case rfbEndOfContinuousUpdates:   snprintf(buf, len, "EndOfContinuousUpdates"); break;
     default:
         snprintf(buf, len, "svr2cli-0x%08X", 0xFF);
     }
@@ -82,6 +85,8 @@ char *messageNameClient2Server(uint32_t type, char *buf, int len) {
     case rfbTextChat:                 snprintf(buf, len, "TextChat"); break;
     case rfbPalmVNCSetScaleFactor:    snprintf(buf, len, "PalmVNCSetScale"); break;
     case rfbXvp:                      snprintf(buf, len, "XvpClientMessage"); break;
+    case rfbFence:                    snprintf(buf, len, "Fence"); break;
+    case rfbEnableContinuousUpdates:  snprintf(buf, len, "EnableContinuousUpdates"); break;
     default:
         snprintf(buf, len, "cli2svr-0x%08X", type);
 
@@ -109,6 +114,7 @@ char *encodingName(uint32_t type, char *buf, int len) {
     case rfbEncodingUltra:              snprintf(buf, len, "ultra");       break;
     case rfbEncodingZRLE:               snprintf(buf, len, "ZRLE");        break;
     case rfbEncodingZYWRLE:             snprintf(buf, len, "ZYWRLE");      break;
+    case rfbEncodingH264:               snprintf(buf, len, "H.264");       break;
     case rfbEncodingCache:              snprintf(buf, len, "cache");       break;
     case rfbEncodingCacheEnable:        snprintf(buf, len, "cacheEnable"); break;
     case rfbEncodingXOR_Zlib:           snprintf(buf, len, "xorZlib");     break;
@@ -130,6 +136,8 @@ char *encodingName(uint32_t type, char *buf, int len) {
     case rfbEncodingSupportedMessages:  snprintf(buf, len, "SupportedMessage");  break;
     case rfbEncodingSupportedEncodings: snprintf(buf, len, "SupportedEncoding"); break;
     case rfbEncodingServerIdentity:     snprintf(buf, len, "ServerIdentify");    break;
+    case rfbEncodingFence:              snprintf(buf, len, "Fence");             break;
+    case rfbEncodingContinuousUpdates:  snprintf(buf, len, "ContinuousUpdates"); break;
 
     /* The following lookups do not report in stats */
     case rfbEncodingCompressLevel0: snprintf(buf, len, "CompressLevel0");  break;
@@ -354,6 +362,19 @@ int rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type)
   return 0;
 }
 
+void rfbStatRecordContentClass(rfbClientPtr cl, rfbContentClass contentClass, int w, int h)
+{
+    if (cl==NULL) return;
+    cl->contentClassRects[contentClass]++;
+    cl->contentClassPixels[contentClass] += (unsigned long)w * h;
+}
+
+int rfbStatGetContentClassCount(rfbClientPtr cl, rfbContentClass contentClass)
+{
+    if (cl==NULL) return 0;
+    return cl->contentClassRects[contentClass];
+}
+
 
 
 
@@ -361,6 +382,10 @@ void rfbResetStats(rfbClientPtr cl)
 {
     rfbStatList *ptr;
     if (cl==NULL) return;
+    memset(cl->contentClassRects, 0, sizeof(cl->contentClassRects));
+    memset(cl->contentClassPixels, 0, sizeof(cl->contentClassPixels));
+    cl->videoPixels = 0;
+    cl->framesHeldBack = 0;
     while (cl->statEncList!=NULL)
     {
         ptr = cl->statEncList;
@@ -478,6 +503,21 @@ void rfbPrintStats(rfbClientPtr cl)
         savings = 100.0 - ((totalBytes/totalBytesIfRaw)*100.0);
     rfbLog(" %-20.20s: %6d | %9.0f/%9.0f (%5.1f%%)\n",
             "TOTALS", totalRects, totalBytes,totalBytesIfRaw, savings);
-      
+
+    if (cl->screen->classifyContent) {
+        static const char *className[rfbContentClasses] = {
+            "solid", "text", "photo", "other"
+        };
+        int c;
+
+        rfbLog("%-21.21s  %-6.6s   %9.9s\n", "Content", "rects", "pixels");
+        for (c = 0; c < rfbContentClasses; c++)
+            rfbLog(" %-20.20s: %6d | %9lu\n",
+                   className[c], cl->contentClassRects[c], cl->contentClassPixels[c]);
+    }
+
+    if (cl->screen->detectVideo)
+        rfbLog("Video: %lu pixels at quality %d, %d frames held back\n",
+               cl->videoPixels, cl->videoPolicy.jpegQuality, cl->framesHeldBack);
 } 
 
@@ -42,6 +42,9 @@
 #include <png.h>
 #endif
 #include "turbojpeg.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 /* Note: The following constant should not be changed. */
@@ -52,21 +55,13 @@
 #define MIN_SOLID_SUBRECT_SIZE  2048
 #define MAX_SPLIT_TILE_SIZE       16
 
-/*
- * There is so much access of the Tight encoding static data buffers
- * that we resort to using thread local storage instead of having
- * per-client data.
- */
-#if LIBVNCSERVER_HAVE_LIBPTHREAD && LIBVNCSERVER_HAVE_TLS && !defined(TLS) && defined(__linux__)
-#define TLS __thread
-#endif
-#ifndef TLS
-#define TLS
-#endif
-
-/* This variable is set on every rfbSendRectEncodingTight() call. */
-static TLS rfbBool usePixelFormat24 = FALSE;
+/* Smoothness is estimated from subrows of this many pixels. */
+#define DETECT_SUBROW_WIDTH        7
+#define DETECT_MIN_WIDTH           8
+#define DETECT_MIN_HEIGHT          8
 
+/* Set this to TRUE to never use the gradient filter. */
+rfbBool rfbTightDisableGradient = FALSE;
 
 /* Compression level stuff. The following array contains various
    encoder parameters for each of 10 compression levels (0..9).
@@ -78,13 +73,17 @@ typedef struct TIGHT_CONF_s {
     int idxZlibLevel, monoZlibLevel, rawZlibLevel;
     int idxMaxColorsDivisor;
     int palMaxColorsWithJPEG;
+    /* lossless full-color rectangles this smooth are gradient filtered,
+       a threshold of 0 disables the filter */
+    int gradientMinRectSize, gradientZlibLevel;
+    int gradientThreshold, gradientThreshold24;
 } TIGHT_CONF;
 
 static TIGHT_CONF tightConf[4] = {
-    { 65536, 2048,   6, 0, 0, 0,   4, 24 }, /* 0  (used only without JPEG) */
-    { 65536, 2048,  32, 1, 1, 1,  96, 24 }, /* 1 */
-    { 65536, 2048,  32, 3, 3, 2,  96, 96 }, /* 2  (used only with JPEG) */
-    { 65536, 2048,  32, 7, 7, 5,  96, 256 } /* 9 */
+    { 65536, 2048,   6, 0, 0, 0,   4, 24,     0, 0,   0,   0 }, /* 0  (used only without JPEG) */
+    { 65536, 2048,  32, 1, 1, 1,  96, 24,  4096, 1, 150, 380 }, /* 1 */
+    { 65536, 2048,  32, 3, 3, 2,  96, 96,     0, 0,   0,   0 }, /* 2  (used only with JPEG) */
+    { 65536, 2048,  32, 7, 7, 5,  96, 256, 4096, 6, 200, 500 }  /* 9 */
 };
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
@@ -106,10 +105,6 @@ static TIGHT_PNG_CONF tightPngConf[10] = {
 };
 #endif
 
-static TLS int compressLevel = 1;
-static TLS int qualityLevel = 95;
-static TLS int subsampLevel = TJ_444;
-
 static const int subsampLevel2tjsubsamp[4] = {
     TJ_444, TJ_420, TJ_422, TJ_GRAYSCALE
 };
@@ -134,42 +129,152 @@ typedef struct PALETTE_s {
     COLOR_LIST list[256];
 } PALETTE;
 
-/* TODO: move into rfbScreen struct */
-static TLS int paletteNumColors = 0;
-static TLS int paletteMaxColors = 0;
-static TLS uint32_t monoBackground = 0;
-static TLS uint32_t monoForeground = 0;
-static TLS PALETTE palette;
+/*
+ * Everything the encoder works with besides the zlib streams.  Each client
+ * has one of these, and the copies encoding for it in parallel one per
+ * stream, so any number of Tight encodes can run at once.
+ */
+
+typedef struct _rfbTightContext {
+    /* These are set on every rfbSendRectEncodingTight() call. */
+    int compressLevel;
+    int qualityLevel;
+    int subsampLevel;
+    rfbBool usePixelFormat24;
+    /* what the rectangle given to SendSubrect() holds, if classifying */
+    rfbContentClass contentClass;
+    /* the policy of the area it lies in, see video.c */
+    rfbEncodingPolicy *policy;
 
-/* Pointers to dynamically-allocated buffers. */
+    int paletteNumColors;
+    int paletteMaxColors;
+    uint32_t monoBackground;
+    uint32_t monoForeground;
+    PALETTE palette;
 
-static TLS int tightBeforeBufSize = 0;
-static TLS char *tightBeforeBuf = NULL;
+    /* Pointers to dynamically-allocated buffers. */
 
-static TLS int tightAfterBufSize = 0;
-static TLS char *tightAfterBuf = NULL;
+    int tightBeforeBufSize;
+    char *tightBeforeBuf;
 
-static TLS tjhandle j = NULL;
+    int tightAfterBufSize;
+    char *tightAfterBuf;
 
-void rfbTightCleanup (rfbScreenInfoPtr screen)
+    tjhandle j;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+    int pngDstDataLen;
+#endif
+} rfbTightContext;
+
+/*
+ * Make sure cl->tightContext is there.  The copies encoding in parallel
+ * (see parallel.c) keep theirs in the client they encode for, so it
+ * outlives them.
+ */
+
+static rfbBool
+PrepareContext(rfbClientPtr cl)
+{
+    rfbTightContext **ctxPtr = cl->encodeParent ?
+        &cl->encodeParent->tightCopyContext[cl->encodeStream] : &cl->tightContext;
+
+    if (*ctxPtr == NULL) {
+        *ctxPtr = (rfbTightContext *)calloc(1, sizeof(rfbTightContext));
+        if (*ctxPtr == NULL) {
+            rfbErr("PrepareContext: out of memory\n");
+            return FALSE;
+        }
+    }
+    cl->tightContext = *ctxPtr;
+    return TRUE;
+}
+
+static void
+ReleaseContextMemory(rfbTightContext *ctx)
 {
-    if (tightBeforeBufSize) {
-        free (tightBeforeBuf);
-        tightBeforeBufSize = 0;
-        tightBeforeBuf = NULL;
-    }
-    if (tightAfterBufSize) {
-        free (tightAfterBuf);
-        tightAfterBufSize = 0;
-        tightAfterBuf = NULL;
-    }
-	if (j) {
-		tjDestroy(j);
+    if (ctx == NULL)
+        return;
+    if (ctx->tightBeforeBufSize) {
+        free (ctx->tightBeforeBuf);
+        ctx->tightBeforeBufSize = 0;
+        ctx->tightBeforeBuf = NULL;
+    }
+    if (ctx->tightAfterBufSize) {
+        free (ctx->tightAfterBuf);
+        ctx->tightAfterBufSize = 0;
+        ctx->tightAfterBuf = NULL;
+    }
+	if (ctx->j) {
+		tjDestroy(ctx->j);
 		/* Set freed resource handle to 0! */
-		j = 0;
+		ctx->j = 0;
 	}
 }
 
+static unsigned long
+ContextMemory(rfbTightContext *ctx)
+{
+    if (ctx == NULL)
+        return 0;
+    return sizeof(rfbTightContext) + ctx->tightBeforeBufSize + ctx->tightAfterBufSize;
+}
+
+/*
+ * Returns how many bytes the Tight encoder holds for cl, not counting the
+ * zlib streams and the JPEG compressor.
+ */
+
+unsigned long
+rfbTightMemoryUsage(rfbClientPtr cl)
+{
+    unsigned long total = ContextMemory(cl->tightContext);
+    int i;
+
+    for (i = 0; i < 4; i++)
+        total += ContextMemory(cl->tightCopyContext[i]);
+    return total;
+}
+
+/*
+ * Free the buffers of the Tight encoder of cl; they are allocated again
+ * when needed.  Must not be called while an update is sent to cl.
+ */
+
+void
+rfbTightReleaseMemory(rfbClientPtr cl)
+{
+    int i;
+
+    ReleaseContextMemory(cl->tightContext);
+    for (i = 0; i < 4; i++)
+        ReleaseContextMemory(cl->tightCopyContext[i]);
+}
+
+void
+rfbFreeTightData(rfbClientPtr cl)
+{
+    int i;
+
+    rfbTightReleaseMemory(cl);
+    free(cl->tightContext);
+    cl->tightContext = NULL;
+    for (i = 0; i < 4; i++) {
+        free(cl->tightCopyContext[i]);
+        cl->tightCopyContext[i] = NULL;
+    }
+}
+
+void rfbTightCleanup (rfbScreenInfoPtr screen)
+{
+    rfbClientIteratorPtr i = rfbGetClientIterator(screen);
+    rfbClientPtr cl;
+
+    while ((cl = rfbClientIteratorNext(i)) != NULL)
+        rfbTightReleaseMemory(cl);
+    rfbReleaseClientIterator(i);
+}
+
 
 /* Prototypes for static functions. */
 
@@ -190,6 +295,8 @@ static rfbBool CheckSolidTile32  (rfbClientPtr cl, int x, int y, int w, int h,
                                   uint32_t *colorPtr, rfbBool needSameColor);
 
 static rfbBool SendRectSimple    (rfbClientPtr cl, int x, int y, int w, int h);
+static rfbBool SendClassifiedRects (rfbClientPtr cl, int x, int y, int w, int h);
+static rfbBool SendClassifiedSpan (rfbClientPtr cl, int x, int y, int w, int h);
 static rfbBool SendSubrect       (rfbClientPtr cl, int x, int y, int w, int h);
 static rfbBool SendTightHeader   (rfbClientPtr cl, int x, int y, int w, int h);
 
@@ -197,32 +304,45 @@ static rfbBool SendSolidRect     (rfbClientPtr cl);
 static rfbBool SendMonoRect      (rfbClientPtr cl, int x, int y, int w, int h);
 static rfbBool SendIndexedRect   (rfbClientPtr cl, int x, int y, int w, int h);
 static rfbBool SendFullColorRect (rfbClientPtr cl, int x, int y, int w, int h);
+static rfbBool SendGradientRect  (rfbClientPtr cl, int x, int y, int w, int h);
 
+static int StreamId (rfbClientPtr cl, int streamId);
 static rfbBool CompressData (rfbClientPtr cl, int streamId, int dataLen,
                              int zlibLevel, int zlibStrategy);
+static char ControlByte (rfbClientPtr cl, int compCtl);
 static rfbBool SendCompressedData (rfbClientPtr cl, char *buf,
                                    int compressedLen);
 
-static void FillPalette8 (int count);
-static void FillPalette16 (int count);
-static void FillPalette32 (int count);
+static void FillPalette8 (rfbTightContext *ctx, int count);
+static void FillPalette16 (rfbTightContext *ctx, int count);
+static void FillPalette32 (rfbTightContext *ctx, int count);
 static void FastFillPalette16 (rfbClientPtr cl, uint16_t *data, int w,
                                int pitch, int h);
 static void FastFillPalette32 (rfbClientPtr cl, uint32_t *data, int w,
                                int pitch, int h);
 
-static void PaletteReset (void);
-static int PaletteInsert (uint32_t rgb, int numPixels, int bpp);
+static void PaletteReset (rfbTightContext *ctx);
+static int PaletteInsert (rfbTightContext *ctx, uint32_t rgb, int numPixels,
+                          int bpp);
 
 static void Pack24 (rfbClientPtr cl, char *buf, rfbPixelFormat *fmt,
                     int count);
 
-static void EncodeIndexedRect16 (uint8_t *buf, int count);
-static void EncodeIndexedRect32 (uint8_t *buf, int count);
+static void FilterGradient24 (uint8_t *buf, int w, int h);
+static void FilterGradient16 (rfbClientPtr cl, uint16_t *buf, int w, int h);
+static void FilterGradient32 (rfbClientPtr cl, uint32_t *buf, int w, int h);
+
+static rfbBool DetectSmoothImage (rfbClientPtr cl, int w, int h);
+static unsigned long DetectSmoothImage24 (rfbClientPtr cl, int w, int h);
+static unsigned long DetectSmoothImage16 (rfbClientPtr cl, int w, int h);
+static unsigned long DetectSmoothImage32 (rfbClientPtr cl, int w, int h);
+
+static void EncodeIndexedRect16 (rfbTightContext *ctx, uint8_t *buf, int count);
+static void EncodeIndexedRect32 (rfbTightContext *ctx, uint8_t *buf, int count);
 
-static void EncodeMonoRect8 (uint8_t *buf, int w, int h);
-static void EncodeMonoRect16 (uint8_t *buf, int w, int h);
-static void EncodeMonoRect32 (uint8_t *buf, int w, int h);
+static void EncodeMonoRect8 (rfbTightContext *ctx, uint8_t *buf, int w, int h);
+static void EncodeMonoRect16 (rfbTightContext *ctx, uint8_t *buf, int w, int h);
+static void EncodeMonoRect32 (rfbTightContext *ctx, uint8_t *buf, int w, int h);
 
 static rfbBool SendJpegRect (rfbClientPtr cl, int x, int y, int w, int h,
                              int quality);
@@ -240,6 +360,42 @@ static rfbBool CanSendPngRect(rfbClientPtr cl, int w, int h);
  * Tight encoding implementation.
  */
 
+/* The index into tightConf for the compression level cl asked for. */
+
+static int
+CompressLevel(rfbClientPtr cl)
+{
+    int compressLevel = cl->tightCompressLevel;
+
+    /* We only allow compression levels that have a demonstrable performance
+       benefit.  CL 0 with JPEG reduces CPU usage for workloads that have low
+       numbers of unique colors, but the same thing can be accomplished by
+       using CL 0 without JPEG (AKA "Lossless Tight.")  For those same
+       low-color workloads, CL 2 can provide typically 20-40% better
+       compression than CL 1 (with a commensurate increase in CPU usage.)  For
+       high-color workloads, CL 1 should always be used, as higher compression
+       levels increase CPU usage for these workloads without providing any
+       significant reduction in bandwidth. */
+    if (cl->turboQualityLevel != -1) {
+        if (compressLevel < 1) compressLevel = 1;
+        if (compressLevel > 2) compressLevel = 2;
+    }
+
+    /* With JPEG disabled, CL 2 offers no significant bandwidth savings over
+       CL 1, so we don't include it. */
+    else if (compressLevel > 1) compressLevel = 1;
+
+    /* CL 9 (which maps internally to CL 3) is included mainly for backward
+       compatibility with TightVNC Compression Levels 5-9.  It should be used
+       only in extremely low-bandwidth cases in which it can be shown to have a
+       benefit.  For low-color workloads, it provides typically only 10-20%
+       better compression than CL 2 with JPEG and CL 1 without JPEG, and it
+       uses, on average, twice as much CPU time. */
+    if (cl->tightCompressLevel == 9) compressLevel = 3;
+
+    return compressLevel;
+}
+
 int
 rfbNumCodedRectsTight(rfbClientPtr cl,
                       int x,
@@ -254,9 +410,13 @@ rfbNumCodedRectsTight(rfbClientPtr cl,
        are used to terminate rectangle stream. */
     if (cl->enableLastRectEncoding && w * h >= MIN_SPLIT_RECT_SIZE)
         return 0;
+    /* Classified rectangles are cut along the tiles, too. */
+    if (cl->enableLastRectEncoding &&
+        (cl->screen->classifyContent || cl->screen->detectVideo))
+        return 0;
 
-    maxRectSize = tightConf[compressLevel].maxRectSize;
-    maxRectWidth = tightConf[compressLevel].maxRectWidth;
+    maxRectSize = tightConf[CompressLevel(cl)].maxRectSize;
+    maxRectWidth = tightConf[CompressLevel(cl)].maxRectWidth;
 
     if (w > maxRectWidth || w * h > maxRectSize) {
         subrectMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
@@ -275,6 +435,8 @@ rfbSendRectEncodingTight(rfbClientPtr cl,
                          int w,
                          int h)
 {
+    if (!PrepareContext(cl))
+        return FALSE;
     cl->tightEncoding = rfbEncodingTight;
     return SendRectEncodingTight(cl, x, y, w, h);
 }
@@ -286,6 +448,8 @@ rfbSendRectEncodingTightPng(rfbClientPtr cl,
                          int w,
                          int h)
 {
+    if (!PrepareContext(cl))
+        return FALSE;
     cl->tightEncoding = rfbEncodingTightPng;
     return SendRectEncodingTight(cl, x, y, w, h);
 }
@@ -303,44 +467,20 @@ SendRectEncodingTight(rfbClientPtr cl,
     int dx, dy, dw, dh;
     int x_best, y_best, w_best, h_best;
     char *fbptr;
+    rfbTightContext *ctx = cl->tightContext;
 
     rfbSendUpdateBuf(cl);
 
-    compressLevel = cl->tightCompressLevel;
-    qualityLevel = cl->turboQualityLevel;
-    subsampLevel = cl->turboSubsampLevel;
-
-    /* We only allow compression levels that have a demonstrable performance
-       benefit.  CL 0 with JPEG reduces CPU usage for workloads that have low
-       numbers of unique colors, but the same thing can be accomplished by
-       using CL 0 without JPEG (AKA "Lossless Tight.")  For those same
-       low-color workloads, CL 2 can provide typically 20-40% better
-       compression than CL 1 (with a commensurate increase in CPU usage.)  For
-       high-color workloads, CL 1 should always be used, as higher compression
-       levels increase CPU usage for these workloads without providing any
-       significant reduction in bandwidth. */
-    if (qualityLevel != -1) {
-        if (compressLevel < 1) compressLevel = 1;
-        if (compressLevel > 2) compressLevel = 2;
-    }
-
-    /* With JPEG disabled, CL 2 offers no significant bandwidth savings over
-       CL 1, so we don't include it. */
-    else if (compressLevel > 1) compressLevel = 1;
-
-    /* CL 9 (which maps internally to CL 3) is included mainly for backward
-       compatibility with TightVNC Compression Levels 5-9.  It should be used
-       only in extremely low-bandwidth cases in which it can be shown to have a
-       benefit.  For low-color workloads, it provides typically only 10-20%
-       better compression than CL 2 with JPEG and CL 1 without JPEG, and it
-       uses, on average, twice as much CPU time. */
-    if (cl->tightCompressLevel == 9) compressLevel = 3;
+    ctx->compressLevel = CompressLevel(cl);
+    /* a refinement has to be lossless */
+    ctx->qualityLevel = cl->losslessUpdate ? -1 : cl->turboQualityLevel;
+    ctx->subsampLevel = cl->turboSubsampLevel;
 
     if ( cl->format.depth == 24 && cl->format.redMax == 0xFF &&
          cl->format.greenMax == 0xFF && cl->format.blueMax == 0xFF ) {
-        usePixelFormat24 = TRUE;
+        ctx->usePixelFormat24 = TRUE;
     } else {
-        usePixelFormat24 = FALSE;
+        ctx->usePixelFormat24 = FALSE;
     }
 
     if (!cl->enableLastRectEncoding || w * h < MIN_SPLIT_RECT_SIZE)
@@ -348,13 +488,13 @@ SendRectEncodingTight(rfbClientPtr cl,
 
     /* Make sure we can write at least one pixel into tightBeforeBuf. */
 
-    if (tightBeforeBufSize < 4) {
-        tightBeforeBufSize = 4;
-        if (tightBeforeBuf == NULL)
-            tightBeforeBuf = (char *)malloc(tightBeforeBufSize);
+    if (ctx->tightBeforeBufSize < 4) {
+        ctx->tightBeforeBufSize = 4;
+        if (ctx->tightBeforeBuf == NULL)
+            ctx->tightBeforeBuf = (char *)malloc(ctx->tightBeforeBufSize);
         else
-            tightBeforeBuf = (char *)realloc(tightBeforeBuf,
-                                             tightBeforeBufSize);
+            ctx->tightBeforeBuf = (char *)realloc(ctx->tightBeforeBuf,
+                                                  ctx->tightBeforeBufSize);
     }
 
     /* Calculate maximum number of rows in one non-solid rectangle. */
@@ -362,8 +502,8 @@ SendRectEncodingTight(rfbClientPtr cl,
     {
         int maxRectSize, maxRectWidth, nMaxWidth;
 
-        maxRectSize = tightConf[compressLevel].maxRectSize;
-        maxRectWidth = tightConf[compressLevel].maxRectWidth;
+        maxRectSize = tightConf[ctx->compressLevel].maxRectSize;
+        maxRectWidth = tightConf[ctx->compressLevel].maxRectWidth;
         nMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
         nMaxRows = maxRectSize / nMaxWidth;
     }
@@ -391,7 +531,7 @@ SendRectEncodingTight(rfbClientPtr cl,
 
             if (CheckSolidTile(cl, dx, dy, dw, dh, &colorValue, FALSE)) {
 
-                if (subsampLevel == TJ_GRAYSCALE && qualityLevel != -1) {
+                if (ctx->subsampLevel == TJ_GRAYSCALE && ctx->qualityLevel != -1) {
                     uint32_t r = (colorValue >> 16) & 0xFF;
                     uint32_t g = (colorValue >> 8) & 0xFF;
                     uint32_t b = (colorValue) & 0xFF;
@@ -438,11 +578,16 @@ SendRectEncodingTight(rfbClientPtr cl,
                          (x_best * (cl->scaledScreen->bitsPerPixel / 8)));
 
                 (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-                                   &cl->format, fbptr, tightBeforeBuf,
+                                   &cl->format, fbptr, ctx->tightBeforeBuf,
                                    cl->scaledScreen->paddedWidthInBytes, 1, 1);
 
                 if (!SendSolidRect(cl))
                     return FALSE;
+                /* its color was made gray above */
+                if (ctx->subsampLevel == TJ_GRAYSCALE && ctx->qualityLevel != -1)
+                    rfbMarkRectLossy(cl, x_best, y_best, w_best, h_best);
+                if (cl->screen->classifyContent)
+                    rfbStatRecordContentClass(cl, rfbContentSolid, w_best, h_best);
 
                 /* Send remaining rectangles (at right and bottom). */
 
@@ -622,29 +767,43 @@ SendRectSimple(rfbClientPtr cl, int x, int y, int w, int h)
     int subrectMaxWidth, subrectMaxHeight;
     int dx, dy;
     int rw, rh;
+    rfbTightContext *ctx = cl->tightContext;
 
-    maxRectSize = tightConf[compressLevel].maxRectSize;
-    maxRectWidth = tightConf[compressLevel].maxRectWidth;
+    maxRectSize = tightConf[ctx->compressLevel].maxRectSize;
+    maxRectWidth = tightConf[ctx->compressLevel].maxRectWidth;
 
     maxBeforeSize = maxRectSize * (cl->format.bitsPerPixel / 8);
     maxAfterSize = maxBeforeSize + (maxBeforeSize + 99) / 100 + 12;
 
-    if (tightBeforeBufSize < maxBeforeSize) {
-        tightBeforeBufSize = maxBeforeSize;
-        if (tightBeforeBuf == NULL)
-            tightBeforeBuf = (char *)malloc(tightBeforeBufSize);
+    if (ctx->tightBeforeBufSize < maxBeforeSize) {
+        ctx->tightBeforeBufSize = maxBeforeSize;
+        if (ctx->tightBeforeBuf == NULL)
+            ctx->tightBeforeBuf = (char *)malloc(ctx->tightBeforeBufSize);
         else
-            tightBeforeBuf = (char *)realloc(tightBeforeBuf,
-                                             tightBeforeBufSize);
+            ctx->tightBeforeBuf = (char *)realloc(ctx->tightBeforeBuf,
+                                                  ctx->tightBeforeBufSize);
     }
 
-    if (tightAfterBufSize < maxAfterSize) {
-        tightAfterBufSize = maxAfterSize;
-        if (tightAfterBuf == NULL)
-            tightAfterBuf = (char *)malloc(tightAfterBufSize);
+    if (ctx->tightAfterBufSize < maxAfterSize) {
+        ctx->tightAfterBufSize = maxAfterSize;
+        if (ctx->tightAfterBuf == NULL)
+            ctx->tightAfterBuf = (char *)malloc(ctx->tightAfterBufSize);
         else
-            tightAfterBuf = (char *)realloc(tightAfterBuf,
-                                            tightAfterBufSize);
+            ctx->tightAfterBuf = (char *)realloc(ctx->tightAfterBuf,
+                                                 ctx->tightAfterBufSize);
+    }
+
+    if (cl->enableLastRectEncoding &&
+        (cl->screen->classifyContent || cl->screen->detectVideo))
+        return SendClassifiedRects(cl, x, y, w, h);
+
+    /* the number of rectangles is fixed, classify them as a whole */
+    ctx->policy = rfbPolicyForRect(cl, x, y, w, h);
+    if (ctx->policy == &cl->videoPolicy)
+        cl->videoPixels += (unsigned long)w * h;
+    if (cl->screen->classifyContent) {
+        ctx->contentClass = rfbClassifyRect(cl, x, y, w, h);
+        rfbStatRecordContentClass(cl, ctx->contentClass, w, h);
     }
 
     if (w > maxRectWidth || w * h > maxRectSize) {
@@ -667,6 +826,70 @@ SendRectSimple(rfbClientPtr cl, int x, int y, int w, int h)
     return TRUE;
 }
 
+/*
+ * Cut the rectangle along the tiles of the content classifier, and send
+ * each run of tiles of the same class and policy in a row as one
+ * subrectangle.
+ */
+
+static rfbBool
+SendClassifiedRects(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    rfbTightContext *ctx = cl->tightContext;
+    int maxSpan = tightConf[ctx->compressLevel].maxRectSize / rfbContentTileSize;
+    int dy, dx, bh, tw, spanX, spanW;
+    rfbContentClass tileClass = rfbContentOther;
+    rfbEncodingPolicy *tilePolicy;
+
+    if (maxSpan > tightConf[ctx->compressLevel].maxRectWidth)
+        maxSpan = tightConf[ctx->compressLevel].maxRectWidth;
+
+    for (dy = y; dy < y + h; dy += bh) {
+        bh = rfbContentTileSize - dy % rfbContentTileSize;
+        if (bh > y + h - dy)
+            bh = y + h - dy;
+
+        spanX = x;
+        spanW = 0;
+        for (dx = x; dx < x + w; dx += tw) {
+            tw = rfbContentTileSize - dx % rfbContentTileSize;
+            if (tw > x + w - dx)
+                tw = x + w - dx;
+            if (cl->screen->classifyContent)
+                tileClass = rfbClassifyRect(cl, dx, dy, tw, bh);
+            tilePolicy = rfbPolicyForRect(cl, dx, dy, tw, bh);
+
+            if (spanW > 0 &&
+                (tileClass != ctx->contentClass || tilePolicy != ctx->policy ||
+                 spanW + tw > maxSpan)) {
+                if (!SendClassifiedSpan(cl, spanX, dy, spanW, bh))
+                    return FALSE;
+                spanX = dx;
+                spanW = 0;
+            }
+            ctx->contentClass = tileClass;
+            ctx->policy = tilePolicy;
+            spanW += tw;
+        }
+        if (!SendClassifiedSpan(cl, spanX, dy, spanW, bh))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static rfbBool
+SendClassifiedSpan(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    rfbTightContext *ctx = cl->tightContext;
+
+    if (cl->screen->classifyContent)
+        rfbStatRecordContentClass(cl, ctx->contentClass, w, h);
+    if (ctx->policy == &cl->videoPolicy)
+        cl->videoPixels += (unsigned long)w * h;
+    return SendSubrect(cl, x, y, w, h);
+}
+
 static rfbBool
 SendSubrect(rfbClientPtr cl,
             int x,
@@ -676,6 +899,14 @@ SendSubrect(rfbClientPtr cl,
 {
     char *fbptr;
     rfbBool success = FALSE;
+    rfbTightContext *ctx = cl->tightContext;
+    int quality = ctx->qualityLevel;
+    rfbBool useJpeg = (quality != -1);
+
+    /* the policy of the area may ask for less */
+    if (useJpeg && ctx->policy && ctx->policy->jpegQuality >= 0 &&
+        ctx->policy->jpegQuality < quality)
+        quality = ctx->policy->jpegQuality;
 
     /* Send pending data if there is more than 128 bytes. */
     if (cl->ublen > 128) {
@@ -690,15 +921,24 @@ SendSubrect(rfbClientPtr cl,
              + (cl->scaledScreen->paddedWidthInBytes * y)
              + (x * (cl->scaledScreen->bitsPerPixel / 8)));
 
-    if (subsampLevel == TJ_GRAYSCALE && qualityLevel != -1)
-        return SendJpegRect(cl, x, y, w, h, qualityLevel);
+    if (ctx->subsampLevel == TJ_GRAYSCALE && useJpeg)
+        return SendJpegRect(cl, x, y, w, h, quality);
+
+    /* Text and UI look bad as JPEG, and photos are not worth looking for
+       a palette in. */
+    if (cl->screen->classifyContent) {
+        if (ctx->contentClass == rfbContentPhoto && useJpeg)
+            return SendJpegRect(cl, x, y, w, h, quality);
+        if (ctx->contentClass != rfbContentPhoto)
+            useJpeg = FALSE;
+    }
 
-    paletteMaxColors = w * h / tightConf[compressLevel].idxMaxColorsDivisor;
-    if(qualityLevel != -1)
-        paletteMaxColors = tightConf[compressLevel].palMaxColorsWithJPEG;
-    if ( paletteMaxColors < 2 &&
-         w * h >= tightConf[compressLevel].monoMinRectSize ) {
-        paletteMaxColors = 2;
+    ctx->paletteMaxColors = w * h / tightConf[ctx->compressLevel].idxMaxColorsDivisor;
+    if(useJpeg)
+        ctx->paletteMaxColors = tightConf[ctx->compressLevel].palMaxColorsWithJPEG;
+    if ( ctx->paletteMaxColors < 2 &&
+         w * h >= tightConf[ctx->compressLevel].monoMinRectSize ) {
+        ctx->paletteMaxColors = 2;
     }
 
     if (cl->format.bitsPerPixel == cl->screen->serverFormat.bitsPerPixel &&
@@ -719,35 +959,37 @@ SendSubrect(rfbClientPtr cl,
                               cl->scaledScreen->paddedWidthInBytes / 4, h);
         }
 
-        if(paletteNumColors != 0 || qualityLevel == -1) {
+        if(ctx->paletteNumColors != 0 || !useJpeg) {
             (*cl->translateFn)(cl->translateLookupTable,
                                &cl->screen->serverFormat, &cl->format, fbptr,
-                               tightBeforeBuf,
+                               ctx->tightBeforeBuf,
                                cl->scaledScreen->paddedWidthInBytes, w, h);
         }
     }
     else {
         (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-                           &cl->format, fbptr, tightBeforeBuf,
+                           &cl->format, fbptr, ctx->tightBeforeBuf,
                            cl->scaledScreen->paddedWidthInBytes, w, h);
 
         switch (cl->format.bitsPerPixel) {
         case 8:
-            FillPalette8(w * h);
+            FillPalette8(ctx, w * h);
             break;
         case 16:
-            FillPalette16(w * h);
+            FillPalette16(ctx, w * h);
             break;
         default:
-            FillPalette32(w * h);
+            FillPalette32(ctx, w * h);
         }
     }
 
-    switch (paletteNumColors) {
+    switch (ctx->paletteNumColors) {
     case 0:
         /* Truecolor image */
-        if (qualityLevel != -1) {
-            success = SendJpegRect(cl, x, y, w, h, qualityLevel);
+        if (useJpeg) {
+            success = SendJpegRect(cl, x, y, w, h, quality);
+        } else if (DetectSmoothImage(cl, w, h)) {
+            success = SendGradientRect(cl, x, y, w, h);
         } else {
             success = SendFullColorRect(cl, x, y, w, h);
         }
@@ -806,10 +1048,11 @@ SendTightHeader(rfbClientPtr cl,
 static rfbBool
 SendSolidRect(rfbClientPtr cl)
 {
+    rfbTightContext *ctx = cl->tightContext;
     int len;
 
-    if (usePixelFormat24) {
-        Pack24(cl, tightBeforeBuf, &cl->format, 1);
+    if (ctx->usePixelFormat24) {
+        Pack24(cl, ctx->tightBeforeBuf, &cl->format, 1);
         len = 3;
     } else
         len = cl->format.bitsPerPixel / 8;
@@ -819,8 +1062,8 @@ SendSolidRect(rfbClientPtr cl)
             return FALSE;
     }
 
-    cl->updateBuf[cl->ublen++] = (char)(rfbTightFill << 4);
-    memcpy (&cl->updateBuf[cl->ublen], tightBeforeBuf, len);
+    cl->updateBuf[cl->ublen++] = ControlByte(cl, rfbTightFill << 4);
+    memcpy (&cl->updateBuf[cl->ublen], ctx->tightBeforeBuf, len);
     cl->ublen += len;
 
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, len + 1);
@@ -835,7 +1078,8 @@ SendMonoRect(rfbClientPtr cl,
              int w,
              int h)
 {
-    int streamId = 1;
+    rfbTightContext *ctx = cl->tightContext;
+    int streamId = StreamId(cl, 1);
     int paletteLen, dataLen;
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
@@ -856,12 +1100,12 @@ SendMonoRect(rfbClientPtr cl,
     dataLen = (w + 7) / 8;
     dataLen *= h;
 
-    if (tightConf[compressLevel].monoZlibLevel == 0 &&
+    if (tightConf[ctx->compressLevel].monoZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
         cl->updateBuf[cl->ublen++] =
-            (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
+            ControlByte(cl, (rfbTightNoZlib | rfbTightExplicitFilter) << 4);
     else
-        cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
+        cl->updateBuf[cl->ublen++] = ControlByte(cl, (streamId | rfbTightExplicitFilter) << 4);
     cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
     cl->updateBuf[cl->ublen++] = 1;
 
@@ -869,42 +1113,42 @@ SendMonoRect(rfbClientPtr cl,
     switch (cl->format.bitsPerPixel) {
 
     case 32:
-        EncodeMonoRect32((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect32(ctx, (uint8_t *)ctx->tightBeforeBuf, w, h);
 
-        ((uint32_t *)tightAfterBuf)[0] = monoBackground;
-        ((uint32_t *)tightAfterBuf)[1] = monoForeground;
-        if (usePixelFormat24) {
-            Pack24(cl, tightAfterBuf, &cl->format, 2);
+        ((uint32_t *)ctx->tightAfterBuf)[0] = ctx->monoBackground;
+        ((uint32_t *)ctx->tightAfterBuf)[1] = ctx->monoForeground;
+        if (ctx->usePixelFormat24) {
+            Pack24(cl, ctx->tightAfterBuf, &cl->format, 2);
             paletteLen = 6;
         } else
             paletteLen = 8;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteLen);
+        memcpy(&cl->updateBuf[cl->ublen], ctx->tightAfterBuf, paletteLen);
         cl->ublen += paletteLen;
         rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 3 + paletteLen);
         break;
 
     case 16:
-        EncodeMonoRect16((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect16(ctx, (uint8_t *)ctx->tightBeforeBuf, w, h);
 
-        ((uint16_t *)tightAfterBuf)[0] = (uint16_t)monoBackground;
-        ((uint16_t *)tightAfterBuf)[1] = (uint16_t)monoForeground;
+        ((uint16_t *)ctx->tightAfterBuf)[0] = (uint16_t)ctx->monoBackground;
+        ((uint16_t *)ctx->tightAfterBuf)[1] = (uint16_t)ctx->monoForeground;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, 4);
+        memcpy(&cl->updateBuf[cl->ublen], ctx->tightAfterBuf, 4);
         cl->ublen += 4;
         rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 7);
         break;
 
     default:
-        EncodeMonoRect8((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect8(ctx, (uint8_t *)ctx->tightBeforeBuf, w, h);
 
-        cl->updateBuf[cl->ublen++] = (char)monoBackground;
-        cl->updateBuf[cl->ublen++] = (char)monoForeground;
+        cl->updateBuf[cl->ublen++] = (char)ctx->monoBackground;
+        cl->updateBuf[cl->ublen++] = (char)ctx->monoForeground;
         rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 5);
     }
 
     return CompressData(cl, streamId, dataLen,
-                        tightConf[compressLevel].monoZlibLevel,
+                        tightConf[ctx->compressLevel].monoZlibLevel,
                         Z_DEFAULT_STRATEGY);
 }
 
@@ -915,7 +1159,8 @@ SendIndexedRect(rfbClientPtr cl,
                 int w,
                 int h)
 {
-    int streamId = 2;
+    rfbTightContext *ctx = cl->tightContext;
+    int streamId = StreamId(cl, 2);
     int i, entryLen;
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
@@ -925,57 +1170,57 @@ SendIndexedRect(rfbClientPtr cl,
 #endif
 
     if ( cl->ublen + TIGHT_MIN_TO_COMPRESS + 6 +
-	 paletteNumColors * cl->format.bitsPerPixel / 8 >
+	 ctx->paletteNumColors * cl->format.bitsPerPixel / 8 >
          UPDATE_BUF_SIZE ) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
 
     /* Prepare tight encoding header. */
-    if (tightConf[compressLevel].idxZlibLevel == 0 &&
+    if (tightConf[ctx->compressLevel].idxZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
         cl->updateBuf[cl->ublen++] =
-            (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
+            ControlByte(cl, (rfbTightNoZlib | rfbTightExplicitFilter) << 4);
     else
-        cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
+        cl->updateBuf[cl->ublen++] = ControlByte(cl, (streamId | rfbTightExplicitFilter) << 4);
     cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
-    cl->updateBuf[cl->ublen++] = (char)(paletteNumColors - 1);
+    cl->updateBuf[cl->ublen++] = (char)(ctx->paletteNumColors - 1);
 
     /* Prepare palette, convert image. */
     switch (cl->format.bitsPerPixel) {
 
     case 32:
-        EncodeIndexedRect32((uint8_t *)tightBeforeBuf, w * h);
+        EncodeIndexedRect32(ctx, (uint8_t *)ctx->tightBeforeBuf, w * h);
 
-        for (i = 0; i < paletteNumColors; i++) {
-            ((uint32_t *)tightAfterBuf)[i] =
-                palette.entry[i].listNode->rgb;
+        for (i = 0; i < ctx->paletteNumColors; i++) {
+            ((uint32_t *)ctx->tightAfterBuf)[i] =
+                ctx->palette.entry[i].listNode->rgb;
         }
-        if (usePixelFormat24) {
-            Pack24(cl, tightAfterBuf, &cl->format, paletteNumColors);
+        if (ctx->usePixelFormat24) {
+            Pack24(cl, ctx->tightAfterBuf, &cl->format, ctx->paletteNumColors);
             entryLen = 3;
         } else
             entryLen = 4;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf,
-               paletteNumColors * entryLen);
-        cl->ublen += paletteNumColors * entryLen;
+        memcpy(&cl->updateBuf[cl->ublen], ctx->tightAfterBuf,
+               ctx->paletteNumColors * entryLen);
+        cl->ublen += ctx->paletteNumColors * entryLen;
         rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding,
-                                     3 + paletteNumColors * entryLen);
+                                     3 + ctx->paletteNumColors * entryLen);
         break;
 
     case 16:
-        EncodeIndexedRect16((uint8_t *)tightBeforeBuf, w * h);
+        EncodeIndexedRect16(ctx, (uint8_t *)ctx->tightBeforeBuf, w * h);
 
-        for (i = 0; i < paletteNumColors; i++) {
-            ((uint16_t *)tightAfterBuf)[i] =
-                (uint16_t)palette.entry[i].listNode->rgb;
+        for (i = 0; i < ctx->paletteNumColors; i++) {
+            ((uint16_t *)ctx->tightAfterBuf)[i] =
+                (uint16_t)ctx->palette.entry[i].listNode->rgb;
         }
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteNumColors * 2);
-        cl->ublen += paletteNumColors * 2;
+        memcpy(&cl->updateBuf[cl->ublen], ctx->tightAfterBuf, ctx->paletteNumColors * 2);
+        cl->ublen += ctx->paletteNumColors * 2;
         rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding,
-                                     3 + paletteNumColors * 2);
+                                     3 + ctx->paletteNumColors * 2);
         break;
 
     default:
@@ -983,7 +1228,7 @@ SendIndexedRect(rfbClientPtr cl,
     }
 
     return CompressData(cl, streamId, w * h,
-                        tightConf[compressLevel].idxZlibLevel,
+                        tightConf[ctx->compressLevel].idxZlibLevel,
                         Z_DEFAULT_STRATEGY);
 }
 
@@ -994,7 +1239,8 @@ SendFullColorRect(rfbClientPtr cl,
                   int w,
                   int h)
 {
-    int streamId = 0;
+    rfbTightContext *ctx = cl->tightContext;
+    int streamId = StreamId(cl, 0);
     int len;
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
@@ -1008,24 +1254,106 @@ SendFullColorRect(rfbClientPtr cl,
             return FALSE;
     }
 
-    if (tightConf[compressLevel].rawZlibLevel == 0 &&
+    if (tightConf[ctx->compressLevel].rawZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
-        cl->updateBuf[cl->ublen++] = (char)(rfbTightNoZlib << 4);
+        cl->updateBuf[cl->ublen++] = ControlByte(cl, rfbTightNoZlib << 4);
     else
-        cl->updateBuf[cl->ublen++] = 0x00;  /* stream id = 0, no flushing, no filter */
+        cl->updateBuf[cl->ublen++] = ControlByte(cl, streamId << 4);  /* no flushing, no filter */
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
-    if (usePixelFormat24) {
-        Pack24(cl, tightBeforeBuf, &cl->format, w * h);
+    if (ctx->usePixelFormat24) {
+        Pack24(cl, ctx->tightBeforeBuf, &cl->format, w * h);
         len = 3;
     } else
         len = cl->format.bitsPerPixel / 8;
 
     return CompressData(cl, streamId, w * h * len,
-                        tightConf[compressLevel].rawZlibLevel,
+                        tightConf[ctx->compressLevel].rawZlibLevel,
                         Z_DEFAULT_STRATEGY);
 }
 
+static rfbBool
+SendGradientRect(rfbClientPtr cl,
+                 int x,
+                 int y,
+                 int w,
+                 int h)
+{
+    rfbTightContext *ctx = cl->tightContext;
+    int streamId = StreamId(cl, 3);
+    int len;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+    if (CanSendPngRect(cl, w, h)) {
+        return SendPngRect(cl, x, y, w, h);
+    }
+#endif
+
+    if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 2 > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    cl->updateBuf[cl->ublen++] = ControlByte(cl, (streamId | rfbTightExplicitFilter) << 4);
+    cl->updateBuf[cl->ublen++] = rfbTightFilterGradient;
+    rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 2);
+
+    if (ctx->usePixelFormat24) {
+        Pack24(cl, ctx->tightBeforeBuf, &cl->format, w * h);
+        FilterGradient24((uint8_t *)ctx->tightBeforeBuf, w, h);
+        len = 3;
+    } else if (cl->format.bitsPerPixel == 32) {
+        FilterGradient32(cl, (uint32_t *)ctx->tightBeforeBuf, w, h);
+        len = 4;
+    } else {
+        FilterGradient16(cl, (uint16_t *)ctx->tightBeforeBuf, w, h);
+        len = 2;
+    }
+
+    return CompressData(cl, streamId, w * h * len,
+                        tightConf[ctx->compressLevel].gradientZlibLevel,
+                        Z_FILTERED);
+}
+
+/*
+ * Make the client start all four zlib streams afresh with the next
+ * subrectangle, so that what follows can be decoded without knowing
+ * anything sent before.  The encode-once cache relies on this.
+ */
+
+void
+rfbTightResetStreams(rfbClientPtr cl)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (cl->zsActive[i])
+            deflateReset(&cl->zsStruct[i]);
+    }
+    cl->zsResetPending = 0x0F;
+}
+
+/*
+ * The copies of a client encoding parts of an update in parallel (see
+ * parallel.c) each use one stream of their own, whatever the subencoding.
+ */
+
+static int
+StreamId(rfbClientPtr cl, int streamId)
+{
+    return cl->encodeParent ? cl->encodeStream : streamId;
+}
+
+/* Add any pending stream reset bits to a compression control byte. */
+
+static char
+ControlByte(rfbClientPtr cl, int compCtl)
+{
+    compCtl |= cl->zsResetPending;
+    cl->zsResetPending = 0;
+    return (char)compCtl;
+}
+
 static rfbBool
 CompressData(rfbClientPtr cl,
              int streamId,
@@ -1033,23 +1361,26 @@ CompressData(rfbClientPtr cl,
              int zlibLevel,
              int zlibStrategy)
 {
+    /* the streams live in the client, not in its copies */
+    rfbClientPtr owner = cl->encodeParent ? cl->encodeParent : cl;
+    rfbTightContext *ctx = cl->tightContext;
     z_streamp pz;
     int err;
 
     if (dataLen < TIGHT_MIN_TO_COMPRESS) {
-        memcpy(&cl->updateBuf[cl->ublen], tightBeforeBuf, dataLen);
+        memcpy(&cl->updateBuf[cl->ublen], ctx->tightBeforeBuf, dataLen);
         cl->ublen += dataLen;
         rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, dataLen);
         return TRUE;
     }
 
     if (zlibLevel == 0)
-        return SendCompressedData (cl, tightBeforeBuf, dataLen);
+        return SendCompressedData (cl, ctx->tightBeforeBuf, dataLen);
 
-    pz = &cl->zsStruct[streamId];
+    pz = &owner->zsStruct[streamId];
 
     /* Initialize compression stream if needed. */
-    if (!cl->zsActive[streamId]) {
+    if (!owner->zsActive[streamId]) {
         pz->zalloc = Z_NULL;
         pz->zfree = Z_NULL;
         pz->opaque = Z_NULL;
@@ -1059,22 +1390,22 @@ CompressData(rfbClientPtr cl,
         if (err != Z_OK)
             return FALSE;
 
-        cl->zsActive[streamId] = TRUE;
-        cl->zsLevel[streamId] = zlibLevel;
+        owner->zsActive[streamId] = TRUE;
+        owner->zsLevel[streamId] = zlibLevel;
     }
 
     /* Prepare buffer pointers. */
-    pz->next_in = (Bytef *)tightBeforeBuf;
+    pz->next_in = (Bytef *)ctx->tightBeforeBuf;
     pz->avail_in = dataLen;
-    pz->next_out = (Bytef *)tightAfterBuf;
-    pz->avail_out = tightAfterBufSize;
+    pz->next_out = (Bytef *)ctx->tightAfterBuf;
+    pz->avail_out = ctx->tightAfterBufSize;
 
     /* Change compression parameters if needed. */
-    if (zlibLevel != cl->zsLevel[streamId]) {
+    if (zlibLevel != owner->zsLevel[streamId]) {
         if (deflateParams (pz, zlibLevel, zlibStrategy) != Z_OK) {
             return FALSE;
         }
-        cl->zsLevel[streamId] = zlibLevel;
+        owner->zsLevel[streamId] = zlibLevel;
     }
 
     /* Actual compression. */
@@ -1083,8 +1414,8 @@ CompressData(rfbClientPtr cl,
         return FALSE;
     }
 
-    return SendCompressedData(cl, tightAfterBuf,
-                              tightAfterBufSize - pz->avail_out);
+    return SendCompressedData(cl, ctx->tightAfterBuf,
+                              ctx->tightAfterBufSize - pz->avail_out);
 }
 
 static rfbBool SendCompressedData(rfbClientPtr cl, char *buf,
@@ -1105,6 +1436,12 @@ static rfbBool SendCompressedData(rfbClientPtr cl, char *buf,
         }
     }
 
+    /* big ones are written from buf, before the next rectangle reuses it */
+    if (compressedLen >= UPDATE_BUF_SIZE && rfbOutputCanReference(cl, compressedLen)) {
+        rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, compressedLen);
+        return rfbOutputQueueReference(cl, buf, compressedLen) && rfbOutputWrite(cl);
+    }
+
     portionLen = UPDATE_BUF_SIZE;
     for (i = 0; i < compressedLen; i += portionLen) {
         if (i + portionLen > compressedLen) {
@@ -1128,22 +1465,22 @@ static rfbBool SendCompressedData(rfbClientPtr cl, char *buf,
  */
 
 static void
-FillPalette8(int count)
+FillPalette8(rfbTightContext *ctx, int count)
 {
-    uint8_t *data = (uint8_t *)tightBeforeBuf;
+    uint8_t *data = (uint8_t *)ctx->tightBeforeBuf;
     uint8_t c0, c1;
     int i, n0, n1;
 
-    paletteNumColors = 0;
+    ctx->paletteNumColors = 0;
 
     c0 = data[0];
     for (i = 1; i < count && data[i] == c0; i++);
     if (i == count) {
-        paletteNumColors = 1;
+        ctx->paletteNumColors = 1;
         return;                 /* Solid rectangle */
     }
 
-    if (paletteMaxColors < 2)
+    if (ctx->paletteMaxColors < 2)
         return;
 
     n0 = i;
@@ -1159,13 +1496,13 @@ FillPalette8(int count)
     }
     if (i == count) {
         if (n0 > n1) {
-            monoBackground = (uint32_t)c0;
-            monoForeground = (uint32_t)c1;
+            ctx->monoBackground = (uint32_t)c0;
+            ctx->monoForeground = (uint32_t)c1;
         } else {
-            monoBackground = (uint32_t)c1;
-            monoForeground = (uint32_t)c0;
+            ctx->monoBackground = (uint32_t)c1;
+            ctx->monoForeground = (uint32_t)c0;
         }
-        paletteNumColors = 2;   /* Two colors */
+        ctx->paletteNumColors = 2;   /* Two colors */
     }
 }
 
@@ -1173,20 +1510,20 @@ FillPalette8(int count)
 #define DEFINE_FILL_PALETTE_FUNCTION(bpp)                               \
                                                                         \
 static void                                                             \
-FillPalette##bpp(int count) {                                           \
-    uint##bpp##_t *data = (uint##bpp##_t *)tightBeforeBuf;              \
+FillPalette##bpp(rfbTightContext *ctx, int count) {                     \
+    uint##bpp##_t *data = (uint##bpp##_t *)ctx->tightBeforeBuf;         \
     uint##bpp##_t c0, c1, ci;                                           \
     int i, n0, n1, ni;                                                  \
                                                                         \
     c0 = data[0];                                                       \
     for (i = 1; i < count && data[i] == c0; i++);                       \
     if (i >= count) {                                                   \
-        paletteNumColors = 1;   /* Solid rectangle */                   \
+        ctx->paletteNumColors = 1;   /* Solid rectangle */              \
         return;                                                         \
     }                                                                   \
                                                                         \
-    if (paletteMaxColors < 2) {                                         \
-        paletteNumColors = 0;   /* Full-color encoding preferred */     \
+    if (ctx->paletteMaxColors < 2) {                                    \
+        ctx->paletteNumColors = 0;   /* Full-color encoding preferred */ \
         return;                                                         \
     }                                                                   \
                                                                         \
@@ -1204,32 +1541,32 @@ FillPalette##bpp(int count) {                                           \
     }                                                                   \
     if (i >= count) {                                                   \
         if (n0 > n1) {                                                  \
-            monoBackground = (uint32_t)c0;                              \
-            monoForeground = (uint32_t)c1;                              \
+            ctx->monoBackground = (uint32_t)c0;                         \
+            ctx->monoForeground = (uint32_t)c1;                         \
         } else {                                                        \
-            monoBackground = (uint32_t)c1;                              \
-            monoForeground = (uint32_t)c0;                              \
+            ctx->monoBackground = (uint32_t)c1;                         \
+            ctx->monoForeground = (uint32_t)c0;                         \
         }                                                               \
-        paletteNumColors = 2;   /* Two colors */                        \
+        ctx->paletteNumColors = 2;   /* Two colors */                   \
         return;                                                         \
     }                                                                   \
                                                                         \
-    PaletteReset();                                                     \
-    PaletteInsert (c0, (uint32_t)n0, bpp);                              \
-    PaletteInsert (c1, (uint32_t)n1, bpp);                              \
+    PaletteReset(ctx);                                                  \
+    PaletteInsert (ctx, c0, (uint32_t)n0, bpp);                         \
+    PaletteInsert (ctx, c1, (uint32_t)n1, bpp);                         \
                                                                         \
     ni = 1;                                                             \
     for (i++; i < count; i++) {                                         \
         if (data[i] == ci) {                                            \
             ni++;                                                       \
         } else {                                                        \
-            if (!PaletteInsert (ci, (uint32_t)ni, bpp))                 \
+            if (!PaletteInsert (ctx, ci, (uint32_t)ni, bpp))            \
                 return;                                                 \
             ci = data[i];                                               \
             ni = 1;                                                     \
         }                                                               \
     }                                                                   \
-    PaletteInsert (ci, (uint32_t)ni, bpp);                              \
+    PaletteInsert (ctx, ci, (uint32_t)ni, bpp);                         \
 }
 
 DEFINE_FILL_PALETTE_FUNCTION(16)
@@ -1241,6 +1578,7 @@ static void                                                             \
 FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
                      int pitch, int h)                                  \
 {                                                                       \
+    rfbTightContext *ctx = cl->tightContext;                            \
     uint##bpp##_t c0, c1, ci, mask, c0t, c1t, cit;                      \
     int i, j, i2 = 0, j2, n0, n1, ni;                                   \
                                                                         \
@@ -1262,11 +1600,11 @@ FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
     }                                                                   \
     done:                                                               \
     if (j >= h) {                                                       \
-        paletteNumColors = 1;   /* Solid rectangle */                   \
+        ctx->paletteNumColors = 1;   /* Solid rectangle */              \
         return;                                                         \
     }                                                                   \
-    if (paletteMaxColors < 2) {                                         \
-        paletteNumColors = 0;   /* Full-color encoding preferred */     \
+    if (ctx->paletteMaxColors < 2) {                                    \
+        ctx->paletteNumColors = 0;   /* Full-color encoding preferred */ \
         return;                                                         \
     }                                                                   \
                                                                         \
@@ -1295,19 +1633,19 @@ FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
                        (char *)&c1, (char *)&c1t, bpp/8, 1, 1);         \
     if (j2 >= h) {                                                      \
         if (n0 > n1) {                                                  \
-            monoBackground = (uint32_t)c0t;                             \
-            monoForeground = (uint32_t)c1t;                             \
+            ctx->monoBackground = (uint32_t)c0t;                        \
+            ctx->monoForeground = (uint32_t)c1t;                        \
         } else {                                                        \
-            monoBackground = (uint32_t)c1t;                             \
-            monoForeground = (uint32_t)c0t;                             \
+            ctx->monoBackground = (uint32_t)c1t;                        \
+            ctx->monoForeground = (uint32_t)c0t;                        \
         }                                                               \
-        paletteNumColors = 2;   /* Two colors */                        \
+        ctx->paletteNumColors = 2;   /* Two colors */                   \
         return;                                                         \
     }                                                                   \
                                                                         \
-    PaletteReset();                                                     \
-    PaletteInsert (c0t, (uint32_t)n0, bpp);                             \
-    PaletteInsert (c1t, (uint32_t)n1, bpp);                             \
+    PaletteReset(ctx);                                                  \
+    PaletteInsert (ctx, c0t, (uint32_t)n0, bpp);                        \
+    PaletteInsert (ctx, c1t, (uint32_t)n1, bpp);                        \
                                                                         \
     ni = 1;                                                             \
     i2++;  if (i2 >= w) {i2 = 0;  j2++;}                                \
@@ -1320,7 +1658,7 @@ FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
                                    &cl->screen->serverFormat,           \
                                    &cl->format, (char *)&ci,            \
                                    (char *)&cit, bpp/8, 1, 1);          \
-                if (!PaletteInsert (cit, (uint32_t)ni, bpp))            \
+                if (!PaletteInsert (ctx, cit, (uint32_t)ni, bpp))       \
                     return;                                             \
                 ci = data[j * pitch + i] & mask;                        \
                 ni = 1;                                                 \
@@ -1332,7 +1670,7 @@ FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
     (*cl->translateFn)(cl->translateLookupTable,                        \
                        &cl->screen->serverFormat, &cl->format,          \
                        (char *)&ci, (char *)&cit, bpp/8, 1, 1);         \
-    PaletteInsert (cit, (uint32_t)ni, bpp);                             \
+    PaletteInsert (ctx, cit, (uint32_t)ni, bpp);                        \
 }
 
 DEFINE_FAST_FILL_PALETTE_FUNCTION(16)
@@ -1348,15 +1686,16 @@ DEFINE_FAST_FILL_PALETTE_FUNCTION(32)
 
 
 static void
-PaletteReset(void)
+PaletteReset(rfbTightContext *ctx)
 {
-    paletteNumColors = 0;
-    memset(palette.hash, 0, 256 * sizeof(COLOR_LIST *));
+    ctx->paletteNumColors = 0;
+    memset(ctx->palette.hash, 0, 256 * sizeof(COLOR_LIST *));
 }
 
 
 static int
-PaletteInsert(uint32_t rgb,
+PaletteInsert(rfbTightContext *ctx,
+              uint32_t rgb,
               int numPixels,
               int bpp)
 {
@@ -1366,58 +1705,58 @@ PaletteInsert(uint32_t rgb,
 
     hash_key = (bpp == 16) ? HASH_FUNC16(rgb) : HASH_FUNC32(rgb);
 
-    pnode = palette.hash[hash_key];
+    pnode = ctx->palette.hash[hash_key];
 
     while (pnode != NULL) {
         if (pnode->rgb == rgb) {
             /* Such palette entry already exists. */
             new_idx = idx = pnode->idx;
-            count = palette.entry[idx].numPixels + numPixels;
-            if (new_idx && palette.entry[new_idx-1].numPixels < count) {
+            count = ctx->palette.entry[idx].numPixels + numPixels;
+            if (new_idx && ctx->palette.entry[new_idx-1].numPixels < count) {
                 do {
-                    palette.entry[new_idx] = palette.entry[new_idx-1];
-                    palette.entry[new_idx].listNode->idx = new_idx;
+                    ctx->palette.entry[new_idx] = ctx->palette.entry[new_idx-1];
+                    ctx->palette.entry[new_idx].listNode->idx = new_idx;
                     new_idx--;
                 }
-                while (new_idx && palette.entry[new_idx-1].numPixels < count);
-                palette.entry[new_idx].listNode = pnode;
+                while (new_idx && ctx->palette.entry[new_idx-1].numPixels < count);
+                ctx->palette.entry[new_idx].listNode = pnode;
                 pnode->idx = new_idx;
             }
-            palette.entry[new_idx].numPixels = count;
-            return paletteNumColors;
+            ctx->palette.entry[new_idx].numPixels = count;
+            return ctx->paletteNumColors;
         }
         prev_pnode = pnode;
         pnode = pnode->next;
     }
 
     /* Check if palette is full. */
-    if (paletteNumColors == 256 || paletteNumColors == paletteMaxColors) {
-        paletteNumColors = 0;
+    if (ctx->paletteNumColors == 256 || ctx->paletteNumColors == ctx->paletteMaxColors) {
+        ctx->paletteNumColors = 0;
         return 0;
     }
 
     /* Move palette entries with lesser pixel counts. */
-    for ( idx = paletteNumColors;
-          idx > 0 && palette.entry[idx-1].numPixels < numPixels;
+    for ( idx = ctx->paletteNumColors;
+          idx > 0 && ctx->palette.entry[idx-1].numPixels < numPixels;
           idx-- ) {
-        palette.entry[idx] = palette.entry[idx-1];
-        palette.entry[idx].listNode->idx = idx;
+        ctx->palette.entry[idx] = ctx->palette.entry[idx-1];
+        ctx->palette.entry[idx].listNode->idx = idx;
     }
 
     /* Add new palette entry into the freed slot. */
-    pnode = &palette.list[paletteNumColors];
+    pnode = &ctx->palette.list[ctx->paletteNumColors];
     if (prev_pnode != NULL) {
         prev_pnode->next = pnode;
     } else {
-        palette.hash[hash_key] = pnode;
+        ctx->palette.hash[hash_key] = pnode;
     }
     pnode->next = NULL;
     pnode->idx = idx;
     pnode->rgb = rgb;
-    palette.entry[idx].listNode = pnode;
-    palette.entry[idx].numPixels = numPixels;
+    ctx->palette.entry[idx].listNode = pnode;
+    ctx->palette.entry[idx].numPixels = numPixels;
 
-    return (++paletteNumColors);
+    return (++ctx->paletteNumColors);
 }
 
 
@@ -1457,6 +1796,259 @@ static void Pack24(rfbClientPtr cl,
 }
 
 
+/*
+ * Gradient filter: every color sample is replaced by its difference to
+ * left + above - above-left, clamped to the sample range, with samples
+ * outside the rectangle taken as 0.  The prediction uses the original
+ * samples only, so the rows are filtered in place from the last sample
+ * backwards, and all samples of a row can be done at once.
+ */
+
+/* The samples of w*h packed 24 bit pixels, red, green and blue bytes. */
+
+static void
+FilterGradient24(uint8_t *buf, int w, int h)
+{
+    int rowLen = w * 3;
+    int y, k, est;
+
+    for (y = h - 1; y >= 0; y--) {
+        uint8_t *row = buf + y * rowLen;
+        uint8_t *prev = y > 0 ? row - rowLen : NULL;
+
+        k = rowLen;
+#ifdef __SSE2__
+        {
+            const __m128i zero = _mm_setzero_si128();
+
+            /* 16 samples at a time; packus clamps the estimates to 0..255 */
+            while (k - 16 >= 3) {
+                __m128i cur, left, up, upLeft, lo, hi;
+
+                k -= 16;
+                cur = _mm_loadu_si128((const __m128i *)(row + k));
+                left = _mm_loadu_si128((const __m128i *)(row + k - 3));
+                up = prev ? _mm_loadu_si128((const __m128i *)(prev + k)) : zero;
+                upLeft = prev ? _mm_loadu_si128((const __m128i *)(prev + k - 3)) : zero;
+                lo = _mm_sub_epi16(_mm_add_epi16(_mm_unpacklo_epi8(left, zero),
+                                                 _mm_unpacklo_epi8(up, zero)),
+                                   _mm_unpacklo_epi8(upLeft, zero));
+                hi = _mm_sub_epi16(_mm_add_epi16(_mm_unpackhi_epi8(left, zero),
+                                                 _mm_unpackhi_epi8(up, zero)),
+                                   _mm_unpackhi_epi8(upLeft, zero));
+                _mm_storeu_si128((__m128i *)(row + k),
+                                 _mm_sub_epi8(cur, _mm_packus_epi16(lo, hi)));
+            }
+        }
+#endif
+        while (k-- > 0) {
+            est = (k >= 3 ? row[k - 3] : 0) + (prev ? prev[k] : 0)
+                - (prev && k >= 3 ? prev[k - 3] : 0);
+            if (est > 0xFF)
+                est = 0xFF;
+            else if (est < 0)
+                est = 0;
+            row[k] = (uint8_t)(row[k] - est);
+        }
+    }
+}
+
+#define DEFINE_GRADIENT_FILTER_FUNCTION(bpp)                            \
+                                                                        \
+static void                                                             \
+FilterGradient##bpp(rfbClientPtr cl, uint##bpp##_t *buf, int w, int h)  \
+{                                                                       \
+    rfbPixelFormat *fmt = &cl->format;                                  \
+    rfbBool endianMismatch =                                            \
+        (!cl->screen->serverFormat.bigEndian != !fmt->bigEndian);       \
+    int maxColor[3], shiftBits[3];                                      \
+    uint##bpp##_t pix, diff;                                            \
+    int sample[4], x, y, c, est;                                        \
+                                                                        \
+    maxColor[0] = fmt->redMax;                                          \
+    maxColor[1] = fmt->greenMax;                                        \
+    maxColor[2] = fmt->blueMax;                                         \
+    shiftBits[0] = fmt->redShift;                                       \
+    shiftBits[1] = fmt->greenShift;                                     \
+    shiftBits[2] = fmt->blueShift;                                      \
+                                                                        \
+    for (y = h - 1; y >= 0; y--) {                                      \
+        for (x = w - 1; x >= 0; x--) {                                  \
+            uint##bpp##_t p[4];                                         \
+                                                                        \
+            /* this, left, up and up-left pixel */                      \
+            p[0] = buf[y * w + x];                                      \
+            p[1] = x > 0 ? buf[y * w + x - 1] : 0;                      \
+            p[2] = y > 0 ? buf[(y - 1) * w + x] : 0;                    \
+            p[3] = x > 0 && y > 0 ? buf[(y - 1) * w + x - 1] : 0;       \
+            diff = 0;                                                   \
+            for (c = 0; c < 3; c++) {                                   \
+                int i;                                                  \
+                for (i = 0; i < 4; i++) {                               \
+                    pix = endianMismatch ? Swap##bpp(p[i]) : p[i];      \
+                    sample[i] = (int)(pix >> shiftBits[c] & maxColor[c]); \
+                }                                                       \
+                est = sample[1] + sample[2] - sample[3];                \
+                if (est > maxColor[c])                                  \
+                    est = maxColor[c];                                  \
+                else if (est < 0)                                       \
+                    est = 0;                                            \
+                diff |= (uint##bpp##_t)(((sample[0] - est) & maxColor[c]) \
+                                        << shiftBits[c]);               \
+            }                                                           \
+            buf[y * w + x] = endianMismatch ? Swap##bpp(diff) : diff;   \
+        }                                                               \
+    }                                                                   \
+}
+
+DEFINE_GRADIENT_FILTER_FUNCTION(16)
+DEFINE_GRADIENT_FILTER_FUNCTION(32)
+
+/*
+ * Decide whether a lossless full-color rectangle should be gradient
+ * filtered.  Color differences between neighbors are sampled along a few
+ * diagonals; the filter pays off where they are small but not zero, as
+ * in photos and shaded areas.  Mostly flat content, like desktops and
+ * text, compresses better unfiltered.
+ */
+
+static rfbBool
+DetectSmoothImage(rfbClientPtr cl, int w, int h)
+{
+    rfbTightContext *ctx = cl->tightContext;
+    TIGHT_CONF *conf = &tightConf[ctx->compressLevel];
+    unsigned long avgError;
+
+    if (rfbTightDisableGradient || conf->gradientThreshold == 0 ||
+        cl->screen->serverFormat.bitsPerPixel == 8 ||
+        cl->format.bitsPerPixel == 8 ||
+        w < DETECT_MIN_WIDTH || h < DETECT_MIN_HEIGHT ||
+        w * h < conf->gradientMinRectSize)
+        return FALSE;
+
+    if (ctx->usePixelFormat24) {
+        avgError = DetectSmoothImage24(cl, w, h);
+        return avgError > 0 && avgError < (unsigned long)conf->gradientThreshold24;
+    }
+    if (cl->format.bitsPerPixel == 32)
+        avgError = DetectSmoothImage32(cl, w, h);
+    else
+        avgError = DetectSmoothImage16(cl, w, h);
+    return avgError > 0 && avgError < (unsigned long)conf->gradientThreshold;
+}
+
+/*
+ * These return the mean squared difference between neighboring samples
+ * which differ, or 0 if most of them do not.
+ */
+
+static unsigned long
+DetectSmoothImage24(rfbClientPtr cl, int w, int h)
+{
+    uint8_t *buf = (uint8_t *)cl->tightContext->tightBeforeBuf;
+    /* the samples of a big endian pixel start at its second byte */
+    int off = (cl->format.bigEndian != 0);
+    int x = 0, y = 0, d, dx, c, pix, left[3];
+    unsigned long pixelCount = 0, zeroCount = 0, sum = 0;
+
+    while (y < h && x < w) {
+        for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) {
+            uint8_t *p = buf + ((y + d) * w + x + d) * 4 + off;
+
+            for (c = 0; c < 3; c++)
+                left[c] = p[c];
+            for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {
+                p += 4;
+                for (c = 0; c < 3; c++) {
+                    pix = p[c];
+                    if (pix == left[c])
+                        zeroCount++;
+                    else
+                        sum += (unsigned long)((pix - left[c]) * (pix - left[c]));
+                    left[c] = pix;
+                }
+                pixelCount++;
+            }
+        }
+        if (w > h) {
+            x += h;
+            y = 0;
+        } else {
+            x = 0;
+            y += w;
+        }
+    }
+
+    if (pixelCount == 0 || zeroCount * 100 >= pixelCount * 3 * 95)
+        return 0;
+    return sum / (pixelCount * 3 - zeroCount);
+}
+
+#define DEFINE_DETECT_FUNCTION(bpp)                                     \
+                                                                        \
+static unsigned long                                                    \
+DetectSmoothImage##bpp(rfbClientPtr cl, int w, int h)                   \
+{                                                                       \
+    uint##bpp##_t *buf = (uint##bpp##_t *)cl->tightContext->tightBeforeBuf; \
+    rfbPixelFormat *fmt = &cl->format;                                  \
+    rfbBool endianMismatch =                                            \
+        (!cl->screen->serverFormat.bigEndian != !fmt->bigEndian);       \
+    int maxColor[3], shiftBits[3];                                      \
+    int x = 0, y = 0, d, dx, c, sample, diff, left[3];                  \
+    unsigned long pixelCount = 0, zeroCount = 0, sum = 0;               \
+    uint##bpp##_t pix;                                                  \
+                                                                        \
+    maxColor[0] = fmt->redMax;                                          \
+    maxColor[1] = fmt->greenMax;                                        \
+    maxColor[2] = fmt->blueMax;                                         \
+    shiftBits[0] = fmt->redShift;                                       \
+    shiftBits[1] = fmt->greenShift;                                     \
+    shiftBits[2] = fmt->blueShift;                                      \
+                                                                        \
+    while (y < h && x < w) {                                            \
+        for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) { \
+            pix = buf[(y + d) * w + x + d];                             \
+            if (endianMismatch)                                         \
+                pix = Swap##bpp(pix);                                   \
+            for (c = 0; c < 3; c++)                                     \
+                left[c] = (int)(pix >> shiftBits[c] & maxColor[c]);     \
+            for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {             \
+                pix = buf[(y + d) * w + x + d + dx];                    \
+                if (endianMismatch)                                     \
+                    pix = Swap##bpp(pix);                               \
+                diff = 0;                                               \
+                for (c = 0; c < 3; c++) {                               \
+                    sample = (int)(pix >> shiftBits[c] & maxColor[c]);  \
+                    diff += abs(sample - left[c]);                      \
+                    left[c] = sample;                                   \
+                }                                                       \
+                if (diff > 255)                                         \
+                    diff = 255;                                         \
+                if (diff == 0)                                          \
+                    zeroCount++;                                        \
+                else                                                    \
+                    sum += (unsigned long)(diff * diff);                \
+                pixelCount++;                                           \
+            }                                                           \
+        }                                                               \
+        if (w > h) {                                                    \
+            x += h;                                                     \
+            y = 0;                                                      \
+        } else {                                                        \
+            x = 0;                                                      \
+            y += w;                                                     \
+        }                                                               \
+    }                                                                   \
+                                                                        \
+    if (pixelCount == 0 || zeroCount * 100 >= pixelCount * 90)          \
+        return 0;                                                       \
+    return sum / (pixelCount - zeroCount);                              \
+}
+
+DEFINE_DETECT_FUNCTION(16)
+DEFINE_DETECT_FUNCTION(32)
+
+
 /*
  * Converting truecolor samples into palette indices.
  */
@@ -1464,7 +2056,7 @@ static void Pack24(rfbClientPtr cl,
 #define DEFINE_IDX_ENCODE_FUNCTION(bpp)                                 \
                                                                         \
 static void                                                             \
-EncodeIndexedRect##bpp(uint8_t *buf, int count) {                       \
+EncodeIndexedRect##bpp(rfbTightContext *ctx, uint8_t *buf, int count) { \
     COLOR_LIST *pnode;                                                  \
     uint##bpp##_t *src;                                                 \
     uint##bpp##_t rgb;                                                  \
@@ -1477,7 +2069,7 @@ EncodeIndexedRect##bpp(uint8_t *buf, int count) {                       \
         while (count && *src == rgb) {                                  \
             rep++, src++, count--;                                      \
         }                                                               \
-        pnode = palette.hash[HASH_FUNC##bpp(rgb)];                      \
+        pnode = ctx->palette.hash[HASH_FUNC##bpp(rgb)];                 \
         while (pnode != NULL) {                                         \
             if ((uint##bpp##_t)pnode->rgb == rgb) {                     \
                 *buf++ = (uint8_t)pnode->idx;                           \
@@ -1499,7 +2091,7 @@ DEFINE_IDX_ENCODE_FUNCTION(32)
 #define DEFINE_MONO_ENCODE_FUNCTION(bpp)                                \
                                                                         \
 static void                                                             \
-EncodeMonoRect##bpp(uint8_t *buf, int w, int h) {                       \
+EncodeMonoRect##bpp(rfbTightContext *ctx, uint8_t *buf, int w, int h) { \
     uint##bpp##_t *ptr;                                                 \
     uint##bpp##_t bg;                                                   \
     unsigned int value, mask;                                           \
@@ -1507,7 +2099,7 @@ EncodeMonoRect##bpp(uint8_t *buf, int w, int h) {                       \
     int x, y, bg_bits;                                                  \
                                                                         \
     ptr = (uint##bpp##_t *) buf;                                        \
-    bg = (uint##bpp##_t) monoBackground;                                \
+    bg = (uint##bpp##_t) ctx->monoBackground;                           \
     aligned_width = w - w % 8;                                          \
                                                                         \
     for (y = 0; y < h; y++) {                                           \
@@ -1558,9 +2150,10 @@ DEFINE_MONO_ENCODE_FUNCTION(32)
 static rfbBool
 SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
 {
+    rfbTightContext *ctx = cl->tightContext;
     unsigned char *srcbuf;
     int ps = cl->screen->serverFormat.bitsPerPixel / 8;
-    int subsamp = subsampLevel2tjsubsamp[subsampLevel];
+    int subsamp = subsampLevel2tjsubsamp[ctx->subsampLevel];
     unsigned long size = 0;
     int flags = 0, pitch;
     unsigned char *tmpbuf = NULL;
@@ -1572,24 +2165,24 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
         rfbLog("Error: JPEG requires 16-bit, 24-bit, or 32-bit pixel format.\n");
         return 0;
     }
-    if (!j) {
-        if ((j = tjInitCompress()) == NULL) {
+    if (!ctx->j) {
+        if ((ctx->j = tjInitCompress()) == NULL) {
             rfbLog("JPEG Error: %s\n", tjGetErrorStr());
             return 0;
         }
     }
 
-    if (tightAfterBufSize < TJBUFSIZE(w, h)) {
-        if (tightAfterBuf == NULL)
-            tightAfterBuf = (char *)malloc(TJBUFSIZE(w, h));
+    if (ctx->tightAfterBufSize < TJBUFSIZE(w, h)) {
+        if (ctx->tightAfterBuf == NULL)
+            ctx->tightAfterBuf = (char *)malloc(TJBUFSIZE(w, h));
         else
-            tightAfterBuf = (char *)realloc(tightAfterBuf,
-                                            TJBUFSIZE(w, h));
-        if (!tightAfterBuf) {
+            ctx->tightAfterBuf = (char *)realloc(ctx->tightAfterBuf,
+                                                 TJBUFSIZE(w, h));
+        if (!ctx->tightAfterBuf) {
             rfbLog("Memory allocation failure!\n");
             return 0;
         }
-        tightAfterBufSize = TJBUFSIZE(w, h);
+        ctx->tightAfterBufSize = TJBUFSIZE(w, h);
     }
 
     if (ps == 2) {
@@ -1642,7 +2235,7 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
             [y * pitch + x * ps];
     }
 
-    if (tjCompress(j, srcbuf, w, pitch, h, ps, (unsigned char *)tightAfterBuf,
+    if (tjCompress(ctx->j, srcbuf, w, pitch, h, ps, (unsigned char *)ctx->tightAfterBuf,
                    &size, subsamp, quality, flags) == -1) {
         rfbLog("JPEG Error: %s\n", tjGetErrorStr());
         if (tmpbuf) {
@@ -1662,10 +2255,11 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
             return FALSE;
     }
 
-    cl->updateBuf[cl->ublen++] = (char)(rfbTightJpeg << 4);
+    cl->updateBuf[cl->ublen++] = ControlByte(cl, rfbTightJpeg << 4);
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
+    rfbMarkRectLossy(cl, x, y, w, h);
 
-    return SendCompressedData(cl, tightAfterBuf, (int)size);
+    return SendCompressedData(cl, ctx->tightAfterBuf, (int)size);
 }
 
 static void
@@ -1750,8 +2344,6 @@ DEFINE_JPEG_GET_ROW_FUNCTION(32)
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
 
-static TLS int pngDstDataLen = 0;
-
 static rfbBool CanSendPngRect(rfbClientPtr cl, int w, int h) {
     if (cl->tightEncoding != rfbEncodingTightPng) {
         return FALSE;
@@ -1768,15 +2360,17 @@ static rfbBool CanSendPngRect(rfbClientPtr cl, int w, int h) {
 static void pngWriteData(png_structp png_ptr, png_bytep data,
                            png_size_t length)
 {
+    rfbTightContext *ctx = ((rfbClientPtr)png_get_io_ptr(png_ptr))->tightContext;
+
 #if 0
     rfbClientPtr cl = png_get_io_ptr(png_ptr);
 
     buffer_reserve(&vs->tight.png, vs->tight.png.offset + length);
     memcpy(vs->tight.png.buffer + vs->tight.png.offset, data, length);
 #endif
-    memcpy(tightAfterBuf + pngDstDataLen, data, length);
+    memcpy(ctx->tightAfterBuf + ctx->pngDstDataLen, data, length);
 
-    pngDstDataLen += length;
+    ctx->pngDstDataLen += length;
 }
 
 static void pngFlushData(png_structp png_ptr)
@@ -1797,6 +2391,7 @@ static void pngFree(png_structp png_ptr, png_voidp ptr)
 static rfbBool SendPngRect(rfbClientPtr cl, int x, int y, int w, int h) {
     /* rfbLog(">> SendPngRect x:%d, y:%d, w:%d, h:%d\n", x, y, w, h); */
 
+    rfbTightContext *ctx = cl->tightContext;
     png_byte color_type;
     png_structp png_ptr;
     png_infop info_ptr;
@@ -1806,7 +2401,7 @@ static rfbBool SendPngRect(rfbClientPtr cl, int x, int y, int w, int h) {
     uint8_t *buf;
     int dy;
 
-    pngDstDataLen = 0;
+    ctx->pngDstDataLen = 0;
 
     png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
                                         NULL, pngMalloc, pngFree);
@@ -1895,10 +2490,10 @@ static rfbBool SendPngRect(rfbClientPtr cl, int x, int y, int w, int h) {
             return FALSE;
     }
 
-    cl->updateBuf[cl->ublen++] = (char)(rfbTightPng << 4);
+    cl->updateBuf[cl->ublen++] = ControlByte(cl, rfbTightPng << 4);
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
     /* rfbLog("<< SendPngRect\n"); */
-    return SendCompressedData(cl, tightAfterBuf, pngDstDataLen);
+    return SendCompressedData(cl, ctx->tightAfterBuf, ctx->pngDstDataLen);
 }
 #endif
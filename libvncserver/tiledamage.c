@@ -0,0 +1,276 @@
+/*
+ * tiledamage.c - track damage in tiles for all clients at once.
+ *
+ * On large framebuffers with many small changes, every client's
+ * modifiedRegion grows to thousands of rectangles, each change costs a
+ * region union per client, and maxRectsPerUpdate finally collapses it all
+ * into a bounding box which resends lots of unchanged pixels.
+ *
+ * With screen->tileDamage set, rfbMarkRegionAsModified() stamps the 64x64
+ * tiles it touches with a new generation instead, using atomic operations
+ * only.  Every client keeps the generation it last took of each tile.
+ * Before an update is put together, rfbCollectTileDamage() scans the tiles
+ * for newer ones and adds them, in runs of whole tiles, to the client's
+ * modifiedRegion.  screen->tileDamageMarks counts the marks, so clients
+ * with nothing new to take skip the scan.
+ *
+ * Marking does not touch the clients at all, so it costs the same however
+ * many there are: output threads waiting for damage are woken by one
+ * broadcast, and the I/O side puts the other clients on the ready list
+ * when it sees the count change (see main.c).
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <string.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+struct _rfbTileDamage {
+    int tilesX, tilesY;
+    unsigned long generation;
+    unsigned long *tiles;
+};
+
+/*
+ * Without atomic builtins, marking and scanning the tiles is serialised
+ * by one mutex instead.
+ */
+
+#if defined(LIBVNCSERVER_HAVE_SYNC_BUILTINS)
+#define TILES_LOCK()
+#define TILES_UNLOCK()
+#define TILES_ADD(x, n) __sync_add_and_fetch(&(x), (n))
+
+static void
+stamp(unsigned long *tile, unsigned long generation)
+{
+    unsigned long old = *tile;
+
+    while (old < generation) {
+        unsigned long seen = __sync_val_compare_and_swap(tile, old, generation);
+        if (seen == old)
+            break;
+        old = seen;
+    }
+}
+#else
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+static pthread_mutex_t tilesMutex = PTHREAD_MUTEX_INITIALIZER;
+#define TILES_LOCK() pthread_mutex_lock(&tilesMutex)
+#define TILES_UNLOCK() pthread_mutex_unlock(&tilesMutex)
+#else
+#define TILES_LOCK()
+#define TILES_UNLOCK()
+#endif
+#define TILES_ADD(x, n) ((x) += (n))
+
+static void
+stamp(unsigned long *tile, unsigned long generation)
+{
+    if (*tile < generation)
+        *tile = generation;
+}
+#endif
+
+/*
+ * Make a new tile map for the screen's current size.  The old one is
+ * returned and must be freed once no client can be using it any more.
+ */
+
+rfbTileDamage *
+rfbTileDamageCreate(rfbScreenInfoPtr screen)
+{
+    rfbTileDamage *old = screen->tileDamageMap;
+    rfbTileDamage *map = (rfbTileDamage *)malloc(sizeof(rfbTileDamage));
+
+    screen->tileDamageMap = NULL;
+    if (!map)
+        return old;
+    map->tilesX = (screen->width + rfbDamageTileSize - 1) / rfbDamageTileSize;
+    map->tilesY = (screen->height + rfbDamageTileSize - 1) / rfbDamageTileSize;
+    map->generation = 0;
+    map->tiles = (unsigned long *)calloc((size_t)map->tilesX * map->tilesY,
+                                         sizeof(unsigned long));
+    if (!map->tiles) {
+        rfbErr("rfbTileDamageCreate: out of memory, tracking damage per client\n");
+        free(map);
+        return old;
+    }
+    screen->tileDamageMap = map;
+    return old;
+}
+
+void
+rfbTileDamageFree(rfbTileDamage *map)
+{
+    if (map) {
+        free(map->tiles);
+        free(map);
+    }
+}
+
+/*
+ * Take over the current state of all tiles, as if the client had seen
+ * everything: its modifiedRegion has to cover what it did not.  Call with
+ * updateMutex held (or before the client is on the screen's list).
+ */
+
+void
+rfbTileDamageInit(rfbClientPtr cl)
+{
+    rfbTileDamage *map = cl->screen->tileDamageMap;
+    size_t size;
+
+    free(cl->tileDamageSeen);
+    cl->tileDamageSeen = NULL;
+    cl->tileDamageSeenMap = map;
+    cl->tileDamageMarks = cl->screen->tileDamageMarks;
+    if (!map)
+        return;
+
+    size = (size_t)map->tilesX * map->tilesY * sizeof(unsigned long);
+    cl->tileDamageSeen = (unsigned long *)malloc(size);
+    if (!cl->tileDamageSeen)
+        return;
+    TILES_LOCK();
+    memcpy(cl->tileDamageSeen, map->tiles, size);
+    TILES_UNLOCK();
+}
+
+void
+rfbTileDamageFreeClient(rfbClientPtr cl)
+{
+    free(cl->tileDamageSeen);
+    cl->tileDamageSeen = NULL;
+    cl->tileDamageSeenMap = NULL;
+}
+
+/* Stamp the tiles touched by region; no client lock is needed. */
+
+void
+rfbTileDamageMark(rfbScreenInfoPtr screen, sraRegionPtr region)
+{
+    rfbTileDamage *map = screen->tileDamageMap;
+    sraRectangleIterator *i;
+    sraRect rect;
+    unsigned long generation;
+    int tx, ty, tx1, tx2, ty2;
+
+    TILES_LOCK();
+    generation = TILES_ADD(map->generation, 1);
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect)) {
+        if (rect.x1 < 0)
+            rect.x1 = 0;
+        if (rect.y1 < 0)
+            rect.y1 = 0;
+        if (rect.x2 > screen->width)
+            rect.x2 = screen->width;
+        if (rect.y2 > screen->height)
+            rect.y2 = screen->height;
+        if (rect.x1 >= rect.x2 || rect.y1 >= rect.y2)
+            continue;
+
+        tx1 = rect.x1 / rfbDamageTileSize;
+        tx2 = (rect.x2 - 1) / rfbDamageTileSize;
+        ty2 = (rect.y2 - 1) / rfbDamageTileSize;
+        for (ty = rect.y1 / rfbDamageTileSize; ty <= ty2; ty++)
+            for (tx = tx1; tx <= tx2; tx++)
+                stamp(&map->tiles[ty * map->tilesX + tx], generation);
+    }
+    sraRgnReleaseIterator(i);
+    /* only now, so that whoever sees the count also sees the tiles */
+    TILES_ADD(screen->tileDamageMarks, 1);
+    TILES_UNLOCK();
+
+    /* client output threads with nothing to do wait for this */
+    LOCK(screen->damageMutex);
+    TBROADCAST(screen->damageCond);
+    UNLOCK(screen->damageMutex);
+}
+
+/*
+ * Add the tiles which changed since the client last looked to its
+ * modifiedRegion.  Call with updateMutex held.
+ */
+
+void
+rfbCollectTileDamage(rfbClientPtr cl)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbTileDamage *map = screen->tileDamageMap;
+    sraRegionPtr damage, row, rect;
+    unsigned long marks, *tiles, *seen;
+    int tx, ty, x1, y1, y2;
+
+    if (!map)
+        return;
+    marks = TILES_ADD(screen->tileDamageMarks, 0);
+    if (marks == cl->tileDamageMarks)
+        return;
+
+    if (!cl->tileDamageSeen || cl->tileDamageSeenMap != map) {
+        /* nothing to compare with, or rfbNewFramebuffer() made a new map
+           and has not come to this client yet: everything may have changed */
+        rfbTileDamageInit(cl);
+        sraRgnDestroy(cl->modifiedRegion);
+        cl->modifiedRegion = sraRgnCreateRect(0, 0, screen->width, screen->height);
+        return;
+    }
+    cl->tileDamageMarks = marks;
+
+    damage = sraRgnCreate();
+    row = sraRgnCreate();
+    TILES_LOCK();
+    for (ty = 0; ty < map->tilesY; ty++) {
+        tiles = map->tiles + ty * map->tilesX;
+        seen = cl->tileDamageSeen + ty * map->tilesX;
+        y1 = ty * rfbDamageTileSize;
+        y2 = y1 + rfbDamageTileSize > screen->height ? screen->height : y1 + rfbDamageTileSize;
+
+        /* runs of newer tiles; equal runs of neighbouring rows coalesce */
+        x1 = -1;
+        for (tx = 0; tx <= map->tilesX; tx++) {
+            unsigned long generation = tx < map->tilesX ? tiles[tx] : 0;
+
+            if (tx < map->tilesX && generation > seen[tx]) {
+                seen[tx] = generation;
+                if (x1 < 0)
+                    x1 = tx * rfbDamageTileSize;
+            } else if (x1 >= 0) {
+                int x2 = tx * rfbDamageTileSize;
+
+                rect = sraRgnCreateRect(x1, y1, x2 > screen->width ? screen->width : x2, y2);
+                sraRgnOr(row, rect);
+                sraRgnDestroy(rect);
+                x1 = -1;
+            }
+        }
+        if (!sraRgnEmpty(row)) {
+            sraRgnOr(damage, row);
+            sraRgnMakeEmpty(row);
+        }
+    }
+    TILES_UNLOCK();
+
+    sraRgnOr(cl->modifiedRegion, damage);
+    sraRgnDestroy(row);
+    sraRgnDestroy(damage);
+}
@@ -25,6 +25,7 @@
 
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
+#include "private.h"
 
 static void PrintPixelFormat(rfbPixelFormat *pf);
 static rfbBool rfbSetClientColourMapBGR233(rfbClientPtr cl);
@@ -216,6 +217,174 @@ static rfbTranslateFnType rfbTranslateWithRGBTablesFns[COUNT_OFFSETS][COUNT_OFFS
 };
 
 
+/*
+ * Lookup tables are shared by all clients, of all screens, which translate
+ * between the same two formats (and, for colour mapped servers, with the
+ * same colour map).  Each is built once, never written to afterwards, and
+ * freed when the last client using it lets go of it.  A colour map which
+ * changes simply stops matching the old tables.
+ */
+
+#define TABLE_SINGLE_TC 0
+#define TABLE_SINGLE_CM 1
+#define TABLE_RGB 2
+
+typedef struct _rfbTranslateTable {
+    struct _rfbTranslateTable *next;
+    int kind;
+    rfbPixelFormat in, out;
+    rfbColourMap colourMap;     /* a copy, for TABLE_SINGLE_CM */
+    int refCount;
+    char *data;
+} rfbTranslateTable;
+
+static rfbTranslateTable *translateTables = NULL;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+static pthread_mutex_t translateTablesMutex = PTHREAD_MUTEX_INITIALIZER;
+#define TABLES_LOCK() pthread_mutex_lock(&translateTablesMutex)
+#define TABLES_UNLOCK() pthread_mutex_unlock(&translateTablesMutex)
+#else
+#define TABLES_LOCK()
+#define TABLES_UNLOCK()
+#endif
+
+/* everything the table init functions look at */
+
+static rfbBool
+rfbSameTableFormat(rfbPixelFormat *x, rfbPixelFormat *y)
+{
+    return x->bitsPerPixel == y->bitsPerPixel &&
+        x->bigEndian == y->bigEndian &&
+        x->trueColour == y->trueColour &&
+        x->redMax == y->redMax && x->greenMax == y->greenMax &&
+        x->blueMax == y->blueMax && x->redShift == y->redShift &&
+        x->greenShift == y->greenShift && x->blueShift == y->blueShift;
+}
+
+static size_t
+rfbColourMapSize(rfbColourMap *cm)
+{
+    return (size_t)cm->count * 3 * (cm->is16 ? 2 : 1);
+}
+
+static rfbBool
+rfbSameColourMap(rfbColourMap *x, rfbColourMap *y)
+{
+    return x->count == y->count && x->is16 == y->is16 &&
+        (x->count == 0 ||
+         memcmp(x->data.bytes, y->data.bytes, rfbColourMapSize(x)) == 0);
+}
+
+/*
+ * Returns a table of the given kind for translating from in to out, with a
+ * reference taken, or NULL if there is no memory.  cm is only used for
+ * TABLE_SINGLE_CM.
+ */
+
+static char *
+rfbGetTranslateTable(int kind, rfbPixelFormat *in, rfbPixelFormat *out,
+                     rfbColourMap *cm)
+{
+    rfbTranslateTable *t;
+    char *data = NULL;
+
+    TABLES_LOCK();
+    for (t = translateTables; t; t = t->next) {
+        if (t->kind == kind && rfbSameTableFormat(&t->in, in) &&
+            rfbSameTableFormat(&t->out, out) &&
+            (kind != TABLE_SINGLE_CM || rfbSameColourMap(&t->colourMap, cm))) {
+            t->refCount++;
+            data = t->data;
+            break;
+        }
+    }
+    if (t) {
+        TABLES_UNLOCK();
+        return data;
+    }
+
+    /* none yet: build it while holding the lock, so it is built only once */
+    t = (rfbTranslateTable *)calloc(1, sizeof(rfbTranslateTable));
+    if (!t) {
+        TABLES_UNLOCK();
+        return NULL;
+    }
+    t->kind = kind;
+    t->in = *in;
+    t->out = *out;
+    if (kind == TABLE_SINGLE_CM) {
+        t->colourMap = *cm;
+        t->colourMap.data.bytes = NULL;
+        if (cm->count > 0) {
+            t->colourMap.data.bytes = (uint8_t *)malloc(rfbColourMapSize(cm));
+            if (!t->colourMap.data.bytes) {
+                free(t);
+                TABLES_UNLOCK();
+                return NULL;
+            }
+            memcpy(t->colourMap.data.bytes, cm->data.bytes, rfbColourMapSize(cm));
+        }
+    }
+
+    switch (kind) {
+    case TABLE_SINGLE_TC:
+        (*rfbInitTrueColourSingleTableFns
+            [BPP2OFFSET(out->bitsPerPixel)]) (&t->data, in, out);
+        break;
+    case TABLE_SINGLE_CM:
+        (*rfbInitColourMapSingleTableFns
+            [BPP2OFFSET(out->bitsPerPixel)]) (&t->data, in, out, &t->colourMap);
+        break;
+    default:
+        (*rfbInitTrueColourRGBTablesFns
+            [BPP2OFFSET(out->bitsPerPixel)]) (&t->data, in, out);
+        break;
+    }
+
+    t->refCount = 1;
+    t->next = translateTables;
+    translateTables = t;
+    data = t->data;
+    TABLES_UNLOCK();
+    return data;
+}
+
+/*
+ * Lets go of a table from rfbGetTranslateTable().  Tables which did not
+ * come from there (a screen's own setTranslateFunction may make them) are
+ * freed as before.
+ */
+
+void
+rfbReleaseTranslateTable(char *table)
+{
+    rfbTranslateTable *t, **prev;
+
+    if (!table)
+        return;
+
+    TABLES_LOCK();
+    for (prev = &translateTables; (t = *prev); prev = &t->next) {
+        if (t->data == table)
+            break;
+    }
+    if (t && --t->refCount > 0) {
+        TABLES_UNLOCK();
+        return;
+    }
+    if (t)
+        *prev = t->next;
+    TABLES_UNLOCK();
+
+    if (t) {
+        free(t->colourMap.data.bytes);
+        free(t);
+    }
+    free(table);
+}
+
+
 
 /*
  * rfbTranslateNone is used when no translation is required.
@@ -290,6 +459,9 @@ rfbSetTranslateFunction(rfbClientPtr cl)
      * bpp is valid, now work out how to translate
      */
 
+    rfbReleaseTranslateTable(cl->translateLookupTable);
+    cl->translateLookupTable = NULL;
+
     if (!cl->format.trueColour) {
         /*
          * truecolour -> colour map
@@ -315,6 +487,13 @@ rfbSetTranslateFunction(rfbClientPtr cl)
         return TRUE;
     }
 
+    /* common cases have kernels which need no tables */
+
+    if ((cl->translateFn = rfbSimdTranslateFunction(&cl->screen->serverFormat,
+                                                    &cl->format)) != NULL) {
+        return TRUE;
+    }
+
     if ((cl->screen->serverFormat.bitsPerPixel < 16) ||
         ((!cl->screen->serverFormat.trueColour || !rfbEconomicTranslate) &&
 	   (cl->screen->serverFormat.bitsPerPixel == 16))) {
@@ -326,13 +505,13 @@ rfbSetTranslateFunction(rfbClientPtr cl)
                                   [BPP2OFFSET(cl->format.bitsPerPixel)];
 
 	if(cl->screen->serverFormat.trueColour)
-	  (*rfbInitTrueColourSingleTableFns
-	   [BPP2OFFSET(cl->format.bitsPerPixel)]) (&cl->translateLookupTable,
-						   &(cl->screen->serverFormat), &cl->format);
+	  cl->translateLookupTable =
+	    rfbGetTranslateTable(TABLE_SINGLE_TC, &cl->screen->serverFormat,
+				 &cl->format, NULL);
 	else
-	  (*rfbInitColourMapSingleTableFns
-	   [BPP2OFFSET(cl->format.bitsPerPixel)]) (&cl->translateLookupTable,
-						   &(cl->screen->serverFormat), &cl->format,&cl->screen->colourMap);
+	  cl->translateLookupTable =
+	    rfbGetTranslateTable(TABLE_SINGLE_CM, &cl->screen->serverFormat,
+				 &cl->format, &cl->screen->colourMap);
 
     } else {
 
@@ -342,9 +521,15 @@ rfbSetTranslateFunction(rfbClientPtr cl)
                               [BPP2OFFSET(cl->screen->serverFormat.bitsPerPixel)]
                                   [BPP2OFFSET(cl->format.bitsPerPixel)];
 
-        (*rfbInitTrueColourRGBTablesFns
-            [BPP2OFFSET(cl->format.bitsPerPixel)]) (&cl->translateLookupTable,
-                                             &(cl->screen->serverFormat), &cl->format);
+        cl->translateLookupTable =
+            rfbGetTranslateTable(TABLE_RGB, &cl->screen->serverFormat,
+                                 &cl->format, NULL);
+    }
+
+    if (!cl->translateLookupTable) {
+        rfbErr("rfbSetTranslateFunction: out of memory\n");
+        rfbCloseClient(cl);
+        return FALSE;
     }
 
     return TRUE;
@@ -424,15 +609,22 @@ rfbSetClientColourMap(rfbClientPtr cl, int firstColour, int nColours)
 
     if (cl->format.trueColour) {
 	LOCK(cl->updateMutex);
-	(*rfbInitColourMapSingleTableFns
-	    [BPP2OFFSET(cl->format.bitsPerPixel)]) (&cl->translateLookupTable,
-					     &cl->screen->serverFormat, &cl->format,&cl->screen->colourMap);
+	rfbReleaseTranslateTable(cl->translateLookupTable);
+	cl->translateLookupTable =
+	  rfbGetTranslateTable(TABLE_SINGLE_CM, &cl->screen->serverFormat,
+			       &cl->format, &cl->screen->colourMap);
 
 	sraRgnDestroy(cl->modifiedRegion);
 	cl->modifiedRegion =
 	  sraRgnCreateRect(0,0,cl->screen->width,cl->screen->height);
 	UNLOCK(cl->updateMutex);
 
+	if (!cl->translateLookupTable) {
+	    rfbErr("rfbSetClientColourMap: out of memory\n");
+	    rfbCloseClient(cl);
+	    return FALSE;
+	}
+
 	return TRUE;
     }
 
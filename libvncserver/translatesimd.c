@@ -0,0 +1,299 @@
+/*
+ * translatesimd.c - translate 32 bit pixels with SIMD instructions.
+ *
+ * Most servers have a 32 bit framebuffer with 8 bits per channel, and most
+ * clients which want something else want its channels swapped, 16 bit
+ * 565 or 555, 24 bit or BGR233.  rfbSetTranslateFunction() asks
+ * rfbSimdTranslateFunction() first, and only builds lookup tables if it
+ * has no kernel for the two formats.
+ *
+ * The kernels are made from translatesimdtemplate.c: SSE2 on x86, which
+ * every x86-64 has, plus AVX2 picked at run time where the compiler can
+ * do that, and NEON on ARM.  They only run on little endian hosts.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#ifdef LIBVNCSERVER_HAVE_AVX2_DISPATCH
+#include <immintrin.h>
+#endif
+#else
+#include <arm_neon.h>
+#endif
+
+#define CONCAT2(a,b) a##b
+#define CONCAT2E(a,b) CONCAT2(a,b)
+
+typedef struct {
+    int bytesPerPixel;
+    rfbBool swap;       /* client has the other byte order */
+    rfbBool scale;      /* some channel has less than 8 bits */
+    int inShift[3], outShift[3], outMax[3];
+} rfbSimdFormat;
+
+static void
+rfbSimdSetup(rfbSimdFormat *f, rfbPixelFormat *in, rfbPixelFormat *out)
+{
+    f->bytesPerPixel = out->bitsPerPixel / 8;
+    f->swap = out->bigEndian != in->bigEndian && f->bytesPerPixel > 1;
+    f->scale = out->redMax != 255 || out->greenMax != 255 || out->blueMax != 255;
+    f->inShift[0] = in->redShift;
+    f->inShift[1] = in->greenShift;
+    f->inShift[2] = in->blueShift;
+    f->outShift[0] = out->redShift;
+    f->outShift[1] = out->greenShift;
+    f->outShift[2] = out->blueShift;
+    f->outMax[0] = out->redMax;
+    f->outMax[1] = out->greenMax;
+    f->outMax[2] = out->blueMax;
+}
+
+/* what the kernels do for one pixel, except for the byte order */
+
+static uint32_t
+rfbSimdPixel(rfbSimdFormat *f, uint32_t p)
+{
+    uint32_t o = 0, v;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        v = (p >> f->inShift[i]) & 0xff;
+        o |= (v * f->outMax[i] + 127) / 255 << f->outShift[i];
+    }
+    return o;
+}
+
+static void
+rfbSimdStore24(uint8_t *op, uint32_t o, rfbBool swap)
+{
+    op[swap ? 2 : 0] = (uint8_t)o;
+    op[1] = (uint8_t)(o >> 8);
+    op[swap ? 0 : 2] = (uint8_t)(o >> 16);
+}
+
+static void
+rfbSimdStore(uint8_t *op, uint32_t o, rfbSimdFormat *f)
+{
+    switch (f->bytesPerPixel) {
+    case 1:
+        *op = (uint8_t)o;
+        break;
+    case 2:
+        *(uint16_t *)op = f->swap ? Swap16(o) : (uint16_t)o;
+        break;
+    case 3:
+        rfbSimdStore24(op, o, f->swap);
+        break;
+    default:
+        *(uint32_t *)op = f->swap ? Swap32(o) : o;
+        break;
+    }
+}
+
+#ifdef __SSE2__
+
+/* packs_epi32 saturates signed, so sign extend the 16 bit values first */
+#define SSE2_SEXT16(v) _mm_srai_epi32(_mm_slli_epi32(v, 16), 16)
+#define SSE2_SWAP16(v) _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8))
+
+#define SIMD Sse2
+#define SIMD_TARGET
+#define VEC __m128i
+#define VLANES 4
+#define VCOUNT __m128i
+#define VRCOUNT(n) _mm_cvtsi32_si128(n)
+#define VLCOUNT(n) _mm_cvtsi32_si128(n)
+#define VLOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define VSTORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define VSET1(n) _mm_set1_epi32(n)
+#define VAND(a, b) _mm_and_si128(a, b)
+#define VOR(a, b) _mm_or_si128(a, b)
+#define VADD(a, b) _mm_add_epi32(a, b)
+#define VMUL16(a, b) _mm_mullo_epi16(a, b)
+#define VSRL(v, c) _mm_srl_epi32(v, c)
+#define VSLL(v, c) _mm_sll_epi32(v, c)
+#define VSRLI(v, n) _mm_srli_epi32(v, n)
+#define VSWAP16(v) SSE2_SWAP16(v)
+#define VSWAP32(v) (x = SSE2_SWAP16(v), _mm_or_si128(_mm_slli_epi32(x, 16), _mm_srli_epi32(x, 16)))
+#define VPACK16(a, b) _mm_packs_epi32(SSE2_SEXT16(a), SSE2_SEXT16(b))
+#define VPACK8(a, b, c, d) _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d))
+#include "translatesimdtemplate.c"
+#undef SIMD
+#undef SIMD_TARGET
+#undef VEC
+#undef VLANES
+#undef VCOUNT
+#undef VRCOUNT
+#undef VLCOUNT
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VAND
+#undef VOR
+#undef VADD
+#undef VMUL16
+#undef VSRL
+#undef VSLL
+#undef VSRLI
+#undef VSWAP16
+#undef VSWAP32
+#undef VPACK16
+#undef VPACK8
+
+#ifdef LIBVNCSERVER_HAVE_AVX2_DISPATCH
+
+/* the AVX2 packs work within 128 bit halves, the permutes put that right */
+#define AVX2_SEXT16(v) _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16)
+#define AVX2_SWAP16(v) _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8))
+
+#define SIMD Avx2
+#define SIMD_TARGET __attribute__((target("avx2")))
+#define VEC __m256i
+#define VLANES 8
+#define VCOUNT __m128i
+#define VRCOUNT(n) _mm_cvtsi32_si128(n)
+#define VLCOUNT(n) _mm_cvtsi32_si128(n)
+#define VLOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define VSTORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define VSET1(n) _mm256_set1_epi32(n)
+#define VAND(a, b) _mm256_and_si256(a, b)
+#define VOR(a, b) _mm256_or_si256(a, b)
+#define VADD(a, b) _mm256_add_epi32(a, b)
+#define VMUL16(a, b) _mm256_mullo_epi16(a, b)
+#define VSRL(v, c) _mm256_srl_epi32(v, c)
+#define VSLL(v, c) _mm256_sll_epi32(v, c)
+#define VSRLI(v, n) _mm256_srli_epi32(v, n)
+#define VSWAP16(v) AVX2_SWAP16(v)
+#define VSWAP32(v) (x = AVX2_SWAP16(v), _mm256_or_si256(_mm256_slli_epi32(x, 16), _mm256_srli_epi32(x, 16)))
+#define VPACK16(a, b) \
+    _mm256_permute4x64_epi64(_mm256_packs_epi32(AVX2_SEXT16(a), AVX2_SEXT16(b)), 0xd8)
+#define VPACK8(a, b, c, d) \
+    _mm256_permutevar8x32_epi32(_mm256_packus_epi16(_mm256_packs_epi32(a, b), \
+                                                    _mm256_packs_epi32(c, d)), \
+                                _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7))
+#include "translatesimdtemplate.c"
+#undef SIMD
+#undef SIMD_TARGET
+#undef VEC
+#undef VLANES
+#undef VCOUNT
+#undef VRCOUNT
+#undef VLCOUNT
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VAND
+#undef VOR
+#undef VADD
+#undef VMUL16
+#undef VSRL
+#undef VSLL
+#undef VSRLI
+#undef VSWAP16
+#undef VSWAP32
+#undef VPACK16
+#undef VPACK8
+
+#endif /* LIBVNCSERVER_HAVE_AVX2_DISPATCH */
+
+#else /* NEON */
+
+#define NEON_NARROW16(a, b) vcombine_u16(vmovn_u32(a), vmovn_u32(b))
+
+#define SIMD Neon
+#define SIMD_TARGET
+#define VEC uint32x4_t
+#define VLANES 4
+#define VCOUNT int32x4_t
+#define VRCOUNT(n) vdupq_n_s32(-(n))
+#define VLCOUNT(n) vdupq_n_s32(n)
+#define VLOAD(p) vld1q_u32((const uint32_t *)(p))
+#define VSTORE(p, v) vst1q_u8((uint8_t *)(p), vreinterpretq_u8_u32(v))
+#define VSET1(n) vdupq_n_u32(n)
+#define VAND(a, b) vandq_u32(a, b)
+#define VOR(a, b) vorrq_u32(a, b)
+#define VADD(a, b) vaddq_u32(a, b)
+#define VMUL16(a, b) vmulq_u32(a, b)
+#define VSRL(v, c) vshlq_u32(v, c)
+#define VSLL(v, c) vshlq_u32(v, c)
+#define VSRLI(v, n) vshrq_n_u32(v, n)
+#define VSWAP16(v) vreinterpretq_u32_u8(vrev16q_u8(vreinterpretq_u8_u32(v)))
+#define VSWAP32(v) vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(v)))
+#define VPACK16(a, b) vreinterpretq_u32_u16(NEON_NARROW16(a, b))
+#define VPACK8(a, b, c, d) \
+    vreinterpretq_u32_u8(vcombine_u8(vmovn_u16(NEON_NARROW16(a, b)), \
+                                     vmovn_u16(NEON_NARROW16(c, d))))
+#include "translatesimdtemplate.c"
+
+#endif
+
+#define FITS(max, shift, bpp) \
+    ((shift) < (bpp) && ((bpp) == 32 || ((uint32_t)(max) << (shift)) >> (bpp) == 0))
+
+/*
+ * Returns a SIMD kernel translating from in to out, or NULL if there is
+ * none for the two formats.
+ */
+
+rfbTranslateFnType
+rfbSimdTranslateFunction(rfbPixelFormat *in, rfbPixelFormat *out)
+{
+    if (!rfbEndianTest)
+        return NULL;
+    if (in->bitsPerPixel != 32 || !in->trueColour || !out->trueColour ||
+        in->redMax != 255 || in->greenMax != 255 || in->blueMax != 255 ||
+        in->redShift > 24 || in->greenShift > 24 || in->blueShift > 24)
+        return NULL;
+    if (out->bitsPerPixel != 8 && out->bitsPerPixel != 16 &&
+        out->bitsPerPixel != 24 && out->bitsPerPixel != 32)
+        return NULL;
+    /* wider channels would overflow the 16 bit multiplies, and channels
+       sticking out of the pixel would saturate when packed */
+    if (out->redMax > 255 || out->greenMax > 255 || out->blueMax > 255 ||
+        !FITS(out->redMax, out->redShift, out->bitsPerPixel) ||
+        !FITS(out->greenMax, out->greenShift, out->bitsPerPixel) ||
+        !FITS(out->blueMax, out->blueShift, out->bitsPerPixel))
+        return NULL;
+
+#ifdef __SSE2__
+#ifdef LIBVNCSERVER_HAVE_AVX2_DISPATCH
+    if (__builtin_cpu_supports("avx2"))
+        return rfbTranslateSimdAvx2;
+#endif
+    return rfbTranslateSimdSse2;
+#else
+    return rfbTranslateSimdNeon;
+#endif
+}
+
+#else
+
+rfbTranslateFnType
+rfbSimdTranslateFunction(rfbPixelFormat *in, rfbPixelFormat *out)
+{
+    return NULL;
+}
+
+#endif
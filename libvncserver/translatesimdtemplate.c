@@ -0,0 +1,154 @@
+/*
+ * translatesimdtemplate.c - template for the SIMD translation kernels.
+ *
+ * This file shouldn't be compiled.  It is included by translatesimd.c once
+ * for each instruction set, with SIMD (the name), SIMD_TARGET, VEC, VLANES
+ * and the V*() operations defined.
+ *
+ * The kernel translates 32 bit pixels with 8 bit channels into any true
+ * colour format of 8, 16, 24 or 32 bits per pixel, VLANES pixels at a
+ * time.  Channels are scaled with the rounding the lookup tables use,
+ * (v * outMax + 127) / 255, where x / 255 is (x + (x >> 8) + 1) >> 8 for
+ * all x that can occur.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#if !defined(SIMD)
+#error "This file shouldn't be compiled."
+#error "It is included as part of translatesimd.c"
+#endif
+
+#define rfbTranslateSimdSIMD CONCAT2E(rfbTranslateSimd,SIMD)
+#define rfbSimdScaleSIMD CONCAT2E(rfbSimdScale,SIMD)
+
+/* (v * mul + 127) / 255 in each lane */
+static inline SIMD_TARGET VEC
+rfbSimdScaleSIMD(VEC v, VEC mul, VEC round, VEC one)
+{
+    VEC x = VADD(VMUL16(v, mul), round);
+
+    return VSRLI(VADD(VADD(x, VSRLI(x, 8)), one), 8);
+}
+
+/* one channel of p, scaled and put where the client wants it */
+#define CHANNEL(p, inShift, mul, outShift)                              \
+    (f.scale ? VSLL(SCALE(VAND(VSRL(p, inShift), mask), mul), outShift)  \
+             : VSLL(VAND(VSRL(p, inShift), mask), outShift))
+#define SCALE(v, mul) rfbSimdScaleSIMD(v, mul, round, one)
+#define CONVERT(p)                                                      \
+    VOR(VOR(CHANNEL(p, redIn, redMul, redOut),                          \
+            CHANNEL(p, greenIn, greenMul, greenOut)),                   \
+        CHANNEL(p, blueIn, blueMul, blueOut))
+
+static SIMD_TARGET void
+rfbTranslateSimdSIMD (char *table, rfbPixelFormat *in,
+                      rfbPixelFormat *out,
+                      char *iptr, char *optr,
+                      int bytesBetweenInputLines,
+                      int width, int height)
+{
+    rfbSimdFormat f;
+    VEC mask, round, one, x, p, o, a, b, c;
+    VEC redMul, greenMul, blueMul;
+    VCOUNT redIn, greenIn, blueIn, redOut, greenOut, blueOut;
+    uint32_t *ip;
+    uint8_t *op = (uint8_t *)optr;
+    uint32_t lanes[VLANES];
+    int i, n;
+
+    rfbSimdSetup(&f, in, out);
+    mask = VSET1(0xff);
+    round = VSET1(127);
+    one = VSET1(1);
+    redMul = VSET1(out->redMax);
+    greenMul = VSET1(out->greenMax);
+    blueMul = VSET1(out->blueMax);
+    redIn = VRCOUNT(in->redShift);
+    greenIn = VRCOUNT(in->greenShift);
+    blueIn = VRCOUNT(in->blueShift);
+    redOut = VLCOUNT(out->redShift);
+    greenOut = VLCOUNT(out->greenShift);
+    blueOut = VLCOUNT(out->blueShift);
+
+    while (height > 0) {
+        ip = (uint32_t *)iptr;
+        n = 0;
+
+        switch (f.bytesPerPixel) {
+        case 4:
+            for (; n + VLANES <= width; n += VLANES) {
+                p = VLOAD(ip + n);
+                o = CONVERT(p);
+                if (f.swap)
+                    o = VSWAP32(o);
+                VSTORE(op + 4 * n, o);
+            }
+            break;
+        case 2:
+            for (; n + 2 * VLANES <= width; n += 2 * VLANES) {
+                p = VLOAD(ip + n);
+                a = CONVERT(p);
+                p = VLOAD(ip + n + VLANES);
+                b = CONVERT(p);
+                o = VPACK16(a, b);
+                if (f.swap)
+                    o = VSWAP16(o);
+                VSTORE(op + 2 * n, o);
+            }
+            break;
+        case 1:
+            for (; n + 4 * VLANES <= width; n += 4 * VLANES) {
+                p = VLOAD(ip + n);
+                a = CONVERT(p);
+                p = VLOAD(ip + n + VLANES);
+                b = CONVERT(p);
+                p = VLOAD(ip + n + 2 * VLANES);
+                c = CONVERT(p);
+                p = VLOAD(ip + n + 3 * VLANES);
+                o = CONVERT(p);
+                VSTORE(op + n, VPACK8(a, b, c, o));
+            }
+            break;
+        case 3:
+            /* three byte pixels are put together by hand */
+            for (; n + VLANES <= width; n += VLANES) {
+                p = VLOAD(ip + n);
+                o = CONVERT(p);
+                VSTORE(lanes, o);
+                for (i = 0; i < VLANES; i++)
+                    rfbSimdStore24(op + 3 * (n + i), lanes[i], f.swap);
+            }
+            break;
+        }
+
+        /* the rest one at a time */
+        for (; n < width; n++)
+            rfbSimdStore(op + n * f.bytesPerPixel, rfbSimdPixel(&f, ip[n]), &f);
+
+        iptr += bytesBetweenInputLines;
+        op += width * f.bytesPerPixel;
+        height--;
+    }
+}
+
+#undef rfbTranslateSimdSIMD
+#undef rfbSimdScaleSIMD
+#undef CHANNEL
+#undef SCALE
+#undef CONVERT
@@ -0,0 +1,179 @@
+/*
+ * video.c - send video areas with a policy of their own.
+ *
+ * With screen->detectVideo set, the content classifier (classify.c) keeps
+ * a short history of which tiles changed when.  Areas that changed on most
+ * frames for a while are video.  When an update is put together,
+ * rfbVideoSplitUpdate() notes the video part of it in cl->videoRegion, and
+ * the two parts of the screen are then treated by the client's
+ * videoPolicy and textPolicy:
+ *
+ *   - an area is held back while its policy's maxFrameRate says it was
+ *     sent too recently; it stays modified and goes out with a later update
+ *   - Tight sends JPEG of no higher quality than the policy's jpegQuality
+ *   - lossy areas are only refined (see refine.c) if the policy says so
+ *
+ * By default video is sent at 25 frames per second, with JPEG quality 50 at
+ * the most and without refinement, while the rest of the screen is sent as
+ * the client asked for.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#ifdef LIBVNCSERVER_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+void
+rfbVideoInit(rfbClientPtr cl)
+{
+    cl->textPolicy = cl->screen->textPolicy;
+    cl->videoPolicy = cl->screen->videoPolicy;
+    cl->videoRegion = sraRgnCreate();
+}
+
+void
+rfbVideoFree(rfbClientPtr cl)
+{
+    sraRgnDestroy(cl->videoRegion);
+    cl->videoRegion = NULL;
+}
+
+/*
+ * Returns TRUE if an area sent with policy at last may be sent at now, and
+ * makes now the time it was last sent if so.
+ */
+
+static rfbBool
+frameDue(rfbEncodingPolicy *policy, struct timeval *last, struct timeval *now)
+{
+    long elapsed = (now->tv_sec - last->tv_sec) * 1000
+        + (now->tv_usec - last->tv_usec) / 1000;
+
+    if (policy->maxFrameRate > 0 && elapsed >= 0
+        && elapsed < 1000 / policy->maxFrameRate)
+        return FALSE;
+    *last = *now;
+    return TRUE;
+}
+
+/*
+ * Split updateRegion into video and text by noting the video part in
+ * cl->videoRegion, and take out what the frame rate of its policy does not
+ * allow to be sent yet.  Call with updateMutex held.
+ */
+
+void
+rfbVideoSplitUpdate(rfbClientPtr cl, sraRegionPtr updateRegion)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    sraRegionPtr text;
+    struct timeval now;
+
+    sraRgnMakeEmpty(cl->videoRegion);
+    if (screen->detectVideo) {
+        rfbClassifierVideoRegion(screen, cl->videoRegion);
+        sraRgnAnd(cl->videoRegion, updateRegion);
+    }
+    if (cl->videoPolicy.maxFrameRate <= 0 && cl->textPolicy.maxFrameRate <= 0)
+        return;
+
+    gettimeofday(&now, NULL);
+    if (!sraRgnEmpty(cl->videoRegion) &&
+        !frameDue(&cl->videoPolicy, &cl->lastVideoUpdate, &now)) {
+        sraRgnSubtract(updateRegion, cl->videoRegion);
+        sraRgnMakeEmpty(cl->videoRegion);
+        cl->framesHeldBack++;
+    }
+
+    text = sraRgnCreateRgn(updateRegion);
+    sraRgnSubtract(text, cl->videoRegion);
+    if (!sraRgnEmpty(text) &&
+        !frameDue(&cl->textPolicy, &cl->lastTextUpdate, &now)) {
+        sraRgnSubtract(updateRegion, text);
+        cl->framesHeldBack++;
+    }
+    sraRgnDestroy(text);
+}
+
+/*
+ * Returns the policy for the rectangle at x,y of cl->scaledScreen: the
+ * video policy if most of it is video.
+ */
+
+rfbEncodingPolicy *
+rfbPolicyForRect(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbScreenInfoPtr scaled = cl->scaledScreen;
+    sraRegionPtr rect;
+    sraRectangleIterator *i;
+    sraRect r;
+    long area = 0;
+    int x2 = x + w, y2 = y + h;
+
+    if (!cl->videoRegion || sraRgnEmpty(cl->videoRegion) || w <= 0 || h <= 0)
+        return &cl->textPolicy;
+
+    if (scaled != screen) {
+        x = x * screen->width / scaled->width;
+        y = y * screen->height / scaled->height;
+        x2 = x2 * screen->width / scaled->width;
+        y2 = y2 * screen->height / scaled->height;
+    }
+    rect = sraRgnCreateRect(x, y, x2, y2);
+    sraRgnAnd(rect, cl->videoRegion);
+    i = sraRgnGetIterator(rect);
+    while (sraRgnIteratorNext(i, &r))
+        area += (long)(r.x2 - r.x1) * (r.y2 - r.y1);
+    sraRgnReleaseIterator(i);
+    sraRgnDestroy(rect);
+
+    return 2 * area > (long)(x2 - x) * (y2 - y) ? &cl->videoPolicy : &cl->textPolicy;
+}
+
+/*
+ * Take the areas out of region (the lossy areas about to be refined) whose
+ * policy does not want them refined.  Call with updateMutex held.
+ */
+
+void
+rfbApplyRefinePolicy(rfbClientPtr cl, sraRegionPtr region)
+{
+    sraRegionPtr video;
+
+    if (cl->textPolicy.refine && cl->videoPolicy.refine)
+        return;
+
+    video = sraRgnCreate();
+    if (cl->screen->detectVideo)
+        rfbClassifierVideoRegion(cl->screen, video);
+    if (!cl->videoPolicy.refine)
+        sraRgnSubtract(region, video);
+    if (!cl->textPolicy.refine)
+        sraRgnAnd(region, video);
+    sraRgnDestroy(video);
+}
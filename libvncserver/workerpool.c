@@ -0,0 +1,185 @@
+/*
+ * workerpool.c - a fixed set of threads running queued jobs.
+ *
+ * Used by rfbRunEventLoop() to serve all clients of a screen from a few
+ * encoder threads instead of spawning two threads per client.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+
+#ifdef LIBVNCSERVER_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+typedef struct _rfbWorkerJob {
+    rfbWorkerJobProc proc;
+    void *data;
+    struct _rfbWorkerJob *next;
+} rfbWorkerJob;
+
+struct _rfbWorkerPool {
+    MUTEX(mutex);
+    COND(jobAvailable);
+    rfbWorkerJob *head, *tail;
+    /* finished job records are kept for reuse, submitting is hot */
+    rfbWorkerJob *freeJobs;
+    rfbBool shutdown;
+    int nThreads;
+    pthread_t *threads;
+};
+
+static void*
+workerRun(void *data)
+{
+    rfbWorkerPool *pool = (rfbWorkerPool*)data;
+    rfbWorkerJob *job;
+    rfbWorkerJobProc proc;
+    void *jobData;
+
+    LOCK(pool->mutex);
+    while (1) {
+	while (!pool->head && !pool->shutdown)
+	    WAIT(pool->jobAvailable, pool->mutex);
+	if (!pool->head)
+	    break;
+
+	job = pool->head;
+	pool->head = job->next;
+	if (!pool->head)
+	    pool->tail = NULL;
+	proc = job->proc;
+	jobData = job->data;
+	job->next = pool->freeJobs;
+	pool->freeJobs = job;
+	UNLOCK(pool->mutex);
+
+	proc(jobData);
+
+	LOCK(pool->mutex);
+    }
+    UNLOCK(pool->mutex);
+    return NULL;
+}
+
+int
+rfbWorkerPoolDefaultSize(void)
+{
+#if defined(LIBVNCSERVER_HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0)
+	return (int)n;
+#endif
+    return 1;
+}
+
+rfbWorkerPool*
+rfbWorkerPoolCreate(int nThreads)
+{
+    rfbWorkerPool *pool;
+    int i;
+
+    if (nThreads < 1)
+	nThreads = 1;
+
+    pool = (rfbWorkerPool*)calloc(1, sizeof(rfbWorkerPool));
+    if (!pool)
+	return NULL;
+    pool->threads = (pthread_t*)calloc(nThreads, sizeof(pthread_t));
+    if (!pool->threads) {
+	free(pool);
+	return NULL;
+    }
+    INIT_MUTEX(pool->mutex);
+    INIT_COND(pool->jobAvailable);
+
+    for (i = 0; i < nThreads; i++) {
+	if (pthread_create(&pool->threads[i], NULL, workerRun, pool) != 0) {
+	    rfbLogPerror("rfbWorkerPoolCreate: pthread_create");
+	    break;
+	}
+	pool->nThreads++;
+    }
+
+    if (pool->nThreads == 0) {
+	rfbWorkerPoolDestroy(pool);
+	return NULL;
+    }
+    return pool;
+}
+
+void
+rfbWorkerPoolSubmit(rfbWorkerPool *pool, rfbWorkerJobProc proc, void *data)
+{
+    rfbWorkerJob *job;
+
+    LOCK(pool->mutex);
+    if ((job = pool->freeJobs))
+	pool->freeJobs = job->next;
+    else if (!(job = (rfbWorkerJob*)malloc(sizeof(rfbWorkerJob)))) {
+	UNLOCK(pool->mutex);
+	/* better late than never */
+	proc(data);
+	return;
+    }
+    job->proc = proc;
+    job->data = data;
+    job->next = NULL;
+    if (pool->tail)
+	pool->tail->next = job;
+    else
+	pool->head = job;
+    pool->tail = job;
+    TSIGNAL(pool->jobAvailable);
+    UNLOCK(pool->mutex);
+}
+
+/*
+ * Runs the jobs still queued, then stops and frees the pool.  Must not be
+ * called from one of the pool's own threads.
+ */
+
+void
+rfbWorkerPoolDestroy(rfbWorkerPool *pool)
+{
+    rfbWorkerJob *job;
+    int i;
+
+    LOCK(pool->mutex);
+    pool->shutdown = TRUE;
+    pthread_cond_broadcast(&pool->jobAvailable);
+    UNLOCK(pool->mutex);
+
+    for (i = 0; i < pool->nThreads; i++)
+	pthread_join(pool->threads[i], NULL);
+
+    while ((job = pool->freeJobs)) {
+	pool->freeJobs = job->next;
+	free(job);
+    }
+    TINI_COND(pool->jobAvailable);
+    TINI_MUTEX(pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+#endif
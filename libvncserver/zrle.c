@@ -212,7 +212,19 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   memcpy(cl->updateBuf+cl->ublen, (char *)&hdr, sz_rfbZRLEHeader);
   cl->ublen += sz_rfbZRLEHeader;
 
-  /* copy into updateBuf and send from there.  Maybe should send directly? */
+  if (cl->zywrleLevel > 0)
+    rfbMarkRectLossy(cl, x, y, w, h);
+
+  /*
+   * Big ones are written straight from the stream's buffer, before the
+   * next rectangle reuses it.  Copy the rest into updateBuf.
+   */
+
+  if (ZRLE_BUFFER_LENGTH(&zos->out) >= UPDATE_BUF_SIZE
+      && rfbOutputCanReference(cl, ZRLE_BUFFER_LENGTH(&zos->out)))
+    return rfbOutputQueueReference(cl, (char *)zos->out.start,
+                                   ZRLE_BUFFER_LENGTH(&zos->out))
+      && rfbOutputWrite(cl);
 
   for (i = 0; i < ZRLE_BUFFER_LENGTH(&zos->out);) {
 
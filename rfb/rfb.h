@@ -71,6 +71,7 @@ typedef UINT32 in_addr_t;
 #define INIT_MUTEX(mutex) (rfbLog("%s:%d INIT_MUTEX(%s,0x%x)\n",__FILE__,__LINE__,#mutex,&(mutex)), pthread_mutex_init(&(mutex),NULL))
 #define TINI_MUTEX(mutex) (rfbLog("%s:%d TINI_MUTEX(%s)\n",__FILE__,__LINE__,#mutex), pthread_mutex_destroy(&(mutex)))
 #define TSIGNAL(cond) (rfbLog("%s:%d TSIGNAL(%s)\n",__FILE__,__LINE__,#cond), pthread_cond_signal(&(cond)))
+#define TBROADCAST(cond) (rfbLog("%s:%d TBROADCAST(%s)\n",__FILE__,__LINE__,#cond), pthread_cond_broadcast(&(cond)))
 #define WAIT(cond,mutex) (rfbLog("%s:%d WAIT(%s,%s)\n",__FILE__,__LINE__,#cond,#mutex), pthread_cond_wait(&(cond),&(mutex)))
 #define COND(cond) pthread_cond_t (cond)
 #define INIT_COND(cond) (rfbLog("%s:%d INIT_COND(%s)\n",__FILE__,__LINE__,#cond), pthread_cond_init(&(cond),NULL))
@@ -85,6 +86,7 @@ typedef UINT32 in_addr_t;
 #define INIT_MUTEX(mutex) pthread_mutex_init(&(mutex),NULL)
 #define TINI_MUTEX(mutex) pthread_mutex_destroy(&(mutex))
 #define TSIGNAL(cond) pthread_cond_signal(&(cond))
+#define TBROADCAST(cond) pthread_cond_broadcast(&(cond))
 #define WAIT(cond,mutex) pthread_cond_wait(&(cond),&(mutex))
 #define COND(cond) pthread_cond_t (cond)
 #define INIT_COND(cond) pthread_cond_init(&(cond),NULL)
@@ -98,6 +100,7 @@ typedef UINT32 in_addr_t;
 #define INIT_MUTEX(mutex)
 #define TINI_MUTEX(mutex)
 #define TSIGNAL(cond)
+#define TBROADCAST(cond)
 #define WAIT(cond,mutex) this_is_unsupported
 #define COND(cond)
 #define INIT_COND(cond)
@@ -129,6 +132,25 @@ struct _rfbClientRec;
 struct _rfbScreenInfo;
 struct rfbCursor;
 
+/** what rfbClassifyRect() found a rectangle to hold */
+typedef enum {
+	rfbContentSolid,
+	rfbContentText,
+	rfbContentPhoto,
+	rfbContentOther,
+	rfbContentClasses
+} rfbContentClass;
+
+/** how an area of the screen is sent to a client, see video.c */
+typedef struct {
+	/** the highest JPEG quality (0-100) Tight may use, -1 for no limit */
+	int jpegQuality;
+	/** the most updates of the area per second, 0 for no limit */
+	int maxFrameRate;
+	/** if FALSE, the area is not refined, see refine.c */
+	rfbBool refine;
+} rfbEncodingPolicy;
+
 enum rfbNewClientAction {
 	RFB_CLIENT_ACCEPT,
 	RFB_CLIENT_ON_HOLD,
@@ -317,6 +339,7 @@ typedef struct _rfbScreenInfo
 
     /* cursor */
     int cursorX, cursorY,underCursorBufferLen;
+    /** no longer used: the cursor is not drawn into the frameBuffer */
     char* underCursorBuffer;
     rfbBool dontConvertRichCursorToXCursor;
     struct rfbCursor* cursor;
@@ -390,6 +413,118 @@ typedef struct _rfbScreenInfo
     SOCKET listen6Sock;
     int http6Port;
     SOCKET httpListen6Sock;
+
+    /** if TRUE, rfbCheckFds() uses epoll(7) instead of select(), which
+     * scales with the number of ready sockets and is not limited by
+     * FD_SETSIZE. Only honoured on Linux; set it before rfbInitServer(). */
+    rfbBool useEpoll;
+    int epollFd;
+    /** if TRUE, rfbProcessEvents() only services the clients on the ready
+     * list, i.e. those that sent input or had damage, a cursor change or
+     * a resize scheduled since the last call.  Code that changes client
+     * visible state behind libvncserver's back must then call
+     * rfbScheduleClientUpdate(). */
+    rfbBool useReadyList;
+    struct _rfbClientRec* readyClientHead;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    MUTEX(readyListMutex);
+#endif
+
+    /** if not 0, rfbRunEventLoop(...,TRUE) serves all clients from one I/O
+     * thread plus this many encoder threads instead of starting two threads
+     * per client. -1 means one encoder thread per online CPU. */
+    int workerThreads;
+    struct _rfbWorkerPool* workerPool;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    pthread_t workerIoThread;
+#endif
+
+    /** if not 0, large Tight updates are cut into bands which are encoded
+     * by this many threads at once. -1 means one thread per online CPU.
+     * Set it before rfbInitServer(). */
+    int encoderThreads;
+    struct _rfbWorkerPool* encoderPool;
+
+    /** if > 0, rectangles encoded for one client are kept (up to this many
+     * bytes in total) and sent as-is to other clients which ask for the
+     * same rectangle with the same pixel format and encoding settings.
+     * Set it before rfbInitServer(). */
+    int encodeCacheSize;
+    struct _rfbEncodeCache* encodeCache;
+    /** bumped whenever framebuffer contents are marked as changed */
+    unsigned long fbGeneration;
+
+    /** if TRUE, rfbMarkRegionAsModified() compares the marked area with a
+     * shadow copy of the framebuffer in tiles of 32x32 pixels and only
+     * passes on those tiles whose contents really changed. Costs one more
+     * framebuffer worth of memory. */
+    rfbBool detectDamage;
+    char* damageShadow;
+    /** if TRUE as well, content that scrolled vertically or horizontally
+     * within the tiles that changed is found and sent as CopyRect */
+    rfbBool detectScroll;
+    /** if TRUE, damage is tracked in tiles of 64x64 pixels shared by all
+     * clients instead of in every client's modifiedRegion: marking costs
+     * the same for any number of clients, and updates are never collapsed
+     * into their bounding box.  For
+     * large framebuffers with many small changes; set it before
+     * rfbInitServer(). */
+    rfbBool tileDamage;
+    struct _rfbTileDamage* tileDamageMap;
+    /** counts the marks made in tileDamageMap */
+    unsigned long tileDamageMarks;
+    /** the count when the clients were last put on the ready list */
+    unsigned long tileDamageScheduled;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    /** client output threads waiting for tile damage wait on this */
+    MUTEX(damageMutex);
+    COND(damageCond);
+#endif
+
+    /** clients understanding fences get no new update while this many
+     * (at most RFB_MAX_FRAMES_IN_FLIGHT) have not been processed yet */
+    int maxFramesInFlight;
+    /** if > 0, no update is started for a client while what is queued for
+     * it would take longer than this many ms (or the round trip time) to
+     * arrive, and its image quality is lowered while that keeps happening */
+    int maxLatency;
+    /** if TRUE, encoders which can choose how to send a rectangle (Tight)
+     * first classify its content: text and UI are then never sent as JPEG,
+     * and photos and video go straight to JPEG if the client allows it */
+    rfbBool classifyContent;
+    struct _rfbContentClassifier* classifier;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    /** guards classifier, which marking writes and encoders read */
+    MUTEX(classifierMutex);
+#endif
+    /** if > 0, areas sent lossily (Tight JPEG, ZYWRLE) which then did not
+     * change for this many ms are sent again losslessly, a slice at a time,
+     * whenever the client has nothing else to update and its link is idle */
+    int refineDelay;
+    /** if TRUE, areas which keep changing on most frames for a while are
+     * video, and are sent with the client's videoPolicy; everything else
+     * is sent with its textPolicy.  New clients start with these two. */
+    rfbBool detectVideo;
+    rfbEncodingPolicy textPolicy;
+    rfbEncodingPolicy videoPolicy;
+
+    /** for a scaled screen: what changed since its frameBuffer was last
+     * brought up to date.  It is only rescaled where a client using it is
+     * about to be sent something. */
+    struct sraRegion* scaledScreenDirty;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    /** guards scaledScreenDirty; on the original screen, the list of scaled
+     * screens and their reference counts */
+    MUTEX(scaledScreenMutex);
+    /** held while the scaled frameBuffer is being written */
+    MUTEX(scaledScreenRefreshMutex);
+#endif
+    /** scaled screens no client uses any more are kept for reuse, up to
+     * this many bytes in total; the one left the longest ago goes first */
+    int scaledScreenCacheSize;
+    /** when a scaled screen was last left by a client; on the original
+     * screen, the clock for this */
+    unsigned long scaledScreenLastUsed;
 } rfbScreenInfo, *rfbScreenInfoPtr;
 
 
@@ -439,6 +574,21 @@ typedef struct _rfbStatList {
 typedef struct _rfbSslCtx rfbSslCtx;
 typedef struct _wsCtx wsCtx;
 
+/** how many sent updates are remembered for the Fence extension */
+#define RFB_MAX_FRAMES_IN_FLIGHT 16
+
+/** how many copies a client can have pending before the oldest is sent as pixels */
+#define RFB_MAX_COPY_MOVES 8
+
+/**
+ * A pending CopyRect: region (the destination) gets the pixels found at
+ * (-dx,-dy) from it.
+ */
+typedef struct {
+    sraRegionPtr region;
+    int dx, dy;
+} rfbCopyMove;
+
 typedef struct _rfbClientRec {
 
     /** back pointer to the screen */
@@ -530,22 +680,24 @@ typedef struct _rfbClientRec {
        (modifiedRegion).
 
        If the client does accept CopyRect encoding, then the update consists of
-       two parts.  First we have a single copy from one region of the screen to
-       another (the destination of the copy is copyRegion), and second we have
-       the region of the screen which has been modified in some other way
-       (modifiedRegion).
+       two parts.  First we have up to RFB_MAX_COPY_MOVES copies from one
+       region of the screen to another (copyMoves, oldest first; copyRegion
+       is the union of their destinations), and second we have the region of
+       the screen which has been modified in some other way (modifiedRegion).
 
-       Although the copy is of a single region, this region may have many
-       rectangles.  When sending an update, the copyRegion is always sent
+       Each copy region may have many rectangles.  When sending an update,
+       the copies are always sent in the order they were scheduled, and
        before the modifiedRegion.  This is because the modifiedRegion may
-       overlap parts of the screen which are in the source of the copy.
+       overlap parts of the screen which are in the source of a copy, and a
+       copy may read what an earlier one wrote.
 
        In fact during normal processing, the modifiedRegion may even overlap
-       the destination copyRegion.  Just before an update is sent we remove
-       from the copyRegion anything in the modifiedRegion. */
+       the destination of a copy.  Just before an update is sent we remove
+       from the copies anything in the modifiedRegion that no later copy
+       reads from. */
 
-    sraRegionPtr copyRegion;	/**< the destination region of the copy */
-    int copyDX, copyDY;		/**< the translation by which the copy happens */
+    sraRegionPtr copyRegion;	/**< the union of the destinations of the copies */
+    int copyDX, copyDY;		/**< the translation of the latest copy */
 
     sraRegionPtr modifiedRegion;
 
@@ -696,6 +848,98 @@ typedef struct _rfbClientRec {
     wsCtx     *wsctx;
     char *wspath;                          /* Requests path component */
 #endif
+
+    /** link in the screen's ready list, see rfbScheduleClientUpdate() */
+    struct _rfbClientRec *readyNext;
+    rfbBool onReadyList;
+    /** an update for this client is queued on the screen's worker pool */
+    rfbBool updateJobQueued;
+    /** bytes of the rectangle being encoded for the encode-once cache;
+     * encodeCaptureFrom is the offset into updateBuf where it starts, or -1
+     * if not capturing */
+    char *encodeCaptureBuf;
+    int encodeCaptureLen;
+    int encodeCaptureSize;
+    int encodeCaptureFrom;
+
+    /** Fence extension: every update is followed by a fence request, the
+     * client echoes it once it has processed the update.  framesSent and
+     * framesAcked count those fences, fenceSentTime is when each of the
+     * last RFB_MAX_FRAMES_IN_FLIGHT was sent, and roundTripTime (in ms) is
+     * how long the last answer took. */
+    rfbBool enableFence;
+    uint32_t framesSent;
+    uint32_t framesAcked;
+    struct timeval fenceSentTime[RFB_MAX_FRAMES_IN_FLIGHT];
+    int roundTripTime;
+    /** ContinuousUpdates extension: while continuousUpdates is on, the
+     * client is sent changes in continuousRegion without asking for them */
+    rfbBool enableContinuousUpdates;
+    rfbBool continuousUpdates;
+    sraRegionPtr continuousRegion;
+
+    /** bytes handed to the socket so far */
+    unsigned long bytesWritten;
+    /** congestion control state, see rfbClientCongested() */
+    struct _rfbCongestion* congestion;
+    /** what is queued to be written, see output.c */
+    struct _rfbOutput* output;
+    /** set in the copies of a client which encode parts of its update in
+     * parallel, see parallel.c: the client they encode for, and the one
+     * Tight zlib stream of it they use */
+    struct _rfbClientRec* encodeParent;
+    int encodeStream;
+    /** lossless refinement state, see refine.c */
+    sraRegionPtr lossyRegion;
+    sraRegionPtr lossyRecentRegion;
+    sraRegionPtr lossyIdleRegion;
+    sraRegionPtr lossyNewRegion;
+    struct timeval lossyTick;
+    rfbBool refinePending;
+    /** set while an update is encoded which must not be lossy */
+    rfbBool losslessUpdate;
+    /** the policies for the client's video areas and the rest of the
+     * screen, copied from the screen's; they may be changed any time */
+    rfbEncodingPolicy textPolicy;
+    rfbEncodingPolicy videoPolicy;
+    /** the video areas of the update being sent, see video.c */
+    sraRegionPtr videoRegion;
+    struct timeval lastTextUpdate;
+    struct timeval lastVideoUpdate;
+    /** statistics: pixels sent with the video policy, and how often the
+     * frame rate of an area held it back */
+    unsigned long videoPixels;
+    int framesHeldBack;
+    /** with screen->tileDamage: the generation of each tile taken into
+     * modifiedRegion, and the screen's tileDamageMarks at the time */
+    unsigned long *tileDamageSeen;
+    unsigned long tileDamageMarks;
+    /** the tile map tileDamageSeen was taken from */
+    struct _rfbTileDamage* tileDamageSeenMap;
+    /** the cursor drawn over a copy of what is under it, for clients
+     * without cursor shape updates, see cursor.c */
+    struct _rfbCursorOverlay* cursorOverlay;
+    /** the output thread waits on the screen's damageCond, and was asked
+     * to wake up for something else; protected by damageMutex */
+    rfbBool waitingForDamage;
+    rfbBool damageWakeUp;
+    /** the scaled screen asked for last, taken for scaledScreen before the
+     * next update; protected by updateMutex */
+    struct _rfbScreenInfo* scaledScreenPending;
+    /** the pending copies, oldest first, see copyRegion above */
+    rfbCopyMove copyMoves[RFB_MAX_COPY_MOVES];
+    int nCopyMoves;
+    /** statistics: rectangles and pixels sent per content class */
+    int contentClassRects[rfbContentClasses];
+    unsigned long contentClassPixels[rfbContentClasses];
+    /** the buffers and state of the Tight encoder, see tight.c; the copies
+     * encoding in parallel use the one of their stream */
+    struct _rfbTightContext* tightContext;
+    struct _rfbTightContext* tightCopyContext[4];
+    /** the client's H.264 stream, see h264.c */
+    struct _rfbH264Context* h264Context;
+    /** the Tight zlib streams to reset with the next control byte */
+    int zsResetPending;
 } rfbClientRec, *rfbClientPtr;
 
 /**
@@ -708,8 +952,10 @@ typedef struct _rfbClientRec {
      (((cl)->enableCursorShapeUpdates == FALSE &&                          \
        ((cl)->cursorX != (cl)->screen->cursorX ||                          \
 	(cl)->cursorY != (cl)->screen->cursorY))) ||                       \
-     ((cl)->useNewFBSize && (cl)->newFBSizePending) ||                     \
+     ((cl)->useNewFBSize &&                                                \
+      ((cl)->newFBSizePending || (cl)->scaledScreenPending)) ||            \
      ((cl)->enableCursorPosUpdates && (cl)->cursorWasMoved) ||             \
+     (cl)->tileDamageMarks != (cl)->screen->tileDamageMarks ||            \
      !sraRgnEmpty((cl)->copyRegion) || !sraRgnEmpty((cl)->modifiedRegion))
 
 /*
@@ -896,6 +1142,9 @@ extern int rfbNumCodedRectsTight(rfbClientPtr cl, int x,int y,int w,int h);
 
 extern rfbBool rfbSendRectEncodingTight(rfbClientPtr cl, int x,int y,int w,int h);
 
+extern unsigned long rfbTightMemoryUsage(rfbClientPtr cl);
+extern void rfbTightReleaseMemory(rfbClientPtr cl);
+
 #if defined(LIBVNCSERVER_HAVE_LIBPNG)
 extern rfbBool rfbSendRectEncodingTightPng(rfbClientPtr cl, int x,int y,int w,int h);
 #endif
@@ -903,6 +1152,12 @@ extern rfbBool rfbSendRectEncodingTightPng(rfbClientPtr cl, int x,int y,int w,in
 #endif
 #endif
 
+#ifdef LIBVNCSERVER_HAVE_H264
+/* h264.c */
+
+extern rfbBool rfbSendRectEncodingH264(rfbClientPtr cl, int x,int y,int w,int h);
+#endif
+
 
 /* cursor.c */
 
@@ -944,6 +1199,12 @@ extern rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w,int
 extern void rfbResetStats(rfbClientPtr cl);
 extern void rfbPrintStats(rfbClientPtr cl);
 
+/* scale.c */
+
+/** bytes taken by the scaled versions of rfbScreen; if unused is not NULL,
+ * it is set to the part taken by those kept without clients */
+extern unsigned long rfbScaledScreenMemory(rfbScreenInfoPtr rfbScreen, unsigned long *unused);
+
 /* font.c */
 
 typedef struct rfbFontData {
@@ -1013,6 +1274,7 @@ void rfbDoCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,int dx,i
 
 void rfbMarkRectAsModified(rfbScreenInfoPtr rfbScreen,int x1,int y1,int x2,int y2);
 void rfbMarkRegionAsModified(rfbScreenInfoPtr rfbScreen,sraRegionPtr modRegion);
+void rfbScheduleClientUpdate(rfbClientPtr cl);
 void rfbDoNothingWithClient(rfbClientPtr cl);
 enum rfbNewClientAction defaultNewClientHook(rfbClientPtr cl);
 void rfbRegisterProtocolExtension(rfbProtocolExtension* extension);
@@ -1085,6 +1347,8 @@ extern int rfbStatGetMessageCountSent(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetMessageCountRcvd(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetEncodingCountSent(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type);
+extern void rfbStatRecordContentClass(rfbClientPtr cl, rfbContentClass contentClass, int w, int h);
+extern int rfbStatGetContentClassCount(rfbClientPtr cl, rfbContentClass contentClass);
 
 /** Set which version you want to advertise 3.3, 3.6, 3.7 and 3.8 are currently supported*/
 extern void rfbSetProtocolVersion(rfbScreenInfoPtr rfbScreen, int major_, int minor_);
@@ -432,6 +432,12 @@ typedef struct _rfbClient {
 
 #endif
 #endif
+
+#ifdef LIBVNCSERVER_HAVE_H264
+	/** H.264 decoder state, and the rectangle its stream is for */
+	void* h264Decoder;
+	int h264X, h264Y, h264Width, h264Height;
+#endif
 } rfbClient;
 
 /* cursor.c */
@@ -393,6 +393,7 @@ typedef struct {
 /* Modif sf@2002 */
 #define rfbResizeFrameBuffer 4
 #define rfbPalmVNCReSizeFrameBuffer 0xF
+#define rfbEndOfContinuousUpdates 150
 
 /* client -> server */
 
@@ -418,6 +419,9 @@ typedef struct {
 #define rfbPalmVNCSetScaleFactor 0xF
 /* Xvp message - bidirectional */
 #define rfbXvp 250
+#define rfbEnableContinuousUpdates 150
+/* Fence message - bidirectional */
+#define rfbFence 248
 
 
 
@@ -459,6 +463,10 @@ typedef struct {
 /* Xvp pseudo-encoding */
 #define rfbEncodingXvp 			 0xFFFFFECB
 
+/* Fence and ContinuousUpdates pseudo-encodings */
+#define rfbEncodingFence               0xFFFFFEC8 /* -312 */
+#define rfbEncodingContinuousUpdates   0xFFFFFEC7 /* -313 */
+
 /*
  * Special encoding numbers:
  *   0xFFFFFD00 .. 0xFFFFFD05 -- subsampling level
@@ -930,6 +938,27 @@ typedef struct {
 #define rfbZRLETileHeight 64
 
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * H.264 - the rectangle is one picture of an H.264 stream.  The header is
+ * followed by length bytes of NAL units in Annex B format, which decode to
+ * a picture at least as large as the rectangle, rounded up to even sizes.
+ * Each rectangle position and size is a stream of its own; the decoder for
+ * it is reset before decoding if flags has rfbH264ResetContext set, and all
+ * decoders are if it has rfbH264ResetAllContexts.  The first picture after
+ * a reset is an IDR picture.
+ */
+
+typedef struct {
+    uint32_t length;
+    uint32_t flags;
+} rfbH264Header;
+
+#define sz_rfbH264Header 8
+
+#define rfbH264ResetContext 1
+#define rfbH264ResetAllContexts 2
+
+
 /*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * ZLIBHEX - zlib compressed Hextile Encoding.  Essentially, this is the
  * hextile encoding with zlib compression on the tiles that can not be
@@ -1133,6 +1162,49 @@ typedef struct {
 #define rfbXvp_Reset 4
 
 
+/*-----------------------------------------------------------------------------
+ * Fence Message
+ * Bidirectional message, only sent to clients which asked for the Fence
+ * pseudo-encoding.  A fence with rfbFenceFlagRequest set must be answered
+ * with the same data and the flags the receiver understood, request cleared.
+ * With rfbFenceFlagBlockBefore, the answer is sent only once everything
+ * received before the fence is handled; with rfbFenceFlagBlockAfter nothing
+ * received after it is handled before the answer is sent.  The server uses
+ * fences after updates to see how many of them the client has not yet
+ * processed.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbFence */
+    uint8_t pad[3];
+    uint32_t flags;
+    uint8_t length;			/* followed by length bytes of data */
+} rfbFenceMsg;
+
+#define sz_rfbFenceMsg 9
+
+#define rfbFenceFlagBlockBefore  0x00000001
+#define rfbFenceFlagBlockAfter   0x00000002
+#define rfbFenceFlagSyncNext     0x00000004
+#define rfbFenceFlagRequest      0x80000000
+
+#define rfbFenceMaxLength 64
+
+
+/*-----------------------------------------------------------------------------
+ * EndOfContinuousUpdates
+ * Sent once when the client asks for the ContinuousUpdates pseudo-encoding,
+ * to say the server supports it, and whenever continuous updates have been
+ * switched off.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbEndOfContinuousUpdates */
+} rfbEndOfContinuousUpdatesMsg;
+
+#define sz_rfbEndOfContinuousUpdatesMsg 1
+
+
 /*-----------------------------------------------------------------------------
  * Modif sf@2002
  * ResizeFrameBuffer - The Client must change the size of its framebuffer  
@@ -1187,6 +1259,8 @@ typedef union {
 	rfbFileTransferMsg ft;
 	rfbTextChatMsg tc;
         rfbXvpMsg xvp;
+        rfbFenceMsg f;
+        rfbEndOfContinuousUpdatesMsg eocu;
 } rfbServerToClientMsg;
 
 
@@ -1422,6 +1496,25 @@ typedef struct _rfbSetSWMsg {
 #define sz_rfbSetSWMsg 6
 
 
+/*-----------------------------------------------------------------------------
+ * EnableContinuousUpdates - with enable set, the server sends updates of the
+ * given rectangle whenever it changes, without waiting for a
+ * FramebufferUpdateRequest.  Only sent to servers which have answered the
+ * ContinuousUpdates pseudo-encoding with an EndOfContinuousUpdates.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbEnableContinuousUpdates */
+    uint8_t enable;
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} rfbEnableContinuousUpdatesMsg;
+
+#define sz_rfbEnableContinuousUpdatesMsg 10
+
+
 
 /*-----------------------------------------------------------------------------
  * Union of all client->server messages.
@@ -1443,6 +1536,8 @@ typedef union {
 	rfbSetSWMsg sw;
 	rfbTextChatMsg tc;
         rfbXvpMsg xvp;
+        rfbFenceMsg f;
+        rfbEnableContinuousUpdatesMsg ecu;
 } rfbClientToServerMsg;
 
 /* 
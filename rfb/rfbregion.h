@@ -43,8 +43,8 @@ extern sraRegion *sraRgnBBox(const sraRegion *src);
 
 typedef struct sraRectangleIterator {
   rfbBool reverseX,reverseY;
-  int ptrSize,ptrPos;
-  struct sraSpan** sPtrs;
+  struct sraRegionData* data;
+  int bandStart,bandEnd,pos;
 } sraRectangleIterator;
 
 extern sraRectangleIterator *sraRgnGetIterator(sraRegion *s);
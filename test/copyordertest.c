@@ -0,0 +1,212 @@
+/*
+ * Scrolls and paints the framebuffer several times between two updates, so
+ * that clients have many copies pending which overlap each other and the
+ * painted areas, and checks that a CopyRect client ends up with the same
+ * picture every time.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <time.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test need pthread support (otherwise the client blocks the client)
+#endif
+
+static const int width=320,height=240;
+#define ROUNDS 300
+
+static MUTEX(updatesMutex);
+static int updatesFinished;
+static rfbBool clientDone,stopClient;
+
+static rfbBool resize(rfbClient* client) {
+	if(client->frameBuffer)
+		free(client->frameBuffer);
+	client->frameBuffer=malloc(client->width*client->height*client->format.bitsPerPixel/8);
+	if(!client->frameBuffer)
+		return FALSE;
+	SendFramebufferUpdateRequest(client,0,0,client->width,client->height,FALSE);
+	return TRUE;
+}
+
+static void update_finished(rfbClient* client) {
+	LOCK(updatesMutex);
+	updatesFinished++;
+	UNLOCK(updatesMutex);
+}
+
+static void* clientLoop(void* data) {
+	rfbClient* client=(rfbClient*)data;
+	int n;
+
+	if(rfbInitClient(client,NULL,NULL)) {
+		while(1) {
+			LOCK(updatesMutex);
+			if(stopClient) {
+				UNLOCK(updatesMutex);
+				break;
+			}
+			UNLOCK(updatesMutex);
+			n=WaitForMessage(client,10000);
+			if(n<0 || (n>0 && !HandleRFBServerMessage(client)))
+				break;
+		}
+		if(client->frameBuffer)
+			free(client->frameBuffer);
+		rfbClientCleanup(client);
+	} else
+		rfbClientErr("Had problems starting client\n");
+	LOCK(updatesMutex);
+	clientDone=TRUE;
+	UNLOCK(updatesMutex);
+	return NULL;
+}
+
+static rfbBool framebuffersMatch(rfbScreenInfoPtr server,rfbClient* client)
+{
+	int i,j;
+
+	if(!client->frameBuffer || client->width!=server->width || client->height!=server->height)
+		return FALSE;
+	for(j=0;j<server->height;j++)
+		for(i=0;i<server->width;i++)
+			if(memcmp(server->frameBuffer+j*server->paddedWidthInBytes+i*4,
+				  client->frameBuffer+(j*client->width+i)*4,3))
+				return FALSE;
+	return TRUE;
+}
+
+/* send whatever is pending, until the client shows the same as the server */
+static rfbBool waitForClient(rfbScreenInfoPtr server,rfbClient* client)
+{
+	time_t t=time(NULL);
+	int seen=-1,n;
+	rfbBool done;
+
+	while(time(NULL)-t<5) {
+		rfbProcessEvents(server,10000);
+		LOCK(updatesMutex);
+		n=updatesFinished;
+		done=clientDone;
+		UNLOCK(updatesMutex);
+		if(done)
+			return FALSE;
+		/* the client only touches its framebuffer while it is in an update */
+		if(n!=seen) {
+			seen=n;
+			if(n>0 && framebuffersMatch(server,client))
+				return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void paint(rfbScreenInfoPtr server)
+{
+	int x1=rand()%width,y1=rand()%height,x2=x1+1+rand()%60,y2=y1+1+rand()%60,i,j;
+	unsigned char c=rand();
+
+	if(x2>width) x2=width;
+	if(y2>height) y2=height;
+	for(j=y1;j<y2;j++)
+		for(i=x1;i<x2;i++)
+			memset(server->frameBuffer+j*server->paddedWidthInBytes+i*4,c+i+j,4);
+	rfbMarkRectAsModified(server,x1,y1,x2,y2);
+}
+
+/* move a random area by a random amount, mostly overlapping itself */
+static void scroll(rfbScreenInfoPtr server)
+{
+	int dx=rand()%41-20,dy=rand()%41-20;
+	int x1=rand()%width,y1=rand()%height,x2=x1+1+rand()%(width/2),y2=y1+1+rand()%(height/2);
+
+	if(dx==0 && dy==0)
+		dy=1;
+	/* both the destination and the source must be on the screen */
+	if(x1<dx) x1=dx;
+	if(y1<dy) y1=dy;
+	if(x2>width) x2=width;
+	if(y2>height) y2=height;
+	if(x2>width+dx) x2=width+dx;
+	if(y2>height+dy) y2=height+dy;
+	if(x1<0) x1=0;
+	if(y1<0) y1=0;
+	if(x1>=x2 || y1>=y2)
+		return;
+	rfbDoCopyRect(server,x1,y1,x2,y2,dx,dy);
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	pthread_t thread;
+	int i,j,round,failed=0;
+	rfbBool done;
+
+	server=rfbGetScreen(&argc,argv,width,height,8,3,4);
+	if(!server)
+		return 0;
+	server->frameBuffer=malloc(width*height*4);
+	for(j=0;j<width*height*4;j++)
+		server->frameBuffer[j]=j*7;
+	server->deferUpdateTime=0;
+	server->autoPort=TRUE;
+	rfbInitServer(server);
+	INIT_MUTEX(updatesMutex);
+
+	client=rfbGetClient(8,3,4);
+	client->MallocFrameBuffer=resize;
+	client->FinishedFrameBufferUpdate=update_finished;
+	client->appData.encodingsString="copyrect raw";
+	/* keep the cursor out of the framebuffer */
+	client->appData.useRemoteCursor=TRUE;
+	free(client->serverHost);
+	client->serverHost=strdup("127.0.0.1");
+	client->serverPort=server->port;
+	pthread_create(&thread,NULL,clientLoop,client);
+
+	srand(1);
+	if(!waitForClient(server,client)) {
+		fprintf(stderr,"the client never showed the framebuffer\n");
+		failed=1;
+	}
+	for(round=0;round<ROUNDS && !failed;round++) {
+		/* more copies than a client can keep, now and then */
+		int n=1+rand()%(RFB_MAX_COPY_MOVES+4);
+
+		for(i=0;i<n;i++)
+			if(rand()%3)
+				scroll(server);
+			else
+				paint(server);
+		/* so there is always something to send */
+		paint(server);
+		if(!waitForClient(server,client)) {
+			fprintf(stderr,"the client's framebuffer differs after round %d\n",round);
+			failed=1;
+		}
+	}
+
+	/* let the client hang up first, so the server sees it go */
+	LOCK(updatesMutex);
+	stopClient=TRUE;
+	UNLOCK(updatesMutex);
+	do {
+		rfbProcessEvents(server,10000);
+		LOCK(updatesMutex);
+		done=clientDone;
+		UNLOCK(updatesMutex);
+	} while(!done);
+	pthread_join(thread,NULL);
+	for(i=0;i<10;i++)
+		rfbProcessEvents(server,10000);
+	rfbShutdownServer(server,TRUE);
+	free(server->frameBuffer);
+	rfbScreenCleanup(server);
+	return failed;
+}
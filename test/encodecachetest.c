@@ -0,0 +1,221 @@
+/*
+ * Checks that clients with equal settings share encoded rectangles, and
+ * that what they get from the cache decodes to the same picture as what
+ * the first client got encoded for itself.
+ *
+ * The framebuffer is changed without being marked before the second
+ * client connects: only a rectangle taken from the cache shows it the
+ * picture the first client was sent, so the test can tell a hit from a
+ * fresh encoding.  After marking the whole framebuffer, both clients must
+ * show the new contents, and a client connecting later gets those from
+ * the cache again.  Tight rectangles in the cache start by resetting the
+ * client's zlib streams; the first client decodes them after its streams
+ * were in use.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <time.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test need pthread support (otherwise the client blocks the server)
+#endif
+
+static const int width=320,height=240;
+static int failed;
+
+static void fail(const char* encoding,const char* what)
+{
+	fprintf(stderr,"%s: %s\n",encoding,what);
+	failed=1;
+}
+
+/* solid blocks, text-like stripes of a few colours, and noise */
+static void fill(rfbScreenInfoPtr server,unsigned int seed)
+{
+	int i,j;
+
+	for(j=0;j<height;j++)
+		for(i=0;i<width;i++) {
+			unsigned char* p=(unsigned char*)server->frameBuffer+j*server->paddedWidthInBytes+i*4;
+
+			if(i<width/3) {
+				p[0]=seed*40+(j/60)*60;
+				p[1]=seed*7;
+				p[2]=(i/32)*80;
+			} else if(i<2*width/3) {
+				p[0]=p[1]=p[2]=((i+seed)%7<2 || (j+seed)%11<3)?0:255;
+				p[2]^=(j/16)&1?0x80:0;
+			} else {
+				p[0]=rand_r(&seed);
+				p[1]=rand_r(&seed);
+				p[2]=rand_r(&seed);
+			}
+			p[3]=0;
+		}
+}
+
+static int updates(rfbClient* client)
+{
+	return (int)(intptr_t)rfbClientGetClientData(client,(void*)fill);
+}
+
+static void updateFinished(rfbClient* client)
+{
+	rfbClientSetClientData(client,(void*)fill,(void*)(intptr_t)(updates(client)+1));
+}
+
+/* the client shows what the server does */
+static rfbBool matchesServer(rfbScreenInfoPtr server,rfbClient* client)
+{
+	int i,j;
+
+	for(j=0;j<height;j++)
+		for(i=0;i<width;i++)
+			if(memcmp(server->frameBuffer+j*server->paddedWidthInBytes+i*4,
+				  client->frameBuffer+(j*width+i)*4,3))
+				return FALSE;
+	return TRUE;
+}
+
+/* the two clients show bit for bit the same */
+static rfbBool matchesClient(rfbClient* a,rfbClient* b)
+{
+	return !memcmp(a->frameBuffer,b->frameBuffer,width*height*4);
+}
+
+/* handle messages until the client finished an update after the count given */
+static rfbBool waitForUpdate(rfbClient* client,int after)
+{
+	time_t t=time(NULL);
+	int n;
+
+	while(updates(client)<=after) {
+		if(time(NULL)-t>5)
+			return FALSE;
+		n=WaitForMessage(client,100000);
+		if(n<0 || (n>0 && !HandleRFBServerMessage(client)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* handle messages until the client shows what the server does */
+static rfbBool waitForServer(rfbScreenInfoPtr server,rfbClient* client)
+{
+	time_t t=time(NULL);
+	int n;
+
+	while(updates(client)==0 || !matchesServer(server,client)) {
+		if(time(NULL)-t>5)
+			return FALSE;
+		n=WaitForMessage(client,100000);
+		if(n<0 || (n>0 && !HandleRFBServerMessage(client)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static rfbClient* connectClient(rfbScreenInfoPtr server,const char* encoding)
+{
+	rfbClient* client=rfbGetClient(8,3,4);
+
+	client->FinishedFrameBufferUpdate=updateFinished;
+	client->appData.encodingsString=encoding;
+	client->appData.compressLevel=6;
+	client->appData.enableJPEG=FALSE;
+	/* keep the cursor out of the framebuffer */
+	client->appData.useRemoteCursor=TRUE;
+	free(client->serverHost);
+	client->serverHost=strdup("127.0.0.1");
+	client->serverPort=server->port;
+	if(!rfbInitClient(client,NULL,NULL)) {
+		fail(encoding,"could not connect to the server");
+		return NULL;
+	}
+	return client;
+}
+
+static void closeClient(rfbClient* client)
+{
+	if(!client)
+		return;
+	free(client->frameBuffer);
+	rfbClientCleanup(client);
+}
+
+static void checkEncoding(rfbScreenInfoPtr server,const char* encoding,unsigned int seed)
+{
+	rfbClient *first,*second=NULL,*third=NULL;
+
+	fill(server,seed);
+	rfbMarkRectAsModified(server,0,0,width,height);
+	first=connectClient(server,encoding);
+	if(!first)
+		return;
+	if(!waitForServer(server,first)) {
+		fail(encoding,"the first client never showed the framebuffer");
+		goto done;
+	}
+
+	/* not marked: only the cache still has the old picture */
+	fill(server,seed+1);
+	second=connectClient(server,encoding);
+	if(!second)
+		goto done;
+	if(!waitForUpdate(second,0))
+		fail(encoding,"the second client got no update");
+	else if(!matchesClient(first,second))
+		fail(encoding,"the second client was not sent the cached rectangles");
+
+	/* a new generation: nothing old may come from the cache */
+	rfbMarkRectAsModified(server,0,0,width,height);
+	if(!waitForServer(server,first) || !waitForServer(server,second))
+		fail(encoding,"the clients do not show the framebuffer after it was marked");
+	else if(!matchesClient(first,second))
+		fail(encoding,"the clients differ after the framebuffer was marked");
+
+	/* and what was encoded for it is shared again */
+	fill(server,seed+2);
+	third=connectClient(server,encoding);
+	if(!third)
+		goto done;
+	if(!waitForUpdate(third,0))
+		fail(encoding,"the third client got no update");
+	else if(!matchesClient(first,third))
+		fail(encoding,"the third client was not sent the cached rectangles");
+
+done:
+	closeClient(third);
+	closeClient(second);
+	closeClient(first);
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+
+	server=rfbGetScreen(&argc,argv,width,height,8,3,4);
+	if(!server)
+		return 0;
+	server->frameBuffer=calloc(width*height*4,1);
+	server->deferUpdateTime=0;
+	server->autoPort=TRUE;
+	server->ipv6port=0;
+	server->encodeCacheSize=8*1024*1024;
+	rfbInitServer(server);
+	rfbRunEventLoop(server,-1,TRUE);
+
+	checkEncoding(server,"hextile",1);
+#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+	checkEncoding(server,"tight",5);
+#endif
+
+	rfbShutdownServer(server,TRUE);
+	free(server->frameBuffer);
+	rfbScreenCleanup(server);
+	return failed;
+}
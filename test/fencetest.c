@@ -0,0 +1,330 @@
+/*
+ * Speaks the Fence and ContinuousUpdates extensions to a server by hand,
+ * since libvncclient does not know them, and checks what comes back:
+ * fences are answered with the right flags and data, updates are pushed
+ * while continuous updates are on, no more than maxFramesInFlight updates
+ * go out before their fences are answered, switching continuous updates
+ * off is confirmed, and malformed or unnegotiated messages close the
+ * connection.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test need pthread support (otherwise the client blocks the server)
+#endif
+
+static const int width=64,height=64;
+
+typedef struct {
+	int type;
+	/* FramebufferUpdate */
+	int nRects;
+	/* Fence */
+	uint32_t flags;
+	int length;
+	char data[rfbFenceMaxLength];
+} message;
+
+static int failed;
+
+static void fail(const char* what)
+{
+	fprintf(stderr,"%s\n",what);
+	failed=1;
+}
+
+/* nothing from the server for a while */
+static rfbBool quiet(rfbClient* client)
+{
+	return client->buffered==0 && WaitForMessage(client,300000)==0;
+}
+
+/* the next message from the server, if it comes within 5 seconds */
+static rfbBool readMessage(rfbClient* client,message* m)
+{
+	rfbFramebufferUpdateMsg fu;
+	rfbFramebufferUpdateRectHeader rect;
+	rfbFenceMsg f;
+	char pixels[1024];
+	uint8_t type;
+	int i,size,n;
+
+	if(client->buffered==0 && WaitForMessage(client,5000000)<=0)
+		return FALSE;
+	if(!ReadFromRFBServer(client,(char*)&type,1))
+		return FALSE;
+	m->type=type;
+	switch(type) {
+	case rfbFramebufferUpdate:
+		if(!ReadFromRFBServer(client,((char*)&fu)+1,sz_rfbFramebufferUpdateMsg-1))
+			return FALSE;
+		m->nRects=rfbClientSwap16IfLE(fu.nRects);
+		for(i=0;i<m->nRects;i++) {
+			if(!ReadFromRFBServer(client,(char*)&rect,sz_rfbFramebufferUpdateRectHeader))
+				return FALSE;
+			if(rfbClientSwap32IfLE(rect.encoding)!=rfbEncodingRaw) {
+				fail("an update has a rectangle that is not Raw");
+				return FALSE;
+			}
+			size=rfbClientSwap16IfLE(rect.r.w)*rfbClientSwap16IfLE(rect.r.h)
+				*client->si.format.bitsPerPixel/8;
+			for(;size>0;size-=n) {
+				n=size<(int)sizeof(pixels)?size:(int)sizeof(pixels);
+				if(!ReadFromRFBServer(client,pixels,n))
+					return FALSE;
+			}
+		}
+		return TRUE;
+	case rfbFence:
+		if(!ReadFromRFBServer(client,((char*)&f)+1,sz_rfbFenceMsg-1))
+			return FALSE;
+		m->flags=rfbClientSwap32IfLE(f.flags);
+		m->length=f.length;
+		if(m->length>rfbFenceMaxLength) {
+			fail("the server sent a fence with too much data");
+			return FALSE;
+		}
+		return ReadFromRFBServer(client,m->data,m->length);
+	case rfbEndOfContinuousUpdates:
+		return TRUE;
+	}
+	fprintf(stderr,"unexpected message type %d\n",type);
+	failed=1;
+	return FALSE;
+}
+
+static rfbBool expectMessage(rfbClient* client,message* m,int type,const char* what)
+{
+	if(!readMessage(client,m) || m->type!=type) {
+		fail(what);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void sendFence(rfbClient* client,uint32_t flags,const char* data,int length)
+{
+	char buf[sz_rfbFenceMsg+256];
+	rfbFenceMsg f;
+
+	f.type=rfbFence;
+	f.pad[0]=f.pad[1]=f.pad[2]=0;
+	f.flags=rfbClientSwap32IfLE(flags);
+	f.length=length;
+	memcpy(buf,(char*)&f,sz_rfbFenceMsg);
+	memcpy(buf+sz_rfbFenceMsg,data,length);
+	WriteToRFBServer(client,buf,sz_rfbFenceMsg+length);
+}
+
+static void sendEnableContinuousUpdates(rfbClient* client,rfbBool enable)
+{
+	char buf[sz_rfbEnableContinuousUpdatesMsg];
+	rfbEnableContinuousUpdatesMsg ecu;
+
+	ecu.type=rfbEnableContinuousUpdates;
+	ecu.enable=enable?1:0;
+	ecu.x=ecu.y=0;
+	ecu.w=rfbClientSwap16IfLE(width);
+	ecu.h=rfbClientSwap16IfLE(height);
+	memcpy(buf,(char*)&ecu,sz_rfbEnableContinuousUpdatesMsg);
+	WriteToRFBServer(client,buf,sz_rfbEnableContinuousUpdatesMsg);
+}
+
+/* Raw, and the two extensions if asked for */
+static void sendEncodings(rfbClient* client,rfbBool extensions)
+{
+	char buf[sz_rfbSetEncodingsMsg+3*4];
+	rfbSetEncodingsMsg se;
+	uint32_t encodings[3];
+
+	se.type=rfbSetEncodings;
+	se.pad=0;
+	se.nEncodings=rfbClientSwap16IfLE(extensions?3:1);
+	encodings[0]=rfbClientSwap32IfLE(rfbEncodingRaw);
+	encodings[1]=rfbClientSwap32IfLE(rfbEncodingFence);
+	encodings[2]=rfbClientSwap32IfLE(rfbEncodingContinuousUpdates);
+	memcpy(buf,(char*)&se,sz_rfbSetEncodingsMsg);
+	memcpy(buf+sz_rfbSetEncodingsMsg,(char*)encodings,sizeof(encodings));
+	WriteToRFBServer(client,buf,sz_rfbSetEncodingsMsg+(extensions?3:1)*4);
+}
+
+/* an update, and the fence request behind it, which is returned in fence */
+static rfbBool expectUpdate(rfbClient* client,message* fence,const char* what)
+{
+	message m;
+
+	if(!expectMessage(client,&m,rfbFramebufferUpdate,what))
+		return FALSE;
+	if(!expectMessage(client,fence,rfbFence,"an update is not followed by a fence"))
+		return FALSE;
+	if(fence->flags!=(rfbFenceFlagRequest|rfbFenceFlagBlockBefore) || fence->length!=4) {
+		fail("the fence after an update is not a request with a frame number");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void answerFence(rfbClient* client,message* fence)
+{
+	sendFence(client,fence->flags&~rfbFenceFlagRequest,fence->data,fence->length);
+}
+
+static void paint(rfbScreenInfoPtr server,int x,int y)
+{
+	int j;
+
+	for(j=y;j<y+8;j++)
+		memset(server->frameBuffer+j*server->paddedWidthInBytes+x*4,x+y+j,8*4);
+	rfbMarkRectAsModified(server,x,y,x+8,y+8);
+}
+
+static rfbClient* connectClient(rfbScreenInfoPtr server)
+{
+	rfbClient* client=rfbGetClient(8,3,4);
+
+	if(!ConnectToRFBServer(client,"127.0.0.1",server->port)
+	   || !InitialiseRFBConnection(client)) {
+		fail("could not connect to the server");
+		rfbClientCleanup(client);
+		return NULL;
+	}
+	return client;
+}
+
+/* the server hangs up after what was sent last */
+static void expectClosed(rfbClient* client,const char* what)
+{
+	message m;
+
+	while(readMessage(client,&m))
+		;
+	if(WaitForMessage(client,0)<=0)
+		fail(what);
+}
+
+static void checkExtensions(rfbScreenInfoPtr server)
+{
+	rfbClient* client=connectClient(server);
+	message m,fences[4];
+	static const char data[]="fencetest";
+	static const char tooLong[rfbFenceMaxLength+1];
+
+	if(!client)
+		return;
+
+	sendEncodings(client,TRUE);
+	if(!expectMessage(client,&m,rfbEndOfContinuousUpdates,
+			  "the ContinuousUpdates encoding is not answered"))
+		goto done;
+
+	/* the answer leaves out the request and the flags the server does not know */
+	sendFence(client,rfbFenceFlagRequest|rfbFenceFlagBlockBefore|rfbFenceFlagBlockAfter
+		  |rfbFenceFlagSyncNext,data,sizeof(data));
+	if(!expectMessage(client,&m,rfbFence,"a fence request is not answered"))
+		goto done;
+	if(m.flags!=(rfbFenceFlagBlockBefore|rfbFenceFlagBlockAfter))
+		fail("a fence is answered with the wrong flags");
+	if(m.length!=sizeof(data) || memcmp(m.data,data,sizeof(data)))
+		fail("a fence is answered with the wrong data");
+
+	/* nothing was asked for yet */
+	if(!quiet(client))
+		fail("an update was sent before it was asked for");
+
+	sendEnableContinuousUpdates(client,TRUE);
+	if(!expectUpdate(client,&fences[0],"no update after enabling continuous updates"))
+		goto done;
+	answerFence(client,&fences[0]);
+	paint(server,8,8);
+	if(!expectUpdate(client,&fences[0],"a change is not pushed"))
+		goto done;
+	answerFence(client,&fences[0]);
+
+	/* only two updates may be unanswered */
+	server->maxFramesInFlight=2;
+	paint(server,16,16);
+	if(!expectUpdate(client,&fences[0],"a change is not pushed"))
+		goto done;
+	paint(server,24,24);
+	if(!expectUpdate(client,&fences[1],"a second change is not pushed"))
+		goto done;
+	paint(server,32,32);
+	if(!quiet(client))
+		fail("more updates were sent than maxFramesInFlight");
+	answerFence(client,&fences[0]);
+	if(!expectUpdate(client,&fences[2],"no update after a fence was answered"))
+		goto done;
+	answerFence(client,&fences[1]);
+	answerFence(client,&fences[2]);
+	server->maxFramesInFlight=4;
+
+	/* switching off is confirmed, and then nothing comes unasked */
+	sendEnableContinuousUpdates(client,FALSE);
+	while(readMessage(client,&m) && m.type!=rfbEndOfContinuousUpdates)
+		if(m.type==rfbFence)
+			answerFence(client,&m);
+	if(m.type!=rfbEndOfContinuousUpdates)
+		fail("switching continuous updates off is not confirmed");
+	paint(server,40,40);
+	if(!quiet(client))
+		fail("a change is pushed after continuous updates were switched off");
+	SendFramebufferUpdateRequest(client,0,0,width,height,TRUE);
+	if(!expectUpdate(client,&fences[3],"no update after a request"))
+		goto done;
+	answerFence(client,&fences[3]);
+
+	/* a fence with more data than allowed */
+	sendFence(client,rfbFenceFlagRequest,tooLong,sizeof(tooLong));
+	expectClosed(client,"a fence with too much data does not close the connection");
+
+done:
+	rfbClientCleanup(client);
+}
+
+static void checkUnnegotiated(rfbScreenInfoPtr server)
+{
+	rfbClient* client=connectClient(server);
+
+	if(!client)
+		return;
+	sendEncodings(client,FALSE);
+	sendFence(client,rfbFenceFlagRequest,"x",1);
+	expectClosed(client,"a fence without the Fence encoding does not close the connection");
+	rfbClientCleanup(client);
+
+	client=connectClient(server);
+	if(!client)
+		return;
+	sendEncodings(client,FALSE);
+	sendEnableContinuousUpdates(client,TRUE);
+	expectClosed(client,"EnableContinuousUpdates without the encoding does not close the connection");
+	rfbClientCleanup(client);
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+
+	server=rfbGetScreen(&argc,argv,width,height,8,3,4);
+	if(!server)
+		return 0;
+	server->frameBuffer=calloc(width*height*4,1);
+	server->deferUpdateTime=0;
+	server->autoPort=TRUE;
+	server->ipv6port=0;
+	rfbInitServer(server);
+	rfbRunEventLoop(server,-1,TRUE);
+
+	checkExtensions(server);
+	checkUnnegotiated(server);
+
+	rfbShutdownServer(server,TRUE);
+	free(server->frameBuffer);
+	rfbScreenCleanup(server);
+	return failed;
+}
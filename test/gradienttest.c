@@ -0,0 +1,200 @@
+/*
+ * Checks that Tight rectangles sent through the gradient filter decode to
+ * the framebuffer bit for bit.  A smooth, but not linear, picture is sent
+ * lossless at compression levels 1 and 9, the ones using the filter, to
+ * clients with 24 bit, 32 bit and 16 bit pixels.
+ *
+ * libvncclient decodes Tight in the byte order of the host only.  The
+ * clients asking for the other byte order use formats whose colour
+ * samples are whole bytes or lie within a byte: the server sends them the
+ * same bytes as to a client of the host's byte order with the samples
+ * moved, and the client decodes them as that.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <time.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test need pthread support (otherwise the client blocks the server)
+#endif
+
+static const int width=320,height=240;
+static int failed;
+
+typedef struct {
+	const char* name;
+	int bitsPerPixel,depth;
+	int redMax,greenMax,blueMax;
+	int redShift,greenShift,blueShift;
+	rfbBool swapped;
+} Format;
+
+static const Format formats[]={
+	{ "24 bit",                    32,24, 255,255,255, 16, 8, 0, FALSE },
+	{ "24 bit, other byte order",  32,24, 255,255,255, 16, 8, 0, TRUE },
+	{ "32 bit, other byte order",  32,32, 255,255,255, 16, 8, 0, TRUE },
+	{ "16 bit",                    16,16,  31, 63, 31, 11, 5, 0, FALSE },
+	{ "16 bit, other byte order",  16,16, 255, 15, 15,  8, 4, 0, TRUE },
+};
+
+static void fail(const Format* format,int compressLevel,const char* what)
+{
+	fprintf(stderr,"%s, compression level %d: %s\n",format->name,compressLevel,what);
+	failed=1;
+}
+
+/* shades changing by a sample or two from pixel to pixel */
+static void fill(rfbScreenInfoPtr server)
+{
+	int i,j;
+
+	for(j=0;j<height;j++)
+		for(i=0;i<width;i++) {
+			unsigned char* p=(unsigned char*)server->frameBuffer+j*server->paddedWidthInBytes+i*4;
+
+			p[0]=i*255/(width-1);
+			p[1]=j*191/(height-1)+i/5;
+			p[2]=((i-width/2)*(i-width/2)+(j-height/2)*(j-height/2))/200;
+			p[3]=0;
+		}
+}
+
+/* where a sample lying within a byte ends up when the bytes are swapped */
+static int swappedShift(int shift,int bitsPerPixel)
+{
+	return (bitsPerPixel/8-1-shift/8)*8+shift%8;
+}
+
+static int sample(uint32_t pix,int shift,int max)
+{
+	return (int)(pix>>shift&max);
+}
+
+/* the client shows what the server does, in the client's format */
+static rfbBool matchesServer(rfbScreenInfoPtr server,rfbClient* client)
+{
+	rfbPixelFormat* in=&server->serverFormat;
+	rfbPixelFormat* out=&client->format;
+	int i,j;
+
+	for(j=0;j<height;j++)
+		for(i=0;i<width;i++) {
+			uint32_t s=*(uint32_t*)(server->frameBuffer+j*server->paddedWidthInBytes+i*4);
+			uint32_t c=out->bitsPerPixel==32 ?
+				((uint32_t*)client->frameBuffer)[j*width+i] :
+				((uint16_t*)client->frameBuffer)[j*width+i];
+
+			if(sample(c,out->redShift,out->redMax)!=
+			   (sample(s,in->redShift,in->redMax)*out->redMax+in->redMax/2)/in->redMax ||
+			   sample(c,out->greenShift,out->greenMax)!=
+			   (sample(s,in->greenShift,in->greenMax)*out->greenMax+in->greenMax/2)/in->greenMax ||
+			   sample(c,out->blueShift,out->blueMax)!=
+			   (sample(s,in->blueShift,in->blueMax)*out->blueMax+in->blueMax/2)/in->blueMax)
+				return FALSE;
+		}
+	return TRUE;
+}
+
+static int updates(rfbClient* client)
+{
+	return (int)(intptr_t)rfbClientGetClientData(client,(void*)fill);
+}
+
+static void updateFinished(rfbClient* client)
+{
+	rfbClientSetClientData(client,(void*)fill,(void*)(intptr_t)(updates(client)+1));
+}
+
+/* handle messages until the client finished an update */
+static rfbBool waitForUpdate(rfbClient* client)
+{
+	time_t t=time(NULL);
+	int n;
+
+	while(updates(client)==0) {
+		if(time(NULL)-t>5)
+			return FALSE;
+		n=WaitForMessage(client,100000);
+		if(n<0 || (n>0 && !HandleRFBServerMessage(client)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void checkFormat(rfbScreenInfoPtr server,const Format* format,int compressLevel)
+{
+	rfbClient* client=rfbGetClient(8,3,4);
+	rfbPixelFormat* pf=&client->format;
+
+	client->FinishedFrameBufferUpdate=updateFinished;
+	client->appData.encodingsString="tight";
+	client->appData.compressLevel=compressLevel;
+	client->appData.enableJPEG=FALSE;
+	client->appData.useRemoteCursor=TRUE;
+	pf->bitsPerPixel=format->bitsPerPixel;
+	pf->depth=format->depth;
+	pf->redMax=format->redMax;
+	pf->greenMax=format->greenMax;
+	pf->blueMax=format->blueMax;
+	pf->redShift=format->redShift;
+	pf->greenShift=format->greenShift;
+	pf->blueShift=format->blueShift;
+	if(format->swapped)
+		pf->bigEndian=!pf->bigEndian;
+	free(client->serverHost);
+	client->serverHost=strdup("127.0.0.1");
+	client->serverPort=server->port;
+	if(!rfbInitClient(client,NULL,NULL)) {
+		fail(format,compressLevel,"could not connect to the server");
+		return;
+	}
+
+	/* the server was told the format, decode what it sends in the host's */
+	if(format->swapped) {
+		pf->bigEndian=!pf->bigEndian;
+		pf->redShift=swappedShift(pf->redShift,pf->bitsPerPixel);
+		pf->greenShift=swappedShift(pf->greenShift,pf->bitsPerPixel);
+		pf->blueShift=swappedShift(pf->blueShift,pf->bitsPerPixel);
+	}
+
+	if(!waitForUpdate(client))
+		fail(format,compressLevel,"the client got no update");
+	else if(!matchesServer(server,client))
+		fail(format,compressLevel,"the client does not show the framebuffer");
+
+	free(client->frameBuffer);
+	rfbClientCleanup(client);
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	int i;
+
+	server=rfbGetScreen(&argc,argv,width,height,8,3,4);
+	if(!server)
+		return 0;
+	server->frameBuffer=malloc(width*height*4);
+	fill(server);
+	server->deferUpdateTime=0;
+	server->autoPort=TRUE;
+	server->ipv6port=0;
+	rfbInitServer(server);
+	rfbRunEventLoop(server,-1,TRUE);
+
+#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+	for(i=0;i<(int)(sizeof(formats)/sizeof(formats[0]));i++) {
+		checkFormat(server,&formats[i],1);
+		checkFormat(server,&formats[i],9);
+	}
+#endif
+
+	rfbShutdownServer(server,TRUE);
+	free(server->frameBuffer);
+	rfbScreenCleanup(server);
+	return failed;
+}
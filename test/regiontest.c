@@ -0,0 +1,325 @@
+/*
+ * Checks the region code against a plain bitmap of the same area: random
+ * regions are combined with every operation, and the result must cover
+ * the same pixels as the bitmap does and be in y-x banded form, which
+ * there is only one of for a set of pixels.  Also checks the order of the
+ * reverse iterators and of sraRgnPopRect(), and that regions sharing
+ * their rectangles do not see each other's changes.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+/* regions are made in 0..SPAN and moved by at most MAX_OFFSET */
+#define SPAN 48
+#define MAX_OFFSET 12
+#define ORIGIN (-2 * MAX_OFFSET)
+#define SIZE (SPAN - 2 * ORIGIN)
+#define ROUNDS 2000
+#define MAX_RECTS 256
+
+typedef struct {
+    unsigned char pixel[SIZE][SIZE];
+} bitmap;
+
+static int failed;
+
+static void
+fail(int round, const char *what)
+{
+    fprintf(stderr, "round %d: %s\n", round, what);
+    failed = 1;
+}
+
+static void
+bitmapClear(bitmap *b)
+{
+    memset(b, 0, sizeof(*b));
+}
+
+static void
+bitmapFill(bitmap *b, int x1, int y1, int x2, int y2)
+{
+    int x, y;
+
+    for (y = y1; y < y2; y++)
+        for (x = x1; x < x2; x++)
+            b->pixel[y - ORIGIN][x - ORIGIN] = 1;
+}
+
+static void
+bitmapOffset(bitmap *b, int dx, int dy)
+{
+    bitmap moved;
+    int x, y;
+
+    bitmapClear(&moved);
+    for (y = 0; y < SIZE; y++)
+        for (x = 0; x < SIZE; x++)
+            if (b->pixel[y][x])
+                moved.pixel[y + dy][x + dx] = 1;
+    *b = moved;
+}
+
+static int
+bitmapCount(const bitmap *b)
+{
+    int x, y, n = 0;
+
+    for (y = 0; y < SIZE; y++)
+        for (x = 0; x < SIZE; x++)
+            n += b->pixel[y][x];
+    return n;
+}
+
+/* a region of up to a few random rectangles, and its bitmap */
+static sraRegionPtr
+randomRegion(bitmap *b)
+{
+    sraRegionPtr region = sraRgnCreate();
+    int n = rand() % 5, k;
+
+    bitmapClear(b);
+    for (k = 0; k < n; k++) {
+        int x1 = rand() % SPAN, y1 = rand() % SPAN;
+        int x2 = x1 + 1 + rand() % (SPAN - x1), y2 = y1 + 1 + rand() % (SPAN - y1);
+        sraRegionPtr rect = sraRgnCreateRect(x1, y1, x2, y2);
+
+        sraRgnOr(region, rect);
+        sraRgnDestroy(rect);
+        bitmapFill(b, x1, y1, x2, y2);
+    }
+    return region;
+}
+
+static int
+getRects(sraRegionPtr region, rfbBool reverseX, rfbBool reverseY, sraRect *rects)
+{
+    sraRectangleIterator *i = sraRgnGetReverseIterator(region, reverseX, reverseY);
+    int n = 0;
+
+    while (n < MAX_RECTS && sraRgnIteratorNext(i, &rects[n]))
+        n++;
+    sraRgnReleaseIterator(i);
+    return n;
+}
+
+/*
+ * Returns TRUE if the rectangles cover just the pixels of b, and are in
+ * y-x banded order: the rectangles of a band have the same y1 and y2 and
+ * are sorted by x without touching, the bands are sorted by y, and two
+ * touching bands do not have the same x spans.
+ */
+static rfbBool
+matches(const sraRect *rects, int n, const bitmap *b)
+{
+    bitmap covered;
+    int k, start, prevStart = -1, prevEnd = -1, end;
+
+    bitmapClear(&covered);
+    for (k = 0; k < n; k++) {
+        const sraRect *r = &rects[k];
+
+        if (r->x1 >= r->x2 || r->y1 >= r->y2 ||
+            r->x1 < ORIGIN || r->y1 < ORIGIN ||
+            r->x2 > ORIGIN + SIZE || r->y2 > ORIGIN + SIZE)
+            return FALSE;
+        bitmapFill(&covered, r->x1, r->y1, r->x2, r->y2);
+    }
+    if (memcmp(&covered, b, sizeof(covered)))
+        return FALSE;
+
+    for (start = 0; start < n; start = end) {
+        for (end = start + 1; end < n && rects[end].y1 == rects[start].y1; end++) {
+            if (rects[end].y2 != rects[start].y2 || rects[end].x1 <= rects[end - 1].x2)
+                return FALSE;
+        }
+        if (prevStart >= 0) {
+            if (rects[start].y1 < rects[prevStart].y2)
+                return FALSE;
+            if (rects[start].y1 == rects[prevStart].y2 && end - start == prevEnd - prevStart) {
+                for (k = 0; k < end - start; k++)
+                    if (rects[start + k].x1 != rects[prevStart + k].x1 ||
+                        rects[start + k].x2 != rects[prevStart + k].x2)
+                        break;
+                if (k == end - start)
+                    return FALSE;
+            }
+        }
+        prevStart = start;
+        prevEnd = end;
+    }
+    return TRUE;
+}
+
+static rfbBool
+regionMatches(sraRegionPtr region, const bitmap *b)
+{
+    sraRect rects[MAX_RECTS];
+    int n = getRects(region, FALSE, FALSE, rects);
+
+    return n < MAX_RECTS && (unsigned long)n == sraRgnCountRects(region)
+        && !sraRgnEmpty(region) == (n > 0) && matches(rects, n, b);
+}
+
+/* The reverse iterators go through the bands, or the rectangles of a band, backwards. */
+static rfbBool
+reverseOrderMatches(sraRegionPtr region)
+{
+    sraRect forward[MAX_RECTS], reverse[MAX_RECTS], expected[MAX_RECTS];
+    int bandStart[MAX_RECTS + 1], nBands = 0;
+    int n = getRects(region, FALSE, FALSE, forward), flags, k, band, m;
+
+    for (k = 0; k < n; k++)
+        if (k == 0 || forward[k].y1 != forward[k - 1].y1)
+            bandStart[nBands++] = k;
+    bandStart[nBands] = n;
+
+    for (flags = 1; flags < 4; flags++) {
+        rfbBool reverseX = (flags & 2) != 0, reverseY = (flags & 1) != 0;
+
+        m = 0;
+        for (k = 0; k < nBands; k++) {
+            band = reverseY ? nBands - 1 - k : k;
+            if (reverseX)
+                for (n = bandStart[band + 1] - 1; n >= bandStart[band]; n--)
+                    expected[m++] = forward[n];
+            else
+                for (n = bandStart[band]; n < bandStart[band + 1]; n++)
+                    expected[m++] = forward[n];
+        }
+        if (getRects(region, reverseX, reverseY, reverse) != m ||
+            memcmp(reverse, expected, m * sizeof(sraRect)))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+checkOperation(int round, int op)
+{
+    bitmap a, b, expected;
+    sraRegionPtr ra = randomRegion(&a), rb = randomRegion(&b);
+    sraRegionPtr shared = sraRgnCreateRgn(ra);
+    sraRectangleIterator *i = sraRgnGetIterator(ra);
+    sraRect before[MAX_RECTS], r;
+    int nBefore = getRects(ra, FALSE, FALSE, before), n = 0, x, y;
+    rfbBool result;
+
+    expected = a;
+    switch (op) {
+    case 0:
+        result = sraRgnAnd(ra, rb);
+        for (y = 0; y < SIZE; y++)
+            for (x = 0; x < SIZE; x++)
+                expected.pixel[y][x] &= b.pixel[y][x];
+        if (!result != (bitmapCount(&expected) == 0))
+            fail(round, "sraRgnAnd() returns the wrong value");
+        break;
+    case 1:
+        sraRgnOr(ra, rb);
+        for (y = 0; y < SIZE; y++)
+            for (x = 0; x < SIZE; x++)
+                expected.pixel[y][x] |= b.pixel[y][x];
+        break;
+    case 2:
+        result = sraRgnSubtract(ra, rb);
+        for (y = 0; y < SIZE; y++)
+            for (x = 0; x < SIZE; x++)
+                expected.pixel[y][x] &= !b.pixel[y][x];
+        if (!result != (bitmapCount(&expected) == 0))
+            fail(round, "sraRgnSubtract() returns the wrong value");
+        break;
+    case 3:
+        x = rand() % (2 * MAX_OFFSET + 1) - MAX_OFFSET;
+        y = rand() % (2 * MAX_OFFSET + 1) - MAX_OFFSET;
+        sraRgnOffset(ra, x, y);
+        bitmapOffset(&expected, x, y);
+        break;
+    }
+    if (!regionMatches(ra, &expected))
+        fail(round, op == 0 ? "sraRgnAnd() is wrong" : op == 1 ? "sraRgnOr() is wrong" :
+             op == 2 ? "sraRgnSubtract() is wrong" : "sraRgnOffset() is wrong");
+    if (!reverseOrderMatches(ra))
+        fail(round, "a reverse iterator has the wrong order");
+
+    /* neither the copy nor the iterator taken before saw the change */
+    if (!regionMatches(shared, &a))
+        fail(round, "a copy of a region changed with it");
+    while (n < MAX_RECTS && sraRgnIteratorNext(i, &r)) {
+        if (n >= nBefore || memcmp(&r, &before[n], sizeof(r)))
+            break;
+        n++;
+    }
+    if (n != nBefore || sraRgnIteratorNext(i, &r))
+        fail(round, "an iterator changed with its region");
+    sraRgnReleaseIterator(i);
+
+    /* and the same the other way round; ra may also share rb's rectangles now */
+    sraRgnDestroy(shared);
+    shared = sraRgnCreateRgn(ra);
+    sraRgnOffset(shared, 1, 1);
+    sraRgnPopRect(shared, &r, 0);
+    if (!regionMatches(ra, &expected))
+        fail(round, "a region changed with its copy");
+    if (!regionMatches(rb, &b))
+        fail(round, "a region changed with the one it was combined with");
+
+    sraRgnDestroy(shared);
+    sraRgnDestroy(ra);
+    sraRgnDestroy(rb);
+}
+
+static void
+checkPopRect(int round)
+{
+    bitmap a;
+    sraRegionPtr region = randomRegion(&a), empty = sraRgnCreate();
+    sraRegionPtr shared;
+    sraRect rects[MAX_RECTS], r;
+    unsigned long flags = rand() % 4;
+    bitmap popped;
+    int n;
+
+    /* an empty region that took the rectangles by sraRgnOr() shares them */
+    sraRgnOr(empty, region);
+    shared = empty;
+
+    bitmapClear(&popped);
+    while ((n = getRects(region, (flags & 2) != 0, (flags & 1) != 0, rects)) > 0) {
+        if (!sraRgnPopRect(region, &r, flags)) {
+            fail(round, "sraRgnPopRect() found no rectangle");
+            break;
+        }
+        if (memcmp(&r, &rects[0], sizeof(r))) {
+            fail(round, "sraRgnPopRect() took the wrong rectangle");
+            break;
+        }
+        if ((unsigned long)(n - 1) != sraRgnCountRects(region)) {
+            fail(round, "sraRgnPopRect() left the wrong rectangles");
+            break;
+        }
+        bitmapFill(&popped, r.x1, r.y1, r.x2, r.y2);
+    }
+    if (!sraRgnEmpty(region) || sraRgnPopRect(region, &r, flags))
+        fail(round, "sraRgnPopRect() did not empty the region");
+    if (memcmp(&popped, &a, sizeof(popped)))
+        fail(round, "sraRgnPopRect() returned the wrong rectangles");
+    if (!regionMatches(shared, &a))
+        fail(round, "sraRgnPopRect() changed a copy of the region");
+
+    sraRgnDestroy(shared);
+    sraRgnDestroy(region);
+}
+
+int main(int argc, char **argv)
+{
+    int round;
+
+    srand(1);
+    for (round = 0; round < ROUNDS && !failed; round++) {
+        checkOperation(round, round % 4);
+        checkPopRect(round);
+    }
+    return failed;
+}
@@ -0,0 +1,149 @@
+/*
+ * Checks the pixel translation against a plain per pixel conversion for
+ * the client formats that have SIMD kernels, with widths which cover both
+ * the vector loop and the scalar tail.
+ */
+
+#include <rfb/rfb.h>
+
+typedef struct {
+    const char *name;
+    int bpp, bigEndian;
+    int redMax, greenMax, blueMax;
+    int redShift, greenShift, blueShift;
+} format;
+
+static const format formats[] = {
+    { "32bpp BGR",          32, 0, 255, 255, 255,  0,  8, 16 },
+    { "32bpp RGB big",      32, 1, 255, 255, 255, 16,  8,  0 },
+    { "32bpp BGR big",      32, 1, 255, 255, 255,  0,  8, 16 },
+    { "32bpp scaled",       32, 0,  31,  63,  31, 22, 11,  1 },
+    { "32bpp scaled big",   32, 1, 127,   7, 255, 20, 16,  0 },
+    { "24bpp RGB",          24, 0, 255, 255, 255, 16,  8,  0 },
+    { "24bpp BGR",          24, 0, 255, 255, 255,  0,  8, 16 },
+    { "24bpp RGB big",      24, 1, 255, 255, 255, 16,  8,  0 },
+    { "16bpp 565",          16, 0,  31,  63,  31, 11,  5,  0 },
+    { "16bpp 565 big",      16, 1,  31,  63,  31, 11,  5,  0 },
+    { "16bpp 555",          16, 0,  31,  31,  31, 10,  5,  0 },
+    { "16bpp 555 big",      16, 1,  31,  31,  31, 10,  5,  0 },
+    { "16bpp 444",          16, 0,  15,  15,  15,  8,  4,  0 },
+    { "8bpp BGR233",         8, 0,   7,   7,   3,  0,  3,  6 },
+    { "8bpp RGB332",         8, 0,   7,   7,   3,  5,  2,  0 },
+    { "8bpp 222",            8, 0,   3,   3,   3,  4,  2,  0 },
+};
+
+#define MAX_WIDTH 70
+#define HEIGHT 3
+#define PAD 12
+
+static uint32_t
+reference(rfbPixelFormat *in, rfbPixelFormat *out, uint32_t p)
+{
+    uint32_t r = (p >> in->redShift) & 0xff;
+    uint32_t g = (p >> in->greenShift) & 0xff;
+    uint32_t b = (p >> in->blueShift) & 0xff;
+
+    return ((r * out->redMax + 127) / 255) << out->redShift |
+           ((g * out->greenMax + 127) / 255) << out->greenShift |
+           ((b * out->blueMax + 127) / 255) << out->blueShift;
+}
+
+static void
+store(rfbPixelFormat *out, unsigned char *op, uint32_t o)
+{
+    int i, n = out->bitsPerPixel / 8;
+
+    for (i = 0; i < n; i++)
+        op[out->bigEndian ? n - 1 - i : i] = (unsigned char)(o >> (8 * i));
+}
+
+static uint32_t
+randomPixel(void)
+{
+    static const uint32_t edges[] = { 0x00, 0x01, 0x7f, 0x80, 0xfe, 0xff };
+    uint32_t p = 0;
+    int i;
+
+    /* favour the values where rounding goes wrong */
+    for (i = 0; i < 4; i++)
+        p |= ((rand() & 1) ? edges[rand() % 6] : (uint32_t)(rand() & 0xff)) << (8 * i);
+    return p;
+}
+
+static int
+check(rfbScreenInfoPtr screen, const format *f)
+{
+    rfbClientRec cl;
+    rfbPixelFormat *in = &screen->serverFormat;
+    uint32_t src[(MAX_WIDTH + PAD) * HEIGHT];
+    unsigned char got[MAX_WIDTH * 4 * HEIGHT + 16], want[MAX_WIDTH * 4 * HEIGHT + 16];
+    int w, i, y, bytes, failed = 0;
+
+    memset(&cl, 0, sizeof(cl));
+    cl.screen = screen;
+    cl.host = "translatetest";
+    cl.format.bitsPerPixel = f->bpp;
+    cl.format.depth = f->bpp == 32 ? 24 : f->bpp;
+    cl.format.bigEndian = f->bigEndian;
+    cl.format.trueColour = TRUE;
+    cl.format.redMax = f->redMax;
+    cl.format.greenMax = f->greenMax;
+    cl.format.blueMax = f->blueMax;
+    cl.format.redShift = f->redShift;
+    cl.format.greenShift = f->greenShift;
+    cl.format.blueShift = f->blueShift;
+
+    if (!rfbSetTranslateFunction(&cl)) {
+        fprintf(stderr, "%s: no translate function\n", f->name);
+        return 1;
+    }
+
+    bytes = f->bpp / 8;
+    for (w = 1; w <= MAX_WIDTH && !failed; w++) {
+        for (i = 0; i < (w + PAD) * HEIGHT; i++)
+            src[i] = randomPixel();
+        memset(got, 0xaa, sizeof(got));
+        memset(want, 0xaa, sizeof(want));
+
+        for (y = 0; y < HEIGHT; y++)
+            for (i = 0; i < w; i++)
+                store(&cl.format, want + (y * w + i) * bytes,
+                      reference(in, &cl.format, src[y * (w + PAD) + i]));
+
+        cl.translateFn(cl.translateLookupTable, in, &cl.format,
+                       (char *)src, (char *)got, (w + PAD) * 4, w, HEIGHT);
+
+        for (i = 0; i < w * HEIGHT * bytes + 16; i++)
+            if (got[i] != want[i]) {
+                fprintf(stderr, "%s: width %d differs at byte %d (%02x, should be %02x)\n",
+                        f->name, w, i, got[i], want[i]);
+                failed = 1;
+                break;
+            }
+    }
+
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    rfbScreenInfoPtr screen;
+    int i, ret = 0;
+
+    rfbLogEnable(FALSE);
+    screen = rfbGetScreen(&argc, argv, 16, 16, 8, 3, 4);
+    if (!screen)
+        return 0;
+    srand(1);
+
+    /* the default server format, and the same with red and blue swapped */
+    for (i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++)
+        ret |= check(screen, &formats[i]);
+    screen->serverFormat.redShift = 0;
+    screen->serverFormat.blueShift = 16;
+    for (i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++)
+        ret |= check(screen, &formats[i]);
+
+    rfbScreenCleanup(screen);
+    return ret;
+}